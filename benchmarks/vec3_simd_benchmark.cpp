@@ -0,0 +1,187 @@
+// Throughput of the SoA vector types of vec3_simd.hpp against the scalar vec3,
+// on normalize(cross(u, w)) followed by a dot product, over arrays of vectors
+// that fit in the L2 cache. Each width also checks that its lanes give the same
+// results as the scalar code (bit for bit, except for normalize_fast()).
+
+#include "vec3_simd.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+namespace
+{
+
+constexpr std::uint32_t vector_count {1u << 16};
+constexpr int pass_count {50};
+
+struct Input
+{
+    std::vector<vec3> u;
+    std::vector<vec3> w;
+    // The same vectors, one array per component
+    std::vector<float> u_components[3];
+    std::vector<float> w_components[3];
+};
+
+[[nodiscard]] Input create_input()
+{
+    Input input {};
+    std::mt19937 generator {1};
+    std::uniform_real_distribution<float> distribution(-1.0f, 1.0f);
+    input.u.resize(vector_count);
+    input.w.resize(vector_count);
+    for (auto &components : input.u_components)
+    {
+        components.resize(vector_count);
+    }
+    for (auto &components : input.w_components)
+    {
+        components.resize(vector_count);
+    }
+    for (std::uint32_t i {0}; i < vector_count; ++i)
+    {
+        input.u[i] = {distribution(generator),
+                      distribution(generator),
+                      distribution(generator)};
+        input.w[i] = {distribution(generator),
+                      distribution(generator),
+                      distribution(generator)};
+        input.u_components[0][i] = input.u[i].x;
+        input.u_components[1][i] = input.u[i].y;
+        input.u_components[2][i] = input.u[i].z;
+        input.w_components[0][i] = input.w[i].x;
+        input.w_components[1][i] = input.w[i].y;
+        input.w_components[2][i] = input.w[i].z;
+    }
+    return input;
+}
+
+// Best time of all passes, in seconds
+template <typename F>
+[[nodiscard]] double measure(F &&kernel)
+{
+    auto best = std::chrono::steady_clock::duration::max();
+    for (int pass {0}; pass < pass_count; ++pass)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        kernel();
+        best = std::min(best, std::chrono::steady_clock::now() - start);
+    }
+    return std::chrono::duration<double>(best).count();
+}
+
+void run_scalar(const Input &input, std::vector<float> &output)
+{
+    for (std::uint32_t i {0}; i < vector_count; ++i)
+    {
+        output[i] = dot(normalize(cross(input.u[i], input.w[i])), input.u[i]);
+    }
+}
+
+template <std::uint32_t N, bool fast>
+void run_simd(const Input &input, std::vector<float> &output)
+{
+    for (std::uint32_t i {0}; i < vector_count; i += N)
+    {
+        const auto u = vec3x<N>::load(input.u_components[0].data() + i,
+                                      input.u_components[1].data() + i,
+                                      input.u_components[2].data() + i);
+        const auto w = vec3x<N>::load(input.w_components[0].data() + i,
+                                      input.w_components[1].data() + i,
+                                      input.w_components[2].data() + i);
+        const auto n =
+            fast ? normalize_fast(cross(u, w)) : normalize(cross(u, w));
+        dot(n, u).store(output.data() + i);
+    }
+}
+
+// Returns false if the results differ from the scalar ones by more than the
+// tolerance
+[[nodiscard]] bool print_result(const char *name,
+                                double seconds,
+                                double scalar_seconds,
+                                const std::vector<float> &output,
+                                const std::vector<float> &scalar_output,
+                                float tolerance)
+{
+    float max_difference {0.0f};
+    for (std::uint32_t i {0}; i < vector_count; ++i)
+    {
+        max_difference = std::max(max_difference,
+                                  std::abs(output[i] - scalar_output[i]));
+    }
+    const bool ok {tolerance > 0.0f
+                       ? max_difference <= tolerance
+                       : std::memcmp(output.data(),
+                                     scalar_output.data(),
+                                     vector_count * sizeof(float)) == 0};
+    std::cout << std::left << std::setw(18) << name << std::right
+              << std::setw(8) << std::fixed << std::setprecision(0)
+              << static_cast<double>(vector_count) / seconds * 1e-6
+              << " M/s" << std::setw(7) << std::setprecision(2)
+              << scalar_seconds / seconds << "x  max difference "
+              << std::scientific << std::setprecision(1)
+              << static_cast<double>(max_difference)
+              << (ok ? "" : "  MISMATCH") << '\n';
+    return ok;
+}
+
+template <std::uint32_t N>
+[[nodiscard]] bool benchmark_width(const Input &input,
+                                   double scalar_seconds,
+                                   const std::vector<float> &scalar_output)
+{
+    std::vector<float> output(vector_count);
+    const auto name = "vec3x" + std::to_string(N);
+
+    const auto seconds =
+        measure([&] { run_simd<N, false>(input, output); });
+    bool ok {print_result(name.c_str(),
+                          seconds,
+                          scalar_seconds,
+                          output,
+                          scalar_output,
+                          0.0f)};
+
+    const auto fast_seconds =
+        measure([&] { run_simd<N, true>(input, output); });
+    ok &= print_result((name + " fast").c_str(),
+                       fast_seconds,
+                       scalar_seconds,
+                       output,
+                       scalar_output,
+                       1e-5f);
+    return ok;
+}
+
+} // namespace
+
+int main()
+{
+    const auto input = create_input();
+
+    std::vector<float> scalar_output(vector_count);
+    const auto scalar_seconds =
+        measure([&] { run_scalar(input, scalar_output); });
+
+    std::cout << "normalize(cross(u, w)) and dot on " << vector_count
+              << " vectors, best of " << pass_count << " passes\n";
+    std::cout << std::left << std::setw(18) << "vec3" << std::right
+              << std::setw(8) << std::fixed << std::setprecision(0)
+              << static_cast<double>(vector_count) / scalar_seconds * 1e-6
+              << " M/s\n";
+
+    bool ok {benchmark_width<4>(input, scalar_seconds, scalar_output)};
+    ok &= benchmark_width<8>(input, scalar_seconds, scalar_output);
+    ok &= benchmark_width<16>(input, scalar_seconds, scalar_output);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,6 +1,12 @@
 #include "application.hpp"
 #include "camera.hpp"
+#include "cpu_renderer.hpp"
+#include "gpu_profile.hpp"
+#include "image_comparison.hpp"
+#include "numa.hpp"
 #include "renderer.hpp"
+#include "scene.hpp"
+#include "utility.hpp"
 #include "vec3.hpp"
 
 #include <imgui.h>
@@ -25,16 +31,23 @@
 #include <GLFW/glfw3.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
 #include <cstdint>
+#include <exception>
+#include <filesystem>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <memory>
 #include <numbers>
+#include <optional>
 #include <ranges>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
 
 namespace
 {
@@ -59,16 +72,32 @@ struct Application_state
     std::unique_ptr<ImGuiContext, Deleter> imgui_context;
     Vulkan_context context;
     Vulkan_render_resources render_resources;
+    Vulkan_render_thread render_thread; // Running while a scene is loaded
     Assimp::Importer importer; // FIXME: this is just to keep the imported scene
                                // alive for debugging. We will probably end up
                                // having our own scene representation anyways.
     const aiScene *scene;
+    Scene render_scene;
     bool scene_loaded;
     Camera camera;
     std::uint32_t render_width;
     std::uint32_t render_height;
+    // Sent to the render thread after each frame of the user interface
+    std::uint32_t samples_to_render;
+    std::uint32_t samples_per_frame;
 };
 
+// A pipeline cache that could not be saved only makes the next start slower
+void save_pipeline_cache_or_warn(const Vulkan_context &context)
+{
+    const auto error_message = save_pipeline_cache(context);
+    if (!error_message.empty())
+    {
+        std::cerr << "Failed to save the pipeline cache: " << error_message
+                  << '\n';
+    }
+}
+
 void remove_quotes(std::string &str)
 {
     auto filtered_str =
@@ -147,28 +176,25 @@ void glfw_framebuffer_size_callback(GLFWwindow *window, int width, int height)
     return ctx;
 }
 
-void open_scene(Application_state &state, const char *file_name)
+[[nodiscard]] const aiScene *import_scene(Assimp::Importer &importer,
+                                         const char *file_name)
 {
-    state.importer.SetPropertyInteger(AI_CONFIG_PP_RVC_FLAGS,
-                                      aiComponent_ANIMATIONS |
-                                          aiComponent_BONEWEIGHTS);
-    state.importer.SetPropertyFloat(AI_CONFIG_PP_GSN_MAX_SMOOTHING_ANGLE, 80);
-    state.importer.SetPropertyInteger(
+    importer.SetPropertyInteger(AI_CONFIG_PP_RVC_FLAGS,
+                                aiComponent_ANIMATIONS |
+                                    aiComponent_BONEWEIGHTS);
+    importer.SetPropertyFloat(AI_CONFIG_PP_GSN_MAX_SMOOTHING_ANGLE, 80);
+    importer.SetPropertyInteger(
         AI_CONFIG_PP_SBP_REMOVE, aiPrimitiveType_LINE | aiPrimitiveType_POINT);
-    state.importer.SetPropertyBool(AI_CONFIG_PP_FD_CHECKAREA, false);
-
-    // FIXME: remove
-    state.importer.SetPropertyBool(AI_CONFIG_PP_PTV_NORMALIZE, true);
+    importer.SetPropertyBool(AI_CONFIG_PP_FD_CHECKAREA, false);
 
-    const auto *const scene = state.importer.ReadFile(
+    return importer.ReadFile(
         file_name,
         // aiProcess_CalcTangentSpace| // TODO: do we want these to be
         // pre-computed, or can we compute them on the fly in the closest hit
         // shader? Also, what if a mesh has normals but no normal map (which is
         // common)? In that case pre-computing tangents/bitangents is just a
         // waste of memory.
-        aiProcess_PreTransformVertices // FIXME: remove
-            | aiProcess_JoinIdenticalVertices | aiProcess_Triangulate |
+        aiProcess_JoinIdenticalVertices | aiProcess_Triangulate |
             aiProcess_RemoveComponent |
             aiProcess_GenSmoothNormals | // TODO: if the file does not contain
                                          // normals, do we want them to be
@@ -187,6 +213,30 @@ void open_scene(Application_state &state, const char *file_name)
                                     // files, we will have to load some of
                                     // them manually anyways.
             | aiProcess_GenBoundingBoxes);
+}
+
+[[nodiscard]] Camera create_perspective_camera(const vec3 &position,
+                                              const vec3 &target,
+                                              float vertical_fov,
+                                              std::uint32_t render_width,
+                                              std::uint32_t render_height)
+{
+    const auto aspect_ratio = static_cast<float>(render_width) /
+                              static_cast<float>(render_height);
+    const float sensor_distance {1.0f};
+    const auto sensor_half_height =
+        std::tan(vertical_fov * 0.5f) * sensor_distance;
+    const auto sensor_half_width = aspect_ratio * sensor_half_height;
+    return create_camera(position,
+                         target,
+                         sensor_distance,
+                         sensor_half_width,
+                         sensor_half_height);
+}
+
+void open_scene(Application_state &state, const char *file_name)
+{
+    const auto *const scene = import_scene(state.importer, file_name);
     if (scene == nullptr)
     {
         std::string importer_error(state.importer.GetErrorString());
@@ -202,6 +252,7 @@ void open_scene(Application_state &state, const char *file_name)
     }
 
     state.scene = scene;
+    state.render_scene = create_scene(scene, default_environment_file_name);
 
     state.render_width = 640;
     state.render_height = 480;
@@ -209,23 +260,24 @@ void open_scene(Application_state &state, const char *file_name)
     const vec3 position {0.0f, 0.0f, 3.5f};
     const vec3 target {0.0f, 0.0f, 0.0f};
     const auto vertical_fov = 45.0f / 180.0f * std::numbers::pi_v<float>;
-    const auto aspect_ratio = static_cast<float>(state.render_width) /
-                              static_cast<float>(state.render_height);
-    const float sensor_distance {1.0f};
-    const auto sensor_half_height =
-        std::tan(vertical_fov * 0.5f) * sensor_distance;
-    const auto sensor_half_width = aspect_ratio * sensor_half_height;
-    state.camera = create_camera(position,
-                                 target,
-                                 sensor_distance,
-                                 sensor_half_width,
-                                 sensor_half_height);
+    state.camera = create_perspective_camera(position,
+                                             target,
+                                             vertical_fov,
+                                             state.render_width,
+                                             state.render_height);
 
+    stop_render_thread(state.context, state.render_thread);
     state.context.device->waitIdle();
 
     state.render_resources = {};
-    state.render_resources = create_render_resources(
-        state.context, state.render_width, state.render_height, scene);
+    state.render_resources = create_render_resources(state.context,
+                                                     state.render_width,
+                                                     state.render_height,
+                                                     state.render_scene);
+    state.samples_to_render = state.render_resources.samples_to_render;
+    state.samples_per_frame = state.render_resources.samples_per_frame;
+    state.render_thread = start_render_thread(
+        state.context, state.render_resources, state.camera);
 
     state.scene_loaded = true;
 }
@@ -244,6 +296,7 @@ void close_scene(Application_state &state)
 {
     if (state.scene_loaded)
     {
+        stop_render_thread(state.context, state.render_thread);
         state.context.device->waitIdle();
         state.render_resources = {};
         state.scene_loaded = false;
@@ -261,8 +314,13 @@ void save_as_png_with_dialog(Application_state &state)
                               nullptr);
     if (file_name != nullptr)
     {
+        // The render target is only read back while nothing writes to it, and
+        // the accumulation then carries on where it stopped
+        stop_render_thread(state.context, state.render_thread);
         auto error_message =
             write_to_png(state.context, state.render_resources, file_name);
+        state.render_thread = start_render_thread(
+            state.context, state.render_resources, state.camera);
         if (!error_message.empty())
         {
             remove_quotes(error_message);
@@ -271,6 +329,72 @@ void save_as_png_with_dialog(Application_state &state)
     }
 }
 
+void save_gpu_profile_with_dialog(Application_state &state)
+{
+    constexpr const char *filter_patterns[] {"*.csv", "*.json"};
+    const auto file_name =
+        tinyfd_saveFileDialog("Save GPU profile",
+                              nullptr,
+                              static_cast<int>(std::size(filter_patterns)),
+                              filter_patterns,
+                              nullptr);
+    if (file_name != nullptr)
+    {
+        const Gpu_profile_track tracks[] {
+            {.name = "render thread",
+             .frames = get_gpu_profile(state.render_thread)},
+            {.name = "user interface",
+             .frames = get_gpu_profile(state.context)}};
+        auto error_message = write_gpu_profile(file_name, tracks);
+        if (!error_message.empty())
+        {
+            remove_quotes(error_message);
+            tinyfd_messageBox("Error", error_message.c_str(), "ok", "error", 1);
+        }
+    }
+}
+
+// Rolling graph of the duration of a scope, with its average. Frames that did
+// not record the scope count as zero in the graph, but not in the average.
+void gpu_scope_plot(const std::vector<Gpu_frame_profile> &frames,
+                    Gpu_scope scope)
+{
+    const auto scope_index = static_cast<std::uint32_t>(scope);
+    std::vector<float> durations;
+    durations.reserve(frames.size());
+    double total_duration {0.0};
+    std::size_t recorded_count {0};
+    for (const auto &frame : frames)
+    {
+        if (is_recorded(frame, scope))
+        {
+            durations.push_back(
+                static_cast<float>(frame.scope_durations[scope_index]));
+            total_duration += frame.scope_durations[scope_index];
+            ++recorded_count;
+        }
+        else
+        {
+            durations.push_back(0.0f);
+        }
+    }
+
+    std::ostringstream overlay;
+    overlay << std::fixed << std::setprecision(3)
+            << (recorded_count > 0
+                    ? total_duration / static_cast<double>(recorded_count)
+                    : 0.0)
+            << " ms";
+    ImGui::PlotLines(get_gpu_scope_name(scope),
+                     durations.data(),
+                     static_cast<int>(durations.size()),
+                     0,
+                     overlay.str().c_str(),
+                     0.0f,
+                     std::numeric_limits<float>::max(),
+                     {0.0f, 40.0f});
+}
+
 void centered_image(ImTextureID texture_id, float aspect_ratio)
 {
     const auto region_size = ImGui::GetContentRegionAvail();
@@ -666,6 +790,10 @@ void make_ui(Application_state &state)
             {
                 save_as_png_with_dialog(state);
             }
+            if (ImGui::MenuItem("Save GPU profile"))
+            {
+                save_gpu_profile_with_dialog(state);
+            }
             ImGui::EndMenu();
         }
         ImGui::EndMainMenuBar();
@@ -687,9 +815,13 @@ void make_ui(Application_state &state)
             const auto cursor_pos = ImGui::GetCursorScreenPos();
             const auto region_size = ImGui::GetContentRegionAvail();
 
+            // The descriptor set of the frame that draw_frame() records next
+            const auto frame_in_flight = state.context.current_frame_in_flight;
             centered_image(
                 static_cast<ImTextureID>(
-                    state.render_resources.final_render_descriptor_set.get()),
+                    state.render_resources
+                        .final_render_descriptor_sets[frame_in_flight]
+                        .get()),
                 static_cast<float>(state.render_width) /
                     static_cast<float>(state.render_height));
 
@@ -776,28 +908,40 @@ void make_ui(Application_state &state)
                     1000.0 / static_cast<double>(ImGui::GetIO().Framerate),
                     static_cast<double>(ImGui::GetIO().Framerate));
 
+        if (ImGui::TreeNode("GPU profile"))
+        {
+            // The render thread submits at its own pace, so its graphs do not
+            // line up with the one of the user interface
+            const auto render_thread_frames =
+                get_gpu_profile(state.render_thread);
+            gpu_scope_plot(render_thread_frames, Gpu_scope::clear);
+            gpu_scope_plot(render_thread_frames, Gpu_scope::trace);
+            gpu_scope_plot(render_thread_frames, Gpu_scope::display_copy);
+            gpu_scope_plot(get_gpu_profile(state.context),
+                           Gpu_scope::user_interface);
+            ImGui::TreePop();
+        }
+
         if (state.scene_loaded)
         {
             ImGui::Text(
                 "Resolution: %u x %u", state.render_width, state.render_height);
 
-            ImGui::Text("Samples: %u", state.render_resources.sample_count);
+            const auto sample_count = get_sample_count(state.render_thread);
+            ImGui::Text("Samples: %u", sample_count);
 
-            auto samples_to_render =
-                static_cast<int>(state.render_resources.samples_to_render);
+            auto samples_to_render = static_cast<int>(state.samples_to_render);
             ImGui::InputInt("Total samples", &samples_to_render);
-            state.render_resources.samples_to_render =
+            state.samples_to_render =
                 static_cast<std::uint32_t>(std::max(samples_to_render, 1));
 
-            auto samples_per_frame =
-                static_cast<int>(state.render_resources.samples_per_frame);
+            auto samples_per_frame = static_cast<int>(state.samples_per_frame);
             ImGui::InputInt("Samples per frame", &samples_per_frame, 1, 10);
-            state.render_resources.samples_per_frame =
+            state.samples_per_frame =
                 static_cast<std::uint32_t>(std::max(samples_per_frame, 1));
 
             if (ImGui::Button("Reset render") ||
-                state.render_resources.samples_to_render <
-                    state.render_resources.sample_count)
+                state.samples_to_render < sample_count)
             {
                 need_to_reset = true;
             }
@@ -895,15 +1039,19 @@ void make_ui(Application_state &state)
                         static_cast<double>(inverse_view.m[1][3]),
                         static_cast<double>(inverse_view.m[2][3]),
                         static_cast<double>(inverse_view.m[3][3]));
-
-            if (need_to_reset)
-            {
-                reset_render(state.render_resources);
-            }
         }
     }
     ImGui::End();
 
+    if (state.scene_loaded)
+    {
+        update_render_thread(state.render_thread,
+                             state.camera,
+                             state.samples_to_render,
+                             state.samples_per_frame,
+                             need_to_reset);
+    }
+
     if (state.scene_loaded)
     {
         if (ImGui::Begin("Scene"))
@@ -928,6 +1076,446 @@ void make_ui(Application_state &state)
     }
 }
 
+void print_render_time(const Headless_options &options,
+                       std::uint32_t sample_count,
+                       std::chrono::steady_clock::time_point start)
+{
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::cout << "Rendered " << sample_count << " samples at "
+              << options.render_width << " x " << options.render_height
+              << " in " << elapsed.count() << " s\n";
+}
+
+void print_scheduler_stats(const Scheduler_stats &stats)
+{
+    for (std::size_t i {0}; i < stats.threads.size(); ++i)
+    {
+        const auto &thread = stats.threads[i];
+        const auto utilization =
+            stats.wall_seconds > 0.0
+                ? 100.0 * thread.busy_seconds / stats.wall_seconds
+                : 0.0;
+        std::cout << "Thread " << i << ": " << utilization << " % busy, "
+                  << thread.task_count << " tasks (" << thread.stolen_task_count
+                  << " stolen)\n";
+    }
+}
+
+[[nodiscard]] bool is_hdr_file_name(const char *file_name)
+{
+    return std::filesystem::path(file_name).extension() == ".hdr";
+}
+
+// Prints the statistics of the difference between a render and the reference
+// image, see image_comparison.hpp
+[[nodiscard]] Image_comparison
+compare_to_reference(const Image<float> &reference,
+                     std::vector<float> rgba,
+                     std::uint32_t sample_count)
+{
+    // The reference went through an HDR file, so the render is rounded the
+    // same way before comparing
+    quantize_like_hdr(rgba);
+    const auto comparison = compare_images(
+        rgba,
+        {reference.data.get(),
+         std::size_t {reference.width} * reference.height * 4},
+        reference.width,
+        reference.height);
+
+    constexpr const char *channel_names[] {"red", "green", "blue"};
+    std::cout << "Reference check at " << sample_count << " samples: RMSE "
+              << comparison.rmse << " ("
+              << comparison.rmse * std::sqrt(static_cast<double>(sample_count))
+              << " times 1/sqrt(samples)), relative MSE "
+              << comparison.relative_mse << ", mean difference "
+              << comparison.mean_difference << " (z = "
+              << comparison.mean_difference_z << "), largest tile z-score "
+              << comparison.max_tile_z << " at (" << comparison.max_tile_x
+              << ", " << comparison.max_tile_y << ") in "
+              << channel_names[comparison.max_tile_channel] << '\n';
+    return comparison;
+}
+
+// Throws if the final render is biased compared to the reference
+void check_reference_comparison(const Image_comparison &comparison)
+{
+    if (comparison.max_tile_z > max_unbiased_tile_z ||
+        std::abs(comparison.mean_difference_z) > max_unbiased_tile_z)
+    {
+        std::ostringstream message;
+        message << "The render differs from the reference by more than noise "
+                   "(largest z-score above "
+                << max_unbiased_tile_z << ')';
+        throw std::runtime_error(message.str());
+    }
+    std::cout << "The render matches the reference\n";
+}
+
+// Keeps the timings of all the frames of a headless render, if they are
+// written to a file
+void prepare_headless_gpu_profile(const Headless_options &options,
+                                  Vulkan_context &context)
+{
+    if (options.gpu_profile_file_name != nullptr)
+    {
+        resize_gpu_profile_history(context.gpu_profiler.history,
+                                   (options.sample_count +
+                                    options.samples_per_frame - 1) /
+                                       options.samples_per_frame);
+    }
+}
+
+// All submissions must have completed
+void write_headless_gpu_profile(const Headless_options &options,
+                                Vulkan_context &context)
+{
+    if (options.gpu_profile_file_name == nullptr)
+    {
+        return;
+    }
+
+    flush_gpu_profile(context);
+    const Gpu_profile_track tracks[] {
+        {.name = "trace_samples", .frames = get_gpu_profile(context)}};
+    const auto error_message =
+        write_gpu_profile(options.gpu_profile_file_name, tracks);
+    if (!error_message.empty())
+    {
+        throw std::runtime_error(error_message);
+    }
+}
+
+// Sample counts at which a render is compared to the reference, doubling
+// from one frame, so that the RMSE can be seen to decrease like
+// 1/sqrt(samples) until the noise of the reference dominates
+[[nodiscard]] bool is_reference_checkpoint(std::uint32_t sample_count,
+                                           std::uint32_t samples_per_frame)
+{
+    const auto frame_count = sample_count / samples_per_frame;
+    return sample_count % samples_per_frame == 0 &&
+           (frame_count & (frame_count - 1)) == 0;
+}
+
+void render_headless_gpu(const Headless_options &options,
+                         const Scene &scene,
+                         const Camera &camera,
+                         const Image<float> *reference)
+{
+    auto context = create_context(nullptr);
+    prepare_headless_gpu_profile(options, context);
+
+    try
+    {
+        auto render_resources = create_render_resources(
+            context, options.render_width, options.render_height, scene);
+        render_resources.samples_to_render = options.sample_count;
+        render_resources.samples_per_frame = options.samples_per_frame;
+        render_resources.rng_seed = options.seed;
+
+        auto start = std::chrono::steady_clock::now();
+
+        Image_comparison comparison {};
+        while (render_resources.sample_count <
+               render_resources.samples_to_render)
+        {
+            trace_samples(context, render_resources, camera);
+            if (reference != nullptr &&
+                (is_reference_checkpoint(render_resources.sample_count,
+                                         render_resources.samples_per_frame) ||
+                 render_resources.sample_count ==
+                     render_resources.samples_to_render))
+            {
+                // Not counted in the render time
+                const auto check_start = std::chrono::steady_clock::now();
+                context.device->waitIdle();
+                comparison = compare_to_reference(
+                    *reference,
+                    read_back_storage_image(context, render_resources),
+                    render_resources.sample_count);
+                start += std::chrono::steady_clock::now() - check_start;
+            }
+        }
+        context.device->waitIdle();
+
+        print_render_time(options, render_resources.sample_count, start);
+        write_headless_gpu_profile(options, context);
+        save_pipeline_cache_or_warn(context);
+
+        const auto error_message =
+            is_hdr_file_name(options.output_file_name)
+                ? write_to_hdr(
+                      context, render_resources, options.output_file_name)
+                : write_to_png(
+                      context, render_resources, options.output_file_name);
+        if (!error_message.empty())
+        {
+            throw std::runtime_error(error_message);
+        }
+
+        if (reference != nullptr)
+        {
+            check_reference_comparison(comparison);
+        }
+    }
+    catch (...)
+    {
+        context.device->waitIdle();
+        throw;
+    }
+}
+
+[[nodiscard]] Cpu_render_resources
+create_headless_cpu_render_resources(const Headless_options &options,
+                                     const Scene &scene)
+{
+    auto render_resources =
+        create_cpu_render_resources(scene,
+                                    options.render_width,
+                                    options.render_height,
+                                    options.thread_count,
+                                    options.bvh_width,
+                                    options.bvh_builder,
+                                    options.sbvh_split_budget,
+                                    options.quantized_bvh_nodes,
+                                    options.numa_replication);
+    render_resources.samples_to_render = options.sample_count;
+    render_resources.samples_per_frame = options.samples_per_frame;
+    render_resources.rng_seed = options.seed;
+    render_resources.use_ray_packets = options.ray_packets;
+    render_resources.integrator = options.integrator;
+
+    std::cout << "Rendering on the CPU with " << render_resources.thread_count
+              << " threads and a " << render_resources.bvh_width
+              << "-wide BVH";
+    if (options.quantized_bvh_nodes)
+    {
+        std::cout << " with quantized nodes";
+    }
+    if (render_resources.integrator == Cpu_integrator::wavefront)
+    {
+        std::cout << ", with the wavefront integrator";
+    }
+    else if (render_resources.use_ray_packets &&
+             render_resources.bvh_width > 2)
+    {
+        std::cout << ", with ray packets";
+    }
+    std::cout << '\n';
+
+    return render_resources;
+}
+
+void write_cpu_render(const Headless_options &options,
+                      const Cpu_render_resources &render_resources)
+{
+    const auto error_message =
+        is_hdr_file_name(options.output_file_name)
+            ? cpu_write_to_hdr(render_resources, options.output_file_name)
+            : cpu_write_to_png(render_resources, options.output_file_name);
+    if (!error_message.empty())
+    {
+        throw std::runtime_error(error_message);
+    }
+}
+
+void render_headless_cpu(const Headless_options &options,
+                         const Scene &scene,
+                         const Camera &camera,
+                         const Image<float> *reference)
+{
+    auto render_resources =
+        create_headless_cpu_render_resources(options, scene);
+
+    auto start = std::chrono::steady_clock::now();
+
+    // All passes are scheduled at once, so that threads never wait for each
+    // other between passes. With a reference, they are scheduled up to each
+    // checkpoint instead.
+    const auto pass_count =
+        (render_resources.samples_to_render +
+         render_resources.samples_per_frame - 1) /
+        render_resources.samples_per_frame;
+    Image_comparison comparison {};
+    for (std::uint32_t passes_done {0}, next_checkpoint {1};
+         passes_done < pass_count;
+         next_checkpoint *= 2)
+    {
+        const auto passes =
+            reference != nullptr
+                ? std::min(next_checkpoint, pass_count) - passes_done
+                : pass_count;
+        cpu_trace_passes(render_resources, camera, passes);
+        passes_done += passes;
+        if (reference != nullptr)
+        {
+            // Not counted in the render time
+            const auto check_start = std::chrono::steady_clock::now();
+            comparison = compare_to_reference(*reference,
+                                              render_resources.storage_image,
+                                              render_resources.sample_count);
+            start += std::chrono::steady_clock::now() - check_start;
+        }
+    }
+
+    print_render_time(options, render_resources.sample_count, start);
+    print_scheduler_stats(render_resources.scheduler_stats);
+
+    write_cpu_render(options, render_resources);
+
+    if (reference != nullptr)
+    {
+        check_reference_comparison(comparison);
+    }
+}
+
+// The GPU and the CPU render the same image side by side, each into its own
+// accumulation image, and the two are merged at the end. Both take batches of
+// samples_per_frame samples from the same budget, so the faster one renders
+// more of them. The CPU stops taking batches once the GPU would render all
+// the remaining samples before the CPU finished another batch, so that it
+// never delays the end of the render.
+void render_headless_hybrid(const Headless_options &options,
+                            const Scene &scene,
+                            const Camera &camera,
+                            const Image<float> *reference)
+{
+    auto cpu_render_resources =
+        create_headless_cpu_render_resources(options, scene);
+    // The CPU samples use frame indices that the GPU never reaches, so that
+    // their random numbers are decorrelated from the GPU ones while still
+    // only depending on the seed
+    constexpr std::uint32_t cpu_first_frame_index {1u << 31};
+    cpu_render_resources.global_frame_count = cpu_first_frame_index;
+
+    auto context = create_context(nullptr);
+    prepare_headless_gpu_profile(options, context);
+
+    try
+    {
+        auto render_resources = create_render_resources(
+            context, options.render_width, options.render_height, scene);
+        render_resources.samples_to_render = 0;
+        render_resources.samples_per_frame = options.samples_per_frame;
+        render_resources.rng_seed = options.seed;
+
+        std::atomic<std::uint32_t> claimed_sample_count {0};
+        // Returns the number of samples of the next batch, or zero once all
+        // samples have been claimed
+        const auto claim_samples = [&]
+        {
+            auto claimed = claimed_sample_count.load();
+            std::uint32_t samples {};
+            do
+            {
+                if (claimed >= options.sample_count)
+                {
+                    return 0u;
+                }
+                samples = std::min(options.sample_count - claimed,
+                                   options.samples_per_frame);
+            } while (!claimed_sample_count.compare_exchange_weak(
+                claimed, claimed + samples));
+            return samples;
+        };
+
+        const auto start = std::chrono::steady_clock::now();
+        std::atomic<double> gpu_samples_per_second {0.0};
+
+        std::exception_ptr cpu_exception;
+        std::jthread cpu_thread(
+            [&](std::stop_token stop_token)
+            {
+                // This thread is thread 0 of the tile scheduler
+                pin_pool_thread(0);
+                try
+                {
+                    double last_batch_seconds {0.0};
+                    while (!stop_token.stop_requested())
+                    {
+                        const auto remaining =
+                            options.sample_count - claimed_sample_count.load();
+                        const auto gpu_rate = gpu_samples_per_second.load();
+                        if (gpu_rate > 0.0 &&
+                            static_cast<double>(remaining) / gpu_rate <
+                                last_batch_seconds)
+                        {
+                            break;
+                        }
+
+                        const auto samples = claim_samples();
+                        if (samples == 0)
+                        {
+                            break;
+                        }
+
+                        const auto batch_start =
+                            std::chrono::steady_clock::now();
+                        cpu_render_resources.samples_to_render =
+                            cpu_render_resources.sample_count + samples;
+                        cpu_trace_samples(cpu_render_resources, camera);
+                        last_batch_seconds =
+                            std::chrono::duration<double>(
+                                std::chrono::steady_clock::now() - batch_start)
+                                .count();
+                    }
+                }
+                catch (...)
+                {
+                    cpu_exception = std::current_exception();
+                }
+            });
+
+        for (auto samples = claim_samples(); samples > 0;
+             samples = claim_samples())
+        {
+            render_resources.samples_to_render =
+                render_resources.sample_count + samples;
+            trace_samples(context, render_resources, camera);
+            const std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - start;
+            gpu_samples_per_second.store(
+                static_cast<double>(render_resources.sample_count) /
+                elapsed.count());
+        }
+        context.device->waitIdle();
+        cpu_thread.join();
+        if (cpu_exception)
+        {
+            std::rethrow_exception(cpu_exception);
+        }
+
+        const auto cpu_sample_count = cpu_render_resources.sample_count;
+        cpu_merge_samples(cpu_render_resources,
+                          read_back_storage_image(context, render_resources),
+                          render_resources.sample_count);
+
+        print_render_time(options, cpu_render_resources.sample_count, start);
+        std::cout << "GPU: " << render_resources.sample_count
+                  << " samples, CPU: " << cpu_sample_count << " samples\n";
+        write_headless_gpu_profile(options, context);
+        save_pipeline_cache_or_warn(context);
+
+        write_cpu_render(options, cpu_render_resources);
+
+        // Only the merged image is checked, the two backends can be checked
+        // separately with --backend gpu and --backend cpu
+        if (reference != nullptr)
+        {
+            check_reference_comparison(
+                compare_to_reference(*reference,
+                                     cpu_render_resources.storage_image,
+                                     cpu_render_resources.sample_count));
+        }
+    }
+    catch (...)
+    {
+        context.device->waitIdle();
+        throw;
+    }
+}
+
 } // namespace
 
 void run(const char *file_name)
@@ -975,10 +1563,13 @@ void run(const char *file_name)
 
             ImGui::Render();
 
-            draw_frame(state.context, state.render_resources, state.camera);
+            draw_frame(
+                state.context, state.render_resources, state.render_thread);
         }
 
+        stop_render_thread(state.context, state.render_thread);
         state.context.device->waitIdle();
+        save_pipeline_cache_or_warn(state.context);
 
         // FIXME: this won't be executed when an exception is thrown
         Assimp::DefaultLogger::kill();
@@ -989,9 +1580,98 @@ void run(const char *file_name)
         // possible, though that might not be actually possible...
         // What if we get a device lost error? In that case we can not
         // wait
+        try
+        {
+            // The render thread must not submit anything while waiting for
+            // the device. If the exception came from it, it is thrown again
+            // below anyway.
+            stop_render_thread(state.context, state.render_thread);
+        }
+        catch (...)
+        {
+        }
         state.context.device->waitIdle();
 
         throw; // FIXME: it makes no sense to throw again just to catch the
                // exception in main immediately
     }
 }
+
+void run_headless(const Headless_options &options)
+{
+    Assimp::Importer importer;
+    const auto *const ai_scene =
+        import_scene(importer, options.input_file_name);
+    if (ai_scene == nullptr)
+    {
+        throw std::runtime_error(importer.GetErrorString());
+    }
+
+    // Read before rendering, so that a missing reference fails early
+    std::optional<Image<float>> reference;
+    if (options.reference_file_name != nullptr)
+    {
+        reference = read_hdr_image(options.reference_file_name);
+        if (reference->width != options.render_width ||
+            reference->height != options.render_height)
+        {
+            throw std::runtime_error(
+                "The reference image does not have the size of the render");
+        }
+    }
+    const auto *const reference_image = reference ? &*reference : nullptr;
+
+    auto scene = create_scene(ai_scene, options.environment_file_name);
+    if (options.presplit_budget > 0.0f)
+    {
+        for (std::size_t i {0}; i < scene.meshes.size(); ++i)
+        {
+            const auto triangle_count = scene.meshes[i].indices.size() / 3;
+            const auto added_count =
+                presplit_triangles(scene.meshes[i], options.presplit_budget);
+            std::cout << "Pre-split mesh " << i << ": " << triangle_count
+                      << " triangles, " << added_count << " added\n";
+        }
+    }
+
+    auto camera = create_perspective_camera(
+        options.camera_position,
+        options.camera_target,
+        options.vertical_fov / 180.0f * std::numbers::pi_v<float>,
+        options.render_width,
+        options.render_height);
+    if (options.focus_distance > 0.0f)
+    {
+        camera.focus_distance = options.focus_distance;
+    }
+    camera.aperture_radius = options.aperture_radius;
+
+    if (options.backend != Backend::gpu)
+    {
+        // Must be set before the BVH builders start their threads
+        const auto thread_count =
+            options.thread_count != 0
+                ? options.thread_count
+                : std::max(std::thread::hardware_concurrency(), 1u);
+        set_thread_layout(create_thread_layout(
+            get_numa_topology(), options.thread_placement, thread_count));
+        std::cout << describe_thread_layout(get_thread_layout());
+        if (options.backend == Backend::cpu)
+        {
+            pin_pool_thread(0);
+        }
+    }
+
+    switch (options.backend)
+    {
+    case Backend::gpu:
+        render_headless_gpu(options, scene, camera, reference_image);
+        break;
+    case Backend::cpu:
+        render_headless_cpu(options, scene, camera, reference_image);
+        break;
+    case Backend::hybrid:
+        render_headless_hybrid(options, scene, camera, reference_image);
+        break;
+    }
+}
@@ -1,6 +1,67 @@
 #ifndef APPLICATION_HPP
 #define APPLICATION_HPP
 
+#include "cpu_renderer.hpp"
+#include "numa.hpp"
+#include "vec3.hpp"
+
+#include <cstdint>
+
+enum struct Backend
+{
+    gpu,
+    cpu,
+    // Both at once, with their samples merged into one image
+    hybrid
+};
+
+// FIXME: hardcoded filename, relative to the working directory
+inline constexpr const char *default_environment_file_name {
+    "../../powerplant.hdr"};
+
+struct Headless_options
+{
+    const char *input_file_name;
+    // Linear HDR image used as the environment map
+    const char *environment_file_name;
+    // The image format is deduced from the extension: ".hdr" writes the
+    // linear accumulated radiance, anything else writes a tone-mapped PNG.
+    const char *output_file_name;
+    // Linear HDR image the render is compared to, nullptr for none. See
+    // image_comparison.hpp for the statistics.
+    const char *reference_file_name;
+    // GPU and hybrid backends only, GPU timings of each frame, nullptr for
+    // none. See gpu_profile.hpp for the formats.
+    const char *gpu_profile_file_name;
+    std::uint32_t render_width;
+    std::uint32_t render_height;
+    std::uint32_t sample_count;
+    std::uint32_t samples_per_frame;
+    std::uint32_t seed;
+    vec3 camera_position;
+    vec3 camera_target;
+    float vertical_fov; // In degrees
+    float focus_distance; // If zero, focus on the target
+    float aperture_radius;
+    Backend backend;
+    unsigned int thread_count; // CPU backend only, zero for all threads
+    std::uint32_t bvh_width;   // CPU backend only, zero for the widest
+    Bvh_builder bvh_builder;   // CPU backend only
+    float sbvh_split_budget;   // CPU backend only
+    bool quantized_bvh_nodes;  // CPU backend only
+    // Up to this many times more triangles are created by splitting the worst
+    // ones before building acceleration structures, zero to disable
+    float presplit_budget;
+    bool ray_packets;          // CPU backend only
+    Cpu_integrator integrator; // CPU backend only
+    Thread_placement thread_placement; // CPU backend only
+    // CPU backend only, copies the meshes and BVHs to each NUMA node with
+    // threads, requires a thread placement
+    bool numa_replication;
+};
+
 void run(const char *file_name);
 
+void run_headless(const Headless_options &options);
+
 #endif // APPLICATION_HPP
@@ -0,0 +1,2013 @@
+#include "bvh.hpp"
+#include "numa.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <iterator>
+#include <limits>
+#include <numeric>
+#include <thread>
+#include <type_traits>
+
+namespace
+{
+
+constexpr std::uint32_t max_leaf_size {8};
+constexpr std::uint32_t bin_count {16};
+constexpr float traversal_cost {1.0f};
+constexpr float intersection_cost {1.0f};
+// Below this size, a node is binned on a single thread
+constexpr std::uint32_t min_parallel_binning_size {1u << 14};
+// Below this size, subtrees are always built on a single thread
+constexpr std::uint32_t min_subtree_size {1u << 10};
+// The builders cut the tree into about this many subtrees whatever the number
+// of threads, so that the layout of the nodes does not depend on it
+constexpr std::uint32_t subtree_count {256};
+constexpr std::size_t max_stack_size {64};
+// Below this size, the LBVH builder runs on a single thread
+constexpr std::uint32_t min_parallel_lbvh_size {1u << 14};
+// 30 bit Morton codes (10 bits per axis) sort in fewer passes than 63 bit ones
+// (21 bits per axis), but larger meshes need the extra precision to keep
+// their primitives apart
+constexpr std::uint32_t max_30_bit_morton_primitive_count {1u << 20};
+constexpr std::uint32_t radix_bits {8};
+constexpr std::uint32_t radix_size {1u << radix_bits};
+constexpr std::uint32_t treelet_leaf_count {7};
+constexpr std::uint32_t treelet_subset_count {1u << treelet_leaf_count};
+constexpr std::uint32_t treelet_pass_count {3};
+constexpr std::uint32_t invalid_node_index {
+    std::numeric_limits<std::uint32_t>::max()};
+constexpr std::uint32_t spatial_bin_count {16};
+// Spatial splits are only tried where the children of the best object split
+// overlap by more than this fraction of the surface area of the root
+constexpr float min_spatial_split_overlap {1e-5f};
+
+[[nodiscard]] constexpr Aabb empty_aabb() noexcept
+{
+    constexpr auto inf = std::numeric_limits<float>::infinity();
+    return {{inf, inf, inf}, {-inf, -inf, -inf}};
+}
+
+[[nodiscard]] constexpr vec3 min(const vec3 &u, const vec3 &v) noexcept
+{
+    return {std::min(u.x, v.x), std::min(u.y, v.y), std::min(u.z, v.z)};
+}
+
+[[nodiscard]] constexpr vec3 max(const vec3 &u, const vec3 &v) noexcept
+{
+    return {std::max(u.x, v.x), std::max(u.y, v.y), std::max(u.z, v.z)};
+}
+
+constexpr void grow(Aabb &aabb, const vec3 &p) noexcept
+{
+    aabb.min = min(aabb.min, p);
+    aabb.max = max(aabb.max, p);
+}
+
+constexpr void grow(Aabb &aabb, const Aabb &other) noexcept
+{
+    aabb.min = min(aabb.min, other.min);
+    aabb.max = max(aabb.max, other.max);
+}
+
+[[nodiscard]] constexpr float get(const vec3 &v, int axis) noexcept
+{
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+constexpr void set(vec3 &v, int axis, float value) noexcept
+{
+    (axis == 0 ? v.x : (axis == 1 ? v.y : v.z)) = value;
+}
+
+[[nodiscard]] constexpr Aabb get_intersection(const Aabb &a,
+                                              const Aabb &b) noexcept
+{
+    return {max(a.min, b.min), min(a.max, b.max)};
+}
+
+[[nodiscard]] constexpr bool is_empty(const Aabb &aabb) noexcept
+{
+    return aabb.min.x > aabb.max.x || aabb.min.y > aabb.max.y ||
+           aabb.min.z > aabb.max.z;
+}
+
+[[nodiscard]] constexpr float surface_area(const Aabb &aabb) noexcept
+{
+    const auto d = aabb.max - aabb.min;
+    if (d.x < 0.0f || d.y < 0.0f || d.z < 0.0f)
+    {
+        return 0.0f;
+    }
+    return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+struct Build_primitives
+{
+    std::vector<Aabb> bounds;
+    std::vector<vec3> centroids;
+};
+
+struct Build_task
+{
+    std::uint32_t node_index;
+    std::uint32_t begin;
+    std::uint32_t end;
+};
+
+struct Range_bounds
+{
+    Aabb bounds;
+    Aabb centroid_bounds;
+};
+
+struct Bin
+{
+    Aabb bounds;
+    std::uint32_t count;
+};
+
+using Bins = std::array<std::array<Bin, bin_count>, 3>;
+
+struct Split
+{
+    int axis; // -1 if no split was found
+    std::uint32_t bin; // First bin of the right child
+    float cost;        // Not normalized by the surface area of the parent
+};
+
+template <typename Code>
+struct Morton_primitive
+{
+    Code code;
+    std::uint32_t primitive;
+};
+
+// Node of the LBVH before it is converted to a Bvh. With n primitives, the
+// n - 1 interior nodes come first, and node n - 1 + i is the leaf holding the
+// i-th primitive in Morton order.
+struct Lbvh_node
+{
+    Aabb bounds;
+    float cost; // SAH cost of the subtree, not normalized
+    std::uint32_t primitive_count;
+    std::uint32_t parent; // invalid_node_index for the root
+    std::uint32_t left;   // Interior nodes only
+    std::uint32_t right;  // Interior nodes only
+};
+
+// Part of a triangle referenced by the SBVH, which can be clipped by spatial
+// splits
+struct Reference
+{
+    Aabb bounds;
+    std::uint32_t primitive;
+};
+
+struct Sbvh_task
+{
+    std::uint32_t node_index;
+    std::vector<Reference> references;
+    // The subtree can duplicate references until it holds this many
+    std::uint32_t max_reference_count;
+};
+
+struct Sbvh_subtree
+{
+    std::vector<Bvh_node> nodes;
+    std::vector<std::uint32_t> primitive_indices;
+};
+
+struct Sbvh_context
+{
+    const std::vector<vec3> &vertices;
+    const std::vector<std::uint32_t> &indices;
+    float root_area;
+};
+
+struct Spatial_bin
+{
+    Aabb bounds;
+    std::uint32_t entry_count; // References starting in this bin
+    std::uint32_t exit_count;  // References ending in this bin
+};
+
+struct Spatial_split
+{
+    int axis; // -1 if no split was found
+    float position;
+    float cost; // Not normalized by the surface area of the parent
+    std::uint32_t left_count;
+    std::uint32_t right_count;
+};
+
+// Calls function(thread_index, begin, end) on thread_count contiguous chunks
+// of [0, count), each on its own thread
+template <typename F>
+void parallel_for(unsigned int thread_count,
+                  std::uint32_t count,
+                  const F &function)
+{
+    const auto chunk_size = (count + thread_count - 1) / thread_count;
+    std::vector<std::thread> threads;
+    threads.reserve(thread_count - 1);
+    for (unsigned int i {1}; i < thread_count; ++i)
+    {
+        const auto begin = std::min(i * chunk_size, count);
+        const auto end = std::min(begin + chunk_size, count);
+        threads.emplace_back(
+            [&function, i, begin, end]
+            {
+                pin_pool_thread(i);
+                function(i, begin, end);
+            });
+    }
+    function(0u, 0u, std::min(chunk_size, count));
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+}
+
+[[nodiscard]] Range_bounds
+compute_range_bounds(const Build_primitives &primitives,
+                     const std::vector<std::uint32_t> &primitive_indices,
+                     std::uint32_t begin,
+                     std::uint32_t end) noexcept
+{
+    Range_bounds result {empty_aabb(), empty_aabb()};
+    for (auto i = begin; i < end; ++i)
+    {
+        const auto primitive = primitive_indices[i];
+        grow(result.bounds, primitives.bounds[primitive]);
+        grow(result.centroid_bounds, primitives.centroids[primitive]);
+    }
+    return result;
+}
+
+[[nodiscard]] constexpr std::uint32_t
+get_bin(float centroid, float min, float scale) noexcept
+{
+    return std::min(static_cast<std::uint32_t>((centroid - min) * scale),
+                    bin_count - 1);
+}
+
+[[nodiscard]] constexpr vec3 get_bin_scale(const Aabb &centroid_bounds)
+{
+    const auto extent = centroid_bounds.max - centroid_bounds.min;
+    constexpr auto n = static_cast<float>(bin_count);
+    return {extent.x > 0.0f ? n / extent.x : 0.0f,
+            extent.y > 0.0f ? n / extent.y : 0.0f,
+            extent.z > 0.0f ? n / extent.z : 0.0f};
+}
+
+void bin_primitives(const Build_primitives &primitives,
+                    const std::vector<std::uint32_t> &primitive_indices,
+                    std::uint32_t begin,
+                    std::uint32_t end,
+                    const Aabb &centroid_bounds,
+                    Bins &bins) noexcept
+{
+    for (auto &axis_bins : bins)
+    {
+        axis_bins.fill({empty_aabb(), 0});
+    }
+
+    const auto scale = get_bin_scale(centroid_bounds);
+    for (auto i = begin; i < end; ++i)
+    {
+        const auto primitive = primitive_indices[i];
+        const auto &centroid = primitives.centroids[primitive];
+        for (int axis {0}; axis < 3; ++axis)
+        {
+            auto &bin = bins[static_cast<std::size_t>(axis)][get_bin(
+                get(centroid, axis),
+                get(centroid_bounds.min, axis),
+                get(scale, axis))];
+            grow(bin.bounds, primitives.bounds[primitive]);
+            ++bin.count;
+        }
+    }
+}
+
+[[nodiscard]] Split find_best_split(const Bins &bins,
+                                    const Aabb &centroid_bounds) noexcept
+{
+    Split best {-1, 0, std::numeric_limits<float>::infinity()};
+    const auto extent = centroid_bounds.max - centroid_bounds.min;
+
+    for (int axis {0}; axis < 3; ++axis)
+    {
+        if (get(extent, axis) <= 0.0f)
+        {
+            continue;
+        }
+        const auto &axis_bins = bins[static_cast<std::size_t>(axis)];
+
+        // Sweep from the right to get the cost of every right child, then
+        // from the left to combine it with the left child
+        std::array<float, bin_count> right_costs {};
+        auto right_bounds = empty_aabb();
+        std::uint32_t right_count {0};
+        for (auto i = bin_count - 1; i > 0; --i)
+        {
+            grow(right_bounds, axis_bins[i].bounds);
+            right_count += axis_bins[i].count;
+            right_costs[i] = static_cast<float>(right_count) *
+                             surface_area(right_bounds);
+        }
+
+        auto left_bounds = empty_aabb();
+        std::uint32_t left_count {0};
+        for (std::uint32_t i {1}; i < bin_count; ++i)
+        {
+            grow(left_bounds, axis_bins[i - 1].bounds);
+            left_count += axis_bins[i - 1].count;
+            if (left_count == 0 || right_costs[i] == 0.0f)
+            {
+                continue;
+            }
+            const auto cost = static_cast<float>(left_count) *
+                                  surface_area(left_bounds) +
+                              right_costs[i];
+            if (cost < best.cost)
+            {
+                best = {axis, i, cost};
+            }
+        }
+    }
+
+    return best;
+}
+
+// Computes the bounds of the node, and partitions its primitives if it should
+// be split. Returns the start of the right child, or end if the node is a
+// leaf, in which case the node is filled accordingly.
+[[nodiscard]] std::uint32_t
+split_node(const Build_primitives &primitives,
+           std::vector<std::uint32_t> &primitive_indices,
+           Bvh_node &node,
+           std::uint32_t begin,
+           std::uint32_t end,
+           unsigned int thread_count)
+{
+    const auto count = end - begin;
+    const bool parallel {thread_count > 1 &&
+                         count >= min_parallel_binning_size};
+
+    Range_bounds range_bounds {};
+    Bins bins {};
+    if (parallel)
+    {
+        std::vector<Range_bounds> partial_bounds(thread_count);
+        parallel_for(thread_count,
+                     count,
+                     [&](unsigned int thread_index,
+                         std::uint32_t chunk_begin,
+                         std::uint32_t chunk_end)
+                     {
+                         partial_bounds[thread_index] =
+                             compute_range_bounds(primitives,
+                                                  primitive_indices,
+                                                  begin + chunk_begin,
+                                                  begin + chunk_end);
+                     });
+        range_bounds = {empty_aabb(), empty_aabb()};
+        for (const auto &partial : partial_bounds)
+        {
+            grow(range_bounds.bounds, partial.bounds);
+            grow(range_bounds.centroid_bounds, partial.centroid_bounds);
+        }
+
+        std::vector<Bins> partial_bins(thread_count);
+        parallel_for(thread_count,
+                     count,
+                     [&](unsigned int thread_index,
+                         std::uint32_t chunk_begin,
+                         std::uint32_t chunk_end)
+                     {
+                         bin_primitives(primitives,
+                                        primitive_indices,
+                                        begin + chunk_begin,
+                                        begin + chunk_end,
+                                        range_bounds.centroid_bounds,
+                                        partial_bins[thread_index]);
+                     });
+        bins = partial_bins.front();
+        for (std::size_t t {1}; t < partial_bins.size(); ++t)
+        {
+            for (std::size_t axis {0}; axis < 3; ++axis)
+            {
+                for (std::size_t i {0}; i < bin_count; ++i)
+                {
+                    grow(bins[axis][i].bounds, partial_bins[t][axis][i].bounds);
+                    bins[axis][i].count += partial_bins[t][axis][i].count;
+                }
+            }
+        }
+    }
+    else
+    {
+        range_bounds =
+            compute_range_bounds(primitives, primitive_indices, begin, end);
+        if (count > 1)
+        {
+            bin_primitives(primitives,
+                           primitive_indices,
+                           begin,
+                           end,
+                           range_bounds.centroid_bounds,
+                           bins);
+        }
+    }
+
+    node.bounds = range_bounds.bounds;
+    node.index = begin;
+    node.primitive_count = count;
+
+    if (count <= 1)
+    {
+        return end;
+    }
+
+    const auto split = find_best_split(bins, range_bounds.centroid_bounds);
+    if (split.axis < 0)
+    {
+        // All centroids coincide
+        return end;
+    }
+
+    const auto leaf_cost = intersection_cost * static_cast<float>(count);
+    const auto split_cost =
+        traversal_cost +
+        intersection_cost * split.cost / surface_area(range_bounds.bounds);
+    if (split_cost >= leaf_cost && count <= max_leaf_size)
+    {
+        return end;
+    }
+
+    const auto min = get(range_bounds.centroid_bounds.min, split.axis);
+    const auto scale =
+        get(get_bin_scale(range_bounds.centroid_bounds), split.axis);
+    const auto middle = std::partition(
+        primitive_indices.begin() + begin,
+        primitive_indices.begin() + end,
+        [&](std::uint32_t primitive)
+        {
+            return get_bin(get(primitives.centroids[primitive], split.axis),
+                           min,
+                           scale) < split.bin;
+        });
+
+    node.index = 0;
+    node.primitive_count = 0;
+    return static_cast<std::uint32_t>(middle - primitive_indices.begin());
+}
+
+// Builds the subtree over primitive_indices[begin, end), with its root at
+// index 0 of the returned nodes
+[[nodiscard]] std::vector<Bvh_node>
+build_subtree(const Build_primitives &primitives,
+              std::vector<std::uint32_t> &primitive_indices,
+              std::uint32_t begin,
+              std::uint32_t end)
+{
+    std::vector<Bvh_node> nodes;
+    nodes.reserve(2 * static_cast<std::size_t>(end - begin));
+    nodes.push_back({});
+
+    std::vector<Build_task> tasks {{0, begin, end}};
+    while (!tasks.empty())
+    {
+        const auto task = tasks.back();
+        tasks.pop_back();
+
+        const auto middle = split_node(primitives,
+                                       primitive_indices,
+                                       nodes[task.node_index],
+                                       task.begin,
+                                       task.end,
+                                       1);
+        if (middle == task.end)
+        {
+            continue;
+        }
+
+        const auto left_index = static_cast<std::uint32_t>(nodes.size());
+        nodes[task.node_index].index = left_index;
+        nodes.push_back({});
+        nodes.push_back({});
+        tasks.push_back({left_index, task.begin, middle});
+        tasks.push_back({left_index + 1, middle, task.end});
+    }
+
+    return nodes;
+}
+
+[[nodiscard]] Build_primitives
+compute_build_primitives(const std::vector<vec3> &vertices,
+                         const std::vector<std::uint32_t> &indices,
+                         unsigned int thread_count)
+{
+    const auto primitive_count =
+        static_cast<std::uint32_t>(indices.size() / 3);
+
+    Build_primitives primitives {};
+    primitives.bounds.resize(primitive_count);
+    primitives.centroids.resize(primitive_count);
+    parallel_for(
+        thread_count,
+        primitive_count,
+        [&](unsigned int, std::uint32_t begin, std::uint32_t end)
+        {
+            for (auto i = begin; i < end; ++i)
+            {
+                auto &bounds = primitives.bounds[i];
+                bounds = empty_aabb();
+                grow(bounds, vertices[indices[i * 3 + 0]]);
+                grow(bounds, vertices[indices[i * 3 + 1]]);
+                grow(bounds, vertices[indices[i * 3 + 2]]);
+                primitives.centroids[i] = (bounds.min + bounds.max) * 0.5f;
+            }
+        });
+    return primitives;
+}
+
+// Inserts two zero bits above each of the 10 low bits
+[[nodiscard]] constexpr std::uint32_t expand_bits(std::uint32_t x) noexcept
+{
+    x &= 0x3ff;
+    x = (x | (x << 16)) & 0x030000ff;
+    x = (x | (x << 8)) & 0x0300f00f;
+    x = (x | (x << 4)) & 0x030c30c3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
+
+// Inserts two zero bits above each of the 21 low bits
+[[nodiscard]] constexpr std::uint64_t expand_bits(std::uint64_t x) noexcept
+{
+    x &= 0x1fffff;
+    x = (x | (x << 32)) & 0x001f00000000ffff;
+    x = (x | (x << 16)) & 0x001f0000ff0000ff;
+    x = (x | (x << 8)) & 0x100f00f00f00f00f;
+    x = (x | (x << 4)) & 0x10c30c30c30c30c3;
+    x = (x | (x << 2)) & 0x1249249249249249;
+    return x;
+}
+
+// The point must be normalized to [0, 1]
+template <typename Code>
+[[nodiscard]] Code get_morton_code(const vec3 &p) noexcept
+{
+    constexpr int bits_per_axis {std::is_same_v<Code, std::uint32_t> ? 10
+                                                                      : 21};
+    constexpr auto scale = static_cast<float>(1u << bits_per_axis);
+    const auto quantize = [](float x)
+    { return static_cast<Code>(std::clamp(x * scale, 0.0f, scale - 1.0f)); };
+    return (expand_bits(quantize(p.x)) << 2) |
+           (expand_bits(quantize(p.y)) << 1) | expand_bits(quantize(p.z));
+}
+
+// Stable LSD radix sort by code. Each pass counts the digits of thread_count
+// chunks in parallel, then scatters each chunk to its own output ranges.
+template <typename Code>
+void radix_sort(std::vector<Morton_primitive<Code>> &keys,
+                unsigned int thread_count)
+{
+    const auto count = static_cast<std::uint32_t>(keys.size());
+    std::vector<Morton_primitive<Code>> sorted_keys(count);
+    std::vector<std::array<std::uint32_t, radix_size>> offsets(thread_count);
+
+    for (std::uint32_t shift {0}; shift < sizeof(Code) * 8;
+         shift += radix_bits)
+    {
+        const auto get_digit = [shift](Code code)
+        {
+            return static_cast<std::uint32_t>(code >> shift) &
+                   (radix_size - 1);
+        };
+
+        parallel_for(thread_count,
+                     count,
+                     [&](unsigned int thread_index,
+                         std::uint32_t begin,
+                         std::uint32_t end)
+                     {
+                         auto &histogram = offsets[thread_index];
+                         histogram.fill(0);
+                         for (auto i = begin; i < end; ++i)
+                         {
+                             ++histogram[get_digit(keys[i].code)];
+                         }
+                     });
+
+        // Exclusive prefix sum over the digits, then over the chunks
+        std::uint32_t offset {0};
+        bool skip_pass {false};
+        for (std::uint32_t digit {0}; digit < radix_size; ++digit)
+        {
+            const auto digit_begin = offset;
+            for (auto &histogram : offsets)
+            {
+                const auto digit_count = histogram[digit];
+                histogram[digit] = offset;
+                offset += digit_count;
+            }
+            // All keys have the same digit, as in the high bits of 30 bit
+            // codes
+            skip_pass = skip_pass || offset - digit_begin == count;
+        }
+        if (skip_pass)
+        {
+            continue;
+        }
+
+        parallel_for(thread_count,
+                     count,
+                     [&](unsigned int thread_index,
+                         std::uint32_t begin,
+                         std::uint32_t end)
+                     {
+                         auto &chunk_offsets = offsets[thread_index];
+                         for (auto i = begin; i < end; ++i)
+                         {
+                             sorted_keys[chunk_offsets[get_digit(
+                                 keys[i].code)]++] = keys[i];
+                         }
+                     });
+        keys.swap(sorted_keys);
+    }
+}
+
+// Length of the common prefix of the keys i and j, where equal codes are
+// distinguished by their index. Returns -1 if j is out of range.
+template <typename Code>
+[[nodiscard]] int
+get_common_prefix_length(const std::vector<Morton_primitive<Code>> &keys,
+                         std::int64_t i,
+                         std::int64_t j) noexcept
+{
+    if (j < 0 || j >= static_cast<std::int64_t>(keys.size()))
+    {
+        return -1;
+    }
+    const auto code_i = keys[static_cast<std::size_t>(i)].code;
+    const auto code_j = keys[static_cast<std::size_t>(j)].code;
+    if (code_i != code_j)
+    {
+        return std::countl_zero(static_cast<Code>(code_i ^ code_j));
+    }
+    return static_cast<int>(sizeof(Code) * 8) +
+           std::countl_zero(static_cast<std::uint64_t>(i ^ j));
+}
+
+// Karras, T. (2012). Maximizing Parallelism in the Construction of BVHs,
+// Octrees, and k-d Trees. Each interior node is found independently of the
+// others, from the range of sorted keys it covers.
+template <typename Code>
+void link_lbvh_node(const std::vector<Morton_primitive<Code>> &keys,
+                    std::vector<Lbvh_node> &nodes,
+                    std::uint32_t index) noexcept
+{
+    const auto leaf_begin = static_cast<std::uint32_t>(keys.size() - 1);
+    const auto prefix_length = [&](std::int64_t i, std::int64_t j)
+    { return get_common_prefix_length(keys, i, j); };
+
+    // Direction of the range, and upper bound of its length
+    const std::int64_t i {index};
+    const std::int64_t d {prefix_length(i, i + 1) > prefix_length(i, i - 1)
+                              ? 1
+                              : -1};
+    const auto min_prefix_length = prefix_length(i, i - d);
+    std::int64_t max_length {2};
+    while (prefix_length(i, i + max_length * d) > min_prefix_length)
+    {
+        max_length *= 2;
+    }
+
+    // Other end of the range
+    std::int64_t length {0};
+    for (auto t = max_length / 2; t > 0; t /= 2)
+    {
+        if (prefix_length(i, i + (length + t) * d) > min_prefix_length)
+        {
+            length += t;
+        }
+    }
+    const auto j = i + length * d;
+
+    // Split position, where the keys stop sharing the prefix of the range
+    const auto node_prefix_length = prefix_length(i, j);
+    std::int64_t split {0};
+    auto t = length;
+    do
+    {
+        t = (t + 1) / 2;
+        if (prefix_length(i, i + (split + t) * d) > node_prefix_length)
+        {
+            split += t;
+        }
+    } while (t > 1);
+    const auto gamma = static_cast<std::uint32_t>(
+        i + split * d + std::min(d, std::int64_t {0}));
+
+    auto &node = nodes[index];
+    node.left = gamma == std::min(i, j) ? leaf_begin + gamma : gamma;
+    node.right = gamma + 1 == std::max(i, j) ? leaf_begin + gamma + 1
+                                              : gamma + 1;
+    nodes[node.left].parent = index;
+    nodes[node.right].parent = index;
+}
+
+// Sorts the primitives by the Morton code of their centroid and links the
+// nodes of the LBVH over them. Only the leaves are filled in.
+template <typename Code>
+[[nodiscard]] std::vector<Lbvh_node>
+create_lbvh_nodes(const Build_primitives &primitives,
+                  const Aabb &centroid_bounds,
+                  unsigned int thread_count,
+                  std::vector<std::uint32_t> &sorted_primitives)
+{
+    const auto primitive_count =
+        static_cast<std::uint32_t>(primitives.centroids.size());
+    const auto extent = centroid_bounds.max - centroid_bounds.min;
+    const vec3 scale {extent.x > 0.0f ? 1.0f / extent.x : 0.0f,
+                      extent.y > 0.0f ? 1.0f / extent.y : 0.0f,
+                      extent.z > 0.0f ? 1.0f / extent.z : 0.0f};
+
+    std::vector<Morton_primitive<Code>> keys(primitive_count);
+    parallel_for(thread_count,
+                 primitive_count,
+                 [&](unsigned int, std::uint32_t begin, std::uint32_t end)
+                 {
+                     for (auto i = begin; i < end; ++i)
+                     {
+                         keys[i] = {get_morton_code<Code>(
+                                        (primitives.centroids[i] -
+                                         centroid_bounds.min) *
+                                        scale),
+                                    i};
+                     }
+                 });
+    radix_sort(keys, thread_count);
+
+    const auto leaf_begin = primitive_count - 1;
+    std::vector<Lbvh_node> nodes(2 * std::size_t {primitive_count} - 1);
+    nodes.front().parent = invalid_node_index;
+    sorted_primitives.resize(primitive_count);
+    parallel_for(thread_count,
+                 primitive_count,
+                 [&](unsigned int, std::uint32_t begin, std::uint32_t end)
+                 {
+                     for (auto i = begin; i < end; ++i)
+                     {
+                         const auto primitive = keys[i].primitive;
+                         sorted_primitives[i] = primitive;
+                         auto &leaf = nodes[leaf_begin + i];
+                         leaf.bounds = primitives.bounds[primitive];
+                         leaf.primitive_count = 1;
+                         leaf.cost =
+                             intersection_cost * surface_area(leaf.bounds);
+                         if (i < leaf_begin)
+                         {
+                             link_lbvh_node(keys, nodes, i);
+                         }
+                     }
+                 });
+
+    return nodes;
+}
+
+// Cost of a node, which is turned into a leaf if that is cheaper
+[[nodiscard]] constexpr float get_lbvh_node_cost(float area,
+                                                 std::uint32_t primitive_count,
+                                                 float children_cost) noexcept
+{
+    const auto split_cost = traversal_cost * area + children_cost;
+    if (primitive_count > max_leaf_size)
+    {
+        return split_cost;
+    }
+    return std::min(split_cost,
+                    intersection_cost * area *
+                        static_cast<float>(primitive_count));
+}
+
+void update_lbvh_node(std::vector<Lbvh_node> &nodes, std::uint32_t index)
+{
+    auto &node = nodes[index];
+    const auto &left = nodes[node.left];
+    const auto &right = nodes[node.right];
+    node.bounds = left.bounds;
+    grow(node.bounds, right.bounds);
+    node.primitive_count = left.primitive_count + right.primitive_count;
+    node.cost = get_lbvh_node_cost(surface_area(node.bounds),
+                                   node.primitive_count,
+                                   left.cost + right.cost);
+}
+
+// Calls visit(index) on every interior node, after both of its children, with
+// thread_count threads climbing from the leaves. Of the two threads that reach
+// a node, the first one stops, and the second one visits it.
+template <typename F>
+void visit_lbvh_bottom_up(const std::vector<Lbvh_node> &nodes,
+                          unsigned int thread_count,
+                          const F &visit)
+{
+    const auto leaf_begin = static_cast<std::uint32_t>(nodes.size() / 2);
+    std::vector<std::atomic<std::uint32_t>> arrival_counts(leaf_begin);
+    parallel_for(thread_count,
+                 leaf_begin + 1,
+                 [&](unsigned int, std::uint32_t begin, std::uint32_t end)
+                 {
+                     for (auto i = begin; i < end; ++i)
+                     {
+                         auto index = nodes[leaf_begin + i].parent;
+                         while (index != invalid_node_index &&
+                                arrival_counts[index].fetch_add(
+                                    1, std::memory_order_acq_rel) == 1)
+                         {
+                             visit(index);
+                             index = nodes[index].parent;
+                         }
+                     }
+                 });
+}
+
+// Links the interior nodes of the treelet to follow the partitions of the
+// subset of its leaves, and updates their bounds and costs
+void link_treelet(
+    std::vector<Lbvh_node> &nodes,
+    const std::array<std::uint32_t, treelet_leaf_count> &leaves,
+    const std::array<std::uint32_t, treelet_leaf_count - 1> &interior_nodes,
+    const std::array<std::uint32_t, treelet_subset_count> &partitions,
+    std::uint32_t subset,
+    std::uint32_t index,
+    std::uint32_t &next_interior_node)
+{
+    const auto get_child = [&](std::uint32_t child_subset)
+    {
+        if (std::popcount(child_subset) == 1)
+        {
+            return leaves[static_cast<std::size_t>(
+                std::countr_zero(child_subset))];
+        }
+        const auto child = interior_nodes[next_interior_node++];
+        link_treelet(nodes,
+                     leaves,
+                     interior_nodes,
+                     partitions,
+                     child_subset,
+                     child,
+                     next_interior_node);
+        return child;
+    };
+
+    const auto left = get_child(partitions[subset]);
+    const auto right = get_child(subset ^ partitions[subset]);
+    nodes[index].left = left;
+    nodes[index].right = right;
+    nodes[left].parent = index;
+    nodes[right].parent = index;
+    update_lbvh_node(nodes, index);
+}
+
+// Karras, T. and Aila, T. (2013). Fast Parallel Construction of High-Quality
+// Bounding Volume Hierarchies. The treelet of the node is grown by expanding
+// its largest leaf until it has treelet_leaf_count leaves, and is then replaced
+// by the topology over the same leaves that minimizes the SAH cost, found by
+// dynamic programming over all subsets of leaves.
+void restructure_treelet(std::vector<Lbvh_node> &nodes, std::uint32_t root)
+{
+    const auto leaf_begin = static_cast<std::uint32_t>(nodes.size() / 2);
+
+    std::array<std::uint32_t, treelet_leaf_count> leaves {nodes[root].left,
+                                                          nodes[root].right};
+    std::array<std::uint32_t, treelet_leaf_count - 1> interior_nodes {root};
+    std::uint32_t leaf_count {2};
+    while (leaf_count < treelet_leaf_count)
+    {
+        std::uint32_t largest_leaf {treelet_leaf_count};
+        float largest_area {-1.0f};
+        for (std::uint32_t i {0}; i < leaf_count; ++i)
+        {
+            const auto area = surface_area(nodes[leaves[i]].bounds);
+            if (leaves[i] < leaf_begin && area > largest_area)
+            {
+                largest_leaf = i;
+                largest_area = area;
+            }
+        }
+        if (largest_leaf == treelet_leaf_count)
+        {
+            return;
+        }
+
+        const auto expanded = leaves[largest_leaf];
+        interior_nodes[leaf_count - 1] = expanded;
+        leaves[largest_leaf] = nodes[expanded].left;
+        leaves[leaf_count++] = nodes[expanded].right;
+    }
+
+    // Subsets are larger than the subsets they contain, so each one only needs
+    // to add its lowest leaf to a subset that is already known
+    std::array<Aabb, treelet_subset_count> bounds {};
+    std::array<std::uint32_t, treelet_subset_count> primitive_counts {};
+    std::array<float, treelet_subset_count> costs {};
+    std::array<std::uint32_t, treelet_subset_count> partitions {};
+    for (std::uint32_t subset {1}; subset < treelet_subset_count; ++subset)
+    {
+        const auto lowest_leaf = subset & (0u - subset);
+        const auto others = subset ^ lowest_leaf;
+        const auto &leaf = nodes[leaves[static_cast<std::size_t>(
+            std::countr_zero(lowest_leaf))]];
+        if (others == 0)
+        {
+            bounds[subset] = leaf.bounds;
+            primitive_counts[subset] = leaf.primitive_count;
+            costs[subset] = leaf.cost;
+            continue;
+        }
+        bounds[subset] = bounds[others];
+        grow(bounds[subset], leaf.bounds);
+        primitive_counts[subset] =
+            primitive_counts[others] + leaf.primitive_count;
+
+        // Only the partitions holding the lowest leaf are tried, the others
+        // are the same with left and right swapped
+        auto best_cost = std::numeric_limits<float>::infinity();
+        auto left_others = others;
+        do
+        {
+            left_others = (left_others - 1) & others;
+            const auto left = lowest_leaf | left_others;
+            const auto cost = costs[left] + costs[subset ^ left];
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                partitions[subset] = left;
+            }
+        } while (left_others != 0);
+        costs[subset] = get_lbvh_node_cost(
+            surface_area(bounds[subset]), primitive_counts[subset], best_cost);
+    }
+
+    if (costs.back() >= nodes[root].cost)
+    {
+        return;
+    }
+
+    std::uint32_t next_interior_node {1};
+    link_treelet(nodes,
+                 leaves,
+                 interior_nodes,
+                 partitions,
+                 treelet_subset_count - 1,
+                 root,
+                 next_interior_node);
+}
+
+// Emits the nodes depth first, turning the subtrees that are cheaper as a
+// single leaf into one
+[[nodiscard]] Bvh
+convert_lbvh(const std::vector<Lbvh_node> &nodes,
+             const std::vector<std::uint32_t> &sorted_primitives)
+{
+    const auto leaf_begin = static_cast<std::uint32_t>(nodes.size() / 2);
+
+    Bvh bvh {};
+    bvh.nodes.reserve(nodes.size());
+    bvh.primitive_indices.reserve(sorted_primitives.size());
+    bvh.nodes.push_back({});
+
+    struct Convert_task
+    {
+        std::uint32_t lbvh_index;
+        std::uint32_t node_index;
+    };
+    std::vector<Convert_task> tasks {{0, 0}};
+    std::vector<std::uint32_t> leaf_stack;
+
+    while (!tasks.empty())
+    {
+        const auto task = tasks.back();
+        tasks.pop_back();
+        const auto &node = nodes[task.lbvh_index];
+
+        const bool is_leaf {
+            task.lbvh_index >= leaf_begin ||
+            (node.primitive_count <= max_leaf_size &&
+             intersection_cost * surface_area(node.bounds) *
+                     static_cast<float>(node.primitive_count) <=
+                 node.cost)};
+        if (is_leaf)
+        {
+            bvh.nodes[task.node_index] = {
+                node.bounds,
+                static_cast<std::uint32_t>(bvh.primitive_indices.size()),
+                node.primitive_count};
+            leaf_stack.push_back(task.lbvh_index);
+            while (!leaf_stack.empty())
+            {
+                const auto index = leaf_stack.back();
+                leaf_stack.pop_back();
+                if (index >= leaf_begin)
+                {
+                    bvh.primitive_indices.push_back(
+                        sorted_primitives[index - leaf_begin]);
+                }
+                else
+                {
+                    leaf_stack.push_back(nodes[index].right);
+                    leaf_stack.push_back(nodes[index].left);
+                }
+            }
+            continue;
+        }
+
+        const auto left_index = static_cast<std::uint32_t>(bvh.nodes.size());
+        bvh.nodes[task.node_index] = {node.bounds, left_index, 0};
+        bvh.nodes.push_back({});
+        bvh.nodes.push_back({});
+        tasks.push_back({node.right, left_index + 1});
+        tasks.push_back({node.left, left_index});
+    }
+
+    return bvh;
+}
+
+// Bounds of the part of the triangle between the two planes along the axis,
+// within the bounds of the reference
+[[nodiscard]] Aabb clip_reference(const Sbvh_context &context,
+                                  const Reference &reference,
+                                  int axis,
+                                  float plane_min,
+                                  float plane_max) noexcept
+{
+    const auto *const triangle = &context.indices[reference.primitive * 3];
+    const vec3 vertices[3] {context.vertices[triangle[0]],
+                            context.vertices[triangle[1]],
+                            context.vertices[triangle[2]]};
+
+    auto result = empty_aabb();
+    for (std::size_t i {0}; i < 3; ++i)
+    {
+        const auto &a = vertices[i];
+        const auto &b = vertices[(i + 1) % 3];
+        const auto pa = get(a, axis);
+        const auto pb = get(b, axis);
+        if (pa >= plane_min && pa <= plane_max)
+        {
+            grow(result, a);
+        }
+        for (const auto plane : {plane_min, plane_max})
+        {
+            if ((pa < plane && plane < pb) || (pb < plane && plane < pa))
+            {
+                auto p = a + (b - a) * ((plane - pa) / (pb - pa));
+                set(p, axis, plane);
+                grow(result, p);
+            }
+        }
+    }
+
+    return get_intersection(result, reference.bounds);
+}
+
+void bin_references(const std::vector<Reference> &references,
+                    const Aabb &centroid_bounds,
+                    Bins &bins) noexcept
+{
+    for (auto &axis_bins : bins)
+    {
+        axis_bins.fill({empty_aabb(), 0});
+    }
+
+    const auto scale = get_bin_scale(centroid_bounds);
+    for (const auto &reference : references)
+    {
+        const auto centroid =
+            (reference.bounds.min + reference.bounds.max) * 0.5f;
+        for (int axis {0}; axis < 3; ++axis)
+        {
+            auto &bin = bins[static_cast<std::size_t>(axis)][get_bin(
+                get(centroid, axis),
+                get(centroid_bounds.min, axis),
+                get(scale, axis))];
+            grow(bin.bounds, reference.bounds);
+            ++bin.count;
+        }
+    }
+}
+
+// Stich, M., Friedrich, H. and Dietrich, A. (2009). Spatial Splits in Bounding
+// Volume Hierarchies. References are clipped into every bin they overlap, and
+// counted where they start and where they end.
+[[nodiscard]] Spatial_split
+find_spatial_split(const Sbvh_context &context,
+                   const std::vector<Reference> &references,
+                   const Aabb &bounds)
+{
+    constexpr auto inf = std::numeric_limits<float>::infinity();
+    Spatial_split best {-1, 0.0f, inf, 0, 0};
+
+    for (int axis {0}; axis < 3; ++axis)
+    {
+        const auto axis_min = get(bounds.min, axis);
+        const auto extent = get(bounds.max, axis) - axis_min;
+        if (extent <= 0.0f)
+        {
+            continue;
+        }
+        const auto bin_width = extent / static_cast<float>(spatial_bin_count);
+        const auto get_spatial_bin = [&](float x)
+        {
+            return std::min(
+                static_cast<std::uint32_t>(std::max(x - axis_min, 0.0f) /
+                                           bin_width),
+                spatial_bin_count - 1);
+        };
+
+        std::array<Spatial_bin, spatial_bin_count> bins {};
+        bins.fill({empty_aabb(), 0, 0});
+        for (const auto &reference : references)
+        {
+            const auto first = get_spatial_bin(get(reference.bounds.min, axis));
+            const auto last = get_spatial_bin(get(reference.bounds.max, axis));
+            for (auto i = first; i <= last; ++i)
+            {
+                if (first == last)
+                {
+                    grow(bins[i].bounds, reference.bounds);
+                    continue;
+                }
+                const auto plane_min =
+                    i == first ? -inf : axis_min + static_cast<float>(i) *
+                                                       bin_width;
+                const auto plane_max =
+                    i == last ? inf : axis_min + static_cast<float>(i + 1) *
+                                                     bin_width;
+                grow(bins[i].bounds,
+                     clip_reference(
+                         context, reference, axis, plane_min, plane_max));
+            }
+            ++bins[first].entry_count;
+            ++bins[last].exit_count;
+        }
+
+        std::array<float, spatial_bin_count> right_costs {};
+        std::array<std::uint32_t, spatial_bin_count> right_counts {};
+        auto right_bounds = empty_aabb();
+        std::uint32_t right_count {0};
+        for (auto i = spatial_bin_count - 1; i > 0; --i)
+        {
+            grow(right_bounds, bins[i].bounds);
+            right_count += bins[i].exit_count;
+            right_costs[i] =
+                static_cast<float>(right_count) * surface_area(right_bounds);
+            right_counts[i] = right_count;
+        }
+
+        auto left_bounds = empty_aabb();
+        std::uint32_t left_count {0};
+        for (std::uint32_t i {1}; i < spatial_bin_count; ++i)
+        {
+            grow(left_bounds, bins[i - 1].bounds);
+            left_count += bins[i - 1].entry_count;
+            if (left_count == 0 || right_counts[i] == 0)
+            {
+                continue;
+            }
+            const auto cost = static_cast<float>(left_count) *
+                                  surface_area(left_bounds) +
+                              right_costs[i];
+            if (cost < best.cost)
+            {
+                best = {axis,
+                        axis_min + static_cast<float>(i) * bin_width,
+                        cost,
+                        left_count,
+                        right_counts[i]};
+            }
+        }
+    }
+
+    return best;
+}
+
+// Moves each reference to the side of the plane it is on, and clips those
+// that straddle it into both. Returns false if one side would be empty.
+[[nodiscard]] bool partition_spatial(const Sbvh_context &context,
+                                     const std::vector<Reference> &references,
+                                     const Spatial_split &split,
+                                     std::vector<Reference> &left,
+                                     std::vector<Reference> &right)
+{
+    constexpr auto inf = std::numeric_limits<float>::infinity();
+
+    left.reserve(split.left_count);
+    right.reserve(split.right_count);
+    for (const auto &reference : references)
+    {
+        if (get(reference.bounds.max, split.axis) <= split.position)
+        {
+            left.push_back(reference);
+        }
+        else if (get(reference.bounds.min, split.axis) >= split.position)
+        {
+            right.push_back(reference);
+        }
+        else
+        {
+            const auto left_bounds = clip_reference(
+                context, reference, split.axis, -inf, split.position);
+            const auto right_bounds = clip_reference(
+                context, reference, split.axis, split.position, inf);
+            if (!is_empty(left_bounds))
+            {
+                left.push_back({left_bounds, reference.primitive});
+            }
+            if (!is_empty(right_bounds))
+            {
+                right.push_back({right_bounds, reference.primitive});
+            }
+            if (is_empty(left_bounds) && is_empty(right_bounds))
+            {
+                left.push_back(reference);
+            }
+        }
+    }
+
+    return !left.empty() && !right.empty();
+}
+
+// Fills the node as a leaf and appends its primitives to primitive_indices,
+// or splits its references between the left and right tasks. Returns true if
+// the node was split.
+[[nodiscard]] bool
+split_sbvh_node(const Sbvh_context &context,
+                Sbvh_task &task,
+                Bvh_node &node,
+                std::vector<std::uint32_t> &primitive_indices,
+                Sbvh_task &left,
+                Sbvh_task &right)
+{
+    const auto &references = task.references;
+    const auto count = static_cast<std::uint32_t>(references.size());
+
+    auto bounds = empty_aabb();
+    auto centroid_bounds = empty_aabb();
+    for (const auto &reference : references)
+    {
+        grow(bounds, reference.bounds);
+        grow(centroid_bounds,
+             (reference.bounds.min + reference.bounds.max) * 0.5f);
+    }
+
+    const auto make_leaf = [&]
+    {
+        node = {bounds,
+                static_cast<std::uint32_t>(primitive_indices.size()),
+                count};
+        for (const auto &reference : references)
+        {
+            primitive_indices.push_back(reference.primitive);
+        }
+        return false;
+    };
+
+    if (count <= 1)
+    {
+        return make_leaf();
+    }
+
+    Bins bins {};
+    bin_references(references, centroid_bounds, bins);
+    const auto object_split = find_best_split(bins, centroid_bounds);
+
+    Spatial_split spatial_split {
+        -1, 0.0f, std::numeric_limits<float>::infinity(), 0, 0};
+    if (task.max_reference_count > count)
+    {
+        bool overlapping {true};
+        if (object_split.axis >= 0)
+        {
+            const auto &axis_bins =
+                bins[static_cast<std::size_t>(object_split.axis)];
+            auto left_bounds = empty_aabb();
+            auto right_bounds = empty_aabb();
+            for (std::uint32_t i {0}; i < bin_count; ++i)
+            {
+                grow(i < object_split.bin ? left_bounds : right_bounds,
+                     axis_bins[i].bounds);
+            }
+            const auto overlap = get_intersection(left_bounds, right_bounds);
+            overlapping = !is_empty(overlap) &&
+                          surface_area(overlap) >
+                              min_spatial_split_overlap * context.root_area;
+        }
+        if (overlapping)
+        {
+            spatial_split = find_spatial_split(context, references, bounds);
+            if (spatial_split.left_count + spatial_split.right_count >
+                task.max_reference_count)
+            {
+                spatial_split.axis = -1;
+            }
+        }
+    }
+
+    const auto best_cost = std::min(
+        object_split.axis >= 0 ? object_split.cost
+                               : std::numeric_limits<float>::infinity(),
+        spatial_split.axis >= 0 ? spatial_split.cost
+                                : std::numeric_limits<float>::infinity());
+    if (best_cost == std::numeric_limits<float>::infinity())
+    {
+        // All centroids coincide, and no plane separates the references
+        return make_leaf();
+    }
+    const auto leaf_cost = intersection_cost * static_cast<float>(count);
+    const auto split_cost =
+        traversal_cost + intersection_cost * best_cost / surface_area(bounds);
+    if (split_cost >= leaf_cost && count <= max_leaf_size)
+    {
+        return make_leaf();
+    }
+
+    const bool spatial {spatial_split.axis >= 0 &&
+                        spatial_split.cost < object_split.cost};
+    if (!spatial || !partition_spatial(context,
+                                       references,
+                                       spatial_split,
+                                       left.references,
+                                       right.references))
+    {
+        if (object_split.axis < 0)
+        {
+            return make_leaf();
+        }
+        left.references.clear();
+        right.references.clear();
+        const auto min = get(centroid_bounds.min, object_split.axis);
+        const auto scale =
+            get(get_bin_scale(centroid_bounds), object_split.axis);
+        for (const auto &reference : references)
+        {
+            const auto centroid =
+                (get(reference.bounds.min, object_split.axis) +
+                 get(reference.bounds.max, object_split.axis)) *
+                0.5f;
+            auto &side = get_bin(centroid, min, scale) < object_split.bin
+                             ? left.references
+                             : right.references;
+            side.push_back(reference);
+        }
+    }
+
+    // The remaining budget of duplicates is shared in proportion to the
+    // number of references of each child
+    const auto left_count = left.references.size();
+    const auto right_count = right.references.size();
+    const auto children_count = left_count + right_count;
+    const auto extra_count = task.max_reference_count > children_count
+                                 ? task.max_reference_count - children_count
+                                 : 0;
+    const auto left_extra_count = extra_count * left_count / children_count;
+    left.max_reference_count =
+        static_cast<std::uint32_t>(left_count + left_extra_count);
+    right.max_reference_count = static_cast<std::uint32_t>(
+        right_count + extra_count - left_extra_count);
+
+    node = {bounds, 0, 0};
+    task.references = {};
+    return true;
+}
+
+[[nodiscard]] Sbvh_subtree build_sbvh_subtree(const Sbvh_context &context,
+                                              Sbvh_task root)
+{
+    Sbvh_subtree subtree {};
+    subtree.nodes.push_back({});
+    root.node_index = 0;
+
+    std::vector<Sbvh_task> tasks;
+    tasks.push_back(std::move(root));
+    while (!tasks.empty())
+    {
+        auto task = std::move(tasks.back());
+        tasks.pop_back();
+
+        Sbvh_task left {};
+        Sbvh_task right {};
+        if (!split_sbvh_node(context,
+                             task,
+                             subtree.nodes[task.node_index],
+                             subtree.primitive_indices,
+                             left,
+                             right))
+        {
+            continue;
+        }
+
+        const auto left_index =
+            static_cast<std::uint32_t>(subtree.nodes.size());
+        subtree.nodes[task.node_index].index = left_index;
+        subtree.nodes.push_back({});
+        subtree.nodes.push_back({});
+        left.node_index = left_index;
+        right.node_index = left_index + 1;
+        tasks.push_back(std::move(left));
+        tasks.push_back(std::move(right));
+    }
+
+    return subtree;
+}
+
+// Returns the entry distance, or infinity if the box is missed
+[[nodiscard]] inline float intersect_aabb(const Aabb &aabb,
+                                          const vec3 &origin,
+                                          const vec3 &inv_direction,
+                                          float t_min,
+                                          float t_max) noexcept
+{
+    const auto t0 = (aabb.min - origin) * inv_direction;
+    const auto t1 = (aabb.max - origin) * inv_direction;
+    const auto t_near = min(t0, t1);
+    const auto t_far = max(t0, t1);
+    const auto t_enter =
+        std::max(std::max(t_near.x, t_near.y), std::max(t_near.z, t_min));
+    const auto t_exit =
+        std::min(std::min(t_far.x, t_far.y), std::min(t_far.z, t_max));
+    return t_enter <= t_exit ? t_enter
+                             : std::numeric_limits<float>::infinity();
+}
+
+// Möller-Trumbore, without backface culling
+[[nodiscard]] inline bool intersect_triangle(const vec3 &v0,
+                                             const vec3 &v1,
+                                             const vec3 &v2,
+                                             const Ray &ray,
+                                             float t_min,
+                                             float t_max,
+                                             float &t,
+                                             float &u,
+                                             float &v) noexcept
+{
+    const auto edge_1 = v1 - v0;
+    const auto edge_2 = v2 - v0;
+    const auto p = cross(ray.direction, edge_2);
+    const auto det = dot(edge_1, p);
+    if (det == 0.0f)
+    {
+        return false;
+    }
+    const auto inv_det = 1.0f / det;
+
+    const auto s = ray.origin - v0;
+    u = dot(s, p) * inv_det;
+    if (u < 0.0f || u > 1.0f)
+    {
+        return false;
+    }
+
+    const auto q = cross(s, edge_1);
+    v = dot(ray.direction, q) * inv_det;
+    if (v < 0.0f || u + v > 1.0f)
+    {
+        return false;
+    }
+
+    t = dot(edge_2, q) * inv_det;
+    return t >= t_min && t < t_max;
+}
+
+// thread_count must not be zero
+[[nodiscard]] Bvh build_binned_sah(const Build_primitives &primitives,
+                                   unsigned int thread_count)
+{
+    const auto primitive_count =
+        static_cast<std::uint32_t>(primitives.bounds.size());
+
+    Bvh bvh {};
+    bvh.primitive_indices.resize(primitive_count);
+    std::iota(bvh.primitive_indices.begin(), bvh.primitive_indices.end(), 0u);
+    if (primitive_count == 0)
+    {
+        return bvh;
+    }
+
+    bvh.nodes.reserve(2 * static_cast<std::size_t>(primitive_count));
+    bvh.nodes.push_back({});
+
+    // The top levels are split one node at a time, with parallel binning.
+    // Below subtree_size primitives, whole subtrees are handed to the threads.
+    const auto subtree_size =
+        std::max(primitive_count / subtree_count, min_subtree_size);
+    std::vector<Build_task> top_level_tasks {{0, 0, primitive_count}};
+    std::vector<Build_task> subtree_tasks;
+
+    while (!top_level_tasks.empty())
+    {
+        const auto task = top_level_tasks.back();
+        top_level_tasks.pop_back();
+
+        if (task.end - task.begin <= subtree_size)
+        {
+            subtree_tasks.push_back(task);
+            continue;
+        }
+
+        const auto middle = split_node(primitives,
+                                       bvh.primitive_indices,
+                                       bvh.nodes[task.node_index],
+                                       task.begin,
+                                       task.end,
+                                       thread_count);
+        if (middle == task.end)
+        {
+            continue;
+        }
+
+        const auto left_index = static_cast<std::uint32_t>(bvh.nodes.size());
+        bvh.nodes[task.node_index].index = left_index;
+        bvh.nodes.push_back({});
+        bvh.nodes.push_back({});
+        top_level_tasks.push_back({left_index, task.begin, middle});
+        top_level_tasks.push_back({left_index + 1, middle, task.end});
+    }
+
+    // Largest subtrees first, for better load balancing
+    std::sort(subtree_tasks.begin(),
+              subtree_tasks.end(),
+              [](const Build_task &a, const Build_task &b)
+              { return a.end - a.begin > b.end - b.begin; });
+
+    std::vector<std::vector<Bvh_node>> subtrees(subtree_tasks.size());
+    std::atomic<std::size_t> next_task {0};
+    const auto work = [&]
+    {
+        for (auto i = next_task.fetch_add(1, std::memory_order_relaxed);
+             i < subtree_tasks.size();
+             i = next_task.fetch_add(1, std::memory_order_relaxed))
+        {
+            subtrees[i] = build_subtree(primitives,
+                                        bvh.primitive_indices,
+                                        subtree_tasks[i].begin,
+                                        subtree_tasks[i].end);
+        }
+    };
+    const auto worker_count = static_cast<unsigned int>(
+        std::min<std::size_t>(thread_count, subtree_tasks.size()));
+    std::vector<std::thread> threads;
+    for (unsigned int i {1}; i < worker_count; ++i)
+    {
+        threads.emplace_back(
+            [&work, i]
+            {
+                pin_pool_thread(i);
+                work();
+            });
+    }
+    work();
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+
+    // Each subtree root replaces its placeholder node, and the rest of the
+    // subtree is appended
+    for (std::size_t i {0}; i < subtrees.size(); ++i)
+    {
+        const auto &subtree = subtrees[i];
+        const auto offset = static_cast<std::uint32_t>(bvh.nodes.size() - 1);
+        const auto relocate = [offset](Bvh_node node)
+        {
+            if (node.primitive_count == 0)
+            {
+                node.index += offset;
+            }
+            return node;
+        };
+        bvh.nodes[subtree_tasks[i].node_index] = relocate(subtree.front());
+        std::transform(subtree.begin() + 1,
+                       subtree.end(),
+                       std::back_inserter(bvh.nodes),
+                       relocate);
+    }
+
+    return bvh;
+}
+
+} // namespace
+
+Bvh build_bvh(const std::vector<vec3> &vertices,
+              const std::vector<std::uint32_t> &indices,
+              unsigned int thread_count)
+{
+    thread_count = std::max(thread_count, 1u);
+    return build_binned_sah(
+        compute_build_primitives(vertices, indices, thread_count),
+        thread_count);
+}
+
+Bvh build_bvh(const std::vector<Aabb> &bounds, unsigned int thread_count)
+{
+    thread_count = std::max(thread_count, 1u);
+    Build_primitives primitives {.bounds = bounds, .centroids = {}};
+    primitives.centroids.reserve(bounds.size());
+    for (const auto &primitive_bounds : bounds)
+    {
+        primitives.centroids.push_back(
+            (primitive_bounds.min + primitive_bounds.max) * 0.5f);
+    }
+    return build_binned_sah(primitives, thread_count);
+}
+
+Bvh build_lbvh(const std::vector<vec3> &vertices,
+               const std::vector<std::uint32_t> &indices,
+               unsigned int thread_count,
+               bool optimize_treelets)
+{
+    const auto primitive_count =
+        static_cast<std::uint32_t>(indices.size() / 3);
+    if (primitive_count == 0)
+    {
+        return {};
+    }
+    thread_count = primitive_count < min_parallel_lbvh_size
+                       ? 1
+                       : std::max(thread_count, 1u);
+
+    const auto primitives =
+        compute_build_primitives(vertices, indices, thread_count);
+
+    std::vector<Aabb> partial_centroid_bounds(thread_count, empty_aabb());
+    parallel_for(thread_count,
+                 primitive_count,
+                 [&](unsigned int thread_index,
+                     std::uint32_t begin,
+                     std::uint32_t end)
+                 {
+                     for (auto i = begin; i < end; ++i)
+                     {
+                         grow(partial_centroid_bounds[thread_index],
+                              primitives.centroids[i]);
+                     }
+                 });
+    auto centroid_bounds = empty_aabb();
+    for (const auto &bounds : partial_centroid_bounds)
+    {
+        grow(centroid_bounds, bounds);
+    }
+
+    std::vector<std::uint32_t> sorted_primitives;
+    auto nodes = primitive_count <= max_30_bit_morton_primitive_count
+                     ? create_lbvh_nodes<std::uint32_t>(primitives,
+                                                        centroid_bounds,
+                                                        thread_count,
+                                                        sorted_primitives)
+                     : create_lbvh_nodes<std::uint64_t>(primitives,
+                                                        centroid_bounds,
+                                                        thread_count,
+                                                        sorted_primitives);
+
+    visit_lbvh_bottom_up(nodes,
+                         thread_count,
+                         [&](std::uint32_t index)
+                         { update_lbvh_node(nodes, index); });
+
+    if (optimize_treelets)
+    {
+        for (std::uint32_t pass {0}; pass < treelet_pass_count; ++pass)
+        {
+            visit_lbvh_bottom_up(
+                nodes,
+                thread_count,
+                [&](std::uint32_t index)
+                {
+                    // The children may have been restructured
+                    update_lbvh_node(nodes, index);
+                    // Smaller subtrees become a single leaf anyway
+                    if (nodes[index].primitive_count > max_leaf_size)
+                    {
+                        restructure_treelet(nodes, index);
+                    }
+                });
+        }
+    }
+
+    return convert_lbvh(nodes, sorted_primitives);
+}
+
+Bvh build_sbvh(const std::vector<vec3> &vertices,
+               const std::vector<std::uint32_t> &indices,
+               unsigned int thread_count,
+               float split_budget)
+{
+    thread_count = std::max(thread_count, 1u);
+    const auto primitive_count =
+        static_cast<std::uint32_t>(indices.size() / 3);
+    if (primitive_count == 0)
+    {
+        return {};
+    }
+
+    const auto primitives =
+        compute_build_primitives(vertices, indices, thread_count);
+
+    Sbvh_task root {};
+    root.references.resize(primitive_count);
+    auto root_bounds = empty_aabb();
+    for (std::uint32_t i {0}; i < primitive_count; ++i)
+    {
+        root.references[i] = {primitives.bounds[i], i};
+        grow(root_bounds, primitives.bounds[i]);
+    }
+    root.max_reference_count = static_cast<std::uint32_t>(std::min(
+        static_cast<double>(primitive_count) *
+            (1.0 + static_cast<double>(std::max(split_budget, 0.0f))),
+        static_cast<double>(std::numeric_limits<std::uint32_t>::max())));
+
+    const Sbvh_context context {vertices, indices, surface_area(root_bounds)};
+
+    Bvh bvh {};
+    bvh.nodes.push_back({});
+
+    // Same scheme as build_bvh(), but the top levels are split on a single
+    // thread
+    const auto subtree_size =
+        std::max(primitive_count / subtree_count, min_subtree_size);
+    std::vector<Sbvh_task> top_level_tasks;
+    top_level_tasks.push_back(std::move(root));
+    std::vector<Sbvh_task> subtree_tasks;
+
+    while (!top_level_tasks.empty())
+    {
+        auto task = std::move(top_level_tasks.back());
+        top_level_tasks.pop_back();
+
+        if (task.references.size() <= subtree_size)
+        {
+            subtree_tasks.push_back(std::move(task));
+            continue;
+        }
+
+        Sbvh_task left {};
+        Sbvh_task right {};
+        if (!split_sbvh_node(context,
+                             task,
+                             bvh.nodes[task.node_index],
+                             bvh.primitive_indices,
+                             left,
+                             right))
+        {
+            continue;
+        }
+
+        const auto left_index = static_cast<std::uint32_t>(bvh.nodes.size());
+        bvh.nodes[task.node_index].index = left_index;
+        bvh.nodes.push_back({});
+        bvh.nodes.push_back({});
+        left.node_index = left_index;
+        right.node_index = left_index + 1;
+        top_level_tasks.push_back(std::move(left));
+        top_level_tasks.push_back(std::move(right));
+    }
+
+    // Largest subtrees first, for better load balancing
+    std::sort(subtree_tasks.begin(),
+              subtree_tasks.end(),
+              [](const Sbvh_task &a, const Sbvh_task &b)
+              { return a.references.size() > b.references.size(); });
+
+    std::vector<Sbvh_subtree> subtrees(subtree_tasks.size());
+    std::atomic<std::size_t> next_task {0};
+    const auto work = [&]
+    {
+        for (auto i = next_task.fetch_add(1, std::memory_order_relaxed);
+             i < subtree_tasks.size();
+             i = next_task.fetch_add(1, std::memory_order_relaxed))
+        {
+            subtrees[i] =
+                build_sbvh_subtree(context, std::move(subtree_tasks[i]));
+        }
+    };
+    const auto worker_count = static_cast<unsigned int>(
+        std::min<std::size_t>(thread_count, subtree_tasks.size()));
+    std::vector<std::thread> threads;
+    for (unsigned int i {1}; i < worker_count; ++i)
+    {
+        threads.emplace_back(
+            [&work, i]
+            {
+                pin_pool_thread(i);
+                work();
+            });
+    }
+    work();
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+
+    // Each subtree root replaces its placeholder node, and the rest of the
+    // subtree and its primitives are appended
+    for (std::size_t i {0}; i < subtrees.size(); ++i)
+    {
+        const auto &subtree = subtrees[i];
+        const auto node_offset =
+            static_cast<std::uint32_t>(bvh.nodes.size() - 1);
+        const auto primitive_offset =
+            static_cast<std::uint32_t>(bvh.primitive_indices.size());
+        const auto relocate = [=](Bvh_node node)
+        {
+            node.index +=
+                node.primitive_count == 0 ? node_offset : primitive_offset;
+            return node;
+        };
+        bvh.nodes[subtree_tasks[i].node_index] =
+            relocate(subtree.nodes.front());
+        std::transform(subtree.nodes.begin() + 1,
+                       subtree.nodes.end(),
+                       std::back_inserter(bvh.nodes),
+                       relocate);
+        bvh.primitive_indices.insert(bvh.primitive_indices.end(),
+                                     subtree.primitive_indices.begin(),
+                                     subtree.primitive_indices.end());
+    }
+
+    return bvh;
+}
+
+float compute_sah_cost(const Bvh &bvh)
+{
+    if (bvh.nodes.empty())
+    {
+        return 0.0f;
+    }
+
+    // Accumulate in double precision, there can be millions of nodes
+    double cost {0.0};
+    for (const auto &node : bvh.nodes)
+    {
+        const auto node_cost =
+            node.primitive_count == 0
+                ? traversal_cost
+                : intersection_cost * static_cast<float>(node.primitive_count);
+        cost += static_cast<double>(node_cost * surface_area(node.bounds));
+    }
+
+    return static_cast<float>(
+        cost / static_cast<double>(surface_area(bvh.nodes.front().bounds)));
+}
+
+bool intersect(const Bvh &bvh,
+               const std::vector<vec3> &vertices,
+               const std::vector<std::uint32_t> &indices,
+               const Ray &ray,
+               float t_min,
+               Ray_hit &hit)
+{
+    if (bvh.nodes.empty())
+    {
+        return false;
+    }
+
+    const auto inv_direction = 1.0f / ray.direction;
+
+    bool found_hit {false};
+
+    std::uint32_t stack[max_stack_size];
+    std::size_t stack_size {0};
+    stack[stack_size++] = 0;
+
+    while (stack_size > 0)
+    {
+        const auto &node = bvh.nodes[stack[--stack_size]];
+
+        if (intersect_aabb(
+                node.bounds, ray.origin, inv_direction, t_min, hit.t) ==
+            std::numeric_limits<float>::infinity())
+        {
+            continue;
+        }
+
+        if (node.primitive_count > 0)
+        {
+            for (std::uint32_t i {0}; i < node.primitive_count; ++i)
+            {
+                const auto primitive = bvh.primitive_indices[node.index + i];
+                float t {};
+                float u {};
+                float v {};
+                if (intersect_triangle(vertices[indices[primitive * 3 + 0]],
+                                       vertices[indices[primitive * 3 + 1]],
+                                       vertices[indices[primitive * 3 + 2]],
+                                       ray,
+                                       t_min,
+                                       hit.t,
+                                       t,
+                                       u,
+                                       v))
+                {
+                    hit = {.t = t, .u = u, .v = v, .primitive_index = primitive};
+                    found_hit = true;
+                }
+            }
+            continue;
+        }
+
+        // Visit the nearest child first
+        const auto t_left = intersect_aabb(bvh.nodes[node.index].bounds,
+                                           ray.origin,
+                                           inv_direction,
+                                           t_min,
+                                           hit.t);
+        const auto t_right = intersect_aabb(bvh.nodes[node.index + 1].bounds,
+                                            ray.origin,
+                                            inv_direction,
+                                            t_min,
+                                            hit.t);
+        assert(stack_size + 2 <= max_stack_size);
+        if (t_left <= t_right)
+        {
+            stack[stack_size++] = node.index + 1;
+            stack[stack_size++] = node.index;
+        }
+        else
+        {
+            stack[stack_size++] = node.index;
+            stack[stack_size++] = node.index + 1;
+        }
+    }
+
+    return found_hit;
+}
+
+bool occluded(const Bvh &bvh,
+              const std::vector<vec3> &vertices,
+              const std::vector<std::uint32_t> &indices,
+              const Ray &ray,
+              float t_min,
+              float t_max)
+{
+    if (bvh.nodes.empty())
+    {
+        return false;
+    }
+
+    const auto inv_direction = 1.0f / ray.direction;
+
+    std::uint32_t stack[max_stack_size];
+    std::size_t stack_size {0};
+    stack[stack_size++] = 0;
+
+    while (stack_size > 0)
+    {
+        const auto &node = bvh.nodes[stack[--stack_size]];
+
+        if (intersect_aabb(
+                node.bounds, ray.origin, inv_direction, t_min, t_max) ==
+            std::numeric_limits<float>::infinity())
+        {
+            continue;
+        }
+
+        if (node.primitive_count > 0)
+        {
+            for (std::uint32_t i {0}; i < node.primitive_count; ++i)
+            {
+                const auto primitive = bvh.primitive_indices[node.index + i];
+                float t {};
+                float u {};
+                float v {};
+                if (intersect_triangle(vertices[indices[primitive * 3 + 0]],
+                                       vertices[indices[primitive * 3 + 1]],
+                                       vertices[indices[primitive * 3 + 2]],
+                                       ray,
+                                       t_min,
+                                       t_max,
+                                       t,
+                                       u,
+                                       v))
+                {
+                    return true;
+                }
+            }
+            continue;
+        }
+
+        // Any hit will do, so the children are not sorted, and each one is
+        // tested against its bounds when it is popped
+        assert(stack_size + 2 <= max_stack_size);
+        stack[stack_size++] = node.index + 1;
+        stack[stack_size++] = node.index;
+    }
+
+    return false;
+}
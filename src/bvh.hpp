@@ -0,0 +1,104 @@
+#ifndef BVH_HPP
+#define BVH_HPP
+
+#include "vec3.hpp"
+
+#include <cstdint>
+#include <vector>
+
+struct Aabb
+{
+    vec3 min;
+    vec3 max;
+};
+
+// If primitive_count is zero, this is an interior node whose children are
+// nodes[index] and nodes[index + 1]. Otherwise, this is a leaf referencing
+// primitive_indices[index] to primitive_indices[index + primitive_count - 1].
+struct Bvh_node
+{
+    Aabb bounds;
+    std::uint32_t index;
+    std::uint32_t primitive_count;
+};
+static_assert(sizeof(Bvh_node) == 32);
+
+struct Bvh
+{
+    std::vector<Bvh_node> nodes;
+    std::vector<std::uint32_t> primitive_indices;
+};
+
+struct Ray
+{
+    vec3 origin;
+    vec3 direction;
+};
+
+// Same convention as the hit attributes of the closest hit shaders: the
+// barycentric coordinates of the hit point are (1 - u - v, u, v)
+struct Ray_hit
+{
+    float t;
+    float u;
+    float v;
+    std::uint32_t primitive_index;
+};
+
+// Binned SAH builder. Subtrees are built in parallel on thread_count threads,
+// and the top levels, where there are too few subtrees to go around, bin their
+// primitives in parallel instead. The root is always nodes[0].
+[[nodiscard]] Bvh build_bvh(const std::vector<vec3> &vertices,
+                            const std::vector<std::uint32_t> &indices,
+                            unsigned int thread_count);
+
+// Same builder, over arbitrary boxes instead of triangles, like the instances
+// of a scene. The boxes must not be empty.
+[[nodiscard]] Bvh build_bvh(const std::vector<Aabb> &bounds,
+                            unsigned int thread_count);
+
+// Binned SAH builder with spatial splits (SBVH). Where the children of the
+// best object split overlap, splitting space instead is also considered, and
+// the triangles that straddle the plane are clipped into both children. The
+// duplicated references can add up to split_budget times the number of
+// triangles, so primitive_indices can hold a triangle more than once. The
+// root is always nodes[0].
+[[nodiscard]] Bvh build_sbvh(const std::vector<vec3> &vertices,
+                             const std::vector<std::uint32_t> &indices,
+                             unsigned int thread_count,
+                             float split_budget);
+
+// Linear BVH builder, much faster than build_bvh() but with a higher SAH
+// cost. The primitives are sorted by the Morton code of their centroid with a
+// parallel radix sort, and the hierarchy follows the bits of the codes.
+// Optional treelet restructuring then recovers most of the SAH quality, but
+// is slower. The root is always nodes[0].
+[[nodiscard]] Bvh build_lbvh(const std::vector<vec3> &vertices,
+                             const std::vector<std::uint32_t> &indices,
+                             unsigned int thread_count,
+                             bool optimize_treelets);
+
+// Expected cost of tracing a random ray through the BVH, relative to the cost
+// of intersecting a single primitive. Lower is better.
+[[nodiscard]] float compute_sah_cost(const Bvh &bvh);
+
+// Only hits with t_min <= t < hit.t are considered. On success, returns true
+// and updates hit.
+[[nodiscard]] bool intersect(const Bvh &bvh,
+                             const std::vector<vec3> &vertices,
+                             const std::vector<std::uint32_t> &indices,
+                             const Ray &ray,
+                             float t_min,
+                             Ray_hit &hit);
+
+// Returns true as soon as any hit with t_min <= t < t_max is found, without
+// looking for the closest one. This is all that shadow and visibility rays
+// need.
+[[nodiscard]] bool occluded(const Bvh &bvh,
+                            const std::vector<vec3> &vertices,
+                            const std::vector<std::uint32_t> &indices,
+                            const Ray &ray,
+                            float t_min,
+                            float t_max);
+
+#endif // BVH_HPP
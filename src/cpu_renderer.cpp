@@ -0,0 +1,2153 @@
+#include "cpu_renderer.hpp"
+#include "camera.hpp"
+#include "numa.hpp"
+#include "tile_scheduler.hpp"
+#include "utility.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <span>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+namespace
+{
+
+// Everything in this namespace mirrors the shaders as closely as possible,
+// including the order of the random number draws.
+
+constexpr float pi {3.1415926535897931f};
+constexpr std::uint32_t tile_size {16};
+// Width of the pixel blocks traced together, whose height is the packet size
+// divided by this
+constexpr std::uint32_t packet_width {4};
+// Number of consecutive tiles traced as one wavefront
+constexpr std::uint32_t wavefront_tile_count {4};
+constexpr std::size_t material_count {4};
+constexpr std::uint32_t max_bounces {32};
+constexpr float ray_t_min {0.0f};
+constexpr float ray_t_max {10000.0f};
+// Same bound as the traversal of the binary BVH in bvh.cpp
+constexpr std::uint32_t max_tlas_stack_size {64};
+
+struct Ray_payload
+{
+    vec3 color;
+    vec3 emissivity;
+    vec3 ray_origin;
+    vec3 ray_direction;
+    float reflectance_attenuation;
+    std::uint32_t rng_state;
+    bool hit_sky;
+};
+
+struct Hit
+{
+    vec3 world_position;
+    vec3 world_normal;
+};
+
+[[nodiscard]] constexpr std::uint32_t hash(std::uint32_t x) noexcept
+{
+    x += x << 10;
+    x ^= x >> 6;
+    x += x << 3;
+    x ^= x >> 11;
+    x += x << 15;
+    return x;
+}
+
+[[nodiscard]] inline float random(std::uint32_t &rng_state) noexcept
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    // NOTE: due to rounding when converting to float,
+    // this can still return 1.0.
+    return static_cast<float>(rng_state) * (1.0f / 4294967296.0f);
+}
+
+// Normal distribution with zero mean and unit standard deviation
+inline void
+sample_gaussian(std::uint32_t &rng_state, float &x, float &y) noexcept
+{
+    constexpr float float_min {1.175494351e-38f};
+    const auto r = std::sqrt(-2.0f * std::log(std::max(float_min,
+                                                       random(rng_state))));
+    const auto theta = 2.0f * pi * random(rng_state);
+    x = r * std::cos(theta);
+    y = r * std::sin(theta);
+}
+
+inline void sample_disk(std::uint32_t &rng_state, float &x, float &y) noexcept
+{
+    const auto r = std::sqrt(random(rng_state));
+    const auto theta = 2.0f * pi * random(rng_state);
+    x = r * std::cos(theta);
+    y = r * std::sin(theta);
+}
+
+[[nodiscard]] inline vec3 sample_sphere(std::uint32_t &rng_state) noexcept
+{
+    const auto theta = 2.0f * pi * random(rng_state);
+    const auto z = 2.0f * random(rng_state) - 1.0f;
+    const auto r = std::sqrt(1.0f - z * z);
+    return {r * std::cos(theta), r * std::sin(theta), z};
+}
+
+[[nodiscard]] inline vec3 reflect_diffuse(const vec3 &normal,
+                                          std::uint32_t &rng_state) noexcept
+{
+    return normalize(normal + sample_sphere(rng_state));
+}
+
+[[nodiscard]] constexpr vec3 reflect(const vec3 &incident,
+                                     const vec3 &normal) noexcept
+{
+    return incident - 2.0f * dot(normal, incident) * normal;
+}
+
+[[nodiscard]] constexpr vec3 faceforward(const vec3 &n,
+                                         const vec3 &incident,
+                                         const vec3 &n_ref) noexcept
+{
+    return dot(n_ref, incident) < 0.0f ? n : -n;
+}
+
+// By Carsten Wächter and Nikolaus Binder from "A Fast and Robust
+// Method for Avoiding Self-Intersection" from Ray Tracing Gems
+// (version 1.7, 2020).
+[[nodiscard]] inline float offset_component(float position,
+                                            float normal) noexcept
+{
+    constexpr float origin {1.0f / 32.0f};
+    constexpr float float_scale {1.0f / 65536.0f};
+
+    if (std::abs(position) < origin)
+    {
+        return position + float_scale * normal;
+    }
+
+    const auto of_i = static_cast<std::int32_t>(256.0f * normal);
+    return std::bit_cast<float>(std::bit_cast<std::int32_t>(position) +
+                                (position < 0.0f ? -of_i : of_i));
+}
+
+[[nodiscard]] inline vec3 offset_position_along_normal(const vec3 &position,
+                                                       const vec3 &normal)
+{
+    return {offset_component(position.x, normal.x),
+            offset_component(position.y, normal.y),
+            offset_component(position.z, normal.z)};
+}
+
+// Equivalent to texture() with linear filtering and repeat addressing
+[[nodiscard]] vec3 sample_environment_map(const Image<float> &image,
+                                          float u,
+                                          float v) noexcept
+{
+    const auto width = static_cast<std::int64_t>(image.width);
+    const auto height = static_cast<std::int64_t>(image.height);
+    const auto x = u * static_cast<float>(width) - 0.5f;
+    const auto y = v * static_cast<float>(height) - 0.5f;
+    const auto x_floor = std::floor(x);
+    const auto y_floor = std::floor(y);
+    const auto fx = x - x_floor;
+    const auto fy = y - y_floor;
+    const auto wrap = [](std::int64_t i, std::int64_t n)
+    { return static_cast<std::size_t>(((i % n) + n) % n); };
+    const auto x0 = wrap(static_cast<std::int64_t>(x_floor), width);
+    const auto x1 = wrap(static_cast<std::int64_t>(x_floor) + 1, width);
+    const auto y0 = wrap(static_cast<std::int64_t>(y_floor), height);
+    const auto y1 = wrap(static_cast<std::int64_t>(y_floor) + 1, height);
+
+    const auto texel = [&](std::size_t i, std::size_t j)
+    {
+        const auto *const p =
+            image.data.get() + (j * static_cast<std::size_t>(width) + i) * 4;
+        return vec3 {p[0], p[1], p[2]};
+    };
+
+    return (texel(x0, y0) * (1.0f - fx) + texel(x1, y0) * fx) * (1.0f - fy) +
+           (texel(x0, y1) * (1.0f - fx) + texel(x1, y1) * fx) * fy;
+}
+
+void miss(const Scene &scene, Ray_payload &payload)
+{
+    const auto &direction = payload.ray_direction;
+    const auto azimuth = std::atan2(direction.z, direction.x);
+    const auto inclination = std::acos(direction.y);
+    const auto u = (azimuth + pi) / (2.0f * pi);
+    const auto v = inclination / pi;
+    const auto color = sample_environment_map(scene.environment_map, u, v);
+    payload.color = color;
+    payload.emissivity = color;
+    payload.hit_sky = true;
+}
+
+[[nodiscard]] Hit get_hit(const Mesh &mesh,
+                          const mat3x4 &object_to_world,
+                          const mat3x4 &world_to_object,
+                          const Ray_hit &ray_hit,
+                          const vec3 &world_ray_direction)
+{
+    const auto i0 = mesh.indices[ray_hit.primitive_index * 3 + 0];
+    const auto i1 = mesh.indices[ray_hit.primitive_index * 3 + 1];
+    const auto i2 = mesh.indices[ray_hit.primitive_index * 3 + 2];
+
+    const auto b0 = 1.0f - ray_hit.u - ray_hit.v;
+    const auto b1 = ray_hit.u;
+    const auto b2 = ray_hit.v;
+    const auto object_position = mesh.vertices[i0] * b0 +
+                                 mesh.vertices[i1] * b1 +
+                                 mesh.vertices[i2] * b2;
+    const auto object_normal =
+        mesh.normals[i0] * b0 + mesh.normals[i1] * b1 + mesh.normals[i2] * b2;
+
+    const auto world_normal = normalize(
+        transform_direction_transposed(world_to_object, object_normal));
+
+    return {.world_position = transform_point(object_to_world, object_position),
+            .world_normal = faceforward(
+                world_normal, world_ray_direction, world_normal)};
+}
+
+void closest_hit_diffuse(const Hit &hit, Ray_payload &payload)
+{
+    payload.ray_origin =
+        offset_position_along_normal(hit.world_position, hit.world_normal);
+    payload.ray_direction =
+        reflect_diffuse(hit.world_normal, payload.rng_state);
+    payload.color = (hit.world_normal + vec3 {1.0f, 1.0f, 1.0f}) * 0.5f;
+    payload.emissivity = {0.0f, 0.0f, 0.0f};
+    payload.hit_sky = false;
+}
+
+void closest_hit_specular(const Hit &hit, Ray_payload &payload)
+{
+    payload.ray_origin =
+        offset_position_along_normal(hit.world_position, hit.world_normal);
+    payload.ray_direction = reflect(payload.ray_direction, hit.world_normal);
+    payload.color = {0.75f, 0.75f, 0.75f};
+    payload.emissivity = {0.0f, 0.0f, 0.0f};
+    payload.hit_sky = false;
+}
+
+void closest_hit_emissive(const Hit &hit, Ray_payload &payload)
+{
+    payload.ray_origin =
+        offset_position_along_normal(hit.world_position, hit.world_normal);
+    payload.ray_direction =
+        reflect_diffuse(hit.world_normal, payload.rng_state);
+    payload.color = {0.75f, 0.75f, 0.75f};
+    payload.emissivity = {5.0f, 5.0f, 5.0f};
+    payload.hit_sky = false;
+}
+
+void closest_hit_dielectric(const Hit &hit, Ray_payload &payload)
+{
+    payload.color = {1.0f, 1.0f, 1.0f};
+    payload.emissivity = {0.0f, 0.0f, 0.0f};
+    payload.hit_sky = false;
+
+    const auto direction = payload.ray_direction;
+    const bool into {dot(direction, hit.world_normal) < 0.0f};
+    const auto normal = into ? hit.world_normal : -hit.world_normal;
+    const auto reflected_dir = reflect(direction, normal);
+    constexpr float n_air {1.0f};
+    constexpr float n_glass {1.5f};
+    const auto n_ratio = into ? n_air / n_glass : n_glass / n_air;
+    const auto dir_dot_normal = dot(direction, normal);
+    const auto cos2t =
+        1.0f - n_ratio * n_ratio * (1.0f - dir_dot_normal * dir_dot_normal);
+    // Total internal reflection
+    if (cos2t < 0.0f)
+    {
+        payload.ray_origin =
+            offset_position_along_normal(hit.world_position, normal);
+        payload.ray_direction = reflected_dir;
+        return;
+    }
+
+    const auto transmitted_dir = normalize(
+        direction * n_ratio -
+        hit.world_normal * ((into ? 1.0f : -1.0f) *
+                            (dir_dot_normal * n_ratio + std::sqrt(cos2t))));
+    constexpr auto a = n_glass - n_air;
+    constexpr auto b = n_glass + n_air;
+    constexpr auto R0 = a * a / (b * b);
+    const auto c = 1.0f - (into ? -dir_dot_normal
+                                : dot(transmitted_dir, hit.world_normal));
+    const auto Re = R0 + (1.0f - R0) * c * c * c * c * c;
+    const auto Tr = 1.0f - Re;
+    const auto P = 0.25f + 0.5f * Re;
+    const auto RP = Re / P;
+    const auto TP = Tr / (1.0f - P);
+    if (random(payload.rng_state) < P)
+    {
+        payload.reflectance_attenuation = RP;
+        payload.ray_origin =
+            offset_position_along_normal(hit.world_position, normal);
+        payload.ray_direction = reflected_dir;
+    }
+    else
+    {
+        payload.reflectance_attenuation = TP;
+        payload.ray_origin =
+            offset_position_along_normal(hit.world_position, -normal);
+        payload.ray_direction = transmitted_dir;
+    }
+}
+
+// Meshes of the NUMA node of the calling thread
+[[nodiscard]] const std::vector<Mesh> &
+get_meshes(const Cpu_render_resources &render_resources) noexcept
+{
+    const auto node = get_current_numa_node();
+    return node > 0 && node <= render_resources.numa_replicas.size()
+               ? render_resources.numa_replicas[node - 1].meshes
+               : render_resources.scene->meshes;
+}
+
+// BVHs of the meshes of the NUMA node of the calling thread
+[[nodiscard]] const std::vector<Mesh_bvh> &
+get_mesh_bvhs(const Cpu_render_resources &render_resources) noexcept
+{
+    const auto node = get_current_numa_node();
+    return node > 0 && node <= render_resources.numa_replicas.size()
+               ? render_resources.numa_replicas[node - 1].mesh_bvhs
+               : render_resources.mesh_bvhs;
+}
+
+// Slab test against the world space bounds of an instance or of a TLAS node.
+// Returns the entry distance, or infinity if the box is missed.
+[[nodiscard]] float intersect_bounds(const Aabb &bounds,
+                                     const vec3 &origin,
+                                     const vec3 &inv_direction,
+                                     float t_max) noexcept
+{
+    const auto t0 = (bounds.min - origin) * inv_direction;
+    const auto t1 = (bounds.max - origin) * inv_direction;
+    const auto t_enter =
+        std::max(std::max(std::min(t0.x, t1.x), std::min(t0.y, t1.y)),
+                 std::max(std::min(t0.z, t1.z), ray_t_min));
+    const auto t_exit =
+        std::min(std::min(std::max(t0.x, t1.x), std::max(t0.y, t1.y)),
+                 std::min(std::max(t0.z, t1.z), t_max));
+    return t_enter <= t_exit ? t_enter
+                             : std::numeric_limits<float>::infinity();
+}
+
+// Equivalent to entering a BLAS instance: the ray is transformed to the object
+// space of the instance and traced against the BVH of its mesh. Returns true
+// if ray_hit was updated.
+[[nodiscard]] bool
+intersect_instance(const Cpu_render_resources &render_resources,
+                   std::size_t instance_index,
+                   const vec3 &ray_origin,
+                   const vec3 &ray_direction,
+                   Ray_hit &ray_hit)
+{
+    const auto &instance = render_resources.scene->instances[instance_index];
+    const auto &mesh = get_meshes(render_resources)[instance.mesh_index];
+    const auto &world_to_object =
+        render_resources.world_to_object_transforms[instance_index];
+    // The direction is not normalized, so that t is the same in world and
+    // object space
+    const Ray object_ray {
+        .origin = transform_point(world_to_object, ray_origin),
+        .direction = transform_direction(world_to_object, ray_direction)};
+    return std::visit(
+        [&](const auto &bvh)
+        {
+            // Wide BVHs store their own copy of the triangles
+            if constexpr (std::is_same_v<std::decay_t<decltype(bvh)>, Bvh>)
+            {
+                return intersect(bvh,
+                                 mesh.vertices,
+                                 mesh.indices,
+                                 object_ray,
+                                 ray_t_min,
+                                 ray_hit);
+            }
+            else
+            {
+                return intersect(bvh, object_ray, ray_t_min, ray_hit);
+            }
+        },
+        get_mesh_bvhs(render_resources)[instance.mesh_index]);
+}
+
+// Equivalent to traceRayEXT() up to the closest hit. Returns the index of the
+// hit instance, or the number of instances if the ray missed.
+[[nodiscard]] std::size_t
+find_closest_hit(const Cpu_render_resources &render_resources,
+                 const vec3 &ray_origin,
+                 const vec3 &ray_direction,
+                 Ray_hit &ray_hit)
+{
+    const auto &tlas = render_resources.tlas;
+
+    ray_hit = {.t = ray_t_max, .u = 0.0f, .v = 0.0f, .primitive_index = 0};
+    std::size_t hit_instance {render_resources.scene->instances.size()};
+    if (tlas.nodes.empty())
+    {
+        return hit_instance;
+    }
+
+    const auto inv_direction = 1.0f / ray_direction;
+
+    std::uint32_t stack[max_tlas_stack_size];
+    std::uint32_t stack_size {0};
+    stack[stack_size++] = 0;
+
+    while (stack_size > 0)
+    {
+        const auto &node = tlas.nodes[stack[--stack_size]];
+
+        if (node.primitive_count > 0)
+        {
+            for (std::uint32_t i {0}; i < node.primitive_count; ++i)
+            {
+                const auto instance = tlas.primitive_indices[node.index + i];
+                if (intersect_bounds(render_resources.instance_bounds[instance],
+                                     ray_origin,
+                                     inv_direction,
+                                     ray_hit.t) !=
+                        std::numeric_limits<float>::infinity() &&
+                    intersect_instance(render_resources,
+                                       instance,
+                                       ray_origin,
+                                       ray_direction,
+                                       ray_hit))
+                {
+                    hit_instance = instance;
+                }
+            }
+            continue;
+        }
+
+        // Visit the nearest child first
+        const auto t_left = intersect_bounds(tlas.nodes[node.index].bounds,
+                                             ray_origin,
+                                             inv_direction,
+                                             ray_hit.t);
+        const auto t_right = intersect_bounds(tlas.nodes[node.index + 1].bounds,
+                                              ray_origin,
+                                              inv_direction,
+                                              ray_hit.t);
+        constexpr auto inf = std::numeric_limits<float>::infinity();
+        assert(stack_size + 2 <= max_tlas_stack_size);
+        const auto near_index = t_left <= t_right ? node.index : node.index + 1;
+        const auto far_index = t_left <= t_right ? node.index + 1 : node.index;
+        if (std::max(t_left, t_right) != inf)
+        {
+            stack[stack_size++] = far_index;
+        }
+        if (std::min(t_left, t_right) != inf)
+        {
+            stack[stack_size++] = near_index;
+        }
+    }
+
+    return hit_instance;
+}
+
+// Same as intersect_instance() for each ray of lane_mask, traced as one
+// packet. Sets the hit instance of the rays whose hit was updated.
+template <std::uint32_t N>
+void intersect_instance_packet(const Cpu_render_resources &render_resources,
+                               std::size_t instance_index,
+                               const Ray_payload *payloads,
+                               std::uint32_t lane_mask,
+                               Ray_packet_hit<ray_packet_size<N>> &packet_hit,
+                               std::size_t *hit_instances)
+{
+    constexpr auto P = ray_packet_size<N>;
+
+    const auto &instance = render_resources.scene->instances[instance_index];
+    const auto &world_to_object =
+        render_resources.world_to_object_transforms[instance_index];
+    Ray_packet<P> packet {};
+    for (auto mask = lane_mask; mask != 0; mask &= mask - 1)
+    {
+        const auto lane = static_cast<std::uint32_t>(std::countr_zero(mask));
+        const auto origin =
+            transform_point(world_to_object, payloads[lane].ray_origin);
+        const auto direction = transform_direction(
+            world_to_object, payloads[lane].ray_direction);
+        packet.origin_x[lane] = origin.x;
+        packet.origin_y[lane] = origin.y;
+        packet.origin_z[lane] = origin.z;
+        packet.direction_x[lane] = direction.x;
+        packet.direction_y[lane] = direction.y;
+        packet.direction_z[lane] = direction.z;
+    }
+
+    auto hit_mask = std::visit(
+        [&](const auto &bvh) -> std::uint32_t
+        {
+            using Bvh_type = std::decay_t<decltype(bvh)>;
+            // Packets are only traced with the BVH of width N
+            if constexpr (std::is_same_v<Bvh_type, Wide_bvh<N>> ||
+                          (N == 4 && std::is_same_v<Bvh_type, Quantized_bvh>))
+            {
+                return intersect(bvh, packet, lane_mask, ray_t_min, packet_hit);
+            }
+            else
+            {
+                return 0;
+            }
+        },
+        get_mesh_bvhs(render_resources)[instance.mesh_index]);
+    for (; hit_mask != 0; hit_mask &= hit_mask - 1)
+    {
+        hit_instances[std::countr_zero(hit_mask)] = instance_index;
+    }
+}
+
+// Same as find_closest_hit() for each ray of lane_mask, traced as one packet.
+// Each TLAS node is visited with the rays that hit it, and each instance is
+// entered with them.
+template <std::uint32_t N>
+void find_closest_hits(const Cpu_render_resources &render_resources,
+                       const Ray_payload *payloads,
+                       std::uint32_t lane_mask,
+                       Ray_hit *ray_hits,
+                       std::size_t *hit_instances)
+{
+    constexpr auto P = ray_packet_size<N>;
+    const auto &tlas = render_resources.tlas;
+
+    Ray_packet_hit<P> packet_hit {};
+    vec3 inv_directions[P] {};
+    for (std::uint32_t lane {0}; lane < P; ++lane)
+    {
+        packet_hit.t[lane] = ray_t_max;
+        hit_instances[lane] = render_resources.scene->instances.size();
+        inv_directions[lane] = 1.0f / payloads[lane].ray_direction;
+    }
+
+    // Returns the mask of the rays of ray_mask that hit the bounds
+    const auto intersect_packet_bounds =
+        [&](const Aabb &bounds, std::uint32_t ray_mask)
+    {
+        std::uint32_t hit_mask {0};
+        for (auto mask = ray_mask; mask != 0; mask &= mask - 1)
+        {
+            const auto lane =
+                static_cast<std::uint32_t>(std::countr_zero(mask));
+            if (intersect_bounds(bounds,
+                                 payloads[lane].ray_origin,
+                                 inv_directions[lane],
+                                 packet_hit.t[lane]) !=
+                std::numeric_limits<float>::infinity())
+            {
+                hit_mask |= 1u << lane;
+            }
+        }
+        return hit_mask;
+    };
+
+    struct Tlas_stack_entry
+    {
+        std::uint32_t index;
+        std::uint32_t lane_mask;
+    };
+
+    Tlas_stack_entry stack[max_tlas_stack_size];
+    std::uint32_t stack_size {0};
+    if (!tlas.nodes.empty())
+    {
+        stack[stack_size++] = {0, lane_mask};
+    }
+
+    while (stack_size > 0)
+    {
+        const auto entry = stack[--stack_size];
+        const auto &node = tlas.nodes[entry.index];
+
+        if (node.primitive_count == 0)
+        {
+            for (std::uint32_t i {0}; i < 2; ++i)
+            {
+                const auto child_mask = intersect_packet_bounds(
+                    tlas.nodes[node.index + i].bounds, entry.lane_mask);
+                if (child_mask != 0)
+                {
+                    assert(stack_size < max_tlas_stack_size);
+                    stack[stack_size++] = {node.index + i, child_mask};
+                }
+            }
+            continue;
+        }
+
+        for (std::uint32_t i {0}; i < node.primitive_count; ++i)
+        {
+            const auto instance = tlas.primitive_indices[node.index + i];
+            const auto instance_mask = intersect_packet_bounds(
+                render_resources.instance_bounds[instance], entry.lane_mask);
+            if (instance_mask != 0)
+            {
+                intersect_instance_packet<N>(render_resources,
+                                             instance,
+                                             payloads,
+                                             instance_mask,
+                                             packet_hit,
+                                             hit_instances);
+            }
+        }
+    }
+
+    for (auto mask = lane_mask; mask != 0; mask &= mask - 1)
+    {
+        const auto lane = static_cast<std::uint32_t>(std::countr_zero(mask));
+        ray_hits[lane] = {.t = packet_hit.t[lane],
+                          .u = packet_hit.u[lane],
+                          .v = packet_hit.v[lane],
+                          .primitive_index = packet_hit.primitive_index[lane]};
+    }
+}
+
+// Any hit counterpart of intersect_instance(): returns true as soon as the
+// ray hits a triangle of the instance with t < t_max
+[[nodiscard]] bool
+occluded_instance(const Cpu_render_resources &render_resources,
+                  std::size_t instance_index,
+                  const Ray &ray,
+                  float t_max)
+{
+    const auto &instance = render_resources.scene->instances[instance_index];
+    const auto &mesh = get_meshes(render_resources)[instance.mesh_index];
+    const auto &world_to_object =
+        render_resources.world_to_object_transforms[instance_index];
+    const Ray object_ray {
+        .origin = transform_point(world_to_object, ray.origin),
+        .direction = transform_direction(world_to_object, ray.direction)};
+    return std::visit(
+        [&](const auto &bvh)
+        {
+            if constexpr (std::is_same_v<std::decay_t<decltype(bvh)>, Bvh>)
+            {
+                return occluded(bvh,
+                                mesh.vertices,
+                                mesh.indices,
+                                object_ray,
+                                ray_t_min,
+                                t_max);
+            }
+            else
+            {
+                return occluded(bvh, object_ray, ray_t_min, t_max);
+            }
+        },
+        get_mesh_bvhs(render_resources)[instance.mesh_index]);
+}
+
+// Any hit counterpart of find_closest_hit(). The TLAS children are visited in
+// no particular order, and the traversal stops at the first hit.
+[[nodiscard]] bool is_occluded(const Cpu_render_resources &render_resources,
+                               const Ray &ray,
+                               float t_max)
+{
+    const auto &tlas = render_resources.tlas;
+    if (tlas.nodes.empty())
+    {
+        return false;
+    }
+
+    const auto inv_direction = 1.0f / ray.direction;
+    constexpr auto inf = std::numeric_limits<float>::infinity();
+
+    std::uint32_t stack[max_tlas_stack_size];
+    std::uint32_t stack_size {0};
+    stack[stack_size++] = 0;
+
+    while (stack_size > 0)
+    {
+        const auto &node = tlas.nodes[stack[--stack_size]];
+
+        if (node.primitive_count > 0)
+        {
+            for (std::uint32_t i {0}; i < node.primitive_count; ++i)
+            {
+                const auto instance = tlas.primitive_indices[node.index + i];
+                if (intersect_bounds(render_resources.instance_bounds[instance],
+                                     ray.origin,
+                                     inv_direction,
+                                     t_max) != inf &&
+                    occluded_instance(render_resources, instance, ray, t_max))
+                {
+                    return true;
+                }
+            }
+            continue;
+        }
+
+        for (std::uint32_t i {0}; i < 2; ++i)
+        {
+            if (intersect_bounds(tlas.nodes[node.index + i].bounds,
+                                 ray.origin,
+                                 inv_direction,
+                                 t_max) != inf)
+            {
+                assert(stack_size < max_tlas_stack_size);
+                stack[stack_size++] = node.index + i;
+            }
+        }
+    }
+
+    return false;
+}
+
+// Same as is_occluded() for each ray of lane_mask, traced as one packet.
+// Returns the mask of the occluded rays. The rays found occluded are dropped
+// from the rest of the traversal, which stops once they all are.
+template <std::uint32_t N>
+[[nodiscard]] std::uint32_t
+are_occluded(const Cpu_render_resources &render_resources,
+             const Ray *rays,
+             const float *t_max,
+             std::uint32_t lane_mask)
+{
+    constexpr auto P = ray_packet_size<N>;
+    const auto &tlas = render_resources.tlas;
+
+    std::uint32_t occluded_mask {0};
+    if (tlas.nodes.empty())
+    {
+        return occluded_mask;
+    }
+
+    vec3 inv_directions[P] {};
+    for (auto mask = lane_mask; mask != 0; mask &= mask - 1)
+    {
+        const auto lane = std::countr_zero(mask);
+        inv_directions[lane] = 1.0f / rays[lane].direction;
+    }
+
+    // Returns the mask of the rays of ray_mask, not yet occluded, that hit
+    // the bounds
+    const auto intersect_packet_bounds =
+        [&](const Aabb &bounds, std::uint32_t ray_mask)
+    {
+        std::uint32_t hit_mask {0};
+        for (auto mask = ray_mask & ~occluded_mask; mask != 0;
+             mask &= mask - 1)
+        {
+            const auto lane =
+                static_cast<std::uint32_t>(std::countr_zero(mask));
+            if (intersect_bounds(bounds,
+                                 rays[lane].origin,
+                                 inv_directions[lane],
+                                 t_max[lane]) !=
+                std::numeric_limits<float>::infinity())
+            {
+                hit_mask |= 1u << lane;
+            }
+        }
+        return hit_mask;
+    };
+
+    struct Tlas_stack_entry
+    {
+        std::uint32_t index;
+        std::uint32_t lane_mask;
+    };
+
+    Tlas_stack_entry stack[max_tlas_stack_size];
+    std::uint32_t stack_size {0};
+    stack[stack_size++] = {0, lane_mask};
+
+    while (stack_size > 0 && occluded_mask != lane_mask)
+    {
+        const auto entry = stack[--stack_size];
+        const auto &node = tlas.nodes[entry.index];
+
+        if (node.primitive_count == 0)
+        {
+            for (std::uint32_t i {0}; i < 2; ++i)
+            {
+                const auto child_mask = intersect_packet_bounds(
+                    tlas.nodes[node.index + i].bounds, entry.lane_mask);
+                if (child_mask != 0)
+                {
+                    assert(stack_size < max_tlas_stack_size);
+                    stack[stack_size++] = {node.index + i, child_mask};
+                }
+            }
+            continue;
+        }
+
+        for (std::uint32_t i {0}; i < node.primitive_count; ++i)
+        {
+            const auto instance_index = tlas.primitive_indices[node.index + i];
+            const auto instance_mask = intersect_packet_bounds(
+                render_resources.instance_bounds[instance_index],
+                entry.lane_mask);
+            if (instance_mask == 0)
+            {
+                continue;
+            }
+
+            const auto &instance =
+                render_resources.scene->instances[instance_index];
+            const auto &world_to_object =
+                render_resources.world_to_object_transforms[instance_index];
+            Ray_packet<P> packet {};
+            for (auto mask = instance_mask; mask != 0; mask &= mask - 1)
+            {
+                const auto lane = std::countr_zero(mask);
+                const auto origin =
+                    transform_point(world_to_object, rays[lane].origin);
+                const auto direction =
+                    transform_direction(world_to_object, rays[lane].direction);
+                packet.origin_x[lane] = origin.x;
+                packet.origin_y[lane] = origin.y;
+                packet.origin_z[lane] = origin.z;
+                packet.direction_x[lane] = direction.x;
+                packet.direction_y[lane] = direction.y;
+                packet.direction_z[lane] = direction.z;
+            }
+
+            occluded_mask |= std::visit(
+                [&](const auto &bvh) -> std::uint32_t
+                {
+                    using Bvh_type = std::decay_t<decltype(bvh)>;
+                    // Packets are only traced with the BVH of width N
+                    if constexpr (std::is_same_v<Bvh_type, Wide_bvh<N>> ||
+                                  (N == 4 &&
+                                   std::is_same_v<Bvh_type, Quantized_bvh>))
+                    {
+                        return occluded(
+                            bvh, packet, instance_mask, ray_t_min, t_max);
+                    }
+                    else
+                    {
+                        return 0;
+                    }
+                },
+                get_mesh_bvhs(render_resources)[instance.mesh_index]);
+        }
+    }
+
+    return occluded_mask;
+}
+
+// Traces the rays in groups of ray_packet_size<N>. Groups whose directions are
+// all in the same octant, which the frustum culling needs, are traced as
+// packets, the others one ray at a time.
+template <std::uint32_t N>
+void trace_occlusion_stream(const Cpu_render_resources &render_resources,
+                            std::span<const Ray> rays,
+                            std::span<const float> t_max,
+                            std::span<std::uint8_t> occluded)
+{
+    constexpr auto P = ray_packet_size<N>;
+
+    const auto get_octant = [](const vec3 &direction)
+    {
+        return (direction.x < 0.0f ? 1u : 0u) |
+               (direction.y < 0.0f ? 2u : 0u) |
+               (direction.z < 0.0f ? 4u : 0u);
+    };
+
+    for (std::size_t begin {0}; begin < rays.size(); begin += P)
+    {
+        const auto count = static_cast<std::uint32_t>(
+            std::min<std::size_t>(P, rays.size() - begin));
+        const auto lane_mask = (1u << count) - 1;
+
+        bool coherent {count >= P / 4};
+        const auto octant = get_octant(rays[begin].direction);
+        for (std::uint32_t lane {1}; lane < count && coherent; ++lane)
+        {
+            coherent = get_octant(rays[begin + lane].direction) == octant;
+        }
+
+        if (!coherent)
+        {
+            for (std::uint32_t lane {0}; lane < count; ++lane)
+            {
+                occluded[begin + lane] = is_occluded(
+                    render_resources, rays[begin + lane], t_max[begin + lane]);
+            }
+            continue;
+        }
+
+        alignas(64) float packet_t_max[P] {};
+        std::copy_n(t_max.begin() + static_cast<std::ptrdiff_t>(begin),
+                    count,
+                    packet_t_max);
+        const auto occluded_mask = are_occluded<N>(
+            render_resources, rays.data() + begin, packet_t_max, lane_mask);
+        for (std::uint32_t lane {0}; lane < count; ++lane)
+        {
+            occluded[begin + lane] =
+                static_cast<std::uint8_t>((occluded_mask >> lane) & 1u);
+        }
+    }
+}
+
+// Equivalent to the closest hit or miss shader
+void shade(const Cpu_render_resources &render_resources,
+           std::size_t hit_instance,
+           const Ray_hit &ray_hit,
+           Ray_payload &payload)
+{
+    const auto &scene = *render_resources.scene;
+
+    if (hit_instance == scene.instances.size())
+    {
+        miss(scene, payload);
+        return;
+    }
+
+    const auto &instance = scene.instances[hit_instance];
+    const auto hit =
+        get_hit(get_meshes(render_resources)[instance.mesh_index],
+                instance.transform,
+                render_resources.world_to_object_transforms[hit_instance],
+                ray_hit,
+                payload.ray_direction);
+
+    switch (instance.material)
+    {
+    case Material::diffuse: closest_hit_diffuse(hit, payload); break;
+    case Material::specular: closest_hit_specular(hit, payload); break;
+    case Material::emissive: closest_hit_emissive(hit, payload); break;
+    case Material::dielectric: closest_hit_dielectric(hit, payload); break;
+    }
+}
+
+// Equivalent to traceRayEXT() followed by the closest hit or miss shader
+void trace_ray(const Cpu_render_resources &render_resources,
+               Ray_payload &payload)
+{
+    Ray_hit ray_hit {};
+    const auto hit_instance = find_closest_hit(
+        render_resources, payload.ray_origin, payload.ray_direction, ray_hit);
+    shade(render_resources, hit_instance, ray_hit, payload);
+}
+
+struct Path
+{
+    vec3 accumulated_color;
+    vec3 accumulated_reflectance;
+};
+
+// Accumulates the bounce that was just traced. Returns false if the path
+// terminates.
+[[nodiscard]] bool accumulate_bounce(Path &path, Ray_payload &payload)
+{
+    path.accumulated_color += path.accumulated_reflectance * payload.emissivity;
+    if (payload.hit_sky)
+    {
+        return false;
+    }
+
+    auto hit_color = payload.color;
+    const auto p = std::max(hit_color.x, std::max(hit_color.y, hit_color.z));
+    if (random(payload.rng_state) < p)
+    {
+        hit_color /= p;
+    }
+    else
+    {
+        return false;
+    }
+    path.accumulated_reflectance *= hit_color * payload.reflectance_attenuation;
+    return true;
+}
+
+[[nodiscard]] vec3 radiance(const Cpu_render_resources &render_resources,
+                            Ray_payload &payload)
+{
+    Path path {.accumulated_color = {0.0f, 0.0f, 0.0f},
+               .accumulated_reflectance = {1.0f, 1.0f, 1.0f}};
+
+    for (std::uint32_t bounces {0}; bounces < max_bounces; ++bounces)
+    {
+        payload.reflectance_attenuation = 1.0f;
+        trace_ray(render_resources, payload);
+        if (!accumulate_bounce(path, payload))
+        {
+            break;
+        }
+    }
+
+    return path.accumulated_color;
+}
+
+// Khronos PBR neutral tone mapper from
+// https://modelviewer.dev/examples/tone-mapping
+[[nodiscard]] vec3 PBR_neutral_tone_map(vec3 color) noexcept
+{
+    constexpr float start_compression {0.8f - 0.04f};
+    constexpr float desaturation {0.15f};
+
+    const auto x = std::min(color.x, std::min(color.y, color.z));
+    const auto offset = x < 0.08f ? x - 6.25f * x * x : 0.04f;
+    color -= offset;
+
+    const auto peak = std::max(color.x, std::max(color.y, color.z));
+    if (peak < start_compression)
+    {
+        return color;
+    }
+
+    constexpr auto d = 1.0f - start_compression;
+    const auto new_peak = 1.0f - d * d / (peak + d - start_compression);
+    color *= new_peak / peak;
+
+    const auto g = 1.0f - 1.0f / (desaturation * (peak - new_peak) + 1.0f);
+    return color + (vec3 {new_peak, new_peak, new_peak} - color) * g;
+}
+
+[[nodiscard]] inline std::uint8_t to_unorm8(float value) noexcept
+{
+    return static_cast<std::uint8_t>(
+        std::lround(std::clamp(value, 0.0f, 1.0f) * 255.0f));
+}
+
+// One call of cpu_trace_samples(), or one pass of cpu_trace_passes()
+struct Pass
+{
+    std::uint32_t frame_index;           // Equivalent of global_frame_count
+    std::uint32_t previous_sample_count; // Equivalent of sample_count
+    std::uint32_t sample_count;          // Samples per pixel in this pass
+};
+
+[[nodiscard]] std::uint32_t
+get_initial_rng_state(const Cpu_render_resources &render_resources,
+                      const Pass &pass,
+                      std::uint32_t pixel_index) noexcept
+{
+    // NOTE: hash(0) == 0, so a seed of zero keeps the default sequence
+    return hash(pixel_index) +
+           hash(pass.frame_index + 1 + hash(render_resources.rng_seed));
+}
+
+void generate_camera_ray(const Cpu_render_resources &render_resources,
+                         const Camera &camera,
+                         std::uint32_t x,
+                         std::uint32_t y,
+                         Ray_payload &payload)
+{
+    const auto width = render_resources.render_width;
+    const auto height = render_resources.render_height;
+
+    float offset_x {};
+    float offset_y {};
+    sample_gaussian(payload.rng_state, offset_x, offset_y);
+    const auto u = 2.0f * (static_cast<float>(x) + 0.5f + 0.375f * offset_x) /
+                       static_cast<float>(width) -
+                   1.0f;
+    const auto v = 2.0f * (static_cast<float>(y) + 0.5f + 0.375f * offset_y) /
+                       static_cast<float>(height) -
+                   1.0f;
+
+    float defocus_x {};
+    float defocus_y {};
+    sample_disk(payload.rng_state, defocus_x, defocus_y);
+    const auto defocus_offset =
+        camera.direction_x * (camera.aperture_radius * defocus_x) +
+        camera.direction_y * (camera.aperture_radius * defocus_y);
+    payload.ray_origin = camera.position + defocus_offset;
+    payload.ray_direction =
+        normalize(camera.focus_distance *
+                      (camera.direction_z * camera.sensor_distance +
+                       camera.direction_x * camera.sensor_half_width * u +
+                       camera.direction_y * camera.sensor_half_height * v) -
+                  defocus_offset);
+}
+
+// Writes the tone mapped average color of the pixel to the render target
+void tone_map_pixel(Cpu_render_resources &render_resources,
+                    std::uint32_t pixel_index)
+{
+    const auto *const average_color =
+        &render_resources.storage_image[static_cast<std::size_t>(pixel_index) *
+                                        4];
+    const auto render_color = PBR_neutral_tone_map(
+        {average_color[0], average_color[1], average_color[2]});
+    auto *const texel =
+        &render_resources.render_target[static_cast<std::size_t>(pixel_index) *
+                                        4];
+    texel[0] = to_unorm8(render_color.x);
+    texel[1] = to_unorm8(render_color.y);
+    texel[2] = to_unorm8(render_color.z);
+    texel[3] = 255;
+}
+
+void store_pixel(Cpu_render_resources &render_resources,
+                 const Pass &pass,
+                 std::uint32_t pixel_index,
+                 const vec3 &accumulated_color)
+{
+    auto *const average_color =
+        &render_resources.storage_image[static_cast<std::size_t>(pixel_index) *
+                                        4];
+    const auto samples = static_cast<float>(pass.sample_count);
+    if (pass.previous_sample_count > 0)
+    {
+        const auto previous = static_cast<float>(pass.previous_sample_count);
+        const auto total = previous + samples;
+        average_color[0] =
+            (average_color[0] * previous + accumulated_color.x) / total;
+        average_color[1] =
+            (average_color[1] * previous + accumulated_color.y) / total;
+        average_color[2] =
+            (average_color[2] * previous + accumulated_color.z) / total;
+        average_color[3] = (average_color[3] * previous + samples) / total;
+    }
+    else
+    {
+        average_color[0] = accumulated_color.x / samples;
+        average_color[1] = accumulated_color.y / samples;
+        average_color[2] = accumulated_color.z / samples;
+        average_color[3] = 1.0f;
+    }
+
+    tone_map_pixel(render_resources, pixel_index);
+}
+
+// Equivalent to one invocation of the ray generation shader
+void trace_pixel(Cpu_render_resources &render_resources,
+                 const Camera &camera,
+                 std::uint32_t x,
+                 std::uint32_t y,
+                 const Pass &pass)
+{
+    const auto pixel_index = y * render_resources.render_width + x;
+
+    Ray_payload payload {};
+    payload.rng_state =
+        get_initial_rng_state(render_resources, pass, pixel_index);
+
+    vec3 accumulated_color {0.0f, 0.0f, 0.0f};
+
+    for (std::uint32_t s {0}; s < pass.sample_count; ++s)
+    {
+        generate_camera_ray(render_resources, camera, x, y, payload);
+        accumulated_color += radiance(render_resources, payload);
+    }
+
+    store_pixel(render_resources, pass, pixel_index, accumulated_color);
+}
+
+// Returns the lanes of lane_mask if their rays are coherent enough to be
+// traced as a packet, zero otherwise. The frustum culling needs all the
+// directions to be in the same octant, and the packet traversal is only
+// faster than single rays if enough of its lanes are active.
+template <std::uint32_t P>
+[[nodiscard]] std::uint32_t get_coherent_lanes(const Ray_payload *payloads,
+                                               std::uint32_t lane_mask)
+{
+    if (std::popcount(lane_mask) < static_cast<int>(P / 4))
+    {
+        return 0;
+    }
+
+    const auto get_octant = [](const vec3 &direction)
+    {
+        return (direction.x < 0.0f ? 1u : 0u) |
+               (direction.y < 0.0f ? 2u : 0u) |
+               (direction.z < 0.0f ? 4u : 0u);
+    };
+    const auto octant = get_octant(
+        payloads[std::countr_zero(lane_mask)].ray_direction);
+    for (auto mask = lane_mask; mask != 0; mask &= mask - 1)
+    {
+        if (get_octant(payloads[std::countr_zero(mask)].ray_direction) !=
+            octant)
+        {
+            return 0;
+        }
+    }
+
+    return lane_mask;
+}
+
+// Same as trace_pixel() for a block of ray_packet_size<N> pixels, packet_width
+// pixels wide, whose paths are traced side by side. Camera rays are traced as
+// a packet if they share their origin, and so are the rays of the paths that
+// keep bouncing off specular surfaces together. The other rays are traced one
+// by one. Each path draws the same random numbers as with trace_pixel().
+template <std::uint32_t N>
+void trace_pixel_block(Cpu_render_resources &render_resources,
+                       const Camera &camera,
+                       std::uint32_t x_begin,
+                       std::uint32_t y_begin,
+                       const Pass &pass)
+{
+    constexpr auto P = ray_packet_size<N>;
+    const auto &scene = *render_resources.scene;
+
+    std::uint32_t lane_mask {0};
+    std::uint32_t x[P];
+    std::uint32_t y[P];
+    Ray_payload payloads[P] {};
+    vec3 accumulated_colors[P] {};
+    for (std::uint32_t lane {0}; lane < P; ++lane)
+    {
+        x[lane] = x_begin + lane % packet_width;
+        y[lane] = y_begin + lane / packet_width;
+        if (x[lane] < render_resources.render_width &&
+            y[lane] < render_resources.render_height)
+        {
+            lane_mask |= 1u << lane;
+            payloads[lane].rng_state = get_initial_rng_state(
+                render_resources,
+                pass,
+                y[lane] * render_resources.render_width + x[lane]);
+        }
+    }
+
+    for (std::uint32_t s {0}; s < pass.sample_count; ++s)
+    {
+        Path paths[P];
+        for (auto mask = lane_mask; mask != 0; mask &= mask - 1)
+        {
+            const auto lane = std::countr_zero(mask);
+            generate_camera_ray(
+                render_resources, camera, x[lane], y[lane], payloads[lane]);
+            paths[lane] = {.accumulated_color = {0.0f, 0.0f, 0.0f},
+                           .accumulated_reflectance = {1.0f, 1.0f, 1.0f}};
+        }
+
+        auto active_mask = lane_mask;
+        auto packet_mask = camera.aperture_radius == 0.0f ? lane_mask : 0;
+        for (std::uint32_t bounces {0};
+             bounces < max_bounces && active_mask != 0;
+             ++bounces)
+        {
+            Ray_hit ray_hits[P];
+            std::size_t hit_instances[P];
+            packet_mask = get_coherent_lanes<P>(payloads, packet_mask);
+            if (packet_mask != 0)
+            {
+                find_closest_hits<N>(render_resources,
+                                     payloads,
+                                     packet_mask,
+                                     ray_hits,
+                                     hit_instances);
+            }
+            for (auto mask = active_mask & ~packet_mask; mask != 0;
+                 mask &= mask - 1)
+            {
+                const auto lane = std::countr_zero(mask);
+                hit_instances[lane] =
+                    find_closest_hit(render_resources,
+                                     payloads[lane].ray_origin,
+                                     payloads[lane].ray_direction,
+                                     ray_hits[lane]);
+            }
+
+            std::uint32_t next_packet_mask {0};
+            for (auto mask = active_mask; mask != 0; mask &= mask - 1)
+            {
+                const auto lane = std::countr_zero(mask);
+                const auto lane_bit = 1u << lane;
+                payloads[lane].reflectance_attenuation = 1.0f;
+                shade(render_resources,
+                      hit_instances[lane],
+                      ray_hits[lane],
+                      payloads[lane]);
+                if (!accumulate_bounce(paths[lane], payloads[lane]))
+                {
+                    active_mask &= ~lane_bit;
+                }
+                else if ((packet_mask & lane_bit) != 0 &&
+                         scene.instances[hit_instances[lane]].material ==
+                             Material::specular)
+                {
+                    next_packet_mask |= lane_bit;
+                }
+            }
+            packet_mask = next_packet_mask;
+        }
+
+        for (auto mask = lane_mask; mask != 0; mask &= mask - 1)
+        {
+            const auto lane = std::countr_zero(mask);
+            accumulated_colors[lane] += paths[lane].accumulated_color;
+        }
+    }
+
+    for (auto mask = lane_mask; mask != 0; mask &= mask - 1)
+    {
+        const auto lane = std::countr_zero(mask);
+        store_pixel(render_resources,
+                    pass,
+                    y[lane] * render_resources.render_width + x[lane],
+                    accumulated_colors[lane]);
+    }
+}
+
+template <std::uint32_t N>
+void trace_tile_blocks(Cpu_render_resources &render_resources,
+                       const Camera &camera,
+                       std::uint32_t x_begin,
+                       std::uint32_t y_begin,
+                       std::uint32_t x_end,
+                       std::uint32_t y_end,
+                       const Pass &pass)
+{
+    constexpr auto block_height = ray_packet_size<N> / packet_width;
+    for (auto y = y_begin; y < y_end; y += block_height)
+    {
+        for (auto x = x_begin; x < x_end; x += packet_width)
+        {
+            trace_pixel_block<N>(render_resources, camera, x, y, pass);
+        }
+    }
+}
+
+void trace_tile(Cpu_render_resources &render_resources,
+                const Camera &camera,
+                std::uint32_t x_begin,
+                std::uint32_t y_begin,
+                std::uint32_t x_end,
+                std::uint32_t y_end,
+                const Pass &pass)
+{
+    if (render_resources.use_ray_packets)
+    {
+        switch (render_resources.bvh_width)
+        {
+        case 4:
+            trace_tile_blocks<4>(render_resources,
+                                 camera,
+                                 x_begin,
+                                 y_begin,
+                                 x_end,
+                                 y_end,
+                                 pass);
+            return;
+        case 8:
+            trace_tile_blocks<8>(render_resources,
+                                 camera,
+                                 x_begin,
+                                 y_begin,
+                                 x_end,
+                                 y_end,
+                                 pass);
+            return;
+        case 16:
+            trace_tile_blocks<16>(render_resources,
+                                  camera,
+                                  x_begin,
+                                  y_begin,
+                                  x_end,
+                                  y_end,
+                                  pass);
+            return;
+        default: break;
+        }
+    }
+
+    // The binary BVH has no packet traversal
+    for (auto y = y_begin; y < y_end; ++y)
+    {
+        for (auto x = x_begin; x < x_end; ++x)
+        {
+            trace_pixel(render_resources, camera, x, y, pass);
+        }
+    }
+}
+
+// Paths in flight, stored as structure of arrays so that tracing only touches
+// the rays, and shading the state of the paths in one bucket
+struct Path_queue
+{
+    std::vector<vec3> ray_origins;
+    std::vector<vec3> ray_directions;
+    std::vector<std::uint32_t> rng_states;
+    std::vector<vec3> accumulated_colors;
+    std::vector<vec3> accumulated_reflectances;
+    std::vector<std::uint32_t> pixel_slots; // Index into Wavefront::pixel_*
+};
+
+void clear(Path_queue &queue) noexcept
+{
+    queue.ray_origins.clear();
+    queue.ray_directions.clear();
+    queue.rng_states.clear();
+    queue.accumulated_colors.clear();
+    queue.accumulated_reflectances.clear();
+    queue.pixel_slots.clear();
+}
+
+void push_path(Path_queue &queue,
+               const Ray_payload &payload,
+               const Path &path,
+               std::uint32_t pixel_slot)
+{
+    queue.ray_origins.push_back(payload.ray_origin);
+    queue.ray_directions.push_back(payload.ray_direction);
+    queue.rng_states.push_back(payload.rng_state);
+    queue.accumulated_colors.push_back(path.accumulated_color);
+    queue.accumulated_reflectances.push_back(path.accumulated_reflectance);
+    queue.pixel_slots.push_back(pixel_slot);
+}
+
+// Per thread state of the wavefront integrator, kept across tiles so that the
+// queues are only allocated once
+struct Wavefront
+{
+    std::vector<std::uint32_t> pixel_indices;
+    std::vector<std::uint32_t> pixel_rng_states;
+    std::vector<vec3> pixel_colors;
+    Path_queue paths;
+    Path_queue next_paths;
+    std::vector<Ray_hit> ray_hits;
+    std::vector<std::size_t> hit_instances;
+    // Indices into paths, one bucket per closest hit shader, then the misses
+    std::array<std::vector<std::uint32_t>, material_count + 1> buckets;
+};
+
+// Shades the paths of one bucket with shader(payload, path_index), then
+// moves the ones that continue to the next queue, and accumulates the others
+// into their pixel
+template <typename Shader>
+void shade_bucket(Wavefront &wavefront,
+                  const std::vector<std::uint32_t> &bucket,
+                  Shader &&shader)
+{
+    auto &paths = wavefront.paths;
+    for (const auto i : bucket)
+    {
+        Ray_payload payload {};
+        payload.ray_origin = paths.ray_origins[i];
+        payload.ray_direction = paths.ray_directions[i];
+        payload.reflectance_attenuation = 1.0f;
+        payload.rng_state = paths.rng_states[i];
+        shader(payload, i);
+
+        Path path {.accumulated_color = paths.accumulated_colors[i],
+                   .accumulated_reflectance =
+                       paths.accumulated_reflectances[i]};
+        const auto pixel_slot = paths.pixel_slots[i];
+        if (accumulate_bounce(path, payload))
+        {
+            push_path(wavefront.next_paths, payload, path, pixel_slot);
+        }
+        else
+        {
+            wavefront.pixel_colors[pixel_slot] += path.accumulated_color;
+            wavefront.pixel_rng_states[pixel_slot] = payload.rng_state;
+        }
+    }
+}
+
+// Same result as trace_pixel() for every pixel of the tiles, but each bounce
+// of all the paths is traced at once, then the hits are sorted by material
+// and each material is shaded in turn. The samples of a pixel are still
+// traced one after the other, as they draw from the same random sequence.
+void trace_tiles_wavefront(Cpu_render_resources &render_resources,
+                           const Camera &camera,
+                           Wavefront &wavefront,
+                           std::span<const std::uint32_t> tiles,
+                           std::uint32_t tiles_x,
+                           const Pass &pass)
+{
+    const auto &scene = *render_resources.scene;
+    const auto width = render_resources.render_width;
+
+    wavefront.pixel_indices.clear();
+    for (const auto tile : tiles)
+    {
+        const auto x_begin = (tile % tiles_x) * tile_size;
+        const auto y_begin = (tile / tiles_x) * tile_size;
+        const auto x_end = std::min(x_begin + tile_size, width);
+        const auto y_end =
+            std::min(y_begin + tile_size, render_resources.render_height);
+        for (auto y = y_begin; y < y_end; ++y)
+        {
+            for (auto x = x_begin; x < x_end; ++x)
+            {
+                wavefront.pixel_indices.push_back(y * width + x);
+            }
+        }
+    }
+    const auto pixel_count =
+        static_cast<std::uint32_t>(wavefront.pixel_indices.size());
+    wavefront.pixel_rng_states.resize(pixel_count);
+    wavefront.pixel_colors.assign(pixel_count, {0.0f, 0.0f, 0.0f});
+    for (std::uint32_t i {0}; i < pixel_count; ++i)
+    {
+        wavefront.pixel_rng_states[i] =
+            get_initial_rng_state(render_resources,
+                                  pass,
+                                  wavefront.pixel_indices[i]);
+    }
+
+    for (std::uint32_t s {0}; s < pass.sample_count; ++s)
+    {
+        clear(wavefront.paths);
+        for (std::uint32_t i {0}; i < pixel_count; ++i)
+        {
+            const auto pixel_index = wavefront.pixel_indices[i];
+            Ray_payload payload {};
+            payload.rng_state = wavefront.pixel_rng_states[i];
+            generate_camera_ray(render_resources,
+                                camera,
+                                pixel_index % width,
+                                pixel_index / width,
+                                payload);
+            push_path(wavefront.paths,
+                      payload,
+                      {.accumulated_color = {0.0f, 0.0f, 0.0f},
+                       .accumulated_reflectance = {1.0f, 1.0f, 1.0f}},
+                      i);
+        }
+
+        for (std::uint32_t bounces {0};
+             bounces < max_bounces && !wavefront.paths.pixel_slots.empty();
+             ++bounces)
+        {
+            auto &paths = wavefront.paths;
+            const auto path_count = paths.pixel_slots.size();
+
+            wavefront.ray_hits.resize(path_count);
+            wavefront.hit_instances.resize(path_count);
+            for (auto &bucket : wavefront.buckets)
+            {
+                bucket.clear();
+            }
+            for (std::size_t i {0}; i < path_count; ++i)
+            {
+                const auto hit_instance =
+                    find_closest_hit(render_resources,
+                                     paths.ray_origins[i],
+                                     paths.ray_directions[i],
+                                     wavefront.ray_hits[i]);
+                wavefront.hit_instances[i] = hit_instance;
+                const auto bucket =
+                    hit_instance == scene.instances.size()
+                        ? material_count
+                        : static_cast<std::size_t>(
+                              scene.instances[hit_instance].material);
+                wavefront.buckets[bucket].push_back(
+                    static_cast<std::uint32_t>(i));
+            }
+
+            clear(wavefront.next_paths);
+            shade_bucket(wavefront,
+                         wavefront.buckets[material_count],
+                         [&](Ray_payload &payload, std::uint32_t)
+                         { miss(scene, payload); });
+            const auto shade_material =
+                [&](Material material, auto &&closest_hit)
+            {
+                shade_bucket(
+                    wavefront,
+                    wavefront.buckets[static_cast<std::size_t>(material)],
+                    [&](Ray_payload &payload, std::uint32_t i)
+                    {
+                        const auto hit_instance = wavefront.hit_instances[i];
+                        const auto &instance = scene.instances[hit_instance];
+                        const auto hit = get_hit(
+                            get_meshes(render_resources)[instance.mesh_index],
+                            instance.transform,
+                            render_resources
+                                .world_to_object_transforms[hit_instance],
+                            wavefront.ray_hits[i],
+                            payload.ray_direction);
+                        closest_hit(hit, payload);
+                    });
+            };
+            shade_material(Material::diffuse, closest_hit_diffuse);
+            shade_material(Material::specular, closest_hit_specular);
+            shade_material(Material::emissive, closest_hit_emissive);
+            shade_material(Material::dielectric, closest_hit_dielectric);
+
+            std::swap(wavefront.paths, wavefront.next_paths);
+        }
+
+        // Paths that reached the maximum number of bounces
+        const auto &paths = wavefront.paths;
+        for (std::size_t i {0}; i < paths.pixel_slots.size(); ++i)
+        {
+            const auto pixel_slot = paths.pixel_slots[i];
+            wavefront.pixel_colors[pixel_slot] += paths.accumulated_colors[i];
+            wavefront.pixel_rng_states[pixel_slot] = paths.rng_states[i];
+        }
+    }
+
+    for (std::uint32_t i {0}; i < pixel_count; ++i)
+    {
+        store_pixel(render_resources,
+                    pass,
+                    wavefront.pixel_indices[i],
+                    wavefront.pixel_colors[i]);
+    }
+}
+
+[[nodiscard]] Bvh build_mesh_bvh(const Mesh &mesh,
+                                 unsigned int thread_count,
+                                 Bvh_builder bvh_builder,
+                                 float sbvh_split_budget)
+{
+    switch (bvh_builder)
+    {
+    case Bvh_builder::sah:
+        return build_bvh(mesh.vertices, mesh.indices, thread_count);
+    case Bvh_builder::sbvh:
+        return build_sbvh(
+            mesh.vertices, mesh.indices, thread_count, sbvh_split_budget);
+    case Bvh_builder::lbvh:
+        return build_lbvh(mesh.vertices, mesh.indices, thread_count, false);
+    case Bvh_builder::lbvh_treelets:
+        return build_lbvh(mesh.vertices, mesh.indices, thread_count, true);
+    }
+    return {};
+}
+
+// Bounds of the vertices, or a point at the origin if there are none, because
+// the TLAS builder does not accept empty bounds
+[[nodiscard]] Aabb compute_bounds(const std::vector<vec3> &vertices)
+{
+    if (vertices.empty())
+    {
+        return {};
+    }
+    Aabb bounds {vertices.front(), vertices.front()};
+    for (const auto &vertex : vertices)
+    {
+        bounds.min = {std::min(bounds.min.x, vertex.x),
+                      std::min(bounds.min.y, vertex.y),
+                      std::min(bounds.min.z, vertex.z)};
+        bounds.max = {std::max(bounds.max.x, vertex.x),
+                      std::max(bounds.max.y, vertex.y),
+                      std::max(bounds.max.z, vertex.z)};
+    }
+    return bounds;
+}
+
+// World space bounds of the 8 transformed corners, grown by a small margin,
+// so that rounding in the ray transform cannot lose hits on the boundary
+[[nodiscard]] Aabb transform_bounds(const mat3x4 &transform,
+                                    const Aabb &bounds)
+{
+    Aabb result {};
+    for (int i {0}; i < 8; ++i)
+    {
+        const auto corner = transform_point(
+            transform,
+            {(i & 1) != 0 ? bounds.max.x : bounds.min.x,
+             (i & 2) != 0 ? bounds.max.y : bounds.min.y,
+             (i & 4) != 0 ? bounds.max.z : bounds.min.z});
+        if (i == 0)
+        {
+            result = {corner, corner};
+            continue;
+        }
+        result.min = {std::min(result.min.x, corner.x),
+                      std::min(result.min.y, corner.y),
+                      std::min(result.min.z, corner.z)};
+        result.max = {std::max(result.max.x, corner.x),
+                      std::max(result.max.y, corner.y),
+                      std::max(result.max.z, corner.z)};
+    }
+
+    const auto magnitude = std::max({std::abs(result.min.x),
+                                     std::abs(result.min.y),
+                                     std::abs(result.min.z),
+                                     std::abs(result.max.x),
+                                     std::abs(result.max.y),
+                                     std::abs(result.max.z)});
+    const auto margin = magnitude * 1e-5f;
+    result.min -= margin;
+    result.max += margin;
+    return result;
+}
+
+// Upper bound of the arena memory that reorder_bvh() allocates for a wide BVH,
+// including the alignment of each array
+[[nodiscard]] std::size_t get_arena_size(const Mesh_bvh &mesh_bvh)
+{
+    return std::visit(
+        [](const auto &bvh) -> std::size_t
+        {
+            if constexpr (std::is_same_v<std::decay_t<decltype(bvh)>, Bvh>)
+            {
+                return 0;
+            }
+            else
+            {
+                return bvh.nodes.size() * sizeof(bvh.nodes[0]) +
+                       alignof(decltype(bvh.nodes[0])) +
+                       bvh.triangle_blocks.size() *
+                           sizeof(bvh.triangle_blocks[0]) +
+                       alignof(decltype(bvh.triangle_blocks[0]));
+            }
+        },
+        mesh_bvh);
+}
+
+// Copies the meshes and their BVHs, with the same layout. Called on a thread
+// of the node the replica is for, which touches all of its memory first.
+[[nodiscard]] Cpu_scene_replica
+create_scene_replica(const Scene &scene,
+                     const std::vector<Mesh_bvh> &mesh_bvhs,
+                     std::size_t arena_size)
+{
+    Cpu_scene_replica replica {};
+    replica.meshes = scene.meshes;
+    if (arena_size > 0)
+    {
+        replica.bvh_arena = create_memory_arena(arena_size);
+    }
+    replica.mesh_bvhs.reserve(mesh_bvhs.size());
+    for (const auto &mesh_bvh : mesh_bvhs)
+    {
+        replica.mesh_bvhs.push_back(std::visit(
+            [&](const auto &bvh) -> Mesh_bvh
+            {
+                using Bvh_type = std::decay_t<decltype(bvh)>;
+                if constexpr (std::is_same_v<Bvh_type, Bvh>)
+                {
+                    return bvh;
+                }
+                else
+                {
+                    auto *const resource = replica.bvh_arena.resource.get();
+                    return Bvh_type {
+                        .nodes = {bvh.nodes, resource},
+                        .triangle_blocks = {bvh.triangle_blocks, resource}};
+                }
+            },
+            mesh_bvh));
+    }
+    return replica;
+}
+
+[[nodiscard]] const char *get_page_kind_name(Page_kind page_kind)
+{
+    switch (page_kind)
+    {
+    case Page_kind::regular: return "regular pages";
+    case Page_kind::transparent_huge: return "transparent huge pages";
+    case Page_kind::explicit_huge: return "explicit huge pages";
+    }
+    return "";
+}
+
+} // namespace
+
+Cpu_render_resources create_cpu_render_resources(const Scene &scene,
+                                                 std::uint32_t width,
+                                                 std::uint32_t height,
+                                                 unsigned int thread_count,
+                                                 std::uint32_t bvh_width,
+                                                 Bvh_builder bvh_builder,
+                                                 float sbvh_split_budget,
+                                                 bool quantized_bvh_nodes,
+                                                 bool numa_replication)
+{
+    if (bvh_width == 0)
+    {
+        bvh_width = quantized_bvh_nodes ? 4 : get_native_bvh_width();
+    }
+    if (!is_bvh_width_supported(bvh_width))
+    {
+        throw std::runtime_error("BVH width " + std::to_string(bvh_width) +
+                                 " is not supported");
+    }
+    if (quantized_bvh_nodes && bvh_width != 4)
+    {
+        throw std::runtime_error("Quantized BVH nodes are only supported with "
+                                 "a BVH width of 4");
+    }
+
+    Cpu_render_resources render_resources {};
+    render_resources.scene = &scene;
+
+    if (thread_count == 0)
+    {
+        thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    render_resources.thread_count = thread_count;
+
+    render_resources.bvh_width = bvh_width;
+    // Built on the heap first, then moved to the arena once its size is known
+    std::vector<Mesh_bvh> mesh_bvhs;
+    mesh_bvhs.reserve(scene.meshes.size());
+    for (std::size_t i {0}; i < scene.meshes.size(); ++i)
+    {
+        const auto &mesh = scene.meshes[i];
+        const auto start = std::chrono::steady_clock::now();
+        auto bvh =
+            build_mesh_bvh(mesh, thread_count, bvh_builder, sbvh_split_budget);
+        const std::chrono::duration<double, std::milli> elapsed =
+            std::chrono::steady_clock::now() - start;
+        const auto triangle_count = mesh.indices.size() / 3;
+        std::cout << "Built BVH for mesh " << i << " (" << triangle_count
+                  << " triangles, " << bvh.nodes.size() << " nodes) in "
+                  << elapsed.count() << " ms, SAH cost "
+                  << compute_sah_cost(bvh);
+        if (bvh_builder == Bvh_builder::sbvh && triangle_count > 0)
+        {
+            std::cout << ", duplication factor "
+                      << static_cast<double>(bvh.primitive_indices.size()) /
+                             static_cast<double>(triangle_count);
+        }
+        std::cout << '\n';
+
+        switch (bvh_width)
+        {
+        case 4:
+        {
+            auto wide_bvh = collapse_bvh<4>(bvh, mesh.vertices, mesh.indices);
+            if (quantized_bvh_nodes)
+            {
+                const auto node_count = wide_bvh.nodes.size();
+                std::cout << "Quantized " << node_count << " nodes from "
+                          << node_count * sizeof(Wide_bvh_node<4>) << " to "
+                          << node_count * sizeof(Quantized_bvh_node)
+                          << " bytes\n";
+                mesh_bvhs.emplace_back(quantize_bvh(std::move(wide_bvh)));
+            }
+            else
+            {
+                mesh_bvhs.emplace_back(std::move(wide_bvh));
+            }
+            break;
+        }
+        case 8:
+            mesh_bvhs.emplace_back(
+                collapse_bvh<8>(bvh, mesh.vertices, mesh.indices));
+            break;
+        case 16:
+            mesh_bvhs.emplace_back(
+                collapse_bvh<16>(bvh, mesh.vertices, mesh.indices));
+            break;
+        default: mesh_bvhs.emplace_back(std::move(bvh)); break;
+        }
+    }
+
+    std::size_t arena_size {0};
+    for (const auto &mesh_bvh : mesh_bvhs)
+    {
+        arena_size += get_arena_size(mesh_bvh);
+    }
+    if (arena_size > 0)
+    {
+        render_resources.bvh_arena = create_memory_arena(arena_size);
+        std::cout << "Wide BVHs take "
+                  << static_cast<double>(arena_size) / (1 << 20)
+                  << " MiB, in an arena of "
+                  << get_size(render_resources.bvh_arena) / (1 << 20)
+                  << " MiB with "
+                  << get_page_kind_name(
+                         get_page_kind(render_resources.bvh_arena))
+                  << '\n';
+    }
+    render_resources.mesh_bvhs.reserve(mesh_bvhs.size());
+    for (auto &mesh_bvh : mesh_bvhs)
+    {
+        render_resources.mesh_bvhs.push_back(std::visit(
+            [&](auto &bvh) -> Mesh_bvh
+            {
+                if constexpr (std::is_same_v<std::decay_t<decltype(bvh)>, Bvh>)
+                {
+                    return std::move(bvh);
+                }
+                else
+                {
+                    return reorder_bvh(
+                        bvh, render_resources.bvh_arena.resource.get());
+                }
+            },
+            mesh_bvh));
+        // Keeps the peak memory usage to one extra BVH
+        mesh_bvh = {};
+    }
+
+    if (numa_replication)
+    {
+        const auto &layout = get_thread_layout();
+        const auto node_count =
+            static_cast<std::uint32_t>(layout.topology.node_cpus.size());
+        render_resources.numa_replicas.resize(node_count > 0 ? node_count - 1
+                                                             : 0);
+        std::uint32_t replica_count {0};
+        for (std::uint32_t node {1}; node < node_count; ++node)
+        {
+            if (std::find(layout.thread_nodes.begin(),
+                          layout.thread_nodes.end(),
+                          node) == layout.thread_nodes.end())
+            {
+                continue;
+            }
+            run_on_numa_node(
+                node,
+                [&]
+                {
+                    render_resources.numa_replicas[node - 1] =
+                        create_scene_replica(scene,
+                                             render_resources.mesh_bvhs,
+                                             arena_size);
+                });
+            ++replica_count;
+        }
+        std::size_t mesh_size {0};
+        for (const auto &mesh : scene.meshes)
+        {
+            mesh_size += mesh.vertices.size() * sizeof(mesh.vertices[0]) +
+                         mesh.normals.size() * sizeof(mesh.normals[0]) +
+                         mesh.indices.size() * sizeof(mesh.indices[0]);
+        }
+        std::cout << "Replicated "
+                  << static_cast<double>(mesh_size + arena_size) / (1 << 20)
+                  << " MiB of meshes and BVHs on " << replica_count
+                  << " other NUMA nodes\n";
+    }
+
+    render_resources.world_to_object_transforms.reserve(
+        scene.instances.size());
+    for (const auto &instance : scene.instances)
+    {
+        render_resources.world_to_object_transforms.push_back(
+            invert_affine_transform(instance.transform));
+    }
+
+    // Like a TLAS, the instances only reference the BVHs of their meshes
+    std::vector<Aabb> mesh_bounds;
+    mesh_bounds.reserve(scene.meshes.size());
+    std::size_t mesh_triangle_count {0};
+    for (const auto &mesh : scene.meshes)
+    {
+        mesh_bounds.push_back(compute_bounds(mesh.vertices));
+        mesh_triangle_count += mesh.indices.size() / 3;
+    }
+    render_resources.instance_bounds.reserve(scene.instances.size());
+    std::size_t instance_triangle_count {0};
+    for (const auto &instance : scene.instances)
+    {
+        render_resources.instance_bounds.push_back(transform_bounds(
+            instance.transform, mesh_bounds[instance.mesh_index]));
+        instance_triangle_count +=
+            scene.meshes[instance.mesh_index].indices.size() / 3;
+    }
+    render_resources.tlas =
+        build_bvh(render_resources.instance_bounds, thread_count);
+    std::cout << "Built TLAS over " << scene.instances.size()
+              << " instances of " << scene.meshes.size() << " meshes ("
+              << render_resources.tlas.nodes.size() << " nodes), "
+              << mesh_triangle_count << " unique triangles for "
+              << instance_triangle_count << " instanced ones\n";
+
+    render_resources.render_width = width;
+    render_resources.render_height = height;
+    const auto pixel_count = static_cast<std::size_t>(width) * height;
+    render_resources.storage_image.resize(pixel_count * 4);
+    render_resources.render_target.resize(pixel_count * 4);
+
+    render_resources.samples_to_render = 1000;
+    render_resources.sample_count = 0;
+    render_resources.samples_per_frame = 1;
+    render_resources.rng_seed = 0;
+    render_resources.global_frame_count = 0;
+    render_resources.use_ray_packets = true;
+    render_resources.integrator = Cpu_integrator::megakernel;
+
+    return render_resources;
+}
+
+void cpu_trace_samples(Cpu_render_resources &render_resources,
+                       const Camera &camera)
+{
+    cpu_trace_passes(render_resources, camera, 1);
+}
+
+void cpu_trace_passes(Cpu_render_resources &render_resources,
+                      const Camera &camera,
+                      std::uint32_t pass_count)
+{
+    std::vector<Pass> passes;
+    auto sample_count = render_resources.sample_count;
+    while (passes.size() < pass_count &&
+           sample_count < render_resources.samples_to_render)
+    {
+        const auto samples =
+            std::min(render_resources.samples_to_render - sample_count,
+                     render_resources.samples_per_frame);
+        passes.push_back(
+            {.frame_index = render_resources.global_frame_count +
+                            static_cast<std::uint32_t>(passes.size()),
+             .previous_sample_count = sample_count,
+             .sample_count = samples});
+        sample_count += samples;
+    }
+    if (passes.empty())
+    {
+        return;
+    }
+
+    const auto tiles_x =
+        (render_resources.render_width + tile_size - 1) / tile_size;
+    const auto tiles_y =
+        (render_resources.render_height + tile_size - 1) / tile_size;
+    const auto tile_order = get_hilbert_tile_order(tiles_x, tiles_y);
+    const auto tile_count = static_cast<std::uint32_t>(tile_order.size());
+
+    const bool wavefront {render_resources.integrator ==
+                          Cpu_integrator::wavefront};
+    // Each task of the wavefront integrator is a group of consecutive tiles
+    const auto tiles_per_item = wavefront ? wavefront_tile_count : 1;
+    const auto item_count = (tile_count + tiles_per_item - 1) / tiles_per_item;
+    std::vector<Wavefront> wavefronts(wavefront ? render_resources.thread_count
+                                                : 0);
+
+    const auto execute =
+        [&](unsigned int thread_index, std::uint32_t item, std::uint32_t pass)
+    {
+        const auto first_tile = item * tiles_per_item;
+        const auto tiles =
+            std::span(tile_order)
+                .subspan(first_tile,
+                         std::min(tiles_per_item, tile_count - first_tile));
+        if (wavefront)
+        {
+            trace_tiles_wavefront(render_resources,
+                                  camera,
+                                  wavefronts[thread_index],
+                                  tiles,
+                                  tiles_x,
+                                  passes[pass]);
+            return;
+        }
+
+        const auto tile = tiles.front();
+        const auto x_begin = (tile % tiles_x) * tile_size;
+        const auto y_begin = (tile / tiles_x) * tile_size;
+        const auto x_end =
+            std::min(x_begin + tile_size, render_resources.render_width);
+        const auto y_end =
+            std::min(y_begin + tile_size, render_resources.render_height);
+        trace_tile(render_resources,
+                   camera,
+                   x_begin,
+                   y_begin,
+                   x_end,
+                   y_end,
+                   passes[pass]);
+    };
+
+    render_resources.scheduler_stats =
+        run_work_stealing(render_resources.thread_count,
+                          item_count,
+                          static_cast<std::uint32_t>(passes.size()),
+                          execute);
+
+    render_resources.sample_count = sample_count;
+    render_resources.global_frame_count +=
+        static_cast<std::uint32_t>(passes.size());
+}
+
+void cpu_merge_samples(Cpu_render_resources &render_resources,
+                       std::span<const float> average_colors,
+                       std::uint32_t sample_count)
+{
+    assert(average_colors.size() == render_resources.storage_image.size());
+    if (sample_count == 0)
+    {
+        return;
+    }
+
+    // Same weighting as the accumulation in the ray generation shader, with
+    // the merged samples in place of the samples of a frame
+    const auto previous = static_cast<float>(render_resources.sample_count);
+    const auto samples = static_cast<float>(sample_count);
+    const auto total = previous + samples;
+    const auto pixel_count = static_cast<std::uint32_t>(
+        render_resources.storage_image.size() / 4);
+    for (std::uint32_t pixel_index {0}; pixel_index < pixel_count;
+         ++pixel_index)
+    {
+        const auto offset = static_cast<std::size_t>(pixel_index) * 4;
+        auto *const average_color = &render_resources.storage_image[offset];
+        for (std::size_t i {0}; i < 4; ++i)
+        {
+            average_color[i] =
+                render_resources.sample_count > 0
+                    ? (average_color[i] * previous +
+                       average_colors[offset + i] * samples) /
+                          total
+                    : average_colors[offset + i];
+        }
+        tone_map_pixel(render_resources, pixel_index);
+    }
+
+    render_resources.sample_count += sample_count;
+}
+
+bool cpu_occluded(const Cpu_render_resources &render_resources,
+                  const Ray &ray,
+                  float t_max)
+{
+    return is_occluded(render_resources, ray, t_max);
+}
+
+void cpu_occluded(const Cpu_render_resources &render_resources,
+                  std::span<const Ray> rays,
+                  std::span<const float> t_max,
+                  std::span<std::uint8_t> occluded)
+{
+    assert(t_max.size() == rays.size());
+    assert(occluded.size() == rays.size());
+
+    if (render_resources.use_ray_packets)
+    {
+        switch (render_resources.bvh_width)
+        {
+        case 4:
+            trace_occlusion_stream<4>(render_resources, rays, t_max, occluded);
+            return;
+        case 8:
+            trace_occlusion_stream<8>(render_resources, rays, t_max, occluded);
+            return;
+        case 16:
+            trace_occlusion_stream<16>(
+                render_resources, rays, t_max, occluded);
+            return;
+        default: break;
+        }
+    }
+
+    // The binary BVH has no packet traversal
+    for (std::size_t i {0}; i < rays.size(); ++i)
+    {
+        occluded[i] = is_occluded(render_resources, rays[i], t_max[i]);
+    }
+}
+
+std::string cpu_write_to_png(const Cpu_render_resources &render_resources,
+                             const char *file_name)
+{
+    return write_png(file_name,
+                     render_resources.render_target.data(),
+                     static_cast<int>(render_resources.render_width),
+                     static_cast<int>(render_resources.render_height));
+}
+
+std::string cpu_write_to_hdr(const Cpu_render_resources &render_resources,
+                             const char *file_name)
+{
+    return write_hdr(file_name,
+                     render_resources.storage_image.data(),
+                     static_cast<int>(render_resources.render_width),
+                     static_cast<int>(render_resources.render_height));
+}
@@ -0,0 +1,155 @@
+#ifndef CPU_RENDERER_HPP
+#define CPU_RENDERER_HPP
+
+#include "bvh.hpp"
+#include "memory_arena.hpp"
+#include "scene.hpp"
+#include "tile_scheduler.hpp"
+#include "wide_bvh.hpp"
+
+#include <cstdint>
+#include <span>
+#include <string>
+#include <variant>
+#include <vector>
+
+using Mesh_bvh =
+    std::variant<Bvh, Wide_bvh<4>, Wide_bvh<8>, Wide_bvh<16>, Quantized_bvh>;
+
+enum struct Cpu_integrator
+{
+    // Each path is traced from start to end before the next one, like on the
+    // GPU
+    megakernel,
+    // The paths of several tiles advance together one bounce at a time, and
+    // the hits of each bounce are shaded grouped by material
+    wavefront
+};
+
+enum struct Bvh_builder
+{
+    // Binned SAH
+    sah,
+    // Binned SAH with spatial splits, the best trees for scenes with large or
+    // long triangles
+    sbvh,
+    // Morton code LBVH, the fastest build
+    lbvh,
+    // LBVH with treelet restructuring, close to SAH quality
+    lbvh_treelets
+};
+
+// Copy of the data that is read for each ray, for the threads of one NUMA node
+struct Cpu_scene_replica
+{
+    std::vector<Mesh> meshes;
+    Memory_arena bvh_arena;
+    std::vector<Mesh_bvh> mesh_bvhs;
+};
+
+// Reference implementation of the ray tracing shaders on the CPU. It consumes
+// the same Scene as the GPU renderer and uses the same random number
+// sequences, so the two backends converge to the same image.
+struct Cpu_render_resources
+{
+    const Scene *scene;
+    std::uint32_t bvh_width;
+    // Holds the nodes and triangle blocks of all the wide BVHs, so it must
+    // outlive them
+    Memory_arena bvh_arena;
+    std::vector<Mesh_bvh> mesh_bvhs; // One per mesh, shared by its instances
+    // With NUMA replication, copies of the meshes and of their BVHs for the
+    // other nodes, each first touched by a thread of its node, so that the
+    // threads never read them across the interconnect. Threads of node n > 0
+    // read numa_replicas[n - 1], those of node 0 the scene and mesh_bvhs.
+    std::vector<Cpu_scene_replica> numa_replicas;
+    std::vector<mat3x4> world_to_object_transforms;
+    std::vector<Aabb> instance_bounds; // In world space
+    Bvh tlas; // Over the instance bounds
+    std::uint32_t render_width;
+    std::uint32_t render_height;
+    std::vector<float> storage_image;         // Linear RGBA
+    std::vector<std::uint8_t> render_target; // Tone mapped RGBA8
+    std::uint32_t samples_to_render;
+    std::uint32_t sample_count;
+    std::uint32_t samples_per_frame;
+    std::uint32_t rng_seed;
+    std::uint32_t global_frame_count;
+    unsigned int thread_count;
+    // Trace coherent rays as packets, with wide BVHs only. Rays that graze a
+    // triangle edge can hit the neighbouring triangle instead.
+    bool use_ray_packets; // Megakernel only
+    Cpu_integrator integrator;
+    Scheduler_stats scheduler_stats; // Of the last call to cpu_trace_*()
+};
+
+// The scene must outlive the render resources. A thread_count of zero uses
+// all hardware threads. The bvh_width is 2 for the binary BVH, 4, 8 or 16 for
+// a wide BVH, or zero for the widest one the CPU supports. Throws if it is not
+// supported. The sbvh_split_budget is only used by Bvh_builder::sbvh, see
+// build_sbvh(). With quantized_bvh_nodes, the nodes are compressed to a cache
+// line each, which is only possible with a bvh_width of 4 (or zero). With
+// numa_replication, each node of the current thread layout (see numa.hpp)
+// that has threads gets its own copy of the meshes and BVHs.
+[[nodiscard]] Cpu_render_resources
+create_cpu_render_resources(const Scene &scene,
+                            std::uint32_t width,
+                            std::uint32_t height,
+                            unsigned int thread_count,
+                            std::uint32_t bvh_width,
+                            Bvh_builder bvh_builder,
+                            float sbvh_split_budget,
+                            bool quantized_bvh_nodes,
+                            bool numa_replication);
+
+// Traces min(samples_per_frame, samples_to_render - sample_count) samples per
+// pixel, blocking until they are all accumulated.
+void cpu_trace_samples(Cpu_render_resources &render_resources,
+                       const struct Camera &camera);
+
+// Same result as up to pass_count calls to cpu_trace_samples(), but each tile
+// moves on to its next pass without waiting for the others.
+void cpu_trace_passes(Cpu_render_resources &render_resources,
+                      const struct Camera &camera,
+                      std::uint32_t pass_count);
+
+// Merges sample_count samples rendered elsewhere, such as on the GPU, into the
+// accumulated image. average_colors holds their average linear RGBA for each
+// pixel, laid out like storage_image. Each pixel is weighted by its sample
+// count, like the accumulation in the ray generation shader, then tone mapped
+// again. The merged samples must be decorrelated from the ones rendered here,
+// i.e. come from other frame indices or another seed.
+void cpu_merge_samples(Cpu_render_resources &render_resources,
+                       std::span<const float> average_colors,
+                       std::uint32_t sample_count);
+
+// Visibility query against the scene, in world space, for shadow rays,
+// picking or probe placement. Returns true if the ray hits any triangle with
+// 0 <= t < t_max, where t is in units of the length of the direction. The
+// traversal stops at the first hit found, without looking for the closest one.
+[[nodiscard]] bool cpu_occluded(const Cpu_render_resources &render_resources,
+                                const Ray &ray,
+                                float t_max);
+
+// Same query for a stream of rays, with t_max[i] for rays[i]. Sets
+// occluded[i] to 1 if rays[i] is occluded, 0 otherwise. With use_ray_packets
+// and a wide BVH, consecutive rays are traced as packets when their
+// directions are in the same octant, so coherent rays (e.g. the shadow rays
+// of neighbouring pixels towards one light) should be kept together.
+void cpu_occluded(const Cpu_render_resources &render_resources,
+                  std::span<const Ray> rays,
+                  std::span<const float> t_max,
+                  std::span<std::uint8_t> occluded);
+
+// On failure, returns an error message. On success, returns an empty string.
+[[nodiscard]] std::string
+cpu_write_to_png(const Cpu_render_resources &render_resources,
+                 const char *file_name);
+
+// Writes the linear accumulated radiance, before tone mapping.
+// On failure, returns an error message. On success, returns an empty string.
+[[nodiscard]] std::string
+cpu_write_to_hdr(const Cpu_render_resources &render_resources,
+                 const char *file_name);
+
+#endif // CPU_RENDERER_HPP
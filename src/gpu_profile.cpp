@@ -0,0 +1,160 @@
+#include "gpu_profile.hpp"
+
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+namespace
+{
+
+void write_csv(std::ostream &stream, std::span<const Gpu_profile_track> tracks)
+{
+    stream << "track,frame,scope,start_ms,duration_ms\n";
+    for (const auto &track : tracks)
+    {
+        for (const auto &frame : track.frames)
+        {
+            for (std::uint32_t i {0}; i < gpu_scope_count; ++i)
+            {
+                const auto scope = static_cast<Gpu_scope>(i);
+                if (!is_recorded(frame, scope))
+                {
+                    continue;
+                }
+                stream << track.name << ',' << frame.frame_index << ','
+                       << get_gpu_scope_name(scope) << ','
+                       << frame.scope_starts[i] << ','
+                       << frame.scope_durations[i] << '\n';
+            }
+        }
+    }
+}
+
+// Complete events ("ph": "X"), in microseconds
+void write_json(std::ostream &stream,
+                std::span<const Gpu_profile_track> tracks)
+{
+    stream << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first {true};
+    for (std::size_t track_index {0}; track_index < tracks.size();
+         ++track_index)
+    {
+        const auto &track = tracks[track_index];
+        stream << (first ? "" : ",")
+               << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,"
+                  "\"tid\":"
+               << track_index << ",\"args\":{\"name\":\"" << track.name
+               << "\"}}";
+        first = false;
+
+        for (const auto &frame : track.frames)
+        {
+            for (std::uint32_t i {0}; i < gpu_scope_count; ++i)
+            {
+                const auto scope = static_cast<Gpu_scope>(i);
+                if (!is_recorded(frame, scope))
+                {
+                    continue;
+                }
+                stream << ",\n{\"name\":\"" << get_gpu_scope_name(scope)
+                       << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << track_index
+                       << ",\"ts\":" << frame.scope_starts[i] * 1000.0
+                       << ",\"dur\":" << frame.scope_durations[i] * 1000.0
+                       << ",\"args\":{\"frame\":" << frame.frame_index
+                       << "}}";
+            }
+        }
+    }
+    stream << "\n]}\n";
+}
+
+} // namespace
+
+const char *get_gpu_scope_name(Gpu_scope scope) noexcept
+{
+    switch (scope)
+    {
+    case Gpu_scope::clear: return "clear";
+    case Gpu_scope::trace: return "trace";
+    case Gpu_scope::display_copy: return "display_copy";
+    case Gpu_scope::user_interface: return "user_interface";
+    }
+    return "unknown";
+}
+
+void resize_gpu_profile_history(Gpu_profile_history &history,
+                                std::size_t capacity)
+{
+    history.frames.clear();
+    history.frames.reserve(capacity);
+    history.capacity = capacity;
+    history.next = 0;
+}
+
+void add_frame(Gpu_profile_history &history, const Gpu_frame_profile &frame)
+{
+    if (history.capacity == 0)
+    {
+        return;
+    }
+    if (history.frames.size() < history.capacity)
+    {
+        history.frames.push_back(frame);
+    }
+    else
+    {
+        history.frames[history.next] = frame;
+    }
+    history.next = (history.next + 1) % history.capacity;
+}
+
+std::vector<Gpu_frame_profile> get_frames(const Gpu_profile_history &history)
+{
+    if (history.frames.size() < history.capacity)
+    {
+        return history.frames;
+    }
+    std::vector<Gpu_frame_profile> frames;
+    frames.reserve(history.frames.size());
+    frames.insert(frames.end(),
+                  history.frames.begin() +
+                      static_cast<std::ptrdiff_t>(history.next),
+                  history.frames.end());
+    frames.insert(frames.end(),
+                  history.frames.begin(),
+                  history.frames.begin() +
+                      static_cast<std::ptrdiff_t>(history.next));
+    return frames;
+}
+
+std::string write_gpu_profile(const char *file_name,
+                              std::span<const Gpu_profile_track> tracks)
+{
+    const std::filesystem::path path(file_name);
+    std::ofstream file(path);
+    if (!file)
+    {
+        std::ostringstream oss;
+        oss << "Failed to open file " << path;
+        return oss.str();
+    }
+
+    file << std::fixed << std::setprecision(6);
+    if (path.extension() == ".json")
+    {
+        write_json(file, tracks);
+    }
+    else
+    {
+        write_csv(file, tracks);
+    }
+
+    if (!file.flush())
+    {
+        std::ostringstream oss;
+        oss << "Failed to write file " << path;
+        return oss.str();
+    }
+    return {};
+}
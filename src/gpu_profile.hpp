@@ -0,0 +1,77 @@
+#ifndef GPU_PROFILE_HPP
+#define GPU_PROFILE_HPP
+
+#include <array>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <vector>
+
+// Named passes of the command buffers, timed with timestamp queries
+enum struct Gpu_scope : std::uint32_t
+{
+    // Clearing the accumulation at the first sample
+    clear,
+    // The ray tracing dispatch, including the tone mapping to the render
+    // target, which is done by the ray generation shader
+    trace,
+    // Copy of the render target to a display image
+    display_copy,
+    // The render pass of the user interface
+    user_interface
+};
+
+inline constexpr std::uint32_t gpu_scope_count {4};
+
+[[nodiscard]] const char *get_gpu_scope_name(Gpu_scope scope) noexcept;
+
+// Timings of one command buffer. Times are in milliseconds, and start times
+// are relative to the first frame of the same profiler.
+struct Gpu_frame_profile
+{
+    std::uint64_t frame_index;
+    std::uint32_t recorded_scopes; // Bit i is set if scope i was recorded
+    std::array<double, gpu_scope_count> scope_starts;
+    std::array<double, gpu_scope_count> scope_durations;
+};
+
+[[nodiscard]] constexpr bool is_recorded(const Gpu_frame_profile &frame,
+                                         Gpu_scope scope) noexcept
+{
+    return (frame.recorded_scopes >> static_cast<std::uint32_t>(scope)) & 1u;
+}
+
+// The latest frames of a profiler, in a ring of fixed capacity
+struct Gpu_profile_history
+{
+    std::vector<Gpu_frame_profile> frames;
+    std::size_t capacity;
+    std::size_t next; // Oldest frame once the ring is full
+};
+
+// Clears the history
+void resize_gpu_profile_history(Gpu_profile_history &history,
+                                std::size_t capacity);
+
+void add_frame(Gpu_profile_history &history, const Gpu_frame_profile &frame);
+
+// Oldest first
+[[nodiscard]] std::vector<Gpu_frame_profile>
+get_frames(const Gpu_profile_history &history);
+
+// Frames of one queue, or one thread submitting to it
+struct Gpu_profile_track
+{
+    std::string name;
+    std::vector<Gpu_frame_profile> frames;
+};
+
+// A ".json" file name writes the Trace Event Format, which can be opened in
+// Perfetto or chrome://tracing, with one thread per track. Anything else
+// writes CSV, with one line per frame and scope.
+// On failure, returns an error message. On success, returns an empty string.
+[[nodiscard]] std::string
+write_gpu_profile(const char *file_name,
+                  std::span<const Gpu_profile_track> tracks);
+
+#endif // GPU_PROFILE_HPP
@@ -0,0 +1,147 @@
+#include "image_comparison.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+namespace
+{
+
+// Sums over a tile, for one channel
+struct Difference_sums
+{
+    double difference;
+    double squared_difference;
+    double absolute_reference;
+    std::uint32_t count;
+};
+
+// Differences below this fraction of the reference are rounding errors
+// between backends rather than noise, so the standard error is never taken
+// smaller than this. Without it, tiles where both images are the same
+// constant (the environment seen directly, with a single light sample) would
+// get an infinite z-score from the slightest difference.
+constexpr double relative_error_floor {1e-4};
+
+[[nodiscard]] double z_score(const Difference_sums &sums) noexcept
+{
+    const auto n = static_cast<double>(sums.count);
+    const auto mean = sums.difference / n;
+    const auto variance =
+        std::max((sums.squared_difference - n * mean * mean) / (n - 1.0), 0.0);
+    const auto standard_error =
+        std::max(std::sqrt(variance / n),
+                 relative_error_floor * sums.absolute_reference / n +
+                     static_cast<double>(std::numeric_limits<float>::min()));
+    return mean / standard_error;
+}
+
+} // namespace
+
+Image_comparison compare_images(std::span<const float> rgba,
+                                std::span<const float> reference_rgba,
+                                std::uint32_t width,
+                                std::uint32_t height,
+                                std::uint32_t tile_size)
+{
+    const auto value_count = std::size_t {width} * height * 4;
+    if (rgba.size() != value_count || reference_rgba.size() != value_count)
+    {
+        throw std::invalid_argument("Image sizes do not match");
+    }
+
+    Image_comparison comparison {};
+    Difference_sums total {};
+    double relative_squared_error {0.0};
+
+    for (std::uint32_t tile_y {0}; tile_y < height; tile_y += tile_size)
+    {
+        for (std::uint32_t tile_x {0}; tile_x < width; tile_x += tile_size)
+        {
+            Difference_sums tile[3] {};
+            for (auto y = tile_y; y < std::min(tile_y + tile_size, height);
+                 ++y)
+            {
+                for (auto x = tile_x; x < std::min(tile_x + tile_size, width);
+                     ++x)
+                {
+                    const auto pixel = (std::size_t {y} * width + x) * 4;
+                    for (std::uint32_t c {0}; c < 3; ++c)
+                    {
+                        const double value {rgba[pixel + c]};
+                        const double reference {reference_rgba[pixel + c]};
+                        const auto difference = value - reference;
+                        tile[c].difference += difference;
+                        tile[c].squared_difference += difference * difference;
+                        tile[c].absolute_reference += std::abs(reference);
+                        ++tile[c].count;
+                        relative_squared_error +=
+                            difference * difference /
+                            (reference * reference + 1e-2);
+                    }
+                }
+            }
+
+            ++comparison.tile_count;
+            for (std::uint32_t c {0}; c < 3; ++c)
+            {
+                total.difference += tile[c].difference;
+                total.squared_difference += tile[c].squared_difference;
+                total.absolute_reference += tile[c].absolute_reference;
+                total.count += tile[c].count;
+
+                // The spread of a single difference says nothing about noise
+                if (tile[c].count < 2)
+                {
+                    continue;
+                }
+                const auto z = std::abs(z_score(tile[c]));
+                if (z > comparison.max_tile_z)
+                {
+                    comparison.max_tile_z = z;
+                    comparison.max_tile_x = tile_x;
+                    comparison.max_tile_y = tile_y;
+                    comparison.max_tile_channel = c;
+                }
+            }
+        }
+    }
+
+    if (total.count > 0)
+    {
+        const auto n = static_cast<double>(total.count);
+        comparison.rmse = std::sqrt(total.squared_difference / n);
+        comparison.relative_mse = relative_squared_error / n;
+        comparison.mean_difference = total.difference / n;
+    }
+    if (total.count > 1)
+    {
+        comparison.mean_difference_z = z_score(total);
+    }
+    return comparison;
+}
+
+void quantize_like_hdr(std::span<float> rgba)
+{
+    for (std::size_t i {0}; i + 3 < rgba.size(); i += 4)
+    {
+        float *const rgb = &rgba[i];
+        const auto max_component = std::max({rgb[0], rgb[1], rgb[2]});
+        if (max_component < 1e-32f)
+        {
+            rgb[0] = rgb[1] = rgb[2] = 0.0f;
+            continue;
+        }
+        int exponent {};
+        const auto normalize =
+            std::frexp(max_component, &exponent) * 256.0f / max_component;
+        // The shared exponent is stored with a bias of 128, and read back as
+        // a scale of 2^(exponent - 8) for each 8-bit mantissa
+        const auto scale = std::ldexp(1.0f, exponent - 8);
+        for (std::uint32_t c {0}; c < 3; ++c)
+        {
+            rgb[c] = std::floor(std::max(rgb[c], 0.0f) * normalize) * scale;
+        }
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef IMAGE_COMPARISON_HPP
+#define IMAGE_COMPARISON_HPP
+
+#include <cstdint>
+#include <span>
+
+// Statistics of the difference between a Monte Carlo render and a reference
+// render of the same scene, both linear RGBA. The renders are noisy, so they
+// never match exactly: the question is whether their difference is
+// consistent with zero-mean noise, i.e. whether one of them is biased.
+//
+// The noise of each pixel is independent of the others, so the per-pixel
+// differences of a tile are independent samples whose mean is zero for
+// unbiased renders. Each tile and channel gets a z-score from the mean of its
+// differences and their standard error, which needs no variance from the
+// renderers. A bias shifts the mean of all the differences of the tiles it
+// affects, and shows up as a large z-score even when it is small compared
+// to the noise of a single pixel.
+struct Image_comparison
+{
+    double rmse; // Over all channels except alpha
+    // Mean of squared differences divided by the squared reference, which
+    // weights dark and bright regions more evenly than the RMSE
+    double relative_mse;
+    double mean_difference; // Over all channels except alpha
+    double mean_difference_z;
+    double max_tile_z; // Largest absolute z-score of a tile and channel
+    std::uint32_t max_tile_x; // In pixels
+    std::uint32_t max_tile_y; // In pixels
+    std::uint32_t max_tile_channel;
+    std::uint32_t tile_count;
+};
+
+// Tiles are tile_size x tile_size pixels, smaller at the right and bottom
+// edges. Throws std::invalid_argument if the sizes of the images do not match
+// width and height.
+[[nodiscard]] Image_comparison
+compare_images(std::span<const float> rgba,
+               std::span<const float> reference_rgba,
+               std::uint32_t width,
+               std::uint32_t height,
+               std::uint32_t tile_size = 16);
+
+// Absolute z-score above which a tile is considered biased. The probability
+// that unbiased noise exceeds it is below 1e-6 per tile and channel, so that
+// images with thousands of tiles still pass.
+inline constexpr double max_unbiased_tile_z {5.0};
+
+// Rounds linear RGBA the way a Radiance HDR file stores it (8 bits of
+// mantissa with a shared exponent, rounded down), so that a render can be
+// compared to a reference read back from such a file without the rounding
+// of the reference alone showing up as a bias.
+void quantize_like_hdr(std::span<float> rgba);
+
+#endif // IMAGE_COMPARISON_HPP
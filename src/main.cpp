@@ -1,19 +1,431 @@
 #include "application.hpp"
 
+#include <charconv>
 #include <cstdlib>
+#include <cstring>
 #include <filesystem>
 #include <iostream>
 #include <stdexcept>
+#include <string>
+#include <system_error>
+
+namespace
+{
+
+void print_usage(const char *program_name)
+{
+    const auto name = std::filesystem::path(program_name).filename().string();
+    std::cout
+        << "Usage: " << name << " [<file>]\n"
+        << "       " << name << " --headless [<options>] <file>\n"
+        << "\n"
+        << "Headless options:\n"
+        << "  -o, --output <file>          Output image, .hdr for linear "
+           "radiance, otherwise PNG (default: render.png)\n"
+        << "  --environment <file.hdr>     Environment map (default: "
+        << default_environment_file_name << ")\n"
+        << "  --reference <file.hdr>       Compare the render to a reference "
+           "of the same scene with the same size, and fail if it is biased\n"
+        << "  --gpu-profile <file>         Write the GPU time of each frame, "
+           ".json for the Trace Event Format, otherwise CSV\n"
+        << "  --width <n>                  Render width (default: 640)\n"
+        << "  --height <n>                 Render height (default: 480)\n"
+        << "  --samples <n>                Number of samples per pixel "
+           "(default: 1000)\n"
+        << "  --samples-per-frame <n>      Number of samples per dispatch "
+           "(default: 8)\n"
+        << "  --seed <n>                   Random seed (default: 0)\n"
+        << "  --camera-position <x,y,z>    (default: 0,0,3.5)\n"
+        << "  --camera-target <x,y,z>      (default: 0,0,0)\n"
+        << "  --fov <degrees>              Vertical field of view "
+           "(default: 45)\n"
+        << "  --focus-distance <d>         (default: distance to the target)\n"
+        << "  --aperture-radius <r>        (default: 0)\n"
+        << "  --backend <gpu|cpu|hybrid>   hybrid renders on both and "
+           "merges the samples (default: gpu)\n"
+        << "  --threads <n>                Number of CPU backend threads, 0 "
+           "for all hardware threads (default: 0)\n"
+        << "  --bvh-width <2|4|8|16>       CPU backend BVH node width, 0 for "
+           "the widest supported by the CPU (default: 0)\n"
+        << "  --bvh-builder <sah|sbvh|lbvh|lbvh-treelets>\n"
+           "                               CPU backend BVH builder (default: "
+           "sah)\n"
+        << "  --sbvh-split-budget <f>      Maximum fraction of triangle "
+           "references the SBVH can duplicate (default: 0.25)\n"
+        << "  --bvh-nodes <float|quantized>\n"
+           "                               CPU backend BVH node format, "
+           "quantized for 64 B nodes with a width of 4 (default: float)\n"
+        << "  --presplit-budget <f>        Maximum fraction of triangles "
+           "added by splitting long ones before building acceleration "
+           "structures (default: 0)\n"
+        << "  --ray-packets <on|off>       Trace coherent rays as packets on "
+           "the CPU backend (default: on)\n"
+        << "  --integrator <megakernel|wavefront>\n"
+           "                               CPU backend integrator (default: "
+           "megakernel)\n"
+        << "  --numa <none|compact|scatter>\n"
+           "                               Pin CPU backend threads to NUMA "
+           "nodes, filling nodes in turn or alternating between them "
+           "(default: none)\n"
+        << "  --numa-replication <on|off>  Copy the meshes and BVHs to each "
+           "NUMA node with pinned threads (default: off)\n";
+}
+
+// Throws std::invalid_argument on failure
+template <typename T>
+[[nodiscard]] T parse_number(const char *option, const char *str)
+{
+    T value {};
+    const auto end = str + std::strlen(str);
+    const auto [ptr, error] = std::from_chars(str, end, value);
+    if (error != std::errc {} || ptr != end)
+    {
+        throw std::invalid_argument(std::string("Invalid value \"") + str +
+                                    "\" for option " + option);
+    }
+    return value;
+}
+
+// Throws std::invalid_argument on failure
+[[nodiscard]] vec3 parse_vec3(const char *option, const char *str)
+{
+    float values[3] {};
+    const auto end = str + std::strlen(str);
+    auto ptr = str;
+    for (int i {0}; i < 3; ++i)
+    {
+        const auto result = std::from_chars(ptr, end, values[i]);
+        ptr = result.ptr;
+        const bool separator_ok {i < 2 ? (ptr != end && *ptr == ',')
+                                       : (ptr == end)};
+        if (result.ec != std::errc {} || !separator_ok)
+        {
+            throw std::invalid_argument(std::string("Invalid value \"") + str +
+                                        "\" for option " + option);
+        }
+        if (i < 2)
+        {
+            ++ptr;
+        }
+    }
+    return {values[0], values[1], values[2]};
+}
+
+// Throws std::invalid_argument on failure
+void parse_option(const char *arg, const char *value, Headless_options &options)
+{
+    if (std::strcmp(arg, "-o") == 0 || std::strcmp(arg, "--output") == 0)
+    {
+        options.output_file_name = value;
+    }
+    else if (std::strcmp(arg, "--environment") == 0)
+    {
+        options.environment_file_name = value;
+    }
+    else if (std::strcmp(arg, "--reference") == 0)
+    {
+        options.reference_file_name = value;
+    }
+    else if (std::strcmp(arg, "--gpu-profile") == 0)
+    {
+        options.gpu_profile_file_name = value;
+    }
+    else if (std::strcmp(arg, "--width") == 0)
+    {
+        options.render_width = parse_number<std::uint32_t>(arg, value);
+    }
+    else if (std::strcmp(arg, "--height") == 0)
+    {
+        options.render_height = parse_number<std::uint32_t>(arg, value);
+    }
+    else if (std::strcmp(arg, "--samples") == 0)
+    {
+        options.sample_count = parse_number<std::uint32_t>(arg, value);
+    }
+    else if (std::strcmp(arg, "--samples-per-frame") == 0)
+    {
+        options.samples_per_frame = parse_number<std::uint32_t>(arg, value);
+    }
+    else if (std::strcmp(arg, "--seed") == 0)
+    {
+        options.seed = parse_number<std::uint32_t>(arg, value);
+    }
+    else if (std::strcmp(arg, "--camera-position") == 0)
+    {
+        options.camera_position = parse_vec3(arg, value);
+    }
+    else if (std::strcmp(arg, "--camera-target") == 0)
+    {
+        options.camera_target = parse_vec3(arg, value);
+    }
+    else if (std::strcmp(arg, "--fov") == 0)
+    {
+        options.vertical_fov = parse_number<float>(arg, value);
+    }
+    else if (std::strcmp(arg, "--focus-distance") == 0)
+    {
+        options.focus_distance = parse_number<float>(arg, value);
+    }
+    else if (std::strcmp(arg, "--aperture-radius") == 0)
+    {
+        options.aperture_radius = parse_number<float>(arg, value);
+    }
+    else if (std::strcmp(arg, "--backend") == 0)
+    {
+        if (std::strcmp(value, "gpu") == 0)
+        {
+            options.backend = Backend::gpu;
+        }
+        else if (std::strcmp(value, "cpu") == 0)
+        {
+            options.backend = Backend::cpu;
+        }
+        else if (std::strcmp(value, "hybrid") == 0)
+        {
+            options.backend = Backend::hybrid;
+        }
+        else
+        {
+            throw std::invalid_argument(std::string("Invalid value \"") +
+                                        value + "\" for option " + arg);
+        }
+    }
+    else if (std::strcmp(arg, "--threads") == 0)
+    {
+        options.thread_count = parse_number<unsigned int>(arg, value);
+    }
+    else if (std::strcmp(arg, "--bvh-width") == 0)
+    {
+        options.bvh_width = parse_number<std::uint32_t>(arg, value);
+    }
+    else if (std::strcmp(arg, "--bvh-builder") == 0)
+    {
+        if (std::strcmp(value, "sah") == 0)
+        {
+            options.bvh_builder = Bvh_builder::sah;
+        }
+        else if (std::strcmp(value, "sbvh") == 0)
+        {
+            options.bvh_builder = Bvh_builder::sbvh;
+        }
+        else if (std::strcmp(value, "lbvh") == 0)
+        {
+            options.bvh_builder = Bvh_builder::lbvh;
+        }
+        else if (std::strcmp(value, "lbvh-treelets") == 0)
+        {
+            options.bvh_builder = Bvh_builder::lbvh_treelets;
+        }
+        else
+        {
+            throw std::invalid_argument(std::string("Invalid value \"") +
+                                        value + "\" for option " + arg);
+        }
+    }
+    else if (std::strcmp(arg, "--sbvh-split-budget") == 0)
+    {
+        options.sbvh_split_budget = parse_number<float>(arg, value);
+    }
+    else if (std::strcmp(arg, "--bvh-nodes") == 0)
+    {
+        if (std::strcmp(value, "float") == 0)
+        {
+            options.quantized_bvh_nodes = false;
+        }
+        else if (std::strcmp(value, "quantized") == 0)
+        {
+            options.quantized_bvh_nodes = true;
+        }
+        else
+        {
+            throw std::invalid_argument(std::string("Invalid value \"") +
+                                        value + "\" for option " + arg);
+        }
+    }
+    else if (std::strcmp(arg, "--presplit-budget") == 0)
+    {
+        options.presplit_budget = parse_number<float>(arg, value);
+    }
+    else if (std::strcmp(arg, "--integrator") == 0)
+    {
+        if (std::strcmp(value, "megakernel") == 0)
+        {
+            options.integrator = Cpu_integrator::megakernel;
+        }
+        else if (std::strcmp(value, "wavefront") == 0)
+        {
+            options.integrator = Cpu_integrator::wavefront;
+        }
+        else
+        {
+            throw std::invalid_argument(std::string("Invalid value \"") +
+                                        value + "\" for option " + arg);
+        }
+    }
+    else if (std::strcmp(arg, "--ray-packets") == 0)
+    {
+        if (std::strcmp(value, "on") == 0)
+        {
+            options.ray_packets = true;
+        }
+        else if (std::strcmp(value, "off") == 0)
+        {
+            options.ray_packets = false;
+        }
+        else
+        {
+            throw std::invalid_argument(std::string("Invalid value \"") +
+                                        value + "\" for option " + arg);
+        }
+    }
+    else if (std::strcmp(arg, "--numa") == 0)
+    {
+        if (std::strcmp(value, "none") == 0)
+        {
+            options.thread_placement = Thread_placement::none;
+        }
+        else if (std::strcmp(value, "compact") == 0)
+        {
+            options.thread_placement = Thread_placement::compact;
+        }
+        else if (std::strcmp(value, "scatter") == 0)
+        {
+            options.thread_placement = Thread_placement::scatter;
+        }
+        else
+        {
+            throw std::invalid_argument(std::string("Invalid value \"") +
+                                        value + "\" for option " + arg);
+        }
+    }
+    else if (std::strcmp(arg, "--numa-replication") == 0)
+    {
+        if (std::strcmp(value, "on") == 0)
+        {
+            options.numa_replication = true;
+        }
+        else if (std::strcmp(value, "off") == 0)
+        {
+            options.numa_replication = false;
+        }
+        else
+        {
+            throw std::invalid_argument(std::string("Invalid value \"") +
+                                        value + "\" for option " + arg);
+        }
+    }
+    else
+    {
+        throw std::invalid_argument(std::string("Unknown option ") + arg);
+    }
+}
+
+// Returns false if the arguments are invalid
+[[nodiscard]] bool
+parse_headless_options(int argc, char *argv[], Headless_options &options)
+{
+    options = {.input_file_name = nullptr,
+               .environment_file_name = default_environment_file_name,
+               .output_file_name = "render.png",
+               .reference_file_name = nullptr,
+               .gpu_profile_file_name = nullptr,
+               .render_width = 640,
+               .render_height = 480,
+               .sample_count = 1000,
+               .samples_per_frame = 8,
+               .seed = 0,
+               .camera_position = {0.0f, 0.0f, 3.5f},
+               .camera_target = {0.0f, 0.0f, 0.0f},
+               .vertical_fov = 45.0f,
+               .focus_distance = 0.0f,
+               .aperture_radius = 0.0f,
+               .backend = Backend::gpu,
+               .thread_count = 0,
+               .bvh_width = 0,
+               .bvh_builder = Bvh_builder::sah,
+               .sbvh_split_budget = 0.25f,
+               .quantized_bvh_nodes = false,
+               .presplit_budget = 0.0f,
+               .ray_packets = true,
+               .integrator = Cpu_integrator::megakernel,
+               .thread_placement = Thread_placement::none,
+               .numa_replication = false};
+
+    for (int i {1}; i < argc; ++i)
+    {
+        const char *const arg = argv[i];
+        if (std::strcmp(arg, "--headless") == 0)
+        {
+            continue;
+        }
+        if (arg[0] != '-')
+        {
+            if (options.input_file_name != nullptr)
+            {
+                return false;
+            }
+            options.input_file_name = arg;
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            return false;
+        }
+        const char *const value = argv[++i];
+
+        try
+        {
+            parse_option(arg, value, options);
+        }
+        catch (const std::invalid_argument &e)
+        {
+            std::cerr << e.what() << '\n';
+            return false;
+        }
+    }
+
+    return options.input_file_name != nullptr && options.render_width > 0 &&
+           options.render_height > 0 && options.sample_count > 0 &&
+           options.samples_per_frame > 0 && options.vertical_fov > 0.0f &&
+           options.vertical_fov < 180.0f && options.sbvh_split_budget >= 0.0f &&
+           options.presplit_budget >= 0.0f;
+}
+
+[[nodiscard]] bool is_headless(int argc, char *argv[])
+{
+    for (int i {1}; i < argc; ++i)
+    {
+        if (std::strcmp(argv[i], "--headless") == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+} // namespace
 
 int main(int argc, char *argv[])
 {
     try
     {
+        if (is_headless(argc, argv))
+        {
+            Headless_options options {};
+            if (!parse_headless_options(argc, argv, options))
+            {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+
+            run_headless(options);
+
+            return EXIT_SUCCESS;
+        }
+
         if (argc > 2 || (argc == 2 && argv[1][0] == '-'))
         {
-            std::cout << "Usage: "
-                      << std::filesystem::path(argv[0]).filename().string()
-                      << " [<file>]\n";
+            print_usage(argv[0]);
             return EXIT_FAILURE;
         }
 
@@ -0,0 +1,120 @@
+#include "memory_arena.hpp"
+
+#include <cstdint>
+#include <new>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+namespace
+{
+
+// The most common huge page size on x86-64 and ARM64
+constexpr std::size_t huge_page_size {std::size_t {1} << 21};
+
+[[nodiscard]] std::size_t round_up(std::size_t size,
+                                   std::size_t alignment) noexcept
+{
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+#if defined(__linux__)
+
+// Returns nullptr on failure
+[[nodiscard]] std::byte *map_transparent_huge_pages(std::size_t size)
+{
+    // Regular mappings are only page aligned, so a larger one is trimmed down
+    // to a huge page boundary
+    const auto mapped_size = size + huge_page_size;
+    auto *const mapping = mmap(nullptr,
+                               mapped_size,
+                               PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS,
+                               -1,
+                               0);
+    if (mapping == MAP_FAILED)
+    {
+        return nullptr;
+    }
+
+    const auto address = reinterpret_cast<std::uintptr_t>(mapping);
+    const auto aligned_address = round_up(address, huge_page_size);
+    const auto head_size = aligned_address - address;
+    if (head_size > 0)
+    {
+        munmap(mapping, head_size);
+    }
+    munmap(reinterpret_cast<void *>(aligned_address + size),
+           mapped_size - head_size - size);
+
+    auto *const memory = reinterpret_cast<void *>(aligned_address);
+    // NOTE: this is only a hint, and fails if transparent huge pages are
+    // disabled, in which case the arena is still usable
+    madvise(memory, size, MADV_HUGEPAGE);
+    return static_cast<std::byte *>(memory);
+}
+
+#endif
+
+} // namespace
+
+void Arena_deleter::operator()(std::byte *memory) const noexcept
+{
+#if defined(__linux__)
+    munmap(memory, size);
+#else
+    ::operator delete(memory, std::align_val_t {huge_page_size});
+#endif
+}
+
+Memory_arena create_memory_arena(std::size_t size)
+{
+    // At least one page, so that the resource always has a buffer
+    size = round_up(size > 0 ? size : 1, huge_page_size);
+
+    std::byte *memory {nullptr};
+    auto page_kind = Page_kind::regular;
+
+#if defined(__linux__)
+    auto *const mapping = mmap(nullptr,
+                               size,
+                               PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                               -1,
+                               0);
+    if (mapping != MAP_FAILED)
+    {
+        memory = static_cast<std::byte *>(mapping);
+        page_kind = Page_kind::explicit_huge;
+    }
+    else
+    {
+        memory = map_transparent_huge_pages(size);
+        page_kind = Page_kind::transparent_huge;
+    }
+    if (memory == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+#else
+    memory = static_cast<std::byte *>(
+        ::operator new(size, std::align_val_t {huge_page_size}));
+#endif
+
+    Memory_arena arena {};
+    arena.memory = {memory, {.size = size, .page_kind = page_kind}};
+    arena.resource = std::make_unique<std::pmr::monotonic_buffer_resource>(
+        memory, size, std::pmr::null_memory_resource());
+    return arena;
+}
+
+std::size_t get_size(const Memory_arena &arena) noexcept
+{
+    return arena.memory.get_deleter().size;
+}
+
+Page_kind get_page_kind(const Memory_arena &arena) noexcept
+{
+    return arena.memory.get_deleter().page_kind;
+}
@@ -0,0 +1,45 @@
+#ifndef MEMORY_ARENA_HPP
+#define MEMORY_ARENA_HPP
+
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+
+enum struct Page_kind
+{
+    regular,
+    // Requested from the kernel with madvise(), which may still back some of
+    // the arena with regular pages
+    transparent_huge,
+    // Reserved huge pages (MAP_HUGETLB)
+    explicit_huge
+};
+
+struct Arena_deleter
+{
+    std::size_t size;
+    Page_kind page_kind;
+
+    void operator()(std::byte *memory) const noexcept;
+};
+
+// Single fixed size allocation for large data that is read at random and never
+// freed piecemeal, like BVH nodes. It is backed by huge pages where the OS
+// provides them, so that it needs far fewer TLB entries than the same data
+// spread over many vectors. Allocations are made through the resource, and
+// throw std::bad_alloc once the arena is full.
+struct Memory_arena
+{
+    std::unique_ptr<std::byte, Arena_deleter> memory;
+    std::unique_ptr<std::pmr::monotonic_buffer_resource> resource;
+};
+
+// Never fails because of huge pages: it falls back to transparent huge pages
+// if none are reserved, and to regular pages on other operating systems.
+[[nodiscard]] Memory_arena create_memory_arena(std::size_t size);
+
+[[nodiscard]] std::size_t get_size(const Memory_arena &arena) noexcept;
+
+[[nodiscard]] Page_kind get_page_kind(const Memory_arena &arena) noexcept;
+
+#endif // MEMORY_ARENA_HPP
@@ -0,0 +1,267 @@
+#include "numa.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <exception>
+#include <fstream>
+#include <sstream>
+#include <string_view>
+#include <thread>
+#include <utility>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace
+{
+
+Thread_layout current_layout {};
+
+thread_local std::uint32_t current_node {0};
+
+// Parses a sysfs CPU list such as "0-15,32-47". Returns an empty vector on
+// failure.
+[[nodiscard]] std::vector<unsigned int> parse_cpu_list(std::string_view list)
+{
+    std::vector<unsigned int> cpus;
+    while (!list.empty() && list.back() == '\n')
+    {
+        list.remove_suffix(1);
+    }
+    while (!list.empty())
+    {
+        const auto comma = list.find(',');
+        const auto range = list.substr(0, comma);
+        list = comma == std::string_view::npos ? std::string_view {}
+                                               : list.substr(comma + 1);
+
+        unsigned int first {};
+        const auto end = range.data() + range.size();
+        auto result = std::from_chars(range.data(), end, first);
+        if (result.ec != std::errc {})
+        {
+            return {};
+        }
+        auto last = first;
+        if (result.ptr != end)
+        {
+            if (*result.ptr != '-')
+            {
+                return {};
+            }
+            result = std::from_chars(result.ptr + 1, end, last);
+            if (result.ec != std::errc {} || result.ptr != end || last < first)
+            {
+                return {};
+            }
+        }
+        for (auto cpu = first; cpu <= last; ++cpu)
+        {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+// Formats CPUs as a list of ranges, like sysfs
+[[nodiscard]] std::string format_cpu_list(const std::vector<unsigned int> &cpus)
+{
+    std::ostringstream stream;
+    for (std::size_t i {0}; i < cpus.size();)
+    {
+        auto j = i + 1;
+        while (j < cpus.size() && cpus[j] == cpus[j - 1] + 1)
+        {
+            ++j;
+        }
+        stream << (i > 0 ? "," : "") << cpus[i];
+        if (j - i > 1)
+        {
+            stream << '-' << cpus[j - 1];
+        }
+        i = j;
+    }
+    return stream.str();
+}
+
+[[nodiscard]] std::vector<unsigned int> get_all_cpus()
+{
+    std::vector<unsigned int> cpus(
+        std::max(std::thread::hardware_concurrency(), 1u));
+    for (unsigned int i {0}; i < cpus.size(); ++i)
+    {
+        cpus[i] = i;
+    }
+    return cpus;
+}
+
+void pin_current_thread(const std::vector<unsigned int> &cpus)
+{
+#if defined(__linux__)
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    for (const auto cpu : cpus)
+    {
+        if (cpu < CPU_SETSIZE)
+        {
+            CPU_SET(cpu, &cpu_set);
+        }
+    }
+    // NOTE: failing to pin only costs performance, so the error is ignored
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+#else
+    static_cast<void>(cpus);
+#endif
+}
+
+} // namespace
+
+Numa_topology get_numa_topology()
+{
+    Numa_topology topology {};
+
+#if defined(__linux__)
+    // Node directories are numbered consecutively from zero, except on
+    // machines with memory-only or offline nodes, which have no CPUs to pin
+    // threads to anyway
+    for (unsigned int node {0};; ++node)
+    {
+        std::ifstream file("/sys/devices/system/node/node" +
+                           std::to_string(node) + "/cpulist");
+        if (!file)
+        {
+            break;
+        }
+        // A single line, such as "0-7,16-23"
+        std::string list;
+        std::getline(file, list);
+        auto cpus = parse_cpu_list(list);
+        if (!cpus.empty())
+        {
+            topology.node_cpus.push_back(std::move(cpus));
+        }
+    }
+#endif
+
+    if (topology.node_cpus.empty())
+    {
+        topology.node_cpus.push_back(get_all_cpus());
+    }
+    return topology;
+}
+
+Thread_layout create_thread_layout(Numa_topology topology,
+                                   Thread_placement placement,
+                                   unsigned int thread_count)
+{
+    Thread_layout layout {.topology = std::move(topology),
+                          .placement = placement,
+                          .thread_nodes = {}};
+    if (placement == Thread_placement::none)
+    {
+        return layout;
+    }
+
+    const auto node_count =
+        static_cast<std::uint32_t>(layout.topology.node_cpus.size());
+    layout.thread_nodes.resize(std::max(thread_count, 1u));
+    for (std::uint32_t i {0}; i < layout.thread_nodes.size(); ++i)
+    {
+        layout.thread_nodes[i] =
+            placement == Thread_placement::compact
+                ? static_cast<std::uint32_t>(
+                      std::uint64_t {i} * node_count /
+                      layout.thread_nodes.size())
+                : i % node_count;
+    }
+    return layout;
+}
+
+std::string describe_thread_layout(const Thread_layout &layout)
+{
+    std::ostringstream stream;
+    const auto &node_cpus = layout.topology.node_cpus;
+    for (std::uint32_t node {0}; node < node_cpus.size(); ++node)
+    {
+        stream << "NUMA node " << node << ": CPUs "
+               << format_cpu_list(node_cpus[node]);
+        if (layout.placement == Thread_placement::none)
+        {
+            stream << ", threads not pinned\n";
+            continue;
+        }
+        std::vector<unsigned int> threads;
+        for (unsigned int i {0}; i < layout.thread_nodes.size(); ++i)
+        {
+            if (layout.thread_nodes[i] == node)
+            {
+                threads.push_back(i);
+            }
+        }
+        stream << ", " << threads.size() << " threads";
+        if (!threads.empty())
+        {
+            stream << " (" << format_cpu_list(threads) << ')';
+        }
+        stream << '\n';
+    }
+    return stream.str();
+}
+
+void set_thread_layout(Thread_layout layout)
+{
+    current_layout = std::move(layout);
+}
+
+const Thread_layout &get_thread_layout() noexcept
+{
+    return current_layout;
+}
+
+void pin_pool_thread(unsigned int thread_index)
+{
+    const auto &thread_nodes = current_layout.thread_nodes;
+    if (thread_nodes.empty())
+    {
+        return;
+    }
+
+    const auto node = thread_nodes[thread_index % thread_nodes.size()];
+    pin_current_thread(current_layout.topology.node_cpus[node]);
+    current_node = node;
+}
+
+std::uint32_t get_current_numa_node() noexcept
+{
+    return current_node;
+}
+
+void run_on_numa_node(std::uint32_t node, const std::function<void()> &function)
+{
+    std::exception_ptr exception;
+    std::thread thread(
+        [&]
+        {
+            const auto &node_cpus = current_layout.topology.node_cpus;
+            if (node < node_cpus.size())
+            {
+                pin_current_thread(node_cpus[node]);
+            }
+            current_node = node;
+            try
+            {
+                function();
+            }
+            catch (...)
+            {
+                exception = std::current_exception();
+            }
+        });
+    thread.join();
+    if (exception)
+    {
+        std::rethrow_exception(exception);
+    }
+}
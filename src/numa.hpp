@@ -0,0 +1,67 @@
+#ifndef NUMA_HPP
+#define NUMA_HPP
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Logical CPUs of each NUMA node. Where the topology cannot be queried (other
+// operating systems, or kernels without NUMA support), there is a single node
+// with all the CPUs.
+struct Numa_topology
+{
+    std::vector<std::vector<unsigned int>> node_cpus;
+};
+
+enum struct Thread_placement
+{
+    // Threads are left to the scheduler of the OS
+    none,
+    // Consecutive threads share a node, and each node gets an equal share
+    compact,
+    // Thread i runs on node i % node_count
+    scatter
+};
+
+// Node of each thread of the thread pools, by thread index. Each thread is
+// pinned to all the CPUs of its node, not to a single one, so that the OS can
+// still balance the threads within the node.
+struct Thread_layout
+{
+    Numa_topology topology;
+    Thread_placement placement;
+    std::vector<std::uint32_t> thread_nodes; // Empty with Thread_placement::none
+};
+
+[[nodiscard]] Numa_topology get_numa_topology();
+
+[[nodiscard]] Thread_layout create_thread_layout(Numa_topology topology,
+                                                 Thread_placement placement,
+                                                 unsigned int thread_count);
+
+// One line per node, with its CPUs and the threads placed on it
+[[nodiscard]] std::string describe_thread_layout(const Thread_layout &layout);
+
+// Sets the layout used by pin_pool_thread() for the rest of the process. It is
+// not synchronized with the thread pools, so it must be called before any of
+// them starts, typically at startup.
+void set_thread_layout(Thread_layout layout);
+
+[[nodiscard]] const Thread_layout &get_thread_layout() noexcept;
+
+// Called at the start of the thread with index thread_index in a thread pool
+// (the BVH builders, the tile scheduler). Pins the calling thread to the CPUs
+// of its node in the current layout, so that the memory it touches first is
+// allocated on that node. Thread indices beyond the layout wrap around. Does
+// nothing with Thread_placement::none, or where pinning is not supported.
+void pin_pool_thread(unsigned int thread_index);
+
+// Node the calling thread was pinned to, zero if it was not pinned
+[[nodiscard]] std::uint32_t get_current_numa_node() noexcept;
+
+// Runs function on a new thread pinned to the CPUs of the node and waits for
+// it, so that the memory it writes first is allocated on that node
+void run_on_numa_node(std::uint32_t node, const std::function<void()> &function);
+
+#endif // NUMA_HPP
@@ -1,26 +1,75 @@
 #include "renderer.hpp"
 #include "camera.hpp"
+#include "scene.hpp"
 #include "utility.hpp"
 
 #include <imgui_impl_vulkan.h>
 
-#include <assimp/scene.h>
-
 #define GLFW_INCLUDE_NONE
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
 #include <cstring>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <limits>
+#include <map>
+#include <random>
 #include <ranges>
+#include <span>
 #include <sstream>
+#include <thread>
+#include <utility>
 #include <vector>
 
 VULKAN_HPP_DEFAULT_DISPATCH_LOADER_DYNAMIC_STORAGE
 
+struct Render_thread_state
+{
+    Vulkan_context *context;
+    Vulkan_render_resources *render_resources;
+    vk::UniqueCommandPool command_pool;
+    std::vector<vk::UniqueCommandBuffer> command_buffers;
+    // Signaled by each submission of the render thread with its number
+    vk::UniqueSemaphore trace_semaphore;
+    // Signaled by each frame of the user interface shown with a display image
+    // with its number
+    vk::UniqueSemaphore ui_semaphore;
+    std::uint32_t global_frame_count; // Render thread only
+
+    std::mutex mutex;
+    std::condition_variable_any condition;
+    // The members below are guarded by the mutex
+    Camera camera;
+    std::uint32_t samples_to_render;
+    std::uint32_t samples_per_frame;
+    bool reset_requested;
+    std::uint32_t published_index;
+    std::uint64_t published_trace_value; // The copy completes at this value
+    bool published_shown; // Whether a frame of the user interface showed it
+    // Value of the last frame of the user interface showing each display image
+    std::array<std::uint64_t, 2> shown_ui_values;
+    std::uint64_t submitted_ui_value;
+    std::exception_ptr exception;
+    // Only the history is guarded by the mutex, the rest belongs to the
+    // render thread
+    Gpu_profiler gpu_profiler;
+
+    std::atomic<std::uint32_t> sample_count;
+
+    // Last, so that it is joined before anything else is destroyed
+    std::jthread thread;
+};
+
 namespace
 {
 
@@ -29,6 +78,7 @@ struct Push_constants
     std::uint32_t global_frame_count;
     std::uint32_t sample_count;
     std::uint32_t samples_per_frame;
+    std::uint32_t rng_seed;
     vec3 camera_position;
     vec3 camera_dir_x;
     vec3 camera_dir_y;
@@ -62,7 +112,7 @@ debug_callback(vk::DebugUtilsMessageSeverityFlagBitsEXT message_severity,
 
 #endif
 
-void create_instance(Vulkan_context &context)
+void create_instance(Vulkan_context &context, bool enable_presentation)
 {
     VULKAN_HPP_DEFAULT_DISPATCHER.init(
         context.dl.getProcAddress<PFN_vkGetInstanceProcAddr>(
@@ -71,9 +121,15 @@ void create_instance(Vulkan_context &context)
     constexpr vk::ApplicationInfo application_info {.apiVersion =
                                                         VK_API_VERSION_1_3};
 
+    // NOTE: a headless context does not initialize GLFW, so it must not query
+    // the surface extensions
     std::uint32_t glfw_required_extension_count {};
-    const auto glfw_required_extension_names =
-        glfwGetRequiredInstanceExtensions(&glfw_required_extension_count);
+    const char *const *glfw_required_extension_names {};
+    if (enable_presentation)
+    {
+        glfw_required_extension_names =
+            glfwGetRequiredInstanceExtensions(&glfw_required_extension_count);
+    }
 
 #ifdef ENABLE_VALIDATION
 
@@ -196,9 +252,12 @@ void create_instance(Vulkan_context &context)
 #endif
 }
 
+// If enable_presentation is false, present_queue_family_index is set to the
+// same family as graphics_compute_queue_family_index.
 void get_queue_family_indices(
     vk::Instance instance,
     vk::PhysicalDevice physical_device,
+    bool enable_presentation,
     std::uint32_t &graphics_compute_queue_family_index,
     std::uint32_t &present_queue_family_index)
 {
@@ -220,8 +279,14 @@ void get_queue_family_indices(
             (queue_family_properties[i].queueCount > 0))
         {
             graphics_compute_queue_family_index = i;
+            if (!enable_presentation)
+            {
+                present_queue_family_index = i;
+                return;
+            }
         }
-        if (glfwGetPhysicalDevicePresentationSupport(
+        if (enable_presentation &&
+            glfwGetPhysicalDevicePresentationSupport(
                 instance, physical_device, i))
         {
             present_queue_family_index = i;
@@ -238,6 +303,7 @@ void get_queue_family_indices(
 
 [[nodiscard]] bool is_device_suitable(vk::Instance instance,
                                       vk::PhysicalDevice physical_device,
+                                      bool enable_presentation,
                                       std::uint32_t device_extension_count,
                                       const char *const *device_extension_names)
 {
@@ -247,6 +313,7 @@ void get_queue_family_indices(
     std::uint32_t present_queue_family_index;
     get_queue_family_indices(instance,
                              physical_device,
+                             enable_presentation,
                              graphics_compute_queue_family_index,
                              present_queue_family_index);
     if (graphics_compute_queue_family_index ==
@@ -329,6 +396,9 @@ void get_queue_family_indices(
     check_support(features_chain.get<vk::PhysicalDeviceVulkan12Features>()
                       .scalarBlockLayout,
                   "scalarBlockLayout");
+    check_support(features_chain.get<vk::PhysicalDeviceVulkan12Features>()
+                      .timelineSemaphore,
+                  "timelineSemaphore");
     check_support(
         features_chain.get<vk::PhysicalDeviceAccelerationStructureFeaturesKHR>()
             .accelerationStructure,
@@ -365,17 +435,20 @@ void get_queue_family_indices(
     return suitable;
 }
 
-void create_device(Vulkan_context &context)
+void create_device(Vulkan_context &context, bool enable_presentation)
 {
     const auto physical_devices = context.instance->enumeratePhysicalDevices();
 
-    constexpr const char *device_extension_names[] {
-        VK_KHR_SWAPCHAIN_EXTENSION_NAME,
+    std::vector<const char *> device_extension_names {
         VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME,
         VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME,
         VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME};
-    constexpr auto device_extension_count =
-        static_cast<std::uint32_t>(std::size(device_extension_names));
+    if (enable_presentation)
+    {
+        device_extension_names.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+    }
+    const auto device_extension_count =
+        static_cast<std::uint32_t>(device_extension_names.size());
 
     std::size_t selected_device_index {};
     for (std::size_t i {0}; i < physical_devices.size(); ++i)
@@ -384,7 +457,9 @@ void create_device(Vulkan_context &context)
             physical_devices[i]
                 .getProperties2<
                     vk::PhysicalDeviceProperties2,
-                    vk::PhysicalDeviceRayTracingPipelinePropertiesKHR>();
+                    vk::PhysicalDeviceIDProperties,
+                    vk::PhysicalDeviceRayTracingPipelinePropertiesKHR,
+                    vk::PhysicalDeviceAccelerationStructurePropertiesKHR>();
 
         const auto &properties =
             properties_chain.get<vk::PhysicalDeviceProperties2>().properties;
@@ -395,8 +470,9 @@ void create_device(Vulkan_context &context)
 
         if (is_device_suitable(context.instance.get(),
                                physical_devices[i],
+                               enable_presentation,
                                device_extension_count,
-                               device_extension_names) &&
+                               device_extension_names.data()) &&
             !context.physical_device)
         {
             selected_device_index = i;
@@ -404,12 +480,18 @@ void create_device(Vulkan_context &context)
             get_queue_family_indices(
                 context.instance.get(),
                 physical_devices[i],
+                enable_presentation,
                 context.graphics_compute_queue_family_index,
                 context.present_queue_family_index);
             context.physical_device_properties = properties;
+            context.physical_device_id_properties =
+                properties_chain.get<vk::PhysicalDeviceIDProperties>();
             context.physical_device_ray_tracing_pipeline_properties =
                 properties_chain
                     .get<vk::PhysicalDeviceRayTracingPipelinePropertiesKHR>();
+            context.physical_device_acceleration_structure_properties =
+                properties_chain.get<
+                    vk::PhysicalDeviceAccelerationStructurePropertiesKHR>();
         }
     }
     if (context.physical_device)
@@ -423,14 +505,24 @@ void create_device(Vulkan_context &context)
         throw std::runtime_error("Failed to find a suitable physical device");
     }
 
-    constexpr float queue_priority {1.0f};
+    const auto graphics_compute_queue_family_properties =
+        context.physical_device.getQueueFamilyProperties()
+            [context.graphics_compute_queue_family_index];
+    context.timestamp_valid_bits =
+        graphics_compute_queue_family_properties.timestampValidBits;
+
+    // The second queue, if any, is the trace queue. Its lower priority hints
+    // the driver to favor the user interface when both have work.
+    constexpr float queue_priorities[] {1.0f, 0.5f};
+    const auto graphics_compute_queue_count =
+        std::min(graphics_compute_queue_family_properties.queueCount, 2u);
     const vk::DeviceQueueCreateInfo queue_create_infos[] {
         {.queueFamilyIndex = context.graphics_compute_queue_family_index,
-         .queueCount = 1,
-         .pQueuePriorities = &queue_priority},
+         .queueCount = graphics_compute_queue_count,
+         .pQueuePriorities = queue_priorities},
         {.queueFamilyIndex = context.present_queue_family_index,
          .queueCount = 1,
-         .pQueuePriorities = &queue_priority}};
+         .pQueuePriorities = queue_priorities}};
 
     const std::uint32_t queue_create_info_count {
         context.graphics_compute_queue_family_index ==
@@ -443,9 +535,10 @@ void create_device(Vulkan_context &context)
                               .pQueueCreateInfos = queue_create_infos,
                               .enabledExtensionCount = device_extension_count,
                               .ppEnabledExtensionNames =
-                                  device_extension_names},
+                                  device_extension_names.data()},
         vk::PhysicalDeviceFeatures2 {},
         vk::PhysicalDeviceVulkan12Features {.scalarBlockLayout = VK_TRUE,
+                                            .timelineSemaphore = VK_TRUE,
                                             .bufferDeviceAddress = VK_TRUE},
         vk::PhysicalDeviceAccelerationStructureFeaturesKHR {
             .accelerationStructure = VK_TRUE},
@@ -610,6 +703,100 @@ void create_swapchain(Vulkan_context &context)
     }
 }
 
+// In the cache directory of the user, with the device UUID and the driver
+// version in the file name, so that each device has its own cache and an
+// updated driver starts from an empty one.
+[[nodiscard]] std::filesystem::path
+get_pipeline_cache_path(const Vulkan_context &context)
+{
+    std::filesystem::path directory {"."};
+    const auto is_set = [](const char *variable)
+    { return variable != nullptr && *variable != '\0'; };
+    if (const auto *const cache_home = std::getenv("XDG_CACHE_HOME");
+        is_set(cache_home))
+    {
+        directory = cache_home;
+    }
+    else if (const auto *const local_app_data = std::getenv("LOCALAPPDATA");
+             is_set(local_app_data))
+    {
+        directory = local_app_data;
+    }
+    else if (const auto *const home = std::getenv("HOME"); is_set(home))
+    {
+        directory = std::filesystem::path(home) / ".cache";
+    }
+
+    std::ostringstream file_name;
+    file_name << "pipeline_cache_" << std::hex << std::setfill('0');
+    for (const auto byte : context.physical_device_id_properties.deviceUUID)
+    {
+        file_name << std::setw(2) << static_cast<unsigned int>(byte);
+    }
+    file_name << '_' << std::setw(8)
+              << context.physical_device_properties.driverVersion << ".bin";
+
+    return directory / "path_tracer" / file_name.str();
+}
+
+// Checks the header of the cache data (VkPipelineCacheHeaderVersionOne), whose
+// fields are stored least significant byte first. The driver should reject
+// data from another device itself, but not all of them do.
+[[nodiscard]] bool
+is_pipeline_cache_compatible(const std::vector<char> &data,
+                             const vk::PhysicalDeviceProperties &properties)
+{
+    constexpr std::size_t header_size {4 * sizeof(std::uint32_t) +
+                                       VK_UUID_SIZE};
+    if (data.size() < header_size)
+    {
+        return false;
+    }
+    const auto read_uint32 = [&](std::size_t offset)
+    {
+        std::uint32_t value {};
+        for (std::size_t i {0}; i < sizeof(value); ++i)
+        {
+            value |= static_cast<std::uint32_t>(
+                         static_cast<unsigned char>(data[offset + i]))
+                     << (8 * i);
+        }
+        return value;
+    };
+    return read_uint32(0) >= header_size &&
+           read_uint32(4) == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+           read_uint32(8) == properties.vendorID &&
+           read_uint32(12) == properties.deviceID &&
+           std::memcmp(data.data() + 16,
+                       properties.pipelineCacheUUID.data(),
+                       VK_UUID_SIZE) == 0;
+}
+
+// A missing or incompatible file gives an empty cache
+void create_pipeline_cache(Vulkan_context &context)
+{
+    context.pipeline_cache_path = get_pipeline_cache_path(context);
+
+    std::vector<char> data;
+    std::ifstream file(context.pipeline_cache_path, std::ios::binary);
+    if (file)
+    {
+        data.assign(std::istreambuf_iterator<char>(file),
+                    std::istreambuf_iterator<char>());
+    }
+    if (!is_pipeline_cache_compatible(data,
+                                      context.physical_device_properties))
+    {
+        data.clear();
+    }
+
+    const vk::PipelineCacheCreateInfo pipeline_cache_create_info {
+        .initialDataSize = data.size(), .pInitialData = data.data()};
+    context.pipeline_cache =
+        context.device->createPipelineCacheUnique(pipeline_cache_create_info);
+    context.pipeline_cache_loaded_size = data.size();
+}
+
 void create_descriptor_pool(Vulkan_context &context)
 {
     // FIXME: ImGui actually only needs a single combined image sampler, so just
@@ -768,7 +955,7 @@ void init_imgui(Vulkan_context &context)
         .ImageCount =
             static_cast<std::uint32_t>(context.swapchain_images.size()),
         .MSAASamples = VK_SAMPLE_COUNT_1_BIT,
-        .PipelineCache = VK_NULL_HANDLE,
+        .PipelineCache = context.pipeline_cache.get(),
         .Subpass = 0,
         .UseDynamicRendering = false,
 #ifdef IMGUI_IMPL_VULKAN_HAS_DYNAMIC_RENDERING
@@ -786,7 +973,11 @@ void init_imgui(Vulkan_context &context)
 
 void recreate_swapchain(Vulkan_context &context)
 {
-    context.device->waitIdle();
+    {
+        // Waiting for the device accesses all of its queues
+        const std::lock_guard lock(*context.queue_mutex);
+        context.device->waitIdle();
+    }
 
     context.framebuffers.clear();
     context.swapchain_image_views.clear();
@@ -915,6 +1106,31 @@ create_buffer(VmaAllocator allocator,
     return buffer;
 }
 
+[[nodiscard]] vk::UniqueSemaphore create_timeline_semaphore(vk::Device device)
+{
+    const vk::StructureChain create_info_chain {
+        vk::SemaphoreCreateInfo {},
+        vk::SemaphoreTypeCreateInfo {.semaphoreType =
+                                         vk::SemaphoreType::eTimeline,
+                                     .initialValue = 0}};
+
+    return device.createSemaphoreUnique(
+        create_info_chain.get<vk::SemaphoreCreateInfo>());
+}
+
+void wait_for_timeline_semaphore(vk::Device device,
+                                 vk::Semaphore semaphore,
+                                 std::uint64_t value)
+{
+    const vk::SemaphoreWaitInfo wait_info {.semaphoreCount = 1,
+                                           .pSemaphores = &semaphore,
+                                           .pValues = &value};
+
+    const auto result = device.waitSemaphores(
+        wait_info, std::numeric_limits<std::uint64_t>::max());
+    vk::detail::resultCheck(result, "vk::Device::waitSemaphores");
+}
+
 [[nodiscard]] vk::UniqueCommandBuffer
 begin_one_time_submit_command_buffer(const Vulkan_context &context)
 {
@@ -949,252 +1165,898 @@ void end_one_time_submit_command_buffer(
     context.graphics_compute_queue.waitIdle();
 }
 
-[[nodiscard]] Vulkan_buffer
-create_buffer_from_host_data(const Vulkan_context &context,
-                             vk::BufferUsageFlags usage,
-                             VmaMemoryUsage memory_usage,
-                             const void *data,
-                             std::size_t size)
+constexpr vk::DeviceSize staging_ring_size {32 * 1024 * 1024};
+
+// Offset alignment of the data in the ring, which is enough for copies to
+// images with texels of up to 16 bytes
+constexpr vk::DeviceSize staging_alignment {16};
+
+// Uploads are split in chunks of at most this size, so that a chunk can be
+// written while the previous one is being copied
+constexpr vk::DeviceSize max_staging_chunk_size {staging_ring_size / 4};
+
+[[nodiscard]] Upload_manager
+create_upload_manager(const Vulkan_context &context)
 {
-    // TODO: is this ever called with memory_usage other than
-    // VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE ? If it isn't, we should probably
-    // remove that parameter. If it is, then we can probably remove the staging
-    // buffer when the buffer is created in CPU memory anyways.
+    Upload_manager upload_manager {};
 
     VmaAllocationInfo staging_allocation_info {};
-    const auto staging_buffer =
+    upload_manager.staging_buffer =
         create_buffer(context.allocator.get(),
                       context.device.get(),
-                      size,
+                      staging_ring_size,
                       vk::BufferUsageFlagBits::eTransferSrc,
                       VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
                           VMA_ALLOCATION_CREATE_MAPPED_BIT,
                       VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
                       &staging_allocation_info);
-
-    auto *const mapped_data =
+    upload_manager.staging_data =
         static_cast<std::uint8_t *>(staging_allocation_info.pMappedData);
 
-    std::memcpy(mapped_data, data, size);
+    upload_manager.semaphore = create_timeline_semaphore(context.device.get());
 
-    auto buffer = create_buffer(context.allocator.get(),
-                                context.device.get(),
-                                size,
-                                usage,
-                                {},
-                                memory_usage,
-                                nullptr);
+    return upload_manager;
+}
 
-    const auto command_buffer = begin_one_time_submit_command_buffer(context);
+// Commands recorded here are submitted with the pending copies, after them
+[[nodiscard]] vk::CommandBuffer
+get_upload_command_buffer(Vulkan_context &context)
+{
+    auto &upload_manager = context.upload_manager;
+    if (!upload_manager.command_buffer)
+    {
+        upload_manager.command_buffer =
+            begin_one_time_submit_command_buffer(context);
+    }
+    return upload_manager.command_buffer.get();
+}
 
-    const vk::BufferCopy region {.srcOffset = 0, .dstOffset = 0, .size = size};
+// The buffer is destroyed once the commands recorded so far have completed
+void keep_until_uploaded(Vulkan_context &context, Vulkan_buffer buffer)
+{
+    context.upload_manager.batch_buffers.push_back(std::move(buffer));
+}
 
-    command_buffer->copyBuffer(
-        staging_buffer.buffer.get(), buffer.buffer.get(), {region});
+void submit_uploads(Vulkan_context &context)
+{
+    auto &upload_manager = context.upload_manager;
+    if (!upload_manager.command_buffer)
+    {
+        return;
+    }
 
-    end_one_time_submit_command_buffer(context, command_buffer);
+    // Later submissions, on any queue, only synchronize with this one through
+    // the semaphore, which does not make the writes visible by itself
+    constexpr vk::MemoryBarrier barrier {
+        .srcAccessMask = vk::AccessFlagBits::eTransferWrite |
+                         vk::AccessFlagBits::eAccelerationStructureWriteKHR,
+        .dstAccessMask = vk::AccessFlagBits::eMemoryRead};
+
+    upload_manager.command_buffer->pipelineBarrier(
+        vk::PipelineStageFlagBits::eTransfer |
+            vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+        vk::PipelineStageFlagBits::eAllCommands,
+        {},
+        {barrier},
+        {},
+        {});
 
-    return buffer;
+    upload_manager.command_buffer->end();
+
+    ++upload_manager.submitted_value;
+    const vk::TimelineSemaphoreSubmitInfo timeline_submit_info {
+        .signalSemaphoreValueCount = 1,
+        .pSignalSemaphoreValues = &upload_manager.submitted_value};
+    const vk::SubmitInfo submit_info {
+        .pNext = &timeline_submit_info,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &upload_manager.command_buffer.get(),
+        .signalSemaphoreCount = 1,
+        .pSignalSemaphores = &upload_manager.semaphore.get()};
+    {
+        const std::lock_guard lock(*context.queue_mutex);
+        context.graphics_compute_queue.submit({submit_info});
+    }
+
+    upload_manager.submissions.push_back(
+        {.command_buffer = std::move(upload_manager.command_buffer),
+         .timeline_value = upload_manager.submitted_value,
+         .ring_end = upload_manager.head,
+         .buffers = std::move(upload_manager.batch_buffers)});
+    upload_manager.batch_buffers.clear();
+    ++upload_manager.submission_count;
 }
 
-[[nodiscard]] Vulkan_buffer create_vertex_or_index_buffer(
-    const Vulkan_context &context, const void *data, std::size_t size)
+// Waits for the oldest submission in flight and releases what it used
+void retire_oldest_upload(const Vulkan_context &context,
+                          Upload_manager &upload_manager)
 {
-    return create_buffer_from_host_data(
-        context,
-        vk::BufferUsageFlagBits::eStorageBuffer |
-            vk::BufferUsageFlagBits::eTransferDst |
-            vk::BufferUsageFlagBits::eShaderDeviceAddress |
-            vk::BufferUsageFlagBits::
-                eAccelerationStructureBuildInputReadOnlyKHR,
-        VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
-        data,
-        size);
+    const auto &submission = upload_manager.submissions.front();
+    wait_for_timeline_semaphore(context.device.get(),
+                                upload_manager.semaphore.get(),
+                                submission.timeline_value);
+    upload_manager.tail = submission.ring_end;
+    upload_manager.submissions.pop_front();
 }
 
-[[nodiscard]] Vulkan_buffer create_storage_buffer(const Vulkan_context &context,
-                                                  const void *data,
-                                                  std::size_t size)
+// Submits the pending commands and waits for all submissions
+void wait_for_uploads(Vulkan_context &context)
 {
-    return create_buffer_from_host_data(
-        context,
-        vk::BufferUsageFlagBits::eStorageBuffer |
-            vk::BufferUsageFlagBits::eTransferDst,
-        VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
-        data,
-        size);
+    submit_uploads(context);
+    while (!context.upload_manager.submissions.empty())
+    {
+        retire_oldest_upload(context, context.upload_manager);
+    }
 }
 
-[[nodiscard]] vk::DeviceAddress get_device_address(vk::Device device,
-                                                   vk::Buffer buffer) noexcept
+// Returns the offset in the staging buffer of size contiguous free bytes.
+// Waits for the oldest submissions if the ring is full, after submitting the
+// batch being recorded if it is the only one reading from the ring.
+[[nodiscard]] vk::DeviceSize allocate_staging(Vulkan_context &context,
+                                              vk::DeviceSize size)
 {
-    const vk::BufferDeviceAddressInfo address_info {.buffer = buffer};
-    return device.getBufferAddress(address_info);
+    auto &upload_manager = context.upload_manager;
+    const auto capacity = upload_manager.staging_buffer.size;
+    assert(size <= capacity);
+
+    auto position = align_up(upload_manager.head, staging_alignment);
+    if (position % capacity + size > capacity)
+    {
+        // The end of the ring is left unused
+        position += capacity - position % capacity;
+    }
+
+    while (position + size - upload_manager.tail > capacity)
+    {
+        if (upload_manager.submissions.empty())
+        {
+            submit_uploads(context);
+        }
+        if (upload_manager.submissions.empty())
+        {
+            // Nothing reads from the ring
+            upload_manager.tail = position;
+            break;
+        }
+        retire_oldest_upload(context, upload_manager);
+    }
+
+    upload_manager.head = position + size;
+    return position % capacity;
 }
 
-[[nodiscard]] vk::DeviceAddress
-get_device_address(vk::Device device,
-                   vk::AccelerationStructureKHR acceleration_structure) noexcept
+// Returns the offset of the copy in the staging buffer
+[[nodiscard]] vk::DeviceSize write_to_staging(Vulkan_context &context,
+                                              const void *data,
+                                              vk::DeviceSize size)
 {
-    const vk::AccelerationStructureDeviceAddressInfoKHR address_info {
-        .accelerationStructure = acceleration_structure};
-    return device.getAccelerationStructureAddressKHR(address_info);
+    auto &upload_manager = context.upload_manager;
+    const auto offset = allocate_staging(context, size);
+    std::memcpy(upload_manager.staging_data + offset, data, size);
+
+    // Does nothing if the memory is host coherent
+    const auto result =
+        vmaFlushAllocation(context.allocator.get(),
+                           upload_manager.staging_buffer.allocation.get(),
+                           offset,
+                           size);
+    vk::detail::resultCheck(vk::Result {result}, "vmaFlushAllocation");
+
+    upload_manager.uploaded_size += size;
+    return offset;
 }
 
-void create_blas(const Vulkan_context &context,
-                 Vulkan_render_resources &render_resources)
+void upload_to_buffer(Vulkan_context &context,
+                      vk::Buffer buffer,
+                      vk::DeviceSize buffer_offset,
+                      const void *data,
+                      vk::DeviceSize size)
 {
-    const auto vertex_buffer_address = get_device_address(
-        context.device.get(), render_resources.vertex_buffer.buffer.get());
-    constexpr auto vertex_size = 3 * sizeof(float);
-    const auto vertex_count = render_resources.vertex_buffer.size / vertex_size;
+    const auto *const bytes = static_cast<const std::uint8_t *>(data);
+    for (vk::DeviceSize offset {0}; offset < size;)
+    {
+        const auto chunk_size = std::min(size - offset, max_staging_chunk_size);
+        const auto staging_offset =
+            write_to_staging(context, bytes + offset, chunk_size);
 
-    const auto index_buffer_address = get_device_address(
-        context.device.get(), render_resources.index_buffer.buffer.get());
-    const auto index_count =
-        render_resources.index_buffer.size / sizeof(std::uint32_t);
-    const auto primitive_count = index_count / 3;
-
-    const vk::AccelerationStructureGeometryTrianglesDataKHR triangles {
-        .vertexFormat = vk::Format::eR32G32B32Sfloat,
-        .vertexData = {.deviceAddress = vertex_buffer_address},
-        .vertexStride = vertex_size,
-        .maxVertex = static_cast<std::uint32_t>(vertex_count - 1),
-        .indexType = vk::IndexType::eUint32,
-        .indexData = {.deviceAddress = index_buffer_address},
-        .transformData = {}};
+        const vk::BufferCopy region {.srcOffset = staging_offset,
+                                     .dstOffset = buffer_offset + offset,
+                                     .size = chunk_size};
 
-    const vk::AccelerationStructureGeometryKHR geometry {
-        .geometryType = vk::GeometryTypeKHR::eTriangles,
-        .geometry = {.triangles = triangles},
-        .flags = vk::GeometryFlagBitsKHR::eOpaque};
+        get_upload_command_buffer(context).copyBuffer(
+            context.upload_manager.staging_buffer.buffer.get(),
+            buffer,
+            {region});
 
-    const vk::AccelerationStructureBuildRangeInfoKHR build_range_info {
-        .primitiveCount = static_cast<std::uint32_t>(primitive_count),
-        .primitiveOffset = 0,
-        .firstVertex = 0,
-        .transformOffset = 0};
+        offset += chunk_size;
+    }
+}
 
-    vk::AccelerationStructureBuildGeometryInfoKHR build_geometry_info {
-        .type = vk::AccelerationStructureTypeKHR::eBottomLevel,
-        .flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace,
-        .mode = vk::BuildAccelerationStructureModeKHR::eBuild,
-        .srcAccelerationStructure = {},
-        .dstAccelerationStructure = {},
-        .geometryCount = 1,
-        .pGeometries = &geometry,
-        .ppGeometries = {},
-        .scratchData = {}};
+// Copies tightly packed rows of texels to the image, which ends up in the
+// shader read-only layout for the ray tracing shaders
+void upload_to_image(Vulkan_context &context,
+                     const Vulkan_image &image,
+                     const void *data,
+                     std::uint32_t texel_size)
+{
+    constexpr vk::ImageSubresourceRange subresource_range {
+        .aspectMask = vk::ImageAspectFlagBits::eColor,
+        .baseMipLevel = 0,
+        .levelCount = 1,
+        .baseArrayLayer = 0,
+        .layerCount = 1};
 
-    const auto build_sizes_info =
-        context.device->getAccelerationStructureBuildSizesKHR(
-            vk::AccelerationStructureBuildTypeKHR::eDevice,
-            build_geometry_info,
-            {build_range_info.primitiveCount});
+    vk::ImageMemoryBarrier image_memory_barrier {
+        .srcAccessMask = vk::AccessFlagBits::eNone,
+        .dstAccessMask = vk::AccessFlagBits::eTransferWrite,
+        .oldLayout = vk::ImageLayout::eUndefined,
+        .newLayout = vk::ImageLayout::eTransferDstOptimal,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = image.image.get(),
+        .subresourceRange = subresource_range};
 
-    render_resources.blas_buffer = create_buffer(
-        context.allocator.get(),
-        context.device.get(),
-        build_sizes_info.accelerationStructureSize,
-        vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR |
-            vk::BufferUsageFlagBits::eShaderDeviceAddress,
+    get_upload_command_buffer(context).pipelineBarrier(
+        vk::PipelineStageFlagBits::eTopOfPipe,
+        vk::PipelineStageFlagBits::eTransfer,
         {},
-        VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
-        nullptr);
+        {},
+        {},
+        {image_memory_barrier});
 
-    const vk::AccelerationStructureCreateInfoKHR
-        acceleration_structure_create_info {
-            .createFlags = {},
-            .buffer = render_resources.blas_buffer.buffer.get(),
-            .offset = {},
-            .size = build_sizes_info.accelerationStructureSize,
-            .type = vk::AccelerationStructureTypeKHR::eBottomLevel,
-            .deviceAddress = {}};
+    // Copied in chunks of whole rows
+    const vk::DeviceSize row_size {static_cast<vk::DeviceSize>(image.width) *
+                                   texel_size};
+    if (row_size > max_staging_chunk_size)
+    {
+        throw std::runtime_error("Image too wide for the staging buffer");
+    }
+    const auto max_chunk_rows =
+        static_cast<std::uint32_t>(max_staging_chunk_size / row_size);
 
-    render_resources.blas =
-        context.device->createAccelerationStructureKHRUnique(
-            acceleration_structure_create_info);
+    constexpr vk::ImageSubresourceLayers subresource_layers {
+        .aspectMask = vk::ImageAspectFlagBits::eColor,
+        .mipLevel = 0,
+        .baseArrayLayer = 0,
+        .layerCount = 1};
 
-    const auto scratch_buffer =
-        create_buffer(context.allocator.get(),
-                      context.device.get(),
-                      build_sizes_info.buildScratchSize,
-                      vk::BufferUsageFlagBits::eStorageBuffer |
-                          vk::BufferUsageFlagBits::eShaderDeviceAddress,
-                      {},
-                      VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
-                      nullptr);
+    const auto *const bytes = static_cast<const std::uint8_t *>(data);
+    for (std::uint32_t y {0}; y < image.height;)
+    {
+        const auto rows = std::min(image.height - y, max_chunk_rows);
+        const auto staging_offset =
+            write_to_staging(context, bytes + y * row_size, rows * row_size);
 
-    const auto scratch_buffer_address =
-        get_device_address(context.device.get(), scratch_buffer.buffer.get());
+        const vk::BufferImageCopy copy_region {
+            .bufferOffset = staging_offset,
+            .bufferRowLength = {},
+            .bufferImageHeight = {},
+            .imageSubresource = subresource_layers,
+            .imageOffset = {0, static_cast<std::int32_t>(y), 0},
+            .imageExtent = {image.width, rows, 1}};
 
-    build_geometry_info.dstAccelerationStructure = render_resources.blas.get();
-    build_geometry_info.scratchData.deviceAddress = scratch_buffer_address;
+        get_upload_command_buffer(context).copyBufferToImage(
+            context.upload_manager.staging_buffer.buffer.get(),
+            image.image.get(),
+            vk::ImageLayout::eTransferDstOptimal,
+            {copy_region});
 
-    const auto command_buffer = begin_one_time_submit_command_buffer(context);
+        y += rows;
+    }
 
-    const auto *const p_build_range_info = &build_range_info;
+    image_memory_barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+    image_memory_barrier.dstAccessMask = vk::AccessFlagBits::eShaderRead;
+    image_memory_barrier.oldLayout = vk::ImageLayout::eTransferDstOptimal;
+    image_memory_barrier.newLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
+
+    get_upload_command_buffer(context).pipelineBarrier(
+        vk::PipelineStageFlagBits::eTransfer,
+        vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+        {},
+        {},
+        {},
+        {image_memory_barrier});
+}
 
-    command_buffer->buildAccelerationStructuresKHR(
-        1, &build_geometry_info, &p_build_range_info);
+// The buffer can be the destination of uploads
+[[nodiscard]] Vulkan_buffer create_device_buffer(const Vulkan_context &context,
+                                                 vk::BufferUsageFlags usage,
+                                                 std::size_t size)
+{
+    return create_buffer(context.allocator.get(),
+                         context.device.get(),
+                         size,
+                         usage | vk::BufferUsageFlagBits::eTransferDst,
+                         {},
+                         VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
+                         nullptr);
+}
 
-    end_one_time_submit_command_buffer(context, command_buffer);
+// The copy is only recorded, see Upload_manager
+[[nodiscard]] Vulkan_buffer
+create_buffer_from_host_data(Vulkan_context &context,
+                             vk::BufferUsageFlags usage,
+                             const void *data,
+                             std::size_t size)
+{
+    auto buffer = create_device_buffer(context, usage, size);
+    upload_to_buffer(context, buffer.buffer.get(), 0, data, size);
+    return buffer;
 }
 
-void create_tlas(const Vulkan_context &context,
-                 Vulkan_render_resources &render_resources)
+// Where the data of a mesh starts in the buffers shared by all meshes, with
+// the layout of Mesh_info in the closest hit shaders. The indices are
+// relative to the first vertex of the mesh.
+struct Gpu_mesh
 {
-    const std::vector<vk::TransformMatrixKHR> transforms {
-        {std::array {std::array {1.0f, 0.0f, 0.0f, -1.0f},
-                     std::array {0.0f, 1.0f, 0.0f, 0.0f},
-                     std::array {0.0f, 0.0f, 1.0f, 0.0f}}},
-        {std::array {std::array {0.7f, 0.0f, 0.0f, 1.0f},
-                     std::array {0.0f, 0.7f, 0.0f, 0.0f},
-                     std::array {0.0f, 0.0f, 0.7f, 0.0f}}},
-        {std::array {std::array {0.2f, 0.0f, 0.0f, 0.0f},
-                     std::array {0.0f, 0.2f, 0.0f, 0.0f},
-                     std::array {0.0f, 0.0f, 0.2f, 0.0f}}},
-        {std::array {std::array {0.8f, 0.0f, 0.0f, 0.0f},
-                     std::array {0.0f, 0.8f, 0.0f, 0.0f},
-                     std::array {0.0f, 0.0f, 0.8f, 0.8f}}}};
+    std::uint32_t first_index;
+    std::uint32_t first_vertex;
+};
 
-    std::vector<vk::AccelerationStructureInstanceKHR> instances;
-    instances.reserve(transforms.size());
-    for (std::uint32_t i {0}; i < static_cast<std::uint32_t>(transforms.size());
-         ++i)
+struct Blas_instance
+{
+    mat3x4 transform;
+    std::uint32_t blas_index;
+    Material material;
+};
+
+// How the meshes of the scene are grouped into BLASes. A mesh referenced by
+// several instances gets its own BLAS, shared by all of them. The meshes that
+// are referenced by a single instance are packed as separate geometries of one
+// BLAS with the other such meshes that have the same transform and material,
+// which is instanced once. Scenes made of thousands of small parts placed
+// under a few nodes then need a few BLASes and TLAS instances instead of
+// thousands, and the builder can separate their triangles instead of the
+// TLAS traversal having to test overlapping instances.
+struct Blas_layout
+{
+    // Geometry i of BLAS b is mesh geometry_meshes[first_geometries[b] + i].
+    // first_geometries has one more element than there are BLASes.
+    std::vector<std::uint32_t> first_geometries;
+    std::vector<std::uint32_t> geometry_meshes;
+    std::vector<Blas_instance> instances;
+};
+
+[[nodiscard]] Blas_layout create_blas_layout(const Scene &scene)
+{
+    std::vector<std::uint32_t> reference_counts(scene.meshes.size());
+    for (const auto &instance : scene.instances)
     {
-        instances.push_back(
-            {.transform = transforms[i],
-             .instanceCustomIndex = 0,
-             .mask = 0xFF,
-             .instanceShaderBindingTableRecordOffset = (i % 4) & 0xffffff,
-             .flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR,
-             .accelerationStructureReference = get_device_address(
-                 context.device.get(), render_resources.blas.get())});
+        ++reference_counts[instance.mesh_index];
     }
 
-    const auto instance_buffer = create_buffer_from_host_data(
-        context,
-        vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR |
-            vk::BufferUsageFlagBits::eShaderDeviceAddress |
-            vk::BufferUsageFlagBits::eTransferDst,
-        VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
-        instances.data(),
-        instances.size() * sizeof(vk::AccelerationStructureInstanceKHR));
-
-    const auto command_buffer = begin_one_time_submit_command_buffer(context);
+    constexpr std::uint32_t no_blas {0xffffffff};
+    std::vector<std::vector<std::uint32_t>> blas_meshes;
+    std::vector<std::uint32_t> shared_blas_indices(scene.meshes.size(),
+                                                   no_blas);
+    using Packing_key = std::pair<std::array<float, 12>, Material>;
+    std::map<Packing_key, std::uint32_t> packed_blas_indices;
 
-    constexpr vk::MemoryBarrier barrier {
-        .srcAccessMask = vk::AccessFlagBits::eTransferWrite,
-        .dstAccessMask = vk::AccessFlagBits::eAccelerationStructureReadKHR};
+    Blas_layout layout {};
+    layout.instances.reserve(scene.instances.size());
+    for (const auto &instance : scene.instances)
+    {
+        const auto new_blas_index =
+            static_cast<std::uint32_t>(blas_meshes.size());
 
-    command_buffer->pipelineBarrier(
-        vk::PipelineStageFlagBits::eTransfer,
-        vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
-        {},
-        {barrier},
-        {},
-        {});
+        if (reference_counts[instance.mesh_index] > 1)
+        {
+            auto &blas_index = shared_blas_indices[instance.mesh_index];
+            if (blas_index == no_blas)
+            {
+                blas_index = new_blas_index;
+                blas_meshes.push_back({instance.mesh_index});
+            }
+            layout.instances.push_back({.transform = instance.transform,
+                                        .blas_index = blas_index,
+                                        .material = instance.material});
+            continue;
+        }
+
+        Packing_key key {{}, instance.material};
+        std::memcpy(key.first.data(), &instance.transform, sizeof(key.first));
+        const auto [it, inserted] =
+            packed_blas_indices.try_emplace(key, new_blas_index);
+        if (inserted)
+        {
+            blas_meshes.emplace_back();
+            layout.instances.push_back({.transform = instance.transform,
+                                        .blas_index = new_blas_index,
+                                        .material = instance.material});
+        }
+        blas_meshes[it->second].push_back(instance.mesh_index);
+    }
+
+    layout.first_geometries.reserve(blas_meshes.size() + 1);
+    for (const auto &meshes : blas_meshes)
+    {
+        layout.first_geometries.push_back(
+            static_cast<std::uint32_t>(layout.geometry_meshes.size()));
+        layout.geometry_meshes.insert(
+            layout.geometry_meshes.end(), meshes.begin(), meshes.end());
+    }
+    layout.first_geometries.push_back(
+        static_cast<std::uint32_t>(layout.geometry_meshes.size()));
+
+    return layout;
+}
+
+// The vertices, indices and normals of all meshes are concatenated in one
+// buffer each, so that the closest hit shaders only need the offsets of the
+// mesh that was hit. These are in the mesh buffer, in the order of the
+// geometries of the BLASes, so that the entry of a geometry is at the custom
+// index of the instance plus the index of the geometry. Returns the offsets of
+// each mesh.
+[[nodiscard]] std::vector<Gpu_mesh>
+create_mesh_buffers(Vulkan_context &context,
+                    Vulkan_render_resources &render_resources,
+                    const Scene &scene,
+                    const Blas_layout &blas_layout)
+{
+    std::vector<Gpu_mesh> gpu_meshes;
+    gpu_meshes.reserve(scene.meshes.size());
+    std::size_t vertex_count {0};
+    std::size_t index_count {0};
+    for (const auto &mesh : scene.meshes)
+    {
+        gpu_meshes.push_back(
+            {.first_index = static_cast<std::uint32_t>(index_count),
+             .first_vertex = static_cast<std::uint32_t>(vertex_count)});
+        vertex_count += mesh.vertices.size();
+        index_count += mesh.indices.size();
+    }
+    if (vertex_count > std::numeric_limits<std::uint32_t>::max() ||
+        index_count > std::numeric_limits<std::uint32_t>::max())
+    {
+        throw std::runtime_error("Too many vertices or indices in the scene");
+    }
+
+    constexpr auto geometry_usage =
+        vk::BufferUsageFlagBits::eStorageBuffer |
+        vk::BufferUsageFlagBits::eShaderDeviceAddress |
+        vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR;
+    render_resources.vertex_buffer = create_device_buffer(
+        context, geometry_usage, vertex_count * sizeof(vec3));
+    render_resources.index_buffer = create_device_buffer(
+        context, geometry_usage, index_count * sizeof(std::uint32_t));
+    render_resources.normal_buffer =
+        create_device_buffer(context,
+                             vk::BufferUsageFlagBits::eStorageBuffer,
+                             vertex_count * sizeof(vec3));
+
+    for (std::size_t i {0}; i < scene.meshes.size(); ++i)
+    {
+        const auto &mesh = scene.meshes[i];
+        const auto &gpu_mesh = gpu_meshes[i];
+        upload_to_buffer(context,
+                         render_resources.vertex_buffer.buffer.get(),
+                         gpu_mesh.first_vertex * sizeof(vec3),
+                         mesh.vertices.data(),
+                         mesh.vertices.size() * sizeof(vec3));
+        upload_to_buffer(context,
+                         render_resources.index_buffer.buffer.get(),
+                         gpu_mesh.first_index * sizeof(std::uint32_t),
+                         mesh.indices.data(),
+                         mesh.indices.size() * sizeof(std::uint32_t));
+        upload_to_buffer(context,
+                         render_resources.normal_buffer.buffer.get(),
+                         gpu_mesh.first_vertex * sizeof(vec3),
+                         mesh.normals.data(),
+                         mesh.normals.size() * sizeof(vec3));
+    }
+
+    std::vector<Gpu_mesh> geometry_gpu_meshes;
+    geometry_gpu_meshes.reserve(blas_layout.geometry_meshes.size());
+    for (const auto mesh_index : blas_layout.geometry_meshes)
+    {
+        geometry_gpu_meshes.push_back(gpu_meshes[mesh_index]);
+    }
+    render_resources.mesh_buffer = create_buffer_from_host_data(
+        context,
+        vk::BufferUsageFlagBits::eStorageBuffer,
+        geometry_gpu_meshes.data(),
+        geometry_gpu_meshes.size() * sizeof(Gpu_mesh));
+
+    return gpu_meshes;
+}
+
+[[nodiscard]] vk::DeviceAddress get_device_address(vk::Device device,
+                                                   vk::Buffer buffer) noexcept
+{
+    const vk::BufferDeviceAddressInfo address_info {.buffer = buffer};
+    return device.getBufferAddress(address_info);
+}
+
+[[nodiscard]] vk::DeviceAddress
+get_device_address(vk::Device device,
+                   vk::AccelerationStructureKHR acceleration_structure) noexcept
+{
+    const vk::AccelerationStructureDeviceAddressInfoKHR address_info {
+        .accelerationStructure = acceleration_structure};
+    return device.getAccelerationStructureAddressKHR(address_info);
+}
+
+// Scratch memory of the BLAS builds recorded in a single command. Builds that
+// do not fit are recorded in the next command, after a barrier, reusing the
+// same scratch buffer.
+constexpr vk::DeviceSize blas_scratch_budget {256 * 1024 * 1024};
+
+// Statistics of create_blases()
+struct Blas_build_info
+{
+    std::uint32_t build_command_count;
+    vk::DeviceSize scratch_size;
+};
+
+// Records the builds of all BLASes in as few commands as the scratch budget
+// allows. The compacted size of BLAS i is written to query i of
+// compacted_size_query_pool when the builds complete. If timestamp_query_pool
+// is not null, the times of the start and end of the builds are written to
+// its first two queries.
+[[nodiscard]] Blas_build_info
+create_blases(Vulkan_context &context,
+              Vulkan_render_resources &render_resources,
+              const Scene &scene,
+              const Blas_layout &blas_layout,
+              std::span<const Gpu_mesh> gpu_meshes,
+              vk::QueryPool compacted_size_query_pool,
+              vk::QueryPool timestamp_query_pool)
+{
+    const auto vertex_buffer_address = get_device_address(
+        context.device.get(), render_resources.vertex_buffer.buffer.get());
+    const auto index_buffer_address = get_device_address(
+        context.device.get(), render_resources.index_buffer.buffer.get());
+
+    const auto blas_count =
+        static_cast<std::uint32_t>(blas_layout.first_geometries.size() - 1);
+    const auto geometry_count = blas_layout.geometry_meshes.size();
+    render_resources.blas_buffers.resize(blas_count);
+    render_resources.blases.resize(blas_count);
+
+    std::vector<vk::AccelerationStructureGeometryKHR> geometries;
+    std::vector<vk::AccelerationStructureBuildRangeInfoKHR> build_ranges;
+    std::vector<std::uint32_t> primitive_counts;
+    geometries.reserve(geometry_count);
+    build_ranges.reserve(geometry_count);
+    primitive_counts.reserve(geometry_count);
+    for (const auto mesh_index : blas_layout.geometry_meshes)
+    {
+        const auto &mesh = scene.meshes[mesh_index];
+        const auto &gpu_mesh = gpu_meshes[mesh_index];
+
+        const auto vertex_address =
+            vertex_buffer_address + gpu_mesh.first_vertex * sizeof(vec3);
+        const auto index_address =
+            index_buffer_address + gpu_mesh.first_index * sizeof(std::uint32_t);
+
+        const vk::AccelerationStructureGeometryTrianglesDataKHR triangles {
+            .vertexFormat = vk::Format::eR32G32B32Sfloat,
+            .vertexData = {.deviceAddress = vertex_address},
+            .vertexStride = sizeof(vec3),
+            .maxVertex = static_cast<std::uint32_t>(mesh.vertices.size() - 1),
+            .indexType = vk::IndexType::eUint32,
+            .indexData = {.deviceAddress = index_address},
+            .transformData = {}};
+
+        geometries.push_back({.geometryType = vk::GeometryTypeKHR::eTriangles,
+                              .geometry = {.triangles = triangles},
+                              .flags = vk::GeometryFlagBitsKHR::eOpaque});
+
+        const auto primitive_count =
+            static_cast<std::uint32_t>(mesh.indices.size() / 3);
+        primitive_counts.push_back(primitive_count);
+        build_ranges.push_back({.primitiveCount = primitive_count,
+                                .primitiveOffset = 0,
+                                .firstVertex = 0,
+                                .transformOffset = 0});
+    }
+
+    const vk::DeviceSize scratch_alignment {
+        context.physical_device_acceleration_structure_properties
+            .minAccelerationStructureScratchOffsetAlignment};
+
+    std::vector<vk::AccelerationStructureBuildGeometryInfoKHR> build_infos(
+        blas_count);
+    std::vector<const vk::AccelerationStructureBuildRangeInfoKHR *>
+        p_build_ranges(blas_count);
+    std::vector<vk::DeviceSize> scratch_offsets(blas_count);
+    // Index of the first BLAS of each build command, and the end of the last
+    std::vector<std::uint32_t> command_firsts {0};
+    vk::DeviceSize command_scratch_size {0};
+    vk::DeviceSize scratch_size {0};
+
+    for (std::uint32_t i {0}; i < blas_count; ++i)
+    {
+        const auto first_geometry = blas_layout.first_geometries[i];
+        const auto blas_geometry_count =
+            blas_layout.first_geometries[i + 1] - first_geometry;
+
+        auto &build_info = build_infos[i];
+        build_info = {
+            .type = vk::AccelerationStructureTypeKHR::eBottomLevel,
+            .flags =
+                vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace |
+                vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction,
+            .mode = vk::BuildAccelerationStructureModeKHR::eBuild,
+            .srcAccelerationStructure = {},
+            .dstAccelerationStructure = {},
+            .geometryCount = blas_geometry_count,
+            .pGeometries = &geometries[first_geometry],
+            .ppGeometries = {},
+            .scratchData = {}};
+        p_build_ranges[i] = &build_ranges[first_geometry];
+
+        const auto build_sizes_info =
+            context.device->getAccelerationStructureBuildSizesKHR(
+                vk::AccelerationStructureBuildTypeKHR::eDevice,
+                build_info,
+                vk::ArrayProxy<const std::uint32_t>(
+                    blas_geometry_count, &primitive_counts[first_geometry]));
+
+        auto &blas_buffer = render_resources.blas_buffers[i];
+        blas_buffer = create_buffer(
+            context.allocator.get(),
+            context.device.get(),
+            build_sizes_info.accelerationStructureSize,
+            vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR |
+                vk::BufferUsageFlagBits::eShaderDeviceAddress,
+            {},
+            VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
+            nullptr);
+
+        const vk::AccelerationStructureCreateInfoKHR
+            acceleration_structure_create_info {
+                .createFlags = {},
+                .buffer = blas_buffer.buffer.get(),
+                .offset = {},
+                .size = build_sizes_info.accelerationStructureSize,
+                .type = vk::AccelerationStructureTypeKHR::eBottomLevel,
+                .deviceAddress = {}};
+
+        render_resources.blases[i] =
+            context.device->createAccelerationStructureKHRUnique(
+                acceleration_structure_create_info);
+        build_info.dstAccelerationStructure = render_resources.blases[i].get();
+
+        // Builds of the same command run concurrently, so their scratch
+        // memory must not overlap
+        const auto blas_scratch_size =
+            align_up(build_sizes_info.buildScratchSize, scratch_alignment);
+        if (command_scratch_size > 0 &&
+            command_scratch_size + blas_scratch_size > blas_scratch_budget)
+        {
+            command_firsts.push_back(i);
+            command_scratch_size = 0;
+        }
+        scratch_offsets[i] = command_scratch_size;
+        command_scratch_size += blas_scratch_size;
+        scratch_size = std::max(scratch_size, command_scratch_size);
+    }
+    command_firsts.push_back(blas_count);
+
+    // The allocation is not necessarily aligned enough for scratch memory
+    auto scratch_buffer =
+        create_buffer(context.allocator.get(),
+                      context.device.get(),
+                      scratch_size + scratch_alignment,
+                      vk::BufferUsageFlagBits::eStorageBuffer |
+                          vk::BufferUsageFlagBits::eShaderDeviceAddress,
+                      {},
+                      VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
+                      nullptr);
+    const auto scratch_address = align_up(
+        get_device_address(context.device.get(), scratch_buffer.buffer.get()),
+        scratch_alignment);
+    for (std::uint32_t i {0}; i < blas_count; ++i)
+    {
+        build_infos[i].scratchData.deviceAddress =
+            scratch_address + scratch_offsets[i];
+    }
+
+    const auto command_buffer = get_upload_command_buffer(context);
+
+    // The vertex and index buffers are copied in the same batch
+    constexpr vk::MemoryBarrier input_barrier {
+        .srcAccessMask = vk::AccessFlagBits::eTransferWrite,
+        .dstAccessMask = vk::AccessFlagBits::eAccelerationStructureReadKHR};
+
+    command_buffer.pipelineBarrier(
+        vk::PipelineStageFlagBits::eTransfer,
+        vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+        {},
+        {input_barrier},
+        {},
+        {});
+
+    if (timestamp_query_pool)
+    {
+        command_buffer.resetQueryPool(timestamp_query_pool, 0, 2);
+        command_buffer.writeTimestamp(
+            vk::PipelineStageFlagBits::eTopOfPipe, timestamp_query_pool, 0);
+    }
+
+    // Orders the reuse of the scratch memory, and the size queries, after the
+    // previous builds
+    constexpr vk::MemoryBarrier build_barrier {
+        .srcAccessMask = vk::AccessFlagBits::eAccelerationStructureWriteKHR,
+        .dstAccessMask = vk::AccessFlagBits::eAccelerationStructureReadKHR |
+                         vk::AccessFlagBits::eAccelerationStructureWriteKHR};
+
+    for (std::size_t c {0}; c + 1 < command_firsts.size(); ++c)
+    {
+        if (c > 0)
+        {
+            command_buffer.pipelineBarrier(
+                vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                {},
+                {build_barrier},
+                {},
+                {});
+        }
+        const auto first = command_firsts[c];
+        command_buffer.buildAccelerationStructuresKHR(
+            command_firsts[c + 1] - first,
+            &build_infos[first],
+            &p_build_ranges[first]);
+    }
+
+    if (timestamp_query_pool)
+    {
+        command_buffer.writeTimestamp(
+            vk::PipelineStageFlagBits::eBottomOfPipe, timestamp_query_pool, 1);
+    }
+
+    keep_until_uploaded(context, std::move(scratch_buffer));
+
+    command_buffer.pipelineBarrier(
+        vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+        vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+        {},
+        {build_barrier},
+        {},
+        {});
+
+    std::vector<vk::AccelerationStructureKHR> blases;
+    blases.reserve(blas_count);
+    for (const auto &blas : render_resources.blases)
+    {
+        blases.push_back(blas.get());
+    }
+
+    command_buffer.resetQueryPool(compacted_size_query_pool, 0, blas_count);
+    command_buffer.writeAccelerationStructuresPropertiesKHR(
+        blases,
+        vk::QueryType::eAccelerationStructureCompactedSizeKHR,
+        compacted_size_query_pool,
+        0);
+
+    return {.build_command_count =
+                static_cast<std::uint32_t>(command_firsts.size() - 1),
+            .scratch_size = scratch_size};
+}
+
+// Must be called once the builds have completed. Records a copy of each BLAS to
+// a buffer of its compacted size, which replaces it in render_resources. The
+// uncompacted BLASes are moved to uncompacted_blases and
+// uncompacted_blas_buffers, which must be kept alive until the copies have
+// completed.
+void compact_blases(
+    Vulkan_context &context,
+    Vulkan_render_resources &render_resources,
+    vk::QueryPool compacted_size_query_pool,
+    std::vector<vk::UniqueAccelerationStructureKHR> &uncompacted_blases,
+    std::vector<Vulkan_buffer> &uncompacted_blas_buffers)
+{
+    const auto blas_count = render_resources.blases.size();
+    std::vector<vk::DeviceSize> compacted_sizes(blas_count);
+    const auto result = context.device->getQueryPoolResults(
+        compacted_size_query_pool,
+        0,
+        static_cast<std::uint32_t>(blas_count),
+        compacted_sizes.size() * sizeof(vk::DeviceSize),
+        compacted_sizes.data(),
+        sizeof(vk::DeviceSize),
+        vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWait);
+    vk::detail::resultCheck(result, "vk::Device::getQueryPoolResults");
+
+    uncompacted_blases = std::move(render_resources.blases);
+    uncompacted_blas_buffers = std::move(render_resources.blas_buffers);
+    render_resources.blases.resize(blas_count);
+    render_resources.blas_buffers.resize(blas_count);
+
+    const auto command_buffer = get_upload_command_buffer(context);
+
+    for (std::size_t i {0}; i < blas_count; ++i)
+    {
+        auto &blas_buffer = render_resources.blas_buffers[i];
+        blas_buffer = create_buffer(
+            context.allocator.get(),
+            context.device.get(),
+            compacted_sizes[i],
+            vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR |
+                vk::BufferUsageFlagBits::eShaderDeviceAddress,
+            {},
+            VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
+            nullptr);
+
+        const vk::AccelerationStructureCreateInfoKHR
+            acceleration_structure_create_info {
+                .createFlags = {},
+                .buffer = blas_buffer.buffer.get(),
+                .offset = {},
+                .size = compacted_sizes[i],
+                .type = vk::AccelerationStructureTypeKHR::eBottomLevel,
+                .deviceAddress = {}};
+
+        render_resources.blases[i] =
+            context.device->createAccelerationStructureKHRUnique(
+                acceleration_structure_create_info);
+
+        const vk::CopyAccelerationStructureInfoKHR copy_info {
+            .src = uncompacted_blases[i].get(),
+            .dst = render_resources.blases[i].get(),
+            .mode = vk::CopyAccelerationStructureModeKHR::eCompact};
+
+        command_buffer.copyAccelerationStructureKHR(copy_info);
+    }
+}
+
+void create_tlas(Vulkan_context &context,
+                 Vulkan_render_resources &render_resources,
+                 const Blas_layout &blas_layout)
+{
+    std::vector<vk::DeviceAddress> blas_addresses;
+    blas_addresses.reserve(render_resources.blases.size());
+    for (const auto &blas : render_resources.blases)
+    {
+        blas_addresses.push_back(
+            get_device_address(context.device.get(), blas.get()));
+    }
+
+    std::vector<vk::AccelerationStructureInstanceKHR> instances;
+    instances.reserve(blas_layout.instances.size());
+    for (const auto &instance : blas_layout.instances)
+    {
+        vk::TransformMatrixKHR transform {};
+        std::memcpy(&transform, &instance.transform, sizeof(transform));
+        // The custom index is the entry of the first geometry of the BLAS in
+        // the mesh buffer
+        instances.push_back(
+            {.transform = transform,
+             .instanceCustomIndex =
+                 blas_layout.first_geometries[instance.blas_index] & 0xffffff,
+             .mask = 0xFF,
+             .instanceShaderBindingTableRecordOffset =
+                 static_cast<std::uint32_t>(instance.material) & 0xffffff,
+             .flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR,
+             .accelerationStructureReference =
+                 blas_addresses[instance.blas_index]});
+    }
+
+    auto instance_buffer = create_buffer_from_host_data(
+        context,
+        vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR |
+            vk::BufferUsageFlagBits::eShaderDeviceAddress,
+        instances.data(),
+        instances.size() * sizeof(vk::AccelerationStructureInstanceKHR));
+
+    const auto command_buffer = get_upload_command_buffer(context);
+
+    // The instances are copied, and the BLAS built, in the same batch
+    constexpr vk::MemoryBarrier barrier {
+        .srcAccessMask = vk::AccessFlagBits::eTransferWrite |
+                         vk::AccessFlagBits::eAccelerationStructureWriteKHR,
+        .dstAccessMask = vk::AccessFlagBits::eAccelerationStructureReadKHR};
+
+    command_buffer.pipelineBarrier(
+        vk::PipelineStageFlagBits::eTransfer |
+            vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+        vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+        {},
+        {barrier},
+        {},
+        {});
 
     const vk::AccelerationStructureGeometryInstancesDataKHR
         geometry_instances_data {
@@ -1250,7 +2112,7 @@ void create_tlas(const Vulkan_context &context,
         context.device->createAccelerationStructureKHRUnique(
             acceleration_structure_create_info);
 
-    const auto scratch_buffer =
+    auto scratch_buffer =
         create_buffer(context.allocator.get(),
                       context.device.get(),
                       build_sizes_info.buildScratchSize,
@@ -1274,10 +2136,11 @@ void create_tlas(const Vulkan_context &context,
 
     const auto *const p_build_range_info = &build_range_info;
 
-    command_buffer->buildAccelerationStructuresKHR({build_geometry_info},
-                                                   {p_build_range_info});
+    command_buffer.buildAccelerationStructuresKHR({build_geometry_info},
+                                                  {p_build_range_info});
 
-    end_one_time_submit_command_buffer(context, command_buffer);
+    keep_until_uploaded(context, std::move(instance_buffer));
+    keep_until_uploaded(context, std::move(scratch_buffer));
 }
 
 void create_descriptor_set_layout(const Vulkan_context &context,
@@ -1311,7 +2174,11 @@ void create_descriptor_set_layout(const Vulkan_context &context,
         {.binding = 6,
          .descriptorType = vk::DescriptorType::eCombinedImageSampler,
          .descriptorCount = 1,
-         .stageFlags = vk::ShaderStageFlagBits::eMissKHR}};
+         .stageFlags = vk::ShaderStageFlagBits::eMissKHR},
+        {.binding = 7,
+         .descriptorType = vk::DescriptorType::eStorageBuffer,
+         .descriptorCount = 1,
+         .stageFlags = vk::ShaderStageFlagBits::eClosestHitKHR}};
 
     const vk::DescriptorSetLayoutCreateInfo descriptor_set_layout_create_info {
         .bindingCount = static_cast<std::uint32_t>(
@@ -1380,6 +2247,11 @@ void create_descriptor_set(const Vulkan_context &context,
         .offset = 0,
         .range = render_resources.normal_buffer.size};
 
+    const vk::DescriptorBufferInfo descriptor_meshes {
+        .buffer = render_resources.mesh_buffer.buffer.get(),
+        .offset = 0,
+        .range = render_resources.mesh_buffer.size};
+
     const vk::DescriptorImageInfo descriptor_render_target {
         .sampler = VK_NULL_HANDLE,
         .imageView = render_resources.render_target_view.get(),
@@ -1433,39 +2305,56 @@ void create_descriptor_set(const Vulkan_context &context,
          .descriptorCount = 1,
          .descriptorType = vk::DescriptorType::eCombinedImageSampler,
          .pImageInfo = &descriptor_environment_map},
+        {.dstSet = render_resources.descriptor_set.get(),
+         .dstBinding = 7,
+         .dstArrayElement = 0,
+         .descriptorCount = 1,
+         .descriptorType = vk::DescriptorType::eStorageBuffer,
+         .pBufferInfo = &descriptor_meshes},
     };
 
     context.device->updateDescriptorSets({descriptor_writes}, {});
 }
 
-void create_final_render_descriptor_set(
+void create_final_render_descriptor_sets(
     const Vulkan_context &context, Vulkan_render_resources &render_resources)
 {
+    std::array<vk::DescriptorSetLayout, Vulkan_context::frames_in_flight>
+        set_layouts;
+    set_layouts.fill(
+        render_resources.final_render_descriptor_set_layout.get());
+
     const vk::DescriptorSetAllocateInfo descriptor_set_allocate_info {
         .descriptorPool = context.descriptor_pool.get(),
-        .descriptorSetCount = 1,
-        .pSetLayouts =
-            &render_resources.final_render_descriptor_set_layout.get()};
+        .descriptorSetCount = static_cast<std::uint32_t>(set_layouts.size()),
+        .pSetLayouts = set_layouts.data()};
 
-    render_resources.final_render_descriptor_set = std::move(
-        context.device
-            ->allocateDescriptorSetsUnique(descriptor_set_allocate_info)
-            .front());
+    auto descriptor_sets = context.device->allocateDescriptorSetsUnique(
+        descriptor_set_allocate_info);
 
-    const vk::DescriptorImageInfo descriptor_render_target {
+    // All frames start with the first display image, which the render thread
+    // publishes first
+    const vk::DescriptorImageInfo descriptor_display_image {
         .sampler = render_resources.render_target_sampler.get(),
-        .imageView = render_resources.render_target_view.get(),
+        .imageView = render_resources.display_image_views[0].get(),
         .imageLayout = vk::ImageLayout::eGeneral};
 
-    const vk::WriteDescriptorSet descriptor_write {
-        .dstSet = render_resources.final_render_descriptor_set.get(),
-        .dstBinding = 0,
-        .dstArrayElement = 0,
-        .descriptorCount = 1,
-        .descriptorType = vk::DescriptorType::eCombinedImageSampler,
-        .pImageInfo = &descriptor_render_target};
-
-    context.device->updateDescriptorSets({descriptor_write}, {});
+    for (std::uint32_t i {0}; i < Vulkan_context::frames_in_flight; ++i)
+    {
+        render_resources.final_render_descriptor_sets[i] =
+            std::move(descriptor_sets[i]);
+        render_resources.final_render_display_indices[i] = 0;
+
+        const vk::WriteDescriptorSet descriptor_write {
+            .dstSet = render_resources.final_render_descriptor_sets[i].get(),
+            .dstBinding = 0,
+            .dstArrayElement = 0,
+            .descriptorCount = 1,
+            .descriptorType = vk::DescriptorType::eCombinedImageSampler,
+            .pImageInfo = &descriptor_display_image};
+
+        context.device->updateDescriptorSets({descriptor_write}, {});
+    }
 }
 
 void create_ray_tracing_pipeline_layout(
@@ -1581,12 +2470,26 @@ void create_ray_tracing_pipeline(const Vulkan_context &context,
         .basePipelineHandle = {},
         .basePipelineIndex = {}};
 
+    const auto start = std::chrono::steady_clock::now();
+
     auto result = context.device->createRayTracingPipelineKHRUnique(
-        {}, {}, ray_tracing_pipeline_create_info);
+        {}, context.pipeline_cache.get(), ray_tracing_pipeline_create_info);
     vk::detail::resultCheck(result.result,
                             "vk::Device::createRayTracingPipelineKHRUnique");
 
     render_resources.ray_tracing_pipeline = std::move(result.value);
+
+    // The first creation with a cache loaded from disk is warm if the shaders
+    // did not change since the cache was saved
+    const std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::cout << "Created the ray tracing pipeline in " << elapsed.count()
+              << " ms, "
+              << (context.pipeline_cache_loaded_size > 0
+                      ? "warm pipeline cache ("
+                      : "cold pipeline cache (")
+              << context.pipeline_cache_loaded_size
+              << " bytes loaded from disk)\n";
 }
 
 void create_shader_binding_table(const Vulkan_context &context,
@@ -1684,96 +2587,811 @@ void create_shader_binding_table(const Vulkan_context &context,
     }
 }
 
-} // namespace
+// A begin and an end timestamp per scope
+constexpr std::uint32_t queries_per_gpu_profiler_slot {2 * gpu_scope_count};
 
-ImGui_backend::~ImGui_backend()
-{
-    if (m_initialized)
-    {
-        ImGui_ImplVulkan_Shutdown();
-    }
-}
+constexpr std::size_t default_gpu_profile_history_capacity {512};
 
-Vulkan_context create_context(GLFWwindow *window)
+[[nodiscard]] Gpu_profiler create_gpu_profiler(const Vulkan_context &context,
+                                               std::uint32_t slot_count)
 {
-    Vulkan_context context {};
+    Gpu_profiler profiler {};
 
-    create_instance(context);
+    const vk::QueryPoolCreateInfo query_pool_info {
+        .queryType = vk::QueryType::eTimestamp,
+        .queryCount = slot_count * queries_per_gpu_profiler_slot};
+    profiler.query_pool =
+        context.device->createQueryPoolUnique(query_pool_info);
 
-    create_device(context);
+    profiler.timestamp_period =
+        context.physical_device_properties.limits.timestampPeriod;
+    profiler.timestamp_mask =
+        context.timestamp_valid_bits >= 64
+            ? ~std::uint64_t {0}
+            : (std::uint64_t {1} << context.timestamp_valid_bits) - 1;
+    profiler.slots.resize(slot_count);
+    resize_gpu_profile_history(profiler.history,
+                               default_gpu_profile_history_capacity);
+
+    return profiler;
+}
 
-    context.graphics_compute_queue = context.device->getQueue(
-        context.graphics_compute_queue_family_index, 0);
-    context.present_queue =
-        context.device->getQueue(context.present_queue_family_index, 0);
+// Returns false if the timestamps of some scope are not available. The
+// queries must not be reset by a pending submission, or the results of the
+// previous use of the slot could be read instead.
+[[nodiscard]] bool read_back_gpu_profiler_slot(vk::Device device,
+                                               Gpu_profiler &profiler,
+                                               std::uint32_t slot_index)
+{
+    auto &slot = profiler.slots[slot_index];
+
+    // Each query gives its value followed by its availability. The queries of
+    // the scopes that were not recorded are never available, in which case
+    // the whole call returns vk::Result::eNotReady.
+    std::array<std::uint64_t, 2 * queries_per_gpu_profiler_slot> results {};
+    const auto result = device.getQueryPoolResults(
+        profiler.query_pool.get(),
+        slot_index * queries_per_gpu_profiler_slot,
+        queries_per_gpu_profiler_slot,
+        sizeof(results),
+        results.data(),
+        2 * sizeof(std::uint64_t),
+        vk::QueryResultFlagBits::e64 |
+            vk::QueryResultFlagBits::eWithAvailability);
+    if (result != vk::Result::eNotReady)
+    {
+        vk::detail::resultCheck(result, "vk::Device::getQueryPoolResults");
+    }
 
-    create_surface(context, window);
+    Gpu_frame_profile frame {.frame_index = slot.frame_index,
+                             .recorded_scopes = slot.written_scopes,
+                             .scope_starts = {},
+                             .scope_durations = {}};
 
-    create_allocator(context);
+    std::uint64_t first_timestamp {std::numeric_limits<std::uint64_t>::max()};
+    for (std::uint32_t i {0}; i < gpu_scope_count; ++i)
+    {
+        if (!is_recorded(frame, static_cast<Gpu_scope>(i)))
+        {
+            continue;
+        }
+        const auto *const scope_results = &results[4 * i];
+        if (scope_results[1] == 0 || scope_results[3] == 0)
+        {
+            return false;
+        }
+        first_timestamp = std::min(first_timestamp, scope_results[0]);
+    }
+    slot.pending = false;
 
-    create_command_pool(context);
+    if (frame.recorded_scopes == 0)
+    {
+        return true;
+    }
+    if (!profiler.has_first_timestamp)
+    {
+        profiler.first_timestamp = first_timestamp;
+        profiler.has_first_timestamp = true;
+    }
 
-    int width {};
-    int height {};
-    glfwGetFramebufferSize(window, &width, &height);
-    context.framebuffer_width = static_cast<std::uint32_t>(width);
-    context.framebuffer_height = static_cast<std::uint32_t>(height);
-    create_swapchain(context);
+    // Differences are taken modulo the valid bits, in case the counter wraps
+    const auto to_milliseconds = [&](std::uint64_t from, std::uint64_t to)
+    {
+        return static_cast<double>((to - from) & profiler.timestamp_mask) *
+               static_cast<double>(profiler.timestamp_period) * 1e-6;
+    };
+    for (std::uint32_t i {0}; i < gpu_scope_count; ++i)
+    {
+        if (is_recorded(frame, static_cast<Gpu_scope>(i)))
+        {
+            const auto *const scope_results = &results[4 * i];
+            frame.scope_starts[i] =
+                to_milliseconds(profiler.first_timestamp, scope_results[0]);
+            frame.scope_durations[i] =
+                to_milliseconds(scope_results[0], scope_results[2]);
+        }
+    }
+    add_frame(profiler.history, frame);
 
-    create_descriptor_pool(context);
-    create_render_pass(context);
-    create_framebuffers(context);
-    create_command_buffers(context);
-    create_synchronization_objects(context);
+    return true;
+}
 
-    constexpr vk::QueryPoolCreateInfo query_pool_info {
-        .queryType = vk::QueryType::eTimestamp, .queryCount = 2};
-    context.query_pool = context.device->createQueryPoolUnique(query_pool_info);
+// The previous submission of the command buffer using the slot must have
+// completed
+void begin_gpu_profiler_frame(vk::Device device,
+                              Gpu_profiler &profiler,
+                              vk::CommandBuffer command_buffer,
+                              std::uint32_t slot_index)
+{
+    auto &slot = profiler.slots[slot_index];
+    if (slot.pending &&
+        !read_back_gpu_profiler_slot(device, profiler, slot_index))
+    {
+        ++profiler.dropped_frame_count;
+    }
 
-    init_imgui(context);
+    command_buffer.resetQueryPool(profiler.query_pool.get(),
+                                  slot_index * queries_per_gpu_profiler_slot,
+                                  queries_per_gpu_profiler_slot);
 
-    return context;
+    slot = {.frame_index = profiler.frame_count,
+            .written_scopes = 0,
+            .pending = true};
+    ++profiler.frame_count;
+    profiler.current_slot = slot_index;
 }
 
-Vulkan_render_resources create_render_resources(const Vulkan_context &context,
-                                                std::uint32_t render_width,
-                                                std::uint32_t render_height,
-                                                const aiScene *scene)
+void begin_gpu_scope(const Gpu_profiler &profiler,
+                     vk::CommandBuffer command_buffer,
+                     Gpu_scope scope)
 {
-    Vulkan_render_resources render_resources {};
-
-    constexpr auto storage_image_format = vk::Format::eR32G32B32A32Sfloat;
-    render_resources.storage_image =
-        create_image(context.allocator.get(),
-                     context.device.get(),
-                     render_width,
-                     render_height,
-                     storage_image_format,
-                     vk::ImageUsageFlagBits::eStorage |
-                         vk::ImageUsageFlagBits::eTransferDst);
-    render_resources.storage_image_view =
-        create_image_view(context.device.get(),
-                          render_resources.storage_image.image.get(),
-                          storage_image_format);
+    command_buffer.writeTimestamp(
+        vk::PipelineStageFlagBits::eTopOfPipe,
+        profiler.query_pool.get(),
+        profiler.current_slot * queries_per_gpu_profiler_slot +
+            2 * static_cast<std::uint32_t>(scope));
+}
 
-    // FIXME: why isn't this sRGB ?
-    constexpr auto render_target_format = vk::Format::eR8G8B8A8Unorm;
-    render_resources.render_target = create_image(
-        context.allocator.get(),
-        context.device.get(),
-        render_width,
-        render_height,
-        render_target_format,
-        vk::ImageUsageFlagBits::eSampled | vk::ImageUsageFlagBits::eStorage |
-            vk::ImageUsageFlagBits::eTransferSrc);
-    render_resources.render_target_view =
-        create_image_view(context.device.get(),
-                          render_resources.render_target.image.get(),
-                          render_target_format);
+void end_gpu_scope(Gpu_profiler &profiler,
+                   vk::CommandBuffer command_buffer,
+                   Gpu_scope scope)
+{
+    const auto scope_index = static_cast<std::uint32_t>(scope);
+    command_buffer.writeTimestamp(
+        vk::PipelineStageFlagBits::eBottomOfPipe,
+        profiler.query_pool.get(),
+        profiler.current_slot * queries_per_gpu_profiler_slot +
+            2 * scope_index + 1);
+    auto &slot = profiler.slots[profiler.current_slot];
+    slot.written_scopes |= 1u << scope_index;
+}
 
+void record_trace_commands(std::uint32_t global_frame_count,
+                           Vulkan_render_resources &render_resources,
+                           const Camera &camera,
+                           Gpu_profiler &profiler,
+                           vk::CommandBuffer command_buffer)
+{
+    // If no scene is loaded
+    if (!render_resources.storage_image.image)
     {
-        const auto command_buffer =
-            begin_one_time_submit_command_buffer(context);
+        return;
+    }
+
+    constexpr vk::ImageSubresourceRange subresource_range {
+        .aspectMask = vk::ImageAspectFlagBits::eColor,
+        .baseMipLevel = 0,
+        .levelCount = 1,
+        .baseArrayLayer = 0,
+        .layerCount = 1};
+
+    if (render_resources.sample_count == 0)
+    {
+        // FIXME: this is actually not necessary on each reset, we
+        // should only do it once at creation
+
+        begin_gpu_scope(profiler, command_buffer, Gpu_scope::clear);
+
+        constexpr vk::ClearColorValue clear_value {
+            .float32 = std::array {0.0f, 0.0f, 0.0f, 1.0f}};
+
+        vk::ImageMemoryBarrier image_memory_barrier {
+            .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
+            .dstAccessMask = vk::AccessFlagBits::eTransferWrite,
+            .oldLayout = vk::ImageLayout::eGeneral,
+            .newLayout = vk::ImageLayout::eGeneral,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .image = render_resources.storage_image.image.get(),
+            .subresourceRange = subresource_range};
+
+        command_buffer.pipelineBarrier(
+            vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+            vk::PipelineStageFlagBits::eTransfer,
+            {},
+            {},
+            {},
+            {image_memory_barrier});
+
+        command_buffer.clearColorImage(
+            render_resources.storage_image.image.get(),
+            vk::ImageLayout::eGeneral,
+            clear_value,
+            {subresource_range});
+
+        image_memory_barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+        image_memory_barrier.dstAccessMask = vk::AccessFlagBits::eShaderRead;
+
+        command_buffer.pipelineBarrier(
+            vk::PipelineStageFlagBits::eTransfer,
+            vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+            {},
+            {},
+            {},
+            {image_memory_barrier});
+
+        end_gpu_scope(profiler, command_buffer, Gpu_scope::clear);
+    }
+    else
+    {
+        // The accumulation in the storage image is a read-modify-write, so the
+        // previous dispatch (possibly from an earlier submission) must be
+        // complete and visible before this one starts
+        const vk::ImageMemoryBarrier image_memory_barrier {
+            .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
+            .dstAccessMask = vk::AccessFlagBits::eShaderRead |
+                             vk::AccessFlagBits::eShaderWrite,
+            .oldLayout = vk::ImageLayout::eGeneral,
+            .newLayout = vk::ImageLayout::eGeneral,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .image = render_resources.storage_image.image.get(),
+            .subresourceRange = subresource_range};
+
+        command_buffer.pipelineBarrier(
+            vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+            vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+            {},
+            {},
+            {},
+            {image_memory_barrier});
+    }
+
+    if (render_resources.sample_count >= render_resources.samples_to_render)
+    {
+        return;
+    }
+
+    begin_gpu_scope(profiler, command_buffer, Gpu_scope::trace);
+
+    command_buffer.bindPipeline(vk::PipelineBindPoint::eRayTracingKHR,
+                                render_resources.ray_tracing_pipeline.get());
+
+    command_buffer.bindDescriptorSets(
+        vk::PipelineBindPoint::eRayTracingKHR,
+        render_resources.ray_tracing_pipeline_layout.get(),
+        0,
+        {render_resources.descriptor_set.get()},
+        {});
+
+    const auto samples_this_frame = std::min(
+        render_resources.samples_to_render - render_resources.sample_count,
+        render_resources.samples_per_frame);
+
+    const Push_constants push_constants {
+        .global_frame_count = global_frame_count,
+        .sample_count = render_resources.sample_count,
+        .samples_per_frame = samples_this_frame,
+        .rng_seed = render_resources.rng_seed,
+        .camera_position = camera.position,
+        .camera_dir_x = camera.direction_x,
+        .camera_dir_y = camera.direction_y,
+        .camera_dir_z = camera.direction_z,
+        .sensor_distance = camera.sensor_distance,
+        .sensor_half_width = camera.sensor_half_width,
+        .sensor_half_height = camera.sensor_half_height,
+        .focus_distance = camera.focus_distance,
+        .aperture_radius = camera.aperture_radius};
+
+    command_buffer.pushConstants(
+        render_resources.ray_tracing_pipeline_layout.get(),
+        vk::ShaderStageFlagBits::eRaygenKHR,
+        0,
+        sizeof(push_constants),
+        &push_constants);
+    render_resources.sample_count += samples_this_frame;
+
+    command_buffer.traceRaysKHR(render_resources.sbt_raygen_region,
+                                render_resources.sbt_miss_region,
+                                render_resources.sbt_hit_region,
+                                render_resources.sbt_callable_region,
+                                render_resources.storage_image.width,
+                                render_resources.storage_image.height,
+                                1);
+
+    end_gpu_scope(profiler, command_buffer, Gpu_scope::trace);
+
+    const vk::ImageMemoryBarrier image_memory_barrier {
+        .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
+        .dstAccessMask = vk::AccessFlagBits::eShaderRead,
+        .oldLayout = vk::ImageLayout::eGeneral,
+        .newLayout = vk::ImageLayout::eGeneral,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = render_resources.render_target.image.get(),
+        .subresourceRange = subresource_range};
+
+    command_buffer.pipelineBarrier(
+        vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+        vk::PipelineStageFlagBits::eFragmentShader,
+        {},
+        {},
+        {},
+        {image_memory_barrier});
+}
+
+// Copies the render target to a display image. The submission must first wait
+// for the frames of the user interface showing the display image.
+void record_display_copy(const Vulkan_render_resources &render_resources,
+                         std::uint32_t display_index,
+                         vk::CommandBuffer command_buffer)
+{
+    const auto &render_target = render_resources.render_target;
+    const auto &display_image = render_resources.display_images[display_index];
+
+    constexpr vk::ImageSubresourceRange subresource_range {
+        .aspectMask = vk::ImageAspectFlagBits::eColor,
+        .baseMipLevel = 0,
+        .levelCount = 1,
+        .baseArrayLayer = 0,
+        .layerCount = 1};
+
+    const vk::ImageMemoryBarrier image_memory_barriers[] {
+        {.srcAccessMask = vk::AccessFlagBits::eShaderWrite,
+         .dstAccessMask = vk::AccessFlagBits::eTransferRead,
+         .oldLayout = vk::ImageLayout::eGeneral,
+         .newLayout = vk::ImageLayout::eGeneral,
+         .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+         .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+         .image = render_target.image.get(),
+         .subresourceRange = subresource_range},
+        {.srcAccessMask = vk::AccessFlagBits::eNone,
+         .dstAccessMask = vk::AccessFlagBits::eTransferWrite,
+         .oldLayout = vk::ImageLayout::eGeneral,
+         .newLayout = vk::ImageLayout::eGeneral,
+         .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+         .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+         .image = display_image.image.get(),
+         .subresourceRange = subresource_range}};
+
+    command_buffer.pipelineBarrier(
+        vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+        vk::PipelineStageFlagBits::eTransfer,
+        {},
+        {},
+        {},
+        image_memory_barriers);
+
+    constexpr vk::ImageSubresourceLayers subresource_layers {
+        .aspectMask = vk::ImageAspectFlagBits::eColor,
+        .mipLevel = 0,
+        .baseArrayLayer = 0,
+        .layerCount = 1};
+
+    const vk::ImageCopy region {
+        .srcSubresource = subresource_layers,
+        .srcOffset = {0, 0, 0},
+        .dstSubresource = subresource_layers,
+        .dstOffset = {0, 0, 0},
+        .extent = {render_target.width, render_target.height, 1}};
+
+    command_buffer.copyImage(render_target.image.get(),
+                             vk::ImageLayout::eGeneral,
+                             display_image.image.get(),
+                             vk::ImageLayout::eGeneral,
+                             {region});
+
+    // The next dispatch overwrites the render target
+    const vk::ImageMemoryBarrier image_memory_barrier {
+        .srcAccessMask = vk::AccessFlagBits::eTransferRead,
+        .dstAccessMask = vk::AccessFlagBits::eShaderWrite,
+        .oldLayout = vk::ImageLayout::eGeneral,
+        .newLayout = vk::ImageLayout::eGeneral,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = render_target.image.get(),
+        .subresourceRange = subresource_range};
+
+    command_buffer.pipelineBarrier(
+        vk::PipelineStageFlagBits::eTransfer,
+        vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+        {},
+        {},
+        {},
+        {image_memory_barrier});
+}
+
+// Whether the render thread can copy the render target to the display image
+// that is not published. The user interface must have shown the published one
+// first, so that copies are not made faster than they are shown, and must
+// have submitted the frames showing the other one, so that the render thread
+// never waits for a semaphore value that has not been submitted yet.
+[[nodiscard]] bool can_publish(const Render_thread_state &state) noexcept
+{
+    return state.published_shown &&
+           state.shown_ui_values[1 - state.published_index] <=
+               state.submitted_ui_value;
+}
+
+void run_render_thread(std::stop_token stop_token, Render_thread_state &state)
+{
+    auto &context = *state.context;
+    auto &render_resources = *state.render_resources;
+
+    std::uint64_t trace_value {0};
+    std::array<std::uint64_t, Vulkan_context::frames_in_flight>
+        command_buffer_trace_values {};
+    // Value of the last submission that changed the render target. The render
+    // target may not have been published when the thread starts.
+    std::uint64_t render_target_trace_value {1};
+    std::uint32_t current_command_buffer {0};
+
+    try
+    {
+        for (;;)
+        {
+            Camera camera {};
+            bool reset {};
+            bool copy {};
+            std::uint32_t display_index {};
+            std::uint64_t shown_ui_value {};
+            {
+                std::unique_lock lock(state.mutex);
+                // Sleeps until there is something to trace or to publish
+                state.condition.wait(
+                    lock,
+                    stop_token,
+                    [&]
+                    {
+                        return state.reset_requested ||
+                               render_resources.sample_count <
+                                   state.samples_to_render ||
+                               (state.published_trace_value <
+                                    render_target_trace_value &&
+                                can_publish(state));
+                    });
+                if (stop_token.stop_requested())
+                {
+                    break;
+                }
+
+                camera = state.camera;
+                reset = std::exchange(state.reset_requested, false);
+                render_resources.samples_to_render = state.samples_to_render;
+                render_resources.samples_per_frame = state.samples_per_frame;
+                copy = can_publish(state);
+                display_index = 1 - state.published_index;
+                shown_ui_value = state.shown_ui_values[display_index];
+            }
+
+            if (reset)
+            {
+                reset_render(render_resources);
+            }
+
+            // Waits for the previous submission of this command buffer
+            wait_for_timeline_semaphore(
+                context.device.get(),
+                state.trace_semaphore.get(),
+                command_buffer_trace_values[current_command_buffer]);
+
+            const auto command_buffer =
+                state.command_buffers[current_command_buffer].get();
+
+            command_buffer.reset();
+
+            constexpr vk::CommandBufferBeginInfo begin_info {
+                .flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit};
+            command_buffer.begin(begin_info);
+
+            {
+                // The user interface reads the history
+                const std::lock_guard lock(state.mutex);
+                begin_gpu_profiler_frame(context.device.get(),
+                                         state.gpu_profiler,
+                                         command_buffer,
+                                         current_command_buffer);
+            }
+
+            const auto previous_sample_count = render_resources.sample_count;
+            record_trace_commands(state.global_frame_count,
+                                  render_resources,
+                                  camera,
+                                  state.gpu_profiler,
+                                  command_buffer);
+            const bool render_target_changed =
+                reset || render_resources.sample_count != previous_sample_count;
+
+            if (copy)
+            {
+                begin_gpu_scope(state.gpu_profiler,
+                                command_buffer,
+                                Gpu_scope::display_copy);
+                record_display_copy(
+                    render_resources, display_index, command_buffer);
+                end_gpu_scope(state.gpu_profiler,
+                              command_buffer,
+                              Gpu_scope::display_copy);
+            }
+
+            command_buffer.end();
+
+            ++trace_value;
+            constexpr vk::PipelineStageFlags wait_stage {
+                vk::PipelineStageFlagBits::eTransfer};
+            const vk::TimelineSemaphoreSubmitInfo timeline_submit_info {
+                .waitSemaphoreValueCount = copy ? 1u : 0u,
+                .pWaitSemaphoreValues = &shown_ui_value,
+                .signalSemaphoreValueCount = 1,
+                .pSignalSemaphoreValues = &trace_value};
+            const vk::SubmitInfo submit_info {
+                .pNext = &timeline_submit_info,
+                .waitSemaphoreCount = copy ? 1u : 0u,
+                .pWaitSemaphores = &state.ui_semaphore.get(),
+                .pWaitDstStageMask = &wait_stage,
+                .commandBufferCount = 1,
+                .pCommandBuffers = &command_buffer,
+                .signalSemaphoreCount = 1,
+                .pSignalSemaphores = &state.trace_semaphore.get()};
+            {
+                const std::lock_guard lock(*context.queue_mutex);
+                context.trace_queue.submit({submit_info});
+            }
+
+            command_buffer_trace_values[current_command_buffer] = trace_value;
+            current_command_buffer =
+                (current_command_buffer + 1) % Vulkan_context::frames_in_flight;
+            if (render_target_changed)
+            {
+                render_target_trace_value = trace_value;
+                ++state.global_frame_count;
+            }
+
+            {
+                const std::lock_guard lock(state.mutex);
+                if (copy)
+                {
+                    state.published_index = display_index;
+                    state.published_trace_value = trace_value;
+                    state.published_shown = false;
+                }
+                state.sample_count.store(render_resources.sample_count);
+            }
+        }
+
+        // The render resources can only be used elsewhere once all
+        // submissions have completed
+        wait_for_timeline_semaphore(
+            context.device.get(), state.trace_semaphore.get(), trace_value);
+    }
+    catch (...)
+    {
+        const std::lock_guard lock(state.mutex);
+        state.exception = std::current_exception();
+    }
+}
+
+// The image must be in the general layout, which is the case for both the
+// storage image and the render target.
+[[nodiscard]] std::vector<std::uint8_t>
+read_back_image(const Vulkan_context &context,
+                const Vulkan_image &image,
+                std::uint32_t texel_size)
+{
+    const vk::DeviceSize size {static_cast<vk::DeviceSize>(image.width) *
+                               image.height * texel_size};
+
+    VmaAllocationInfo staging_allocation_info {};
+    const auto staging_buffer =
+        create_buffer(context.allocator.get(),
+                      context.device.get(),
+                      size,
+                      vk::BufferUsageFlagBits::eTransferDst,
+                      VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT |
+                          VMA_ALLOCATION_CREATE_MAPPED_BIT,
+                      VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
+                      &staging_allocation_info);
+
+    const auto command_buffer = begin_one_time_submit_command_buffer(context);
+
+    constexpr vk::ImageSubresourceRange subresource_range {
+        .aspectMask = vk::ImageAspectFlagBits::eColor,
+        .baseMipLevel = 0,
+        .levelCount = 1,
+        .baseArrayLayer = 0,
+        .layerCount = 1};
+
+    vk::ImageMemoryBarrier image_memory_barrier {
+        .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
+        .dstAccessMask = vk::AccessFlagBits::eTransferRead,
+        .oldLayout = vk::ImageLayout::eGeneral,
+        .newLayout = vk::ImageLayout::eTransferSrcOptimal,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = image.image.get(),
+        .subresourceRange = subresource_range};
+
+    command_buffer->pipelineBarrier(
+        vk::PipelineStageFlagBits::eRayTracingShaderKHR |
+            vk::PipelineStageFlagBits::eFragmentShader,
+        vk::PipelineStageFlagBits::eTransfer,
+        {},
+        {},
+        {},
+        {image_memory_barrier});
+
+    constexpr vk::ImageSubresourceLayers subresource_layers {
+        .aspectMask = vk::ImageAspectFlagBits::eColor,
+        .mipLevel = 0,
+        .baseArrayLayer = 0,
+        .layerCount = 1};
+
+    const vk::BufferImageCopy copy_region {
+        .bufferOffset = 0,
+        .bufferRowLength = {},
+        .bufferImageHeight = image.height,
+        .imageSubresource = subresource_layers,
+        .imageOffset = {0, 0, 0},
+        .imageExtent = {image.width, image.height, 1}};
+
+    command_buffer->copyImageToBuffer(image.image.get(),
+                                      vk::ImageLayout::eTransferSrcOptimal,
+                                      staging_buffer.buffer.get(),
+                                      {copy_region});
+
+    image_memory_barrier.srcAccessMask = vk::AccessFlagBits::eTransferRead;
+    image_memory_barrier.dstAccessMask =
+        vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite;
+    image_memory_barrier.oldLayout = vk::ImageLayout::eTransferSrcOptimal;
+    image_memory_barrier.newLayout = vk::ImageLayout::eGeneral;
+
+    command_buffer->pipelineBarrier(
+        vk::PipelineStageFlagBits::eTransfer,
+        vk::PipelineStageFlagBits::eRayTracingShaderKHR |
+            vk::PipelineStageFlagBits::eFragmentShader,
+        {},
+        {},
+        {},
+        {image_memory_barrier});
+
+    end_one_time_submit_command_buffer(context, command_buffer);
+
+    const auto result = vmaInvalidateAllocation(context.allocator.get(),
+                                                staging_buffer.allocation.get(),
+                                                0,
+                                                VK_WHOLE_SIZE);
+    vk::detail::resultCheck(vk::Result {result}, "vmaInvalidateAllocation");
+
+    const auto *const mapped_data =
+        static_cast<const std::uint8_t *>(staging_allocation_info.pMappedData);
+
+    return std::vector<std::uint8_t>(mapped_data, mapped_data + size);
+}
+
+} // namespace
+
+ImGui_backend::~ImGui_backend()
+{
+    if (m_initialized)
+    {
+        ImGui_ImplVulkan_Shutdown();
+    }
+}
+
+Vulkan_context create_context(GLFWwindow *window)
+{
+    Vulkan_context context {};
+
+    const bool enable_presentation {window != nullptr};
+
+    create_instance(context, enable_presentation);
+
+    create_device(context, enable_presentation);
+
+    context.graphics_compute_queue = context.device->getQueue(
+        context.graphics_compute_queue_family_index, 0);
+    context.present_queue =
+        context.device->getQueue(context.present_queue_family_index, 0);
+    context.trace_queue =
+        context.physical_device.getQueueFamilyProperties()
+                    [context.graphics_compute_queue_family_index]
+                        .queueCount > 1
+            ? context.device->getQueue(
+                  context.graphics_compute_queue_family_index, 1)
+            : context.graphics_compute_queue;
+    context.queue_mutex = std::make_unique<std::mutex>();
+
+    if (enable_presentation)
+    {
+        create_surface(context, window);
+    }
+
+    create_allocator(context);
+
+    create_pipeline_cache(context);
+
+    create_command_pool(context);
+
+    context.upload_manager = create_upload_manager(context);
+
+    if (enable_presentation)
+    {
+        int width {};
+        int height {};
+        glfwGetFramebufferSize(window, &width, &height);
+        context.framebuffer_width = static_cast<std::uint32_t>(width);
+        context.framebuffer_height = static_cast<std::uint32_t>(height);
+        create_swapchain(context);
+    }
+
+    create_descriptor_pool(context);
+    if (enable_presentation)
+    {
+        create_render_pass(context);
+        create_framebuffers(context);
+    }
+    create_command_buffers(context);
+    create_synchronization_objects(context);
+
+    context.gpu_profiler =
+        create_gpu_profiler(context, Vulkan_context::frames_in_flight);
+
+    if (enable_presentation)
+    {
+        init_imgui(context);
+    }
+
+    return context;
+}
+
+Vulkan_render_resources create_render_resources(Vulkan_context &context,
+                                                std::uint32_t render_width,
+                                                std::uint32_t render_height,
+                                                const Scene &scene)
+{
+    Vulkan_render_resources render_resources {};
+
+    const auto submission_count = context.upload_manager.submission_count;
+    const auto uploaded_size = context.upload_manager.uploaded_size;
+
+    constexpr auto storage_image_format = vk::Format::eR32G32B32A32Sfloat;
+    render_resources.storage_image =
+        create_image(context.allocator.get(),
+                     context.device.get(),
+                     render_width,
+                     render_height,
+                     storage_image_format,
+                     vk::ImageUsageFlagBits::eStorage |
+                         vk::ImageUsageFlagBits::eTransferSrc |
+                         vk::ImageUsageFlagBits::eTransferDst);
+    render_resources.storage_image_view =
+        create_image_view(context.device.get(),
+                          render_resources.storage_image.image.get(),
+                          storage_image_format);
+
+    // FIXME: why isn't this sRGB ?
+    constexpr auto render_target_format = vk::Format::eR8G8B8A8Unorm;
+    render_resources.render_target = create_image(
+        context.allocator.get(),
+        context.device.get(),
+        render_width,
+        render_height,
+        render_target_format,
+        vk::ImageUsageFlagBits::eSampled | vk::ImageUsageFlagBits::eStorage |
+            vk::ImageUsageFlagBits::eTransferSrc);
+    render_resources.render_target_view =
+        create_image_view(context.device.get(),
+                          render_resources.render_target.image.get(),
+                          render_target_format);
+
+    for (std::size_t i {0}; i < render_resources.display_images.size(); ++i)
+    {
+        render_resources.display_images[i] =
+            create_image(context.allocator.get(),
+                         context.device.get(),
+                         render_width,
+                         render_height,
+                         render_target_format,
+                         vk::ImageUsageFlagBits::eSampled |
+                             vk::ImageUsageFlagBits::eTransferDst);
+        render_resources.display_image_views[i] = create_image_view(
+            context.device.get(),
+            render_resources.display_images[i].image.get(),
+            render_target_format);
+    }
+
+    {
+        const auto command_buffer = get_upload_command_buffer(context);
 
         constexpr vk::ImageSubresourceRange subresource_range {
             .aspectMask = vk::ImageAspectFlagBits::eColor,
@@ -1802,7 +3420,7 @@ Vulkan_render_resources create_render_resources(const Vulkan_context &context,
              .image = render_resources.render_target.image.get(),
              .subresourceRange = subresource_range}};
 
-        command_buffer->pipelineBarrier(
+        command_buffer.pipelineBarrier(
             vk::PipelineStageFlagBits::eTopOfPipe,
             vk::PipelineStageFlagBits::eRayTracingShaderKHR,
             {},
@@ -1810,36 +3428,58 @@ Vulkan_render_resources create_render_resources(const Vulkan_context &context,
             {},
             image_memory_barriers);
 
-        end_one_time_submit_command_buffer(context, command_buffer);
-    }
+        // The display images are shown before anything is rendered
+        for (const auto &display_image : render_resources.display_images)
+        {
+            vk::ImageMemoryBarrier display_image_memory_barrier {
+                .srcAccessMask = vk::AccessFlagBits::eNone,
+                .dstAccessMask = vk::AccessFlagBits::eTransferWrite,
+                .oldLayout = vk::ImageLayout::eUndefined,
+                .newLayout = vk::ImageLayout::eGeneral,
+                .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .image = display_image.image.get(),
+                .subresourceRange = subresource_range};
 
-    create_render_target_sampler(context, render_resources);
+            command_buffer.pipelineBarrier(
+                vk::PipelineStageFlagBits::eTopOfPipe,
+                vk::PipelineStageFlagBits::eTransfer,
+                {},
+                {},
+                {},
+                {display_image_memory_barrier});
 
-    const auto *const mesh = scene->mMeshes[0];
-    std::vector<std::uint32_t> indices(mesh->mNumFaces * 3);
-    for (unsigned int i {0}; i < mesh->mNumFaces; ++i)
-    {
-        indices[i * 3 + 0] = mesh->mFaces[i].mIndices[0];
-        indices[i * 3 + 1] = mesh->mFaces[i].mIndices[1];
-        indices[i * 3 + 2] = mesh->mFaces[i].mIndices[2];
-    }
+            constexpr vk::ClearColorValue clear_value {
+                .float32 = std::array {0.0f, 0.0f, 0.0f, 1.0f}};
+            command_buffer.clearColorImage(display_image.image.get(),
+                                           vk::ImageLayout::eGeneral,
+                                           clear_value,
+                                           {subresource_range});
 
-    render_resources.vertex_buffer = create_vertex_or_index_buffer(
-        context,
-        mesh->mVertices,
-        mesh->mNumVertices * sizeof(mesh->mVertices[0]));
+            display_image_memory_barrier.srcAccessMask =
+                vk::AccessFlagBits::eTransferWrite;
+            display_image_memory_barrier.dstAccessMask =
+                vk::AccessFlagBits::eShaderRead;
+            display_image_memory_barrier.oldLayout = vk::ImageLayout::eGeneral;
+
+            command_buffer.pipelineBarrier(
+                vk::PipelineStageFlagBits::eTransfer,
+                vk::PipelineStageFlagBits::eFragmentShader,
+                {},
+                {},
+                {},
+                {display_image_memory_barrier});
+        }
+    }
 
-    render_resources.index_buffer = create_vertex_or_index_buffer(
-        context, indices.data(), indices.size() * sizeof(indices.front()));
+    create_render_target_sampler(context, render_resources);
 
-    render_resources.normal_buffer =
-        create_storage_buffer(context,
-                              mesh->mNormals,
-                              mesh->mNumVertices * sizeof(mesh->mNormals[0]));
+    const auto blas_layout = create_blas_layout(scene);
+    const auto gpu_meshes =
+        create_mesh_buffers(context, render_resources, scene, blas_layout);
 
     {
-        // FIXME: hardcoded filename
-        const auto environment_map = read_hdr_image("../../powerplant.hdr");
+        const auto &environment_map = scene.environment_map;
 
         constexpr auto environment_map_format = vk::Format::eR32G32B32A32Sfloat;
         render_resources.environment_map =
@@ -1856,115 +3496,279 @@ Vulkan_render_resources create_render_resources(const Vulkan_context &context,
                               environment_map_format);
         create_environment_map_sampler(context, render_resources);
 
-        const std::size_t buffer_size {
-            environment_map.width * environment_map.height * 4 * sizeof(float)};
-        VmaAllocationInfo staging_allocation_info {};
-        const auto staging_buffer = create_buffer(
-            context.allocator.get(),
-            context.device.get(),
-            buffer_size,
-            vk::BufferUsageFlagBits::eTransferSrc,
-            VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
-                VMA_ALLOCATION_CREATE_MAPPED_BIT,
-            VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
-            &staging_allocation_info);
-
-        auto *const mapped_data =
-            static_cast<float *>(staging_allocation_info.pMappedData);
-        std::memcpy(mapped_data, environment_map.data.get(), buffer_size);
-
-        const auto command_buffer =
-            begin_one_time_submit_command_buffer(context);
-
-        constexpr vk::ImageSubresourceRange subresource_range {
-            .aspectMask = vk::ImageAspectFlagBits::eColor,
-            .baseMipLevel = 0,
-            .levelCount = 1,
-            .baseArrayLayer = 0,
-            .layerCount = 1};
-
-        vk::ImageMemoryBarrier image_memory_barrier {
-            .srcAccessMask = vk::AccessFlagBits::eNone,
-            .dstAccessMask = vk::AccessFlagBits::eTransferWrite,
-            .oldLayout = vk::ImageLayout::eUndefined,
-            .newLayout = vk::ImageLayout::eTransferDstOptimal,
-            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-            .image = render_resources.environment_map.image.get(),
-            .subresourceRange = subresource_range};
-
-        command_buffer->pipelineBarrier(vk::PipelineStageFlagBits::eTopOfPipe,
-                                        vk::PipelineStageFlagBits::eTransfer,
-                                        {},
-                                        {},
-                                        {},
-                                        {image_memory_barrier});
+        upload_to_image(context,
+                        render_resources.environment_map,
+                        environment_map.data.get(),
+                        4 * sizeof(float));
+    }
 
-        constexpr vk::ImageSubresourceLayers subresource_layers {
-            .aspectMask = vk::ImageAspectFlagBits::eColor,
-            .mipLevel = 0,
-            .baseArrayLayer = 0,
-            .layerCount = 1};
+    const auto blas_count =
+        static_cast<std::uint32_t>(blas_layout.first_geometries.size() - 1);
+    const vk::QueryPoolCreateInfo compacted_size_query_pool_info {
+        .queryType = vk::QueryType::eAccelerationStructureCompactedSizeKHR,
+        .queryCount = blas_count};
+    const auto compacted_size_query_pool =
+        context.device->createQueryPoolUnique(compacted_size_query_pool_info);
 
-        const vk::BufferImageCopy copy_region {
-            .bufferOffset = 0,
-            .bufferRowLength = {},
-            .bufferImageHeight = environment_map.height,
-            .imageSubresource = subresource_layers,
-            .imageOffset = {0, 0, 0},
-            .imageExtent = {environment_map.width, environment_map.height, 1}};
+    vk::UniqueQueryPool timestamp_query_pool {};
+    if (context.timestamp_valid_bits > 0)
+    {
+        const vk::QueryPoolCreateInfo timestamp_query_pool_info {
+            .queryType = vk::QueryType::eTimestamp, .queryCount = 2};
+        timestamp_query_pool =
+            context.device->createQueryPoolUnique(timestamp_query_pool_info);
+    }
 
-        command_buffer->copyBufferToImage(
-            staging_buffer.buffer.get(),
-            render_resources.environment_map.image.get(),
-            vk::ImageLayout::eTransferDstOptimal,
-            {copy_region});
+    const auto blas_build_info = create_blases(context,
+                                               render_resources,
+                                               scene,
+                                               blas_layout,
+                                               gpu_meshes,
+                                               compacted_size_query_pool.get(),
+                                               timestamp_query_pool.get());
+
+    // The compacted sizes are only known once the builds have completed
+    wait_for_uploads(context);
+
+    std::cout << blas_count << " BLASes of "
+              << blas_layout.geometry_meshes.size() << " meshes for "
+              << blas_layout.instances.size() << " instances built in "
+              << blas_build_info.build_command_count << " commands";
+    if (timestamp_query_pool)
+    {
+        std::array<std::uint64_t, 2> timestamps {};
+        const auto result = context.device->getQueryPoolResults(
+            timestamp_query_pool.get(),
+            0,
+            2,
+            sizeof(timestamps),
+            timestamps.data(),
+            sizeof(std::uint64_t),
+            vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWait);
+        vk::detail::resultCheck(result, "vk::Device::getQueryPoolResults");
+        const auto timestamp_mask =
+            context.timestamp_valid_bits >= 64
+                ? ~std::uint64_t {0}
+                : (std::uint64_t {1} << context.timestamp_valid_bits) - 1;
+        const auto ticks = (timestamps[1] - timestamps[0]) & timestamp_mask;
+        std::cout << ", "
+                  << static_cast<double>(ticks) *
+                         static_cast<double>(
+                             context.physical_device_properties.limits
+                                 .timestampPeriod) *
+                         1e-6
+                  << " ms on the GPU";
+    }
+    std::cout << ", with "
+              << static_cast<double>(blas_build_info.scratch_size) /
+                     (1024.0 * 1024.0)
+              << " MiB of scratch memory\n";
 
-        image_memory_barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
-        image_memory_barrier.dstAccessMask = vk::AccessFlagBits::eShaderRead;
-        image_memory_barrier.oldLayout = vk::ImageLayout::eTransferDstOptimal;
-        image_memory_barrier.newLayout =
-            vk::ImageLayout::eShaderReadOnlyOptimal;
+    std::vector<vk::UniqueAccelerationStructureKHR> uncompacted_blases;
+    std::vector<Vulkan_buffer> uncompacted_blas_buffers;
+    compact_blases(context,
+                   render_resources,
+                   compacted_size_query_pool.get(),
+                   uncompacted_blases,
+                   uncompacted_blas_buffers);
 
-        command_buffer->pipelineBarrier(
-            vk::PipelineStageFlagBits::eTransfer,
-            vk::PipelineStageFlagBits::eRayTracingShaderKHR,
-            {},
-            {},
-            {},
-            {image_memory_barrier});
+    create_tlas(context, render_resources, blas_layout);
 
-        end_one_time_submit_command_buffer(context, command_buffer);
-    }
+    // The compaction copies and the TLAS build run while the pipeline is
+    // being compiled
+    submit_uploads(context);
 
-    create_blas(context, render_resources);
-    create_tlas(context, render_resources);
     create_descriptor_set_layout(context, render_resources);
     create_final_render_descriptor_set_layout(context, render_resources);
     create_descriptor_set(context, render_resources);
-    create_final_render_descriptor_set(context, render_resources);
+    create_final_render_descriptor_sets(context, render_resources);
     create_ray_tracing_pipeline_layout(context, render_resources);
     create_ray_tracing_pipeline(context, render_resources);
     create_shader_binding_table(context, render_resources);
 
+    wait_for_uploads(context);
+    std::cout << "Scene uploaded in "
+              << context.upload_manager.submission_count - submission_count
+              << " submissions ("
+              << static_cast<double>(context.upload_manager.uploaded_size -
+                                     uploaded_size) /
+                     (1024.0 * 1024.0)
+              << " MiB)\n";
+
+    const auto get_total_size = [](const std::vector<Vulkan_buffer> &buffers)
+    {
+        vk::DeviceSize size {0};
+        for (const auto &buffer : buffers)
+        {
+            size += buffer.size;
+        }
+        return static_cast<double>(size) / (1024.0 * 1024.0);
+    };
+    std::cout << "BLASes compacted from "
+              << get_total_size(uncompacted_blas_buffers) << " MiB to "
+              << get_total_size(render_resources.blas_buffers) << " MiB\n";
+
     render_resources.samples_to_render = 1000;
     render_resources.sample_count = 0;
     render_resources.samples_per_frame = 1;
+    render_resources.rng_seed = 0;
 
     return render_resources;
 }
 
+void Render_thread_deleter::operator()(Render_thread_state *state) const
+{
+    delete state;
+}
+
+Vulkan_render_thread start_render_thread(
+    Vulkan_context &context,
+    Vulkan_render_resources &render_resources,
+    const Camera &camera)
+{
+    Vulkan_render_thread render_thread {
+        .state = std::unique_ptr<Render_thread_state, Render_thread_deleter>(
+            new Render_thread_state {})};
+    auto &state = *render_thread.state;
+
+    state.context = &context;
+    state.render_resources = &render_resources;
+
+    const vk::CommandPoolCreateInfo command_pool_create_info {
+        .flags = vk::CommandPoolCreateFlagBits::eResetCommandBuffer,
+        .queueFamilyIndex = context.graphics_compute_queue_family_index};
+    state.command_pool =
+        context.device->createCommandPoolUnique(command_pool_create_info);
+
+    const vk::CommandBufferAllocateInfo allocate_info {
+        .commandPool = state.command_pool.get(),
+        .level = vk::CommandBufferLevel::ePrimary,
+        .commandBufferCount = Vulkan_context::frames_in_flight};
+    state.command_buffers =
+        context.device->allocateCommandBuffersUnique(allocate_info);
+
+    state.trace_semaphore = create_timeline_semaphore(context.device.get());
+    state.ui_semaphore = create_timeline_semaphore(context.device.get());
+    state.gpu_profiler =
+        create_gpu_profiler(context, Vulkan_context::frames_in_flight);
+    state.global_frame_count = context.global_frame_count;
+
+    state.camera = camera;
+    state.samples_to_render = render_resources.samples_to_render;
+    state.samples_per_frame = render_resources.samples_per_frame;
+    // The first display image is shown until the render thread publishes the
+    // other one
+    state.published_index = 0;
+    state.published_shown = true;
+    state.sample_count.store(render_resources.sample_count);
+
+    state.thread = std::jthread([&state](std::stop_token stop_token)
+                                { run_render_thread(stop_token, state); });
+
+    return render_thread;
+}
+
+void stop_render_thread(Vulkan_context &context,
+                        Vulkan_render_thread &render_thread)
+{
+    if (!render_thread.state)
+    {
+        return;
+    }
+
+    auto &state = *render_thread.state;
+    state.thread.request_stop();
+    state.thread.join();
+    context.global_frame_count = state.global_frame_count;
+    const auto exception = state.exception;
+
+    {
+        // The frames of the user interface in flight still use the display
+        // images and signal the semaphore
+        const std::lock_guard lock(*context.queue_mutex);
+        context.device->waitIdle();
+    }
+    render_thread.state.reset();
+
+    if (exception)
+    {
+        std::rethrow_exception(exception);
+    }
+}
+
+void update_render_thread(Vulkan_render_thread &render_thread,
+                          const Camera &camera,
+                          std::uint32_t samples_to_render,
+                          std::uint32_t samples_per_frame,
+                          bool reset)
+{
+    auto &state = *render_thread.state;
+    {
+        const std::lock_guard lock(state.mutex);
+        state.camera = camera;
+        state.samples_to_render = samples_to_render;
+        state.samples_per_frame = samples_per_frame;
+        state.reset_requested = state.reset_requested || reset;
+    }
+    state.condition.notify_one();
+}
+
+std::uint32_t get_sample_count(const Vulkan_render_thread &render_thread)
+{
+    return render_thread.state->sample_count.load();
+}
+
+std::vector<Gpu_frame_profile> get_gpu_profile(const Vulkan_context &context)
+{
+    return get_frames(context.gpu_profiler.history);
+}
+
+std::vector<Gpu_frame_profile>
+get_gpu_profile(const Vulkan_render_thread &render_thread)
+{
+    if (!render_thread.state)
+    {
+        return {};
+    }
+    const std::lock_guard lock(render_thread.state->mutex);
+    return get_frames(render_thread.state->gpu_profiler.history);
+}
+
+void flush_gpu_profile(Vulkan_context &context)
+{
+    auto &profiler = context.gpu_profiler;
+    // Slots are used in turn, so the oldest frame follows the current slot
+    const auto slot_count = static_cast<std::uint32_t>(profiler.slots.size());
+    for (std::uint32_t i {1}; i <= slot_count; ++i)
+    {
+        const auto slot_index = (profiler.current_slot + i) % slot_count;
+        if (profiler.slots[slot_index].pending &&
+            !read_back_gpu_profiler_slot(
+                context.device.get(), profiler, slot_index))
+        {
+            ++profiler.dropped_frame_count;
+            profiler.slots[slot_index].pending = false;
+        }
+    }
+}
+
 void draw_frame(Vulkan_context &context,
                 Vulkan_render_resources &render_resources,
-                const Camera &camera)
+                Vulkan_render_thread &render_thread)
 {
+    auto *const thread_state = render_thread.state.get();
+    if (thread_state != nullptr)
+    {
+        const std::lock_guard lock(thread_state->mutex);
+        if (thread_state->exception)
+        {
+            std::rethrow_exception(thread_state->exception);
+        }
+    }
+
+    // Tracing goes on in the render thread while the window is minimized
     if (context.framebuffer_width == 0 || context.framebuffer_height == 0)
     {
-        // FIXME: We want to
-        // continue tracing when the window is minimized, just not draw to
-        // the framebuffer. But this requires a better separation of the
-        // tracing vs drawing code. And this separation would probably be
-        // best anyways.
         return;
     }
 
@@ -1993,6 +3797,53 @@ void draw_frame(Vulkan_context &context,
     context.device->resetFences(
         {context.in_flight_fences[context.current_frame_in_flight].get()});
 
+    // Takes the latest display image published by the render thread. Once the
+    // frame is submitted, the render thread can overwrite the other one.
+    std::uint64_t published_trace_value {0};
+    std::uint64_t ui_value {0};
+    if (thread_state != nullptr)
+    {
+        std::uint32_t display_index {};
+        {
+            const std::lock_guard lock(thread_state->mutex);
+            display_index = thread_state->published_index;
+            published_trace_value = thread_state->published_trace_value;
+            ui_value = thread_state->submitted_ui_value + 1;
+            thread_state->shown_ui_values[display_index] = ui_value;
+            thread_state->published_shown = true;
+        }
+        thread_state->condition.notify_one();
+
+        // The fence of this frame was waited for, so its descriptor set is no
+        // longer in use
+        auto &frame_display_index =
+            render_resources
+                .final_render_display_indices[context.current_frame_in_flight];
+        if (frame_display_index != display_index)
+        {
+            frame_display_index = display_index;
+
+            const vk::DescriptorImageInfo descriptor_display_image {
+                .sampler = render_resources.render_target_sampler.get(),
+                .imageView =
+                    render_resources.display_image_views[display_index].get(),
+                .imageLayout = vk::ImageLayout::eGeneral};
+
+            const vk::WriteDescriptorSet descriptor_write {
+                .dstSet = render_resources
+                              .final_render_descriptor_sets
+                                  [context.current_frame_in_flight]
+                              .get(),
+                .dstBinding = 0,
+                .dstArrayElement = 0,
+                .descriptorCount = 1,
+                .descriptorType = vk::DescriptorType::eCombinedImageSampler,
+                .pImageInfo = &descriptor_display_image};
+
+            context.device->updateDescriptorSets({descriptor_write}, {});
+        }
+    }
+
     const auto command_buffer =
         context.command_buffers[context.current_frame_in_flight].get();
 
@@ -2001,136 +3852,12 @@ void draw_frame(Vulkan_context &context,
     constexpr vk::CommandBufferBeginInfo begin_info {};
     command_buffer.begin(begin_info);
 
-    command_buffer.resetQueryPool(context.query_pool.get(), 0, 2);
-    command_buffer.writeTimestamp(
-        vk::PipelineStageFlagBits::eTopOfPipe, context.query_pool.get(), 0);
-
-    constexpr vk::ImageSubresourceRange subresource_range {
-        .aspectMask = vk::ImageAspectFlagBits::eColor,
-        .baseMipLevel = 0,
-        .levelCount = 1,
-        .baseArrayLayer = 0,
-        .layerCount = 1};
-
-    // If a scene is loaded
-    if (render_resources.storage_image.image)
-    {
-        if (render_resources.sample_count == 0)
-        {
-            // FIXME: this is actually not necessary on each reset, we
-            // should only do it once at creation
-
-            constexpr vk::ClearColorValue clear_value {
-                .float32 = std::array {0.0f, 0.0f, 0.0f, 1.0f}};
-
-            vk::ImageMemoryBarrier image_memory_barrier {
-                .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
-                .dstAccessMask = vk::AccessFlagBits::eTransferWrite,
-                .oldLayout = vk::ImageLayout::eGeneral,
-                .newLayout = vk::ImageLayout::eGeneral,
-                .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-                .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-                .image = render_resources.storage_image.image.get(),
-                .subresourceRange = subresource_range};
-
-            command_buffer.pipelineBarrier(
-                vk::PipelineStageFlagBits::eRayTracingShaderKHR,
-                vk::PipelineStageFlagBits::eTransfer,
-                {},
-                {},
-                {},
-                {image_memory_barrier});
-
-            command_buffer.clearColorImage(
-                render_resources.storage_image.image.get(),
-                vk::ImageLayout::eGeneral,
-                clear_value,
-                {subresource_range});
-
-            image_memory_barrier.srcAccessMask =
-                vk::AccessFlagBits::eTransferWrite;
-            image_memory_barrier.dstAccessMask =
-                vk::AccessFlagBits::eShaderRead;
-
-            command_buffer.pipelineBarrier(
-                vk::PipelineStageFlagBits::eTransfer,
-                vk::PipelineStageFlagBits::eRayTracingShaderKHR,
-                {},
-                {},
-                {},
-                {image_memory_barrier});
-        }
-
-        if (render_resources.sample_count < render_resources.samples_to_render)
-        {
-            command_buffer.bindPipeline(
-                vk::PipelineBindPoint::eRayTracingKHR,
-                render_resources.ray_tracing_pipeline.get());
-
-            command_buffer.bindDescriptorSets(
-                vk::PipelineBindPoint::eRayTracingKHR,
-                render_resources.ray_tracing_pipeline_layout.get(),
-                0,
-                {render_resources.descriptor_set.get()},
-                {});
-
-            const auto samples_this_frame =
-                std::min(render_resources.samples_to_render -
-                             render_resources.sample_count,
-                         render_resources.samples_per_frame);
-
-            const Push_constants push_constants {
-                .global_frame_count = context.global_frame_count,
-                .sample_count = render_resources.sample_count,
-                .samples_per_frame = samples_this_frame,
-                .camera_position = camera.position,
-                .camera_dir_x = camera.direction_x,
-                .camera_dir_y = camera.direction_y,
-                .camera_dir_z = camera.direction_z,
-                .sensor_distance = camera.sensor_distance,
-                .sensor_half_width = camera.sensor_half_width,
-                .sensor_half_height = camera.sensor_half_height,
-                .focus_distance = camera.focus_distance,
-                .aperture_radius = camera.aperture_radius};
-
-            command_buffer.pushConstants(
-                render_resources.ray_tracing_pipeline_layout.get(),
-                vk::ShaderStageFlagBits::eRaygenKHR,
-                0,
-                sizeof(push_constants),
-                &push_constants);
-            render_resources.sample_count += samples_this_frame;
-
-            command_buffer.traceRaysKHR(render_resources.sbt_raygen_region,
-                                        render_resources.sbt_miss_region,
-                                        render_resources.sbt_hit_region,
-                                        render_resources.sbt_callable_region,
-                                        render_resources.storage_image.width,
-                                        render_resources.storage_image.height,
-                                        1);
-
-            const vk::ImageMemoryBarrier image_memory_barrier {
-                .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
-                .dstAccessMask = vk::AccessFlagBits::eShaderRead,
-                .oldLayout = vk::ImageLayout::eGeneral,
-                .newLayout = vk::ImageLayout::eGeneral,
-                .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-                .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-                .image = render_resources.render_target.image.get(),
-                .subresourceRange = subresource_range};
-
-            command_buffer.pipelineBarrier(
-                vk::PipelineStageFlagBits::eRayTracingShaderKHR,
-                vk::PipelineStageFlagBits::eFragmentShader,
-                {},
-                {},
-                {},
-                {image_memory_barrier});
-        }
-    }
-
-    command_buffer.writeTimestamp(
-        vk::PipelineStageFlagBits::eBottomOfPipe, context.query_pool.get(), 1);
+    begin_gpu_profiler_frame(context.device.get(),
+                             context.gpu_profiler,
+                             command_buffer,
+                             context.current_frame_in_flight);
+    begin_gpu_scope(
+        context.gpu_profiler, command_buffer, Gpu_scope::user_interface);
 
     constexpr vk::ClearValue clear_value {
         .color = {.float32 = std::array {0.0f, 0.0f, 0.0f, 1.0f}}};
@@ -2149,46 +3876,46 @@ void draw_frame(Vulkan_context &context,
 
     command_buffer.endRenderPass();
 
+    end_gpu_scope(
+        context.gpu_profiler, command_buffer, Gpu_scope::user_interface);
+
     command_buffer.end();
 
-    constexpr vk::PipelineStageFlags wait_stage {
-        vk::PipelineStageFlagBits::eColorAttachmentOutput};
+    // With a render thread, the frame also waits for the copy to the display
+    // image and signals that it is done showing it. Binary semaphores ignore
+    // their values.
+    const std::uint32_t semaphore_count {thread_state != nullptr ? 2u : 1u};
+    const vk::Semaphore wait_semaphores[] {
+        context.image_available_semaphores[context.current_frame_in_flight]
+            .get(),
+        thread_state != nullptr ? thread_state->trace_semaphore.get()
+                                : vk::Semaphore {}};
+    const std::uint64_t wait_values[] {0, published_trace_value};
+    constexpr vk::PipelineStageFlags wait_stages[] {
+        vk::PipelineStageFlagBits::eColorAttachmentOutput,
+        vk::PipelineStageFlagBits::eFragmentShader};
+    const vk::Semaphore signal_semaphores[] {
+        context.render_finished_semaphores[context.current_frame_in_flight]
+            .get(),
+        thread_state != nullptr ? thread_state->ui_semaphore.get()
+                                : vk::Semaphore {}};
+    const std::uint64_t signal_values[] {0, ui_value};
+
+    const vk::TimelineSemaphoreSubmitInfo timeline_submit_info {
+        .waitSemaphoreValueCount = semaphore_count,
+        .pWaitSemaphoreValues = wait_values,
+        .signalSemaphoreValueCount = semaphore_count,
+        .pSignalSemaphoreValues = signal_values};
 
     const vk::SubmitInfo submit_info {
-        .waitSemaphoreCount = 1,
-        .pWaitSemaphores =
-            &context.image_available_semaphores[context.current_frame_in_flight]
-                 .get(),
-        .pWaitDstStageMask = &wait_stage,
+        .pNext = &timeline_submit_info,
+        .waitSemaphoreCount = semaphore_count,
+        .pWaitSemaphores = wait_semaphores,
+        .pWaitDstStageMask = wait_stages,
         .commandBufferCount = 1,
         .pCommandBuffers = &command_buffer,
-        .signalSemaphoreCount = 1,
-        .pSignalSemaphores =
-            &context.render_finished_semaphores[context.current_frame_in_flight]
-                 .get()};
-
-    context.graphics_compute_queue.submit(
-        {submit_info},
-        context.in_flight_fences[context.current_frame_in_flight].get());
-
-    // FIXME: we shouldn't have the "eWait" flag here, see the bottom of
-    // https://docs.vulkan.org/samples/latest/samples/api/timestamp_queries/README.html
-    /*std::uint64_t timestamps[2] {};
-    vk::detail::resultCheck(
-        context.device->getQueryPoolResults(context.query_pool.get(),
-                                            0,
-                                            2,
-                                            sizeof(timestamps),
-                                            timestamps,
-                                            sizeof(std::uint64_t),
-                                            vk::QueryResultFlagBits::e64 |
-                                                vk::QueryResultFlagBits::eWait),
-        "vk::Device::getQueryPoolResults");
-    const auto period =
-        context.physical_device_properties.limits.timestampPeriod;
-    const float elapsed_ms =
-        static_cast<float>(timestamps[1] - timestamps[0]) * period / 1e6f;
-    std::cout << elapsed_ms << " ms\n";*/
+        .signalSemaphoreCount = semaphore_count,
+        .pSignalSemaphores = signal_semaphores};
 
     const vk::PresentInfoKHR present_info {
         .waitSemaphoreCount = 1,
@@ -2200,10 +3927,27 @@ void draw_frame(Vulkan_context &context,
         .pImageIndices = &image_index.value,
         .pResults = {}};
 
-    // NOTE: we use the noexcept version of presentKHR that takes the
-    // vk::PresentInfoKHR by pointer, because we don't want the call to
-    // throw an exception in case of vk::Result::ErrorOutOfDateKHR
-    result = context.present_queue.presentKHR(&present_info);
+    {
+        const std::lock_guard lock(*context.queue_mutex);
+
+        context.graphics_compute_queue.submit(
+            {submit_info},
+            context.in_flight_fences[context.current_frame_in_flight].get());
+
+        // NOTE: we use the noexcept version of presentKHR that takes the
+        // vk::PresentInfoKHR by pointer, because we don't want the call to
+        // throw an exception in case of vk::Result::ErrorOutOfDateKHR
+        result = context.present_queue.presentKHR(&present_info);
+    }
+
+    if (thread_state != nullptr)
+    {
+        {
+            const std::lock_guard lock(thread_state->mutex);
+            thread_state->submitted_ui_value = ui_value;
+        }
+        thread_state->condition.notify_one();
+    }
 
     if (result == vk::Result::eErrorOutOfDateKHR ||
         result == vk::Result::eSuboptimalKHR || context.framebuffer_resized)
@@ -2219,6 +3963,51 @@ void draw_frame(Vulkan_context &context,
         vk::detail::resultCheck(result, "vk::Queue::presentKHR");
     }
 
+    context.current_frame_in_flight = (context.current_frame_in_flight + 1) %
+                                      Vulkan_context::frames_in_flight;
+}
+
+void trace_samples(Vulkan_context &context,
+                   Vulkan_render_resources &render_resources,
+                   const Camera &camera)
+{
+    const auto result = context.device->waitForFences(
+        {context.in_flight_fences[context.current_frame_in_flight].get()},
+        VK_TRUE,
+        std::numeric_limits<std::uint64_t>::max());
+    vk::detail::resultCheck(result, "vk::Device::waitForFences");
+
+    context.device->resetFences(
+        {context.in_flight_fences[context.current_frame_in_flight].get()});
+
+    const auto command_buffer =
+        context.command_buffers[context.current_frame_in_flight].get();
+
+    command_buffer.reset();
+
+    constexpr vk::CommandBufferBeginInfo begin_info {
+        .flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit};
+    command_buffer.begin(begin_info);
+
+    begin_gpu_profiler_frame(context.device.get(),
+                             context.gpu_profiler,
+                             command_buffer,
+                             context.current_frame_in_flight);
+    record_trace_commands(context.global_frame_count,
+                          render_resources,
+                          camera,
+                          context.gpu_profiler,
+                          command_buffer);
+
+    command_buffer.end();
+
+    const vk::SubmitInfo submit_info {.commandBufferCount = 1,
+                                      .pCommandBuffers = &command_buffer};
+
+    context.graphics_compute_queue.submit(
+        {submit_info},
+        context.in_flight_fences[context.current_frame_in_flight].get());
+
     context.current_frame_in_flight = (context.current_frame_in_flight + 1) %
                                       Vulkan_context::frames_in_flight;
     ++context.global_frame_count;
@@ -2238,90 +4027,88 @@ void reset_render(Vulkan_render_resources &render_resources)
     render_resources.sample_count = 0;
 }
 
-std::string write_to_png(const Vulkan_context &context,
-                         const Vulkan_render_resources &render_resources,
-                         const char *file_name)
+std::string save_pipeline_cache(const Vulkan_context &context)
 {
-    VmaAllocationInfo staging_allocation_info {};
-    const auto staging_buffer =
-        create_buffer(context.allocator.get(),
-                      context.device.get(),
-                      render_resources.render_target.width *
-                          render_resources.render_target.height * 4,
-                      vk::BufferUsageFlagBits::eTransferDst,
-                      VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
-                          VMA_ALLOCATION_CREATE_MAPPED_BIT,
-                      VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
-                      &staging_allocation_info);
+    const auto data =
+        context.device->getPipelineCacheData(context.pipeline_cache.get());
+    const auto &path = context.pipeline_cache_path;
 
-    const auto *const mapped_data =
-        static_cast<std::uint8_t *>(staging_allocation_info.pMappedData);
+    std::error_code error;
+    std::filesystem::create_directories(path.parent_path(), error);
+    if (error)
+    {
+        std::ostringstream oss;
+        oss << "Failed to create directory " << path.parent_path() << ": "
+            << error.message();
+        return oss.str();
+    }
 
-    const auto command_buffer = begin_one_time_submit_command_buffer(context);
+    // Written next to the cache then renamed over it, so that a crash, or
+    // another instance saving at the same time, never leaves a truncated
+    // cache behind
+    auto temporary_path = path;
+    temporary_path += '.' + std::to_string(std::random_device {}()) + ".tmp";
+    {
+        std::ofstream file(temporary_path, std::ios::binary);
+        file.write(reinterpret_cast<const char *>(data.data()),
+                   static_cast<std::streamsize>(data.size()));
+        if (!file.flush())
+        {
+            file.close();
+            std::filesystem::remove(temporary_path, error);
+            std::ostringstream oss;
+            oss << "Failed to write file " << temporary_path;
+            return oss.str();
+        }
+    }
 
-    constexpr vk::ImageSubresourceRange subresource_range {
-        .aspectMask = vk::ImageAspectFlagBits::eColor,
-        .baseMipLevel = 0,
-        .levelCount = 1,
-        .baseArrayLayer = 0,
-        .layerCount = 1};
+    std::filesystem::rename(temporary_path, path, error);
+    if (error)
+    {
+        std::ostringstream oss;
+        oss << "Failed to rename " << temporary_path << " to " << path << ": "
+            << error.message();
+        std::filesystem::remove(temporary_path, error);
+        return oss.str();
+    }
 
-    // FIXME: these are probably wrong since we changed the way we write to
-    // the final image
-    vk::ImageMemoryBarrier image_memory_barrier {
-        .srcAccessMask = vk::AccessFlagBits::eShaderRead,
-        .dstAccessMask = vk::AccessFlagBits::eTransferRead,
-        .oldLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
-        .newLayout = vk::ImageLayout::eTransferSrcOptimal,
-        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .image = render_resources.render_target.image.get(),
-        .subresourceRange = subresource_range};
+    return {};
+}
 
-    command_buffer->pipelineBarrier(vk::PipelineStageFlagBits::eFragmentShader,
-                                    vk::PipelineStageFlagBits::eTransfer,
-                                    {},
-                                    {},
-                                    {},
-                                    {image_memory_barrier});
+std::string write_to_png(const Vulkan_context &context,
+                         const Vulkan_render_resources &render_resources,
+                         const char *file_name)
+{
+    const auto &image = render_resources.render_target;
+    const auto pixels = read_back_image(context, image, 4);
 
-    constexpr vk::ImageSubresourceLayers subresource_layers {
-        .aspectMask = vk::ImageAspectFlagBits::eColor,
-        .mipLevel = 0,
-        .baseArrayLayer = 0,
-        .layerCount = 1};
+    return write_png(file_name,
+                     pixels.data(),
+                     static_cast<int>(image.width),
+                     static_cast<int>(image.height));
+}
 
-    const vk::BufferImageCopy copy_region {
-        .bufferOffset = 0,
-        .bufferRowLength = {},
-        .bufferImageHeight = render_resources.render_target.height,
-        .imageSubresource = subresource_layers,
-        .imageOffset = {0, 0, 0},
-        .imageExtent = {render_resources.render_target.width,
-                        render_resources.render_target.height,
-                        1}};
-
-    command_buffer->copyImageToBuffer(
-        render_resources.render_target.image.get(),
-        vk::ImageLayout::eTransferSrcOptimal,
-        staging_buffer.buffer.get(),
-        {copy_region});
-
-    std::swap(image_memory_barrier.srcAccessMask,
-              image_memory_barrier.dstAccessMask);
-    std::swap(image_memory_barrier.oldLayout, image_memory_barrier.newLayout);
-
-    command_buffer->pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
-                                    vk::PipelineStageFlagBits::eFragmentShader,
-                                    {},
-                                    {},
-                                    {},
-                                    {image_memory_barrier});
+std::vector<float>
+read_back_storage_image(const Vulkan_context &context,
+                        const Vulkan_render_resources &render_resources)
+{
+    const auto pixels = read_back_image(
+        context, render_resources.storage_image, 4 * sizeof(float));
 
-    end_one_time_submit_command_buffer(context, command_buffer);
+    std::vector<float> rgba(pixels.size() / sizeof(float));
+    std::memcpy(rgba.data(), pixels.data(), pixels.size());
+    return rgba;
+}
 
-    return write_png(file_name,
-                     mapped_data,
-                     static_cast<int>(render_resources.render_target.width),
-                     static_cast<int>(render_resources.render_target.height));
+std::string write_to_hdr(const Vulkan_context &context,
+                         const Vulkan_render_resources &render_resources,
+                         const char *file_name)
+{
+    const auto &image = render_resources.storage_image;
+    const auto rgba = read_back_storage_image(context, render_resources);
+
+    return write_hdr(file_name,
+                     rgba.data(),
+                     static_cast<int>(image.width),
+                     static_cast<int>(image.height));
 }
@@ -9,8 +9,14 @@
 #define VULKAN_HPP_DISPATCH_LOADER_DYNAMIC 1
 #include <vulkan/vulkan.hpp>
 
+#include "gpu_profile.hpp"
+
 #include <array>
 #include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -166,6 +172,65 @@ struct Vulkan_buffer
     Unique_allocation allocation;
 };
 
+struct Upload_submission
+{
+    vk::UniqueCommandBuffer command_buffer;
+    std::uint64_t timeline_value;
+    std::uint64_t ring_end; // Position in the ring after the data it reads
+    // Kept alive until the submission completes, such as scratch buffers
+    std::vector<Vulkan_buffer> buffers;
+};
+
+// Host data is copied to a persistent host-visible staging buffer, used as a
+// ring, and the copies to device buffers and images are recorded into a
+// single command buffer, along with the commands that consume them such as
+// acceleration structure builds. The batch is only submitted when the ring is
+// full or when the uploads are waited for. Each submission signals a timeline
+// semaphore, so that the part of the ring it reads from is reused as soon as
+// it has completed, without waiting for the whole device.
+struct Upload_manager
+{
+    Vulkan_buffer staging_buffer;
+    std::uint8_t *staging_data;
+    // Positions only increase, the offset in the ring is the position modulo
+    // the size of the staging buffer
+    std::uint64_t head; // Next free position
+    std::uint64_t tail; // Oldest position a submission may still read from
+    vk::UniqueSemaphore semaphore;
+    std::uint64_t submitted_value;
+    vk::UniqueCommandBuffer command_buffer; // Empty if nothing is recorded
+    std::vector<Vulkan_buffer> batch_buffers; // Kept alive by the batch
+    std::deque<Upload_submission> submissions; // In flight, oldest first
+    std::uint64_t submission_count;
+    std::uint64_t uploaded_size;
+};
+
+struct Gpu_profiler_slot
+{
+    std::uint64_t frame_index;
+    std::uint32_t written_scopes; // Bit mask of the scopes
+    bool pending; // Written by a submission and not read back yet
+};
+
+// Timestamp queries around the scopes of the command buffers of one thread.
+// Each command buffer that can be in flight has its own slot of queries, read
+// back when the command buffer is recorded again: its previous submission
+// has completed by then, so reading the results never stalls.
+struct Gpu_profiler
+{
+    vk::UniqueQueryPool query_pool;
+    float timestamp_period; // In nanoseconds
+    std::uint64_t timestamp_mask;
+    std::uint64_t first_timestamp;
+    bool has_first_timestamp;
+    std::vector<Gpu_profiler_slot> slots;
+    std::uint32_t current_slot; // Of the command buffer being recorded
+    std::uint64_t frame_count;
+    // Frames whose timestamps were not available when their slot was reused
+    std::uint64_t dropped_frame_count;
+    Gpu_profile_history history;
+};
+
 struct Vulkan_context
 {
     vk::detail::DynamicLoader dl;
@@ -178,20 +243,40 @@ struct Vulkan_context
     vk::PhysicalDevice physical_device;
     std::uint32_t graphics_compute_queue_family_index;
     std::uint32_t present_queue_family_index;
+    std::uint32_t timestamp_valid_bits; // Of the graphics and compute family
     vk::PhysicalDeviceProperties physical_device_properties;
+    vk::PhysicalDeviceIDProperties physical_device_id_properties;
     vk::PhysicalDeviceRayTracingPipelinePropertiesKHR
         physical_device_ray_tracing_pipeline_properties;
+    vk::PhysicalDeviceAccelerationStructurePropertiesKHR
+        physical_device_acceleration_structure_properties;
 
     vk::UniqueDevice device;
     vk::Queue graphics_compute_queue;
     vk::Queue present_queue;
+    // Second queue of the graphics and compute queue family, for the render
+    // thread, so that long dispatches do not hold back the user interface. The
+    // graphics and compute queue itself if the family has a single queue.
+    vk::Queue trace_queue;
+    // Queues are externally synchronized, and some of the above can be the
+    // same queue. Submissions and presentation lock this while a render
+    // thread is running.
+    std::unique_ptr<std::mutex> queue_mutex;
 
     vk::UniqueSurfaceKHR surface;
 
     Unique_allocator allocator;
 
+    // Loaded from disk at creation and used for all pipelines, see
+    // save_pipeline_cache()
+    vk::UniquePipelineCache pipeline_cache;
+    std::filesystem::path pipeline_cache_path;
+    std::size_t pipeline_cache_loaded_size; // Zero for an empty cache
+
     vk::UniqueCommandPool command_pool;
 
+    Upload_manager upload_manager;
+
     bool framebuffer_resized;
     std::uint32_t framebuffer_width;
     std::uint32_t framebuffer_height;
@@ -215,7 +300,8 @@ struct Vulkan_context
     std::uint32_t current_frame_in_flight;
     std::uint32_t global_frame_count;
 
-    vk::UniqueQueryPool query_pool;
+    // Frames of the user interface, or of trace_samples() when headless
+    Gpu_profiler gpu_profiler;
 
     ImGui_backend imgui_backend;
 };
@@ -227,20 +313,32 @@ struct Vulkan_render_resources
     Vulkan_image render_target;
     vk::UniqueImageView render_target_view;
     vk::UniqueSampler render_target_sampler;
+    // Copies of the render target shown by the user interface, see
+    // Vulkan_render_thread
+    std::array<Vulkan_image, 2> display_images;
+    std::array<vk::UniqueImageView, 2> display_image_views;
+    // Shared by all meshes, see create_mesh_buffers()
     Vulkan_buffer vertex_buffer;
     Vulkan_buffer index_buffer;
     Vulkan_buffer normal_buffer;
+    Vulkan_buffer mesh_buffer;
     Vulkan_image environment_map;
     vk::UniqueImageView environment_map_view;
     vk::UniqueSampler environment_map_sampler;
-    Vulkan_buffer blas_buffer;
-    vk::UniqueAccelerationStructureKHR blas;
+    // One per mesh referenced by several instances, and one per group of
+    // meshes packed together, see create_blas_layout()
+    std::vector<Vulkan_buffer> blas_buffers;
+    std::vector<vk::UniqueAccelerationStructureKHR> blases;
     Vulkan_buffer tlas_buffer;
     vk::UniqueAccelerationStructureKHR tlas;
     vk::UniqueDescriptorSetLayout descriptor_set_layout;
     vk::UniqueDescriptorSetLayout final_render_descriptor_set_layout;
     vk::UniqueDescriptorSet descriptor_set;
-    vk::UniqueDescriptorSet final_render_descriptor_set;
+    // One per frame in flight, each with the display image its frame shows
+    std::array<vk::UniqueDescriptorSet, Vulkan_context::frames_in_flight>
+        final_render_descriptor_sets;
+    std::array<std::uint32_t, Vulkan_context::frames_in_flight>
+        final_render_display_indices;
     vk::UniquePipelineLayout ray_tracing_pipeline_layout;
     vk::UniquePipeline ray_tracing_pipeline;
     Vulkan_buffer sbt_buffer;
@@ -251,19 +349,91 @@ struct Vulkan_render_resources
     std::uint32_t samples_to_render;
     std::uint32_t sample_count;
     std::uint32_t samples_per_frame;
+    std::uint32_t rng_seed;
 };
 
+// If window is nullptr, the context is headless: it has no surface, swapchain
+// or ImGui backend, and can only be used with trace_samples().
 [[nodiscard]] Vulkan_context create_context(struct GLFWwindow *window);
 
+// Uploads the scene through the upload manager of the context, and waits for
+// it before returning
 [[nodiscard]] Vulkan_render_resources
-create_render_resources(const Vulkan_context &context,
+create_render_resources(Vulkan_context &context,
                         std::uint32_t render_width,
                         std::uint32_t render_height,
-                        const struct aiScene *scene);
+                        const struct Scene &scene);
 
+struct Render_thread_state;
+
+struct Render_thread_deleter
+{
+    void operator()(Render_thread_state *state) const;
+};
+
+// Traces samples on its own thread and queue, at its own pace, while
+// draw_frame() presents the latest tone-mapped image at display rate. Once the
+// user interface has shown the latest copy of the render target, the render
+// thread copies it again after its next dispatch, into the other of the two
+// display images, and publishes that one. Each side only waits for the other
+// on the GPU, through one timeline semaphore each, so long dispatches never
+// block the user interface thread, and tracing goes on while the window is
+// minimized. The render resources must not be used elsewhere while the thread
+// runs. Empty when no thread is running.
+struct Vulkan_render_thread
+{
+    std::unique_ptr<Render_thread_state, Render_thread_deleter> state;
+};
+
+// Starts accumulating samples from the current state of the render resources
+[[nodiscard]] Vulkan_render_thread
+start_render_thread(Vulkan_context &context,
+                    Vulkan_render_resources &render_resources,
+                    const struct Camera &camera);
+
+// Waits for the thread and for all submissions, then leaves it empty. Does
+// nothing if it is already empty. Rethrows an exception thrown by the thread.
+void stop_render_thread(Vulkan_context &context,
+                        Vulkan_render_thread &render_thread);
+
+// Takes effect at the next dispatch. With reset, the accumulation starts over.
+void update_render_thread(Vulkan_render_thread &render_thread,
+                          const struct Camera &camera,
+                          std::uint32_t samples_to_render,
+                          std::uint32_t samples_per_frame,
+                          bool reset);
+
+// Samples accumulated by the dispatches submitted so far
+[[nodiscard]] std::uint32_t
+get_sample_count(const Vulkan_render_thread &render_thread);
+
+// Latest frames of the user interface, or of trace_samples(), oldest first.
+// The timestamps of a frame are read back when its command buffer is reused,
+// so the last frames in flight only show up later, or after
+// flush_gpu_profile().
+[[nodiscard]] std::vector<Gpu_frame_profile>
+get_gpu_profile(const Vulkan_context &context);
+
+// Same for the submissions of a render thread, empty if none is running
+[[nodiscard]] std::vector<Gpu_frame_profile>
+get_gpu_profile(const Vulkan_render_thread &render_thread);
+
+// Reads back the timestamps of all the frames of the context. All
+// submissions must have completed, e.g. after a vk::Device::waitIdle().
+void flush_gpu_profile(Vulkan_context &context);
+
+// Draws the user interface, with the latest display image published by the
+// render thread, if any. Rethrows an exception thrown by the render thread.
 void draw_frame(Vulkan_context &context,
                 Vulkan_render_resources &render_resources,
-                const struct Camera &camera);
+                Vulkan_render_thread &render_thread);
+
+// Traces the next batch of samples_per_frame samples without presenting
+// anything. The submission is not waited for, so this can be called in a loop
+// and followed by a vk::Device::waitIdle().
+void trace_samples(Vulkan_context &context,
+                   Vulkan_render_resources &render_resources,
+                   const struct Camera &camera);
 
 void resize_framebuffer(Vulkan_context &context,
                         std::uint32_t width,
@@ -271,10 +441,29 @@ void resize_framebuffer(Vulkan_context &context,
 
 void reset_render(Vulkan_render_resources &render_resources);
 
+// Returns the linear accumulated radiance as RGBA floats, row by row. Blocks
+// until all previous submissions have completed.
+[[nodiscard]] std::vector<float>
+read_back_storage_image(const Vulkan_context &context,
+                        const Vulkan_render_resources &render_resources);
+
+// Writes the pipeline cache back to the file it was loaded from, atomically,
+// to be called before exiting. Failing to save it only makes the next start
+// slower.
+// On failure, returns an error message. On success, returns an empty string.
+[[nodiscard]] std::string save_pipeline_cache(const Vulkan_context &context);
+
 // On failure, returns an error message. On success, returns an empty string.
 [[nodiscard]] std::string
 write_to_png(const Vulkan_context &context,
              const Vulkan_render_resources &render_resources,
              const char *file_name);
 
+// Writes the linear, non tone-mapped accumulated radiance.
+// On failure, returns an error message. On success, returns an empty string.
+[[nodiscard]] std::string
+write_to_hdr(const Vulkan_context &context,
+             const Vulkan_render_resources &render_resources,
+             const char *file_name);
+
 #endif // RENDERER_HPP
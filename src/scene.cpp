@@ -0,0 +1,351 @@
+#include "scene.hpp"
+
+#include <assimp/scene.h>
+
+#include <algorithm>
+#include <limits>
+#include <queue>
+#include <span>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+
+namespace
+{
+
+[[nodiscard]] float
+get_box_area(const vec3 &v0, const vec3 &v1, const vec3 &v2) noexcept
+{
+    const vec3 min {std::min({v0.x, v1.x, v2.x}),
+                    std::min({v0.y, v1.y, v2.y}),
+                    std::min({v0.z, v1.z, v2.z})};
+    const vec3 max {std::max({v0.x, v1.x, v2.x}),
+                    std::max({v0.y, v1.y, v2.y}),
+                    std::max({v0.z, v1.z, v2.z})};
+    const auto d = max - min;
+    return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+// Surface area of the bounding box of the triangle, minus the smallest it can
+// be for a triangle of this area, which is when it is axis aligned
+[[nodiscard]] float
+get_wasted_area(const vec3 &v0, const vec3 &v1, const vec3 &v2) noexcept
+{
+    const auto triangle_area = 0.5f * norm(cross(v1 - v0, v2 - v0));
+    return get_box_area(v0, v1, v2) - 4.0f * triangle_area;
+}
+
+constexpr std::uint32_t no_mesh {0xffffffff};
+
+[[nodiscard]] mat3x4 to_mat3x4(const aiMatrix4x4 &matrix) noexcept
+{
+    return {{{matrix.a1, matrix.a2, matrix.a3, matrix.a4},
+             {matrix.b1, matrix.b2, matrix.b3, matrix.b4},
+             {matrix.c1, matrix.c2, matrix.c3, matrix.c4}}};
+}
+
+// Transform applying b, then a
+[[nodiscard]] mat3x4 multiply(const mat3x4 &a, const mat3x4 &b) noexcept
+{
+    mat3x4 result {};
+    for (int i {0}; i < 3; ++i)
+    {
+        for (int j {0}; j < 4; ++j)
+        {
+            result.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] +
+                             a.m[i][2] * b.m[2][j];
+        }
+        result.m[i][3] += a.m[i][3];
+    }
+    return result;
+}
+
+[[nodiscard]] Mesh create_mesh(const aiMesh *ai_mesh)
+{
+    Mesh mesh {};
+
+    mesh.vertices.resize(ai_mesh->mNumVertices);
+    mesh.normals.resize(ai_mesh->mNumVertices);
+    for (unsigned int i {0}; i < ai_mesh->mNumVertices; ++i)
+    {
+        const auto &vertex = ai_mesh->mVertices[i];
+        const auto &normal = ai_mesh->mNormals[i];
+        mesh.vertices[i] = {vertex.x, vertex.y, vertex.z};
+        mesh.normals[i] = {normal.x, normal.y, normal.z};
+    }
+
+    mesh.indices.resize(ai_mesh->mNumFaces * 3);
+    for (unsigned int i {0}; i < ai_mesh->mNumFaces; ++i)
+    {
+        mesh.indices[i * 3 + 0] = ai_mesh->mFaces[i].mIndices[0];
+        mesh.indices[i * 3 + 1] = ai_mesh->mFaces[i].mIndices[1];
+        mesh.indices[i * 3 + 2] = ai_mesh->mFaces[i].mIndices[2];
+    }
+
+    return mesh;
+}
+
+// Closest of the materials we support
+[[nodiscard]] Material get_material(const aiMaterial *material)
+{
+    aiColor3D emissive_color {};
+    if (material->Get(AI_MATKEY_COLOR_EMISSIVE, emissive_color) ==
+            aiReturn_SUCCESS &&
+        !emissive_color.IsBlack())
+    {
+        return Material::emissive;
+    }
+
+    float opacity {1.0f};
+    material->Get(AI_MATKEY_OPACITY, opacity);
+    float transmission {0.0f};
+    material->Get(AI_MATKEY_TRANSMISSION_FACTOR, transmission);
+    if (opacity < 1.0f || transmission > 0.0f)
+    {
+        return Material::dielectric;
+    }
+
+    float metallic {0.0f};
+    material->Get(AI_MATKEY_METALLIC_FACTOR, metallic);
+    if (metallic >= 0.5f)
+    {
+        return Material::specular;
+    }
+
+    return Material::diffuse;
+}
+
+// One instance per mesh of the node and of its descendants, with the transform
+// accumulated from the root
+void add_node_instances(const aiScene *scene,
+                        const aiNode *node,
+                        const mat3x4 &transform,
+                        std::span<const std::uint32_t> mesh_indices,
+                        Scene &result)
+{
+    for (unsigned int i {0}; i < node->mNumMeshes; ++i)
+    {
+        const auto ai_mesh_index = node->mMeshes[i];
+        if (mesh_indices[ai_mesh_index] == no_mesh)
+        {
+            continue;
+        }
+        const auto material_index =
+            scene->mMeshes[ai_mesh_index]->mMaterialIndex;
+        result.instances.push_back(
+            {.transform = transform,
+             .mesh_index = mesh_indices[ai_mesh_index],
+             .material = get_material(scene->mMaterials[material_index])});
+    }
+
+    for (unsigned int i {0}; i < node->mNumChildren; ++i)
+    {
+        const auto *const child = node->mChildren[i];
+        add_node_instances(scene,
+                           child,
+                           multiply(transform,
+                                    to_mat3x4(child->mTransformation)),
+                           mesh_indices,
+                           result);
+    }
+}
+
+void expand_bounds(vec3 &bounds_min, vec3 &bounds_max, const vec3 &p) noexcept
+{
+    bounds_min = {std::min(bounds_min.x, p.x),
+                  std::min(bounds_min.y, p.y),
+                  std::min(bounds_min.z, p.z)};
+    bounds_max = {std::max(bounds_max.x, p.x),
+                  std::max(bounds_max.y, p.y),
+                  std::max(bounds_max.z, p.z)};
+}
+
+// Centers the instances at the origin and scales them uniformly to fit in
+// [-1, 1] along each axis, like aiProcess_PreTransformVertices did with
+// AI_CONFIG_PP_PTV_NORMALIZE, so that the default camera frames the scene
+void normalize_instances(Scene &scene)
+{
+    constexpr auto infinity = std::numeric_limits<float>::infinity();
+    constexpr vec3 empty_min {infinity, infinity, infinity};
+    constexpr vec3 empty_max {-infinity, -infinity, -infinity};
+
+    std::vector<vec3> mesh_mins(scene.meshes.size(), empty_min);
+    std::vector<vec3> mesh_maxs(scene.meshes.size(), empty_max);
+    for (std::size_t i {0}; i < scene.meshes.size(); ++i)
+    {
+        for (const auto &vertex : scene.meshes[i].vertices)
+        {
+            expand_bounds(mesh_mins[i], mesh_maxs[i], vertex);
+        }
+    }
+
+    // Bounds of the transformed corners of the mesh bounds
+    auto scene_min = empty_min;
+    auto scene_max = empty_max;
+    for (const auto &instance : scene.instances)
+    {
+        const auto &mesh_min = mesh_mins[instance.mesh_index];
+        const auto &mesh_max = mesh_maxs[instance.mesh_index];
+        for (int corner {0}; corner < 8; ++corner)
+        {
+            const vec3 p {(corner & 1) ? mesh_max.x : mesh_min.x,
+                          (corner & 2) ? mesh_max.y : mesh_min.y,
+                          (corner & 4) ? mesh_max.z : mesh_min.z};
+            expand_bounds(
+                scene_min, scene_max, transform_point(instance.transform, p));
+        }
+    }
+
+    const auto center = (scene_min + scene_max) * 0.5f;
+    const auto extent = scene_max - scene_min;
+    const auto max_extent = std::max({extent.x, extent.y, extent.z});
+    const auto scale = max_extent > 0.0f ? 2.0f / max_extent : 1.0f;
+    const mat3x4 normalization {{{scale, 0.0f, 0.0f, -center.x * scale},
+                                 {0.0f, scale, 0.0f, -center.y * scale},
+                                 {0.0f, 0.0f, scale, -center.z * scale}}};
+
+    for (auto &instance : scene.instances)
+    {
+        instance.transform = multiply(normalization, instance.transform);
+    }
+}
+
+} // namespace
+
+Scene create_scene(const aiScene *scene, const char *environment_file_name)
+{
+    Scene result {};
+
+    // Meshes of points or lines are not rendered
+    std::vector<std::uint32_t> mesh_indices(scene->mNumMeshes, no_mesh);
+    for (unsigned int i {0}; i < scene->mNumMeshes; ++i)
+    {
+        const auto *const ai_mesh = scene->mMeshes[i];
+        if (ai_mesh->mPrimitiveTypes != aiPrimitiveType_TRIANGLE ||
+            ai_mesh->mNumFaces == 0 || !ai_mesh->HasNormals())
+        {
+            continue;
+        }
+        mesh_indices[i] = static_cast<std::uint32_t>(result.meshes.size());
+        result.meshes.push_back(create_mesh(ai_mesh));
+    }
+    if (result.meshes.empty())
+    {
+        throw std::runtime_error("Scene has no triangle meshes");
+    }
+
+    add_node_instances(scene,
+                       scene->mRootNode,
+                       to_mat3x4(scene->mRootNode->mTransformation),
+                       mesh_indices,
+                       result);
+    if (result.instances.empty())
+    {
+        throw std::runtime_error("Scene has no mesh instances");
+    }
+
+    normalize_instances(result);
+
+    result.environment_map = read_hdr_image(environment_file_name);
+
+    return result;
+}
+
+std::uint32_t presplit_triangles(Mesh &mesh, float budget)
+{
+    const auto triangle_count =
+        static_cast<std::uint32_t>(mesh.indices.size() / 3);
+    const auto max_split_count = static_cast<std::uint32_t>(
+        static_cast<float>(triangle_count) * std::max(budget, 0.0f));
+    if (triangle_count == 0 || max_split_count == 0)
+    {
+        return 0;
+    }
+
+    const auto get_triangle_wasted_area = [&](std::uint32_t triangle)
+    {
+        const auto *const indices = &mesh.indices[triangle * 3];
+        return get_wasted_area(mesh.vertices[indices[0]],
+                               mesh.vertices[indices[1]],
+                               mesh.vertices[indices[2]]);
+    };
+
+    // Only the triangles that waste more area than the average triangle box
+    // are worth splitting, the others are already a good fit
+    using Entry = std::pair<float, std::uint32_t>;
+    std::vector<Entry> entries(triangle_count);
+    double total_box_area {0.0};
+    for (std::uint32_t i {0}; i < triangle_count; ++i)
+    {
+        entries[i] = {get_triangle_wasted_area(i), i};
+        const auto *const indices = &mesh.indices[i * 3];
+        total_box_area += static_cast<double>(
+            get_box_area(mesh.vertices[indices[0]],
+                         mesh.vertices[indices[1]],
+                         mesh.vertices[indices[2]]));
+    }
+    const auto min_wasted_area = static_cast<float>(
+        total_box_area / static_cast<double>(triangle_count));
+    std::priority_queue<Entry> queue(std::less<Entry> {}, std::move(entries));
+
+    // Triangles that share an edge share its midpoint too
+    std::unordered_map<std::uint64_t, std::uint32_t> midpoints;
+    const auto get_midpoint = [&](std::uint32_t a, std::uint32_t b)
+    {
+        const auto key =
+            (std::uint64_t {std::min(a, b)} << 32) | std::max(a, b);
+        const auto [it, inserted] = midpoints.try_emplace(
+            key, static_cast<std::uint32_t>(mesh.vertices.size()));
+        if (inserted)
+        {
+            mesh.vertices.push_back((mesh.vertices[a] + mesh.vertices[b]) *
+                                    0.5f);
+            // Not normalized, so that interpolating the normals across the
+            // halves gives the same result as across the whole triangle
+            mesh.normals.push_back((mesh.normals[a] + mesh.normals[b]) * 0.5f);
+        }
+        return it->second;
+    };
+
+    std::uint32_t split_count {0};
+    while (split_count < max_split_count && !queue.empty() &&
+           queue.top().first > min_wasted_area)
+    {
+        const auto triangle = queue.top().second;
+        queue.pop();
+
+        // Rotate the triangle so that its longest edge is i0 i1, the winding
+        // order is unchanged
+        std::uint32_t i[3] {mesh.indices[triangle * 3 + 0],
+                            mesh.indices[triangle * 3 + 1],
+                            mesh.indices[triangle * 3 + 2]};
+        float longest_length {-1.0f};
+        int longest_edge {0};
+        for (int e {0}; e < 3; ++e)
+        {
+            const auto edge =
+                mesh.vertices[i[(e + 1) % 3]] - mesh.vertices[i[e]];
+            const auto length = dot(edge, edge);
+            if (length > longest_length)
+            {
+                longest_length = length;
+                longest_edge = e;
+            }
+        }
+        std::rotate(i, i + longest_edge, i + 3);
+
+        const auto midpoint = get_midpoint(i[0], i[1]);
+        const auto new_triangle =
+            static_cast<std::uint32_t>(mesh.indices.size() / 3);
+        mesh.indices[triangle * 3 + 0] = i[0];
+        mesh.indices[triangle * 3 + 1] = midpoint;
+        mesh.indices[triangle * 3 + 2] = i[2];
+        mesh.indices.insert(mesh.indices.end(), {midpoint, i[1], i[2]});
+        ++split_count;
+
+        queue.emplace(get_triangle_wasted_area(triangle), triangle);
+        queue.emplace(get_triangle_wasted_area(new_triangle), new_triangle);
+    }
+
+    return split_count;
+}
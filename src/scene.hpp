@@ -0,0 +1,124 @@
+#ifndef SCENE_HPP
+#define SCENE_HPP
+
+#include "utility.hpp"
+#include "vec3.hpp"
+
+#include <cstdint>
+#include <vector>
+
+// Row-major affine transform, with the same layout as VkTransformMatrixKHR
+struct mat3x4
+{
+    float m[3][4];
+};
+
+[[nodiscard]] constexpr vec3 transform_point(const mat3x4 &transform,
+                                             const vec3 &p) noexcept
+{
+    const auto &m = transform.m;
+    return {m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+            m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+            m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]};
+}
+
+[[nodiscard]] constexpr vec3 transform_direction(const mat3x4 &transform,
+                                                 const vec3 &v) noexcept
+{
+    const auto &m = transform.m;
+    return {m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+            m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+            m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z};
+}
+
+// Multiplies v by the transpose of the linear part of the transform. Applied
+// to the inverse transform, this is how normals are transformed.
+[[nodiscard]] constexpr vec3
+transform_direction_transposed(const mat3x4 &transform, const vec3 &v) noexcept
+{
+    const auto &m = transform.m;
+    return {m[0][0] * v.x + m[1][0] * v.y + m[2][0] * v.z,
+            m[0][1] * v.x + m[1][1] * v.y + m[2][1] * v.z,
+            m[0][2] * v.x + m[1][2] * v.y + m[2][2] * v.z};
+}
+
+// The linear part of the transform must be invertible
+[[nodiscard]] constexpr mat3x4
+invert_affine_transform(const mat3x4 &transform) noexcept
+{
+    const auto &m = transform.m;
+
+    const auto c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+    const auto c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+    const auto c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+    const auto inv_det =
+        1.0f / (m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02);
+
+    mat3x4 result {};
+    auto &r = result.m;
+    r[0][0] = c00 * inv_det;
+    r[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+    r[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+    r[1][0] = c01 * inv_det;
+    r[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+    r[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+    r[2][0] = c02 * inv_det;
+    r[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+    r[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+
+    const vec3 t {m[0][3], m[1][3], m[2][3]};
+    const auto inverse_t = -transform_direction(result, t);
+    r[0][3] = inverse_t.x;
+    r[1][3] = inverse_t.y;
+    r[2][3] = inverse_t.z;
+
+    return result;
+}
+
+// The values match the order of the hit groups in the shader binding table
+enum struct Material : std::uint32_t
+{
+    diffuse,
+    specular,
+    emissive,
+    dielectric
+};
+
+struct Mesh
+{
+    std::vector<vec3> vertices;
+    std::vector<vec3> normals;
+    std::vector<std::uint32_t> indices;
+};
+
+struct Instance
+{
+    mat3x4 transform;
+    std::uint32_t mesh_index;
+    Material material;
+};
+
+// Host-side copy of everything that gets uploaded to the GPU, so that the CPU
+// and GPU backends render exactly the same data.
+struct Scene
+{
+    std::vector<Mesh> meshes;
+    std::vector<Instance> instances;
+    Image<float> environment_map;
+};
+
+// The environment map is read from a linear HDR image
+[[nodiscard]] Scene create_scene(const struct aiScene *scene,
+                                const char *environment_file_name);
+
+// Splits the triangles whose bounding box is much larger than they are, such
+// as long diagonal ones, in two at the middle of their longest edge, so that
+// acceleration structures built over the mesh get tighter boxes. The worst
+// triangles are split first, until budget times the original number of
+// triangles were added, or all triangles fit their box well enough. The
+// surface and its interpolated normals are unchanged, but the new vertices can
+// create T-junctions with neighbouring triangles. Returns the number of
+// triangles added.
+std::uint32_t presplit_triangles(Mesh &mesh, float budget);
+
+#endif // SCENE_HPP
@@ -8,6 +8,18 @@ layout (binding = 2, scalar) restrict readonly buffer Vertices { vec3 vertices[]
 layout (binding = 3, scalar) restrict readonly buffer Indices { uint indices[]; };
 layout (binding = 5, scalar) restrict readonly buffer Normals { vec3 normals[]; };
 
+// Where the data of a mesh starts in the buffers above, the indices being
+// relative to the first vertex of the mesh
+struct Mesh_info
+{
+    uint first_index;
+    uint first_vertex;
+};
+
+// Indexed by the custom index of the instance plus the index of the geometry
+// in the BLAS
+layout (binding = 7, scalar) restrict readonly buffer Meshes { Mesh_info meshes[]; };
+
 layout (location = 0) rayPayloadInEXT Ray_payload payload;
 
 hitAttributeEXT vec2 attributes;
@@ -58,9 +70,11 @@ vec3 reflect_diffuse(vec3 normal, inout uint rng_state)
 
 Hit get_hit()
 {
-    const uint i0 = indices[gl_PrimitiveID * 3 + 0];
-    const uint i1 = indices[gl_PrimitiveID * 3 + 1];
-    const uint i2 = indices[gl_PrimitiveID * 3 + 2];
+    const Mesh_info mesh = meshes[gl_InstanceCustomIndexEXT + gl_GeometryIndexEXT];
+    const uint first_index = mesh.first_index + gl_PrimitiveID * 3;
+    const uint i0 = mesh.first_vertex + indices[first_index + 0];
+    const uint i1 = mesh.first_vertex + indices[first_index + 1];
+    const uint i2 = mesh.first_vertex + indices[first_index + 2];
     const vec3 v0 = vertices[i0];
     const vec3 v1 = vertices[i1];
     const vec3 v2 = vertices[i2];
@@ -0,0 +1,201 @@
+#include "tile_scheduler.hpp"
+#include "numa.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+namespace
+{
+
+struct Task
+{
+    std::uint32_t item;
+    std::uint32_t pass;
+};
+
+// The owner pushes and pops at the back, thieves take from the front, which
+// holds the items the owner would have reached last
+struct Worker
+{
+    std::mutex mutex;
+    std::deque<Task> tasks;
+};
+
+// From https://en.wikipedia.org/wiki/Hilbert_curve, n must be a power of 2
+[[nodiscard]] std::uint64_t
+get_hilbert_index(std::uint32_t n, std::uint32_t x, std::uint32_t y) noexcept
+{
+    std::uint64_t d {0};
+    for (auto s = n / 2; s > 0; s /= 2)
+    {
+        const std::uint32_t rx {(x & s) > 0 ? 1u : 0u};
+        const std::uint32_t ry {(y & s) > 0 ? 1u : 0u};
+        d += std::uint64_t {s} * s * ((3 * rx) ^ ry);
+        if (ry == 0)
+        {
+            if (rx == 1)
+            {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+[[nodiscard]] bool pop_back(Worker &worker, Task &task)
+{
+    const std::lock_guard lock {worker.mutex};
+    if (worker.tasks.empty())
+    {
+        return false;
+    }
+    task = worker.tasks.back();
+    worker.tasks.pop_back();
+    return true;
+}
+
+[[nodiscard]] bool steal_front(Worker &worker, Task &task)
+{
+    const std::lock_guard lock {worker.mutex};
+    if (worker.tasks.empty())
+    {
+        return false;
+    }
+    task = worker.tasks.front();
+    worker.tasks.pop_front();
+    return true;
+}
+
+void push_back(Worker &worker, const Task &task)
+{
+    const std::lock_guard lock {worker.mutex};
+    worker.tasks.push_back(task);
+}
+
+} // namespace
+
+std::vector<std::uint32_t> get_hilbert_tile_order(std::uint32_t tiles_x,
+                                                  std::uint32_t tiles_y)
+{
+    const auto n = std::bit_ceil(std::max(tiles_x, tiles_y));
+
+    std::vector<std::pair<std::uint64_t, std::uint32_t>> keys;
+    keys.reserve(std::size_t {tiles_x} * tiles_y);
+    for (std::uint32_t y {0}; y < tiles_y; ++y)
+    {
+        for (std::uint32_t x {0}; x < tiles_x; ++x)
+        {
+            keys.emplace_back(get_hilbert_index(n, x, y), y * tiles_x + x);
+        }
+    }
+    std::sort(keys.begin(), keys.end());
+
+    std::vector<std::uint32_t> order;
+    order.reserve(keys.size());
+    for (const auto &key : keys)
+    {
+        order.push_back(key.second);
+    }
+    return order;
+}
+
+Scheduler_stats run_work_stealing(
+    unsigned int thread_count,
+    std::uint32_t item_count,
+    std::uint32_t pass_count,
+    const std::function<void(unsigned int, std::uint32_t, std::uint32_t)>
+        &execute)
+{
+    thread_count = std::max(thread_count, 1u);
+
+    Scheduler_stats stats {};
+    stats.threads.resize(thread_count);
+
+    std::vector<Worker> workers(thread_count);
+    for (unsigned int i {0}; i < thread_count; ++i)
+    {
+        const auto begin = static_cast<std::uint32_t>(
+            std::uint64_t {item_count} * i / thread_count);
+        const auto end = static_cast<std::uint32_t>(
+            std::uint64_t {item_count} * (i + 1) / thread_count);
+        for (auto item = end; item > begin; --item)
+        {
+            workers[i].tasks.push_back({item - 1, 0});
+        }
+    }
+
+    std::atomic<std::uint64_t> remaining_task_count {
+        pass_count > 0 ? std::uint64_t {item_count} * pass_count : 0};
+
+    const auto work = [&](unsigned int thread_index)
+    {
+        if (thread_index > 0)
+        {
+            pin_pool_thread(thread_index);
+        }
+        auto &thread_stats = stats.threads[thread_index];
+        auto &worker = workers[thread_index];
+
+        while (remaining_task_count.load(std::memory_order_acquire) > 0)
+        {
+            Task task {};
+            bool found {pop_back(worker, task)};
+            for (unsigned int i {1}; !found && i < thread_count; ++i)
+            {
+                found = steal_front(
+                    workers[(thread_index + i) % thread_count], task);
+                if (found)
+                {
+                    ++thread_stats.stolen_task_count;
+                }
+            }
+            if (!found)
+            {
+                // The remaining tasks are running, and may still push their
+                // next pass
+                std::this_thread::yield();
+                continue;
+            }
+
+            const auto start = std::chrono::steady_clock::now();
+            execute(thread_index, task.item, task.pass);
+            const std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - start;
+            thread_stats.busy_seconds += elapsed.count();
+            ++thread_stats.task_count;
+
+            if (task.pass + 1 < pass_count)
+            {
+                push_back(worker, {task.item, task.pass + 1});
+            }
+            remaining_task_count.fetch_sub(1, std::memory_order_release);
+        }
+    };
+
+    const auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    threads.reserve(thread_count - 1);
+    for (unsigned int i {1}; i < thread_count; ++i)
+    {
+        threads.emplace_back(work, i);
+    }
+    work(0);
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    stats.wall_seconds = elapsed.count();
+    return stats;
+}
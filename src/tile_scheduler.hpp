@@ -0,0 +1,39 @@
+#ifndef TILE_SCHEDULER_HPP
+#define TILE_SCHEDULER_HPP
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+struct Scheduler_thread_stats
+{
+    double busy_seconds; // Time spent executing tasks
+    std::uint32_t task_count;
+    std::uint32_t stolen_task_count; // Tasks taken from another thread
+};
+
+struct Scheduler_stats
+{
+    double wall_seconds;
+    std::vector<Scheduler_thread_stats> threads;
+};
+
+// Returns the indices of the tiles of a tiles_x by tiles_y grid (row major),
+// sorted along a Hilbert curve, so that consecutive tiles are close together
+[[nodiscard]] std::vector<std::uint32_t>
+get_hilbert_tile_order(std::uint32_t tiles_x, std::uint32_t tiles_y);
+
+// Calls execute(thread_index, item, pass) for every item in [0, item_count)
+// and every pass in [0, pass_count), on thread_count threads including the
+// calling one. Pass p + 1 of an item always runs after pass p, but without
+// waiting for the other items. Each thread starts with a contiguous range of
+// items in its own deque, continues each item with its next pass, and steals
+// from the other threads once its deque is empty.
+[[nodiscard]] Scheduler_stats run_work_stealing(
+    unsigned int thread_count,
+    std::uint32_t item_count,
+    std::uint32_t pass_count,
+    const std::function<void(unsigned int, std::uint32_t, std::uint32_t)>
+        &execute);
+
+#endif // TILE_SCHEDULER_HPP
@@ -109,3 +109,19 @@ std::string write_png(const char *file_name,
         return {};
     }
 }
+
+std::string
+write_hdr(const char *file_name, const float *data, int width, int height)
+{
+    const auto write_result = stbi_write_hdr(file_name, width, height, 4, data);
+    if (write_result == 0)
+    {
+        std::ostringstream message;
+        message << "Failed to write HDR image to \"" << file_name << '\"';
+        return message.str();
+    }
+    else
+    {
+        return {};
+    }
+}
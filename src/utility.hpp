@@ -42,4 +42,9 @@ read_binary_file(const char *file_name);
                                     int width,
                                     int height);
 
+// Expects 4 channels per pixel, the alpha channel is discarded.
+// On failure, returns an error message. On success, returns an empty string.
+[[nodiscard]] std::string
+write_hdr(const char *file_name, const float *data, int width, int height);
+
 #endif // UTILITY_HPP
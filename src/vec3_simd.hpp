@@ -0,0 +1,721 @@
+#ifndef VEC3_SIMD_HPP
+#define VEC3_SIMD_HPP
+
+// Structure of arrays companions of vec3: vec3x4, vec3x8 and vec3x16 hold 4, 8
+// or 16 vectors, with each component in one SIMD register (floatx<N>). They
+// use SSE, AVX or AVX-512 registers when the file that includes them is
+// compiled for that instruction set. Wider types are otherwise made of two
+// halves, down to a scalar fallback on architectures without SSE. All the
+// operations are done lane by lane in the same order as for vec3, so each lane
+// gets the same result as the scalar code, except for rsqrt(), which is an
+// approximation. As for the wide BVH traversal, that requires files built
+// with FMA to disable contraction (-ffp-contract=off), or the compiler fuses
+// the products and sums differently in both versions.
+//
+// NOTE: the types depend on the instruction sets enabled in the including
+// file, so everything is in an inline namespace named after them. Files
+// compiled with different flags (like wide_bvh_avx2.cpp) then get distinct
+// symbols, instead of the linker keeping a single copy of each function.
+
+#include "vec3.hpp"
+
+#include <cmath>
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+#if defined(__AVX512F__)
+#define VEC3_SIMD_NAMESPACE avx512
+#elif defined(__AVX__)
+#define VEC3_SIMD_NAMESPACE avx
+#elif defined(__SSE2__) || defined(_M_X64)
+#define VEC3_SIMD_NAMESPACE sse2
+#else
+#define VEC3_SIMD_NAMESPACE portable
+#endif
+
+inline namespace VEC3_SIMD_NAMESPACE
+{
+
+// Register and mask types of width N, with the primitive operations that
+// floatx<N> is built on. Without a native register, two halves are used.
+template <std::uint32_t N>
+struct Simd_ops
+{
+    static_assert(N > 4 && N % 2 == 0);
+    using Half = Simd_ops<N / 2>;
+
+    struct Float
+    {
+        typename Half::Float lo;
+        typename Half::Float hi;
+    };
+
+    struct Mask
+    {
+        typename Half::Mask lo;
+        typename Half::Mask hi;
+    };
+
+    [[nodiscard]] static Float set1(float f) noexcept
+    {
+        return {Half::set1(f), Half::set1(f)};
+    }
+
+    [[nodiscard]] static Float load(const float *p) noexcept
+    {
+        return {Half::load(p), Half::load(p + N / 2)};
+    }
+
+    static void store(float *p, const Float &a) noexcept
+    {
+        Half::store(p, a.lo);
+        Half::store(p + N / 2, a.hi);
+    }
+
+#define SIMD_OPS_SPLIT_UNARY(name, Result, Argument)                           \
+    [[nodiscard]] static Result name(const Argument &a) noexcept               \
+    {                                                                          \
+        return {Half::name(a.lo), Half::name(a.hi)};                           \
+    }
+#define SIMD_OPS_SPLIT_BINARY(name, Result, Argument)                          \
+    [[nodiscard]] static Result name(const Argument &a,                        \
+                                     const Argument &b) noexcept               \
+    {                                                                          \
+        return {Half::name(a.lo, b.lo), Half::name(a.hi, b.hi)};               \
+    }
+
+    SIMD_OPS_SPLIT_BINARY(add, Float, Float)
+    SIMD_OPS_SPLIT_BINARY(sub, Float, Float)
+    SIMD_OPS_SPLIT_BINARY(mul, Float, Float)
+    SIMD_OPS_SPLIT_BINARY(div, Float, Float)
+    SIMD_OPS_SPLIT_BINARY(min, Float, Float)
+    SIMD_OPS_SPLIT_BINARY(max, Float, Float)
+    SIMD_OPS_SPLIT_UNARY(sqrt, Float, Float)
+    SIMD_OPS_SPLIT_UNARY(rsqrt, Float, Float)
+    SIMD_OPS_SPLIT_BINARY(less, Mask, Float)
+    SIMD_OPS_SPLIT_BINARY(less_equal, Mask, Float)
+    SIMD_OPS_SPLIT_BINARY(equal, Mask, Float)
+    SIMD_OPS_SPLIT_BINARY(not_equal, Mask, Float)
+    SIMD_OPS_SPLIT_BINARY(mask_and, Mask, Mask)
+    SIMD_OPS_SPLIT_BINARY(mask_or, Mask, Mask)
+    SIMD_OPS_SPLIT_UNARY(mask_not, Mask, Mask)
+
+#undef SIMD_OPS_SPLIT_UNARY
+#undef SIMD_OPS_SPLIT_BINARY
+
+    [[nodiscard]] static Float
+    select(const Mask &m, const Float &a, const Float &b) noexcept
+    {
+        return {Half::select(m.lo, a.lo, b.lo), Half::select(m.hi, a.hi, b.hi)};
+    }
+
+    [[nodiscard]] static std::uint32_t bits(const Mask &m) noexcept
+    {
+        return Half::bits(m.lo) | (Half::bits(m.hi) << (N / 2));
+    }
+};
+
+#if defined(__SSE2__) || defined(_M_X64)
+
+template <>
+struct Simd_ops<4>
+{
+    using Float = __m128;
+    using Mask = __m128;
+
+    // clang-format off
+    [[nodiscard]] static Float set1(float f) noexcept { return _mm_set1_ps(f); }
+    [[nodiscard]] static Float load(const float *p) noexcept { return _mm_loadu_ps(p); }
+    static void store(float *p, Float a) noexcept { _mm_storeu_ps(p, a); }
+    [[nodiscard]] static Float add(Float a, Float b) noexcept { return _mm_add_ps(a, b); }
+    [[nodiscard]] static Float sub(Float a, Float b) noexcept { return _mm_sub_ps(a, b); }
+    [[nodiscard]] static Float mul(Float a, Float b) noexcept { return _mm_mul_ps(a, b); }
+    [[nodiscard]] static Float div(Float a, Float b) noexcept { return _mm_div_ps(a, b); }
+    [[nodiscard]] static Float min(Float a, Float b) noexcept { return _mm_min_ps(a, b); }
+    [[nodiscard]] static Float max(Float a, Float b) noexcept { return _mm_max_ps(a, b); }
+    [[nodiscard]] static Float sqrt(Float a) noexcept { return _mm_sqrt_ps(a); }
+    [[nodiscard]] static Mask less(Float a, Float b) noexcept { return _mm_cmplt_ps(a, b); }
+    [[nodiscard]] static Mask less_equal(Float a, Float b) noexcept { return _mm_cmple_ps(a, b); }
+    [[nodiscard]] static Mask equal(Float a, Float b) noexcept { return _mm_cmpeq_ps(a, b); }
+    [[nodiscard]] static Mask not_equal(Float a, Float b) noexcept { return _mm_cmpneq_ps(a, b); }
+    [[nodiscard]] static Mask mask_and(Mask a, Mask b) noexcept { return _mm_and_ps(a, b); }
+    [[nodiscard]] static Mask mask_or(Mask a, Mask b) noexcept { return _mm_or_ps(a, b); }
+    // clang-format on
+
+    // The hardware estimate has 12 bits of precision, one Newton-Raphson step
+    // brings it to about 22
+    [[nodiscard]] static Float rsqrt(Float a) noexcept
+    {
+        const auto y = _mm_rsqrt_ps(a);
+        const auto a_y_y = _mm_mul_ps(_mm_mul_ps(a, y), y);
+        return _mm_mul_ps(
+            _mm_mul_ps(_mm_set1_ps(0.5f), y),
+            _mm_sub_ps(_mm_set1_ps(3.0f), a_y_y));
+    }
+
+    [[nodiscard]] static Mask mask_not(Mask a) noexcept
+    {
+        return _mm_xor_ps(a, _mm_castsi128_ps(_mm_set1_epi32(-1)));
+    }
+
+    [[nodiscard]] static Float select(Mask m, Float a, Float b) noexcept
+    {
+        return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b));
+    }
+
+    [[nodiscard]] static std::uint32_t bits(Mask m) noexcept
+    {
+        return static_cast<std::uint32_t>(_mm_movemask_ps(m));
+    }
+};
+
+#else
+
+// Written so that the compiler can vectorize it
+template <>
+struct Simd_ops<4>
+{
+    struct Float
+    {
+        float v[4];
+    };
+    using Mask = std::uint32_t; // One bit per lane
+
+    [[nodiscard]] static Float set1(float f) noexcept
+    {
+        return {{f, f, f, f}};
+    }
+
+    [[nodiscard]] static Float load(const float *p) noexcept
+    {
+        return {{p[0], p[1], p[2], p[3]}};
+    }
+
+    static void store(float *p, const Float &a) noexcept
+    {
+        for (std::uint32_t i {0}; i < 4; ++i)
+        {
+            p[i] = a.v[i];
+        }
+    }
+
+#define SIMD_OPS_PORTABLE_BINARY(name, expression)                             \
+    [[nodiscard]] static Float name(const Float &a, const Float &b) noexcept   \
+    {                                                                          \
+        Float result;                                                          \
+        for (std::uint32_t i {0}; i < 4; ++i)                                  \
+        {                                                                      \
+            result.v[i] = expression;                                          \
+        }                                                                      \
+        return result;                                                         \
+    }
+#define SIMD_OPS_PORTABLE_COMPARISON(name, op)                                 \
+    [[nodiscard]] static Mask name(const Float &a, const Float &b) noexcept    \
+    {                                                                          \
+        Mask mask {0};                                                         \
+        for (std::uint32_t i {0}; i < 4; ++i)                                  \
+        {                                                                      \
+            mask |= static_cast<std::uint32_t>(a.v[i] op b.v[i]) << i;         \
+        }                                                                      \
+        return mask;                                                           \
+    }
+
+    SIMD_OPS_PORTABLE_BINARY(add, a.v[i] + b.v[i])
+    SIMD_OPS_PORTABLE_BINARY(sub, a.v[i] - b.v[i])
+    SIMD_OPS_PORTABLE_BINARY(mul, a.v[i] * b.v[i])
+    SIMD_OPS_PORTABLE_BINARY(div, a.v[i] / b.v[i])
+    // Same NaN behaviour as the SSE instructions: the second operand wins
+    SIMD_OPS_PORTABLE_BINARY(min, a.v[i] < b.v[i] ? a.v[i] : b.v[i])
+    SIMD_OPS_PORTABLE_BINARY(max, a.v[i] > b.v[i] ? a.v[i] : b.v[i])
+    SIMD_OPS_PORTABLE_COMPARISON(less, <)
+    SIMD_OPS_PORTABLE_COMPARISON(less_equal, <=)
+    SIMD_OPS_PORTABLE_COMPARISON(equal, ==)
+    SIMD_OPS_PORTABLE_COMPARISON(not_equal, !=)
+
+#undef SIMD_OPS_PORTABLE_BINARY
+#undef SIMD_OPS_PORTABLE_COMPARISON
+
+    [[nodiscard]] static Float sqrt(const Float &a) noexcept
+    {
+        Float result;
+        for (std::uint32_t i {0}; i < 4; ++i)
+        {
+            result.v[i] = std::sqrt(a.v[i]);
+        }
+        return result;
+    }
+
+    // Exact, there is no portable estimate
+    [[nodiscard]] static Float rsqrt(const Float &a) noexcept
+    {
+        return div(set1(1.0f), sqrt(a));
+    }
+
+    // clang-format off
+    [[nodiscard]] static Mask mask_and(Mask a, Mask b) noexcept { return a & b; }
+    [[nodiscard]] static Mask mask_or(Mask a, Mask b) noexcept { return a | b; }
+    [[nodiscard]] static Mask mask_not(Mask a) noexcept { return ~a & 0xfu; }
+    [[nodiscard]] static std::uint32_t bits(Mask m) noexcept { return m; }
+    // clang-format on
+
+    [[nodiscard]] static Float
+    select(Mask m, const Float &a, const Float &b) noexcept
+    {
+        Float result;
+        for (std::uint32_t i {0}; i < 4; ++i)
+        {
+            result.v[i] = ((m >> i) & 1u) != 0 ? a.v[i] : b.v[i];
+        }
+        return result;
+    }
+};
+
+#endif
+
+#if defined(__AVX__)
+
+template <>
+struct Simd_ops<8>
+{
+    using Float = __m256;
+    using Mask = __m256;
+
+    // clang-format off
+    [[nodiscard]] static Float set1(float f) noexcept { return _mm256_set1_ps(f); }
+    [[nodiscard]] static Float load(const float *p) noexcept { return _mm256_loadu_ps(p); }
+    static void store(float *p, Float a) noexcept { _mm256_storeu_ps(p, a); }
+    [[nodiscard]] static Float add(Float a, Float b) noexcept { return _mm256_add_ps(a, b); }
+    [[nodiscard]] static Float sub(Float a, Float b) noexcept { return _mm256_sub_ps(a, b); }
+    [[nodiscard]] static Float mul(Float a, Float b) noexcept { return _mm256_mul_ps(a, b); }
+    [[nodiscard]] static Float div(Float a, Float b) noexcept { return _mm256_div_ps(a, b); }
+    [[nodiscard]] static Float min(Float a, Float b) noexcept { return _mm256_min_ps(a, b); }
+    [[nodiscard]] static Float max(Float a, Float b) noexcept { return _mm256_max_ps(a, b); }
+    [[nodiscard]] static Float sqrt(Float a) noexcept { return _mm256_sqrt_ps(a); }
+    [[nodiscard]] static Mask less(Float a, Float b) noexcept { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+    [[nodiscard]] static Mask less_equal(Float a, Float b) noexcept { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+    [[nodiscard]] static Mask equal(Float a, Float b) noexcept { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+    [[nodiscard]] static Mask not_equal(Float a, Float b) noexcept { return _mm256_cmp_ps(a, b, _CMP_NEQ_UQ); }
+    [[nodiscard]] static Mask mask_and(Mask a, Mask b) noexcept { return _mm256_and_ps(a, b); }
+    [[nodiscard]] static Mask mask_or(Mask a, Mask b) noexcept { return _mm256_or_ps(a, b); }
+    [[nodiscard]] static Float select(Mask m, Float a, Float b) noexcept { return _mm256_blendv_ps(b, a, m); }
+    // clang-format on
+
+    // Same precision as the SSE version
+    [[nodiscard]] static Float rsqrt(Float a) noexcept
+    {
+        const auto y = _mm256_rsqrt_ps(a);
+        const auto a_y_y = _mm256_mul_ps(_mm256_mul_ps(a, y), y);
+        return _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), y),
+                             _mm256_sub_ps(_mm256_set1_ps(3.0f), a_y_y));
+    }
+
+    [[nodiscard]] static Mask mask_not(Mask a) noexcept
+    {
+        return _mm256_xor_ps(a, _mm256_cmp_ps(a, a, _CMP_TRUE_UQ));
+    }
+
+    [[nodiscard]] static std::uint32_t bits(Mask m) noexcept
+    {
+        return static_cast<std::uint32_t>(_mm256_movemask_ps(m));
+    }
+};
+
+#endif
+
+#if defined(__AVX512F__)
+
+// GCC warns that the undefined source operand that some AVX-512 intrinsics
+// pass to their masked builtin (_mm512_undefined_ps()) is used uninitialized.
+// That operand is ignored under a full mask, so the warning is a false
+// positive from the compiler headers.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+template <>
+struct Simd_ops<16>
+{
+    using Float = __m512;
+    using Mask = __mmask16;
+
+    // clang-format off
+    [[nodiscard]] static Float set1(float f) noexcept { return _mm512_set1_ps(f); }
+    [[nodiscard]] static Float load(const float *p) noexcept { return _mm512_loadu_ps(p); }
+    static void store(float *p, Float a) noexcept { _mm512_storeu_ps(p, a); }
+    [[nodiscard]] static Float add(Float a, Float b) noexcept { return _mm512_add_ps(a, b); }
+    [[nodiscard]] static Float sub(Float a, Float b) noexcept { return _mm512_sub_ps(a, b); }
+    [[nodiscard]] static Float mul(Float a, Float b) noexcept { return _mm512_mul_ps(a, b); }
+    [[nodiscard]] static Float div(Float a, Float b) noexcept { return _mm512_div_ps(a, b); }
+    [[nodiscard]] static Float min(Float a, Float b) noexcept { return _mm512_min_ps(a, b); }
+    [[nodiscard]] static Float max(Float a, Float b) noexcept { return _mm512_max_ps(a, b); }
+    [[nodiscard]] static Float sqrt(Float a) noexcept { return _mm512_sqrt_ps(a); }
+    [[nodiscard]] static Mask less(Float a, Float b) noexcept { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+    [[nodiscard]] static Mask less_equal(Float a, Float b) noexcept { return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ); }
+    [[nodiscard]] static Mask equal(Float a, Float b) noexcept { return _mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ); }
+    [[nodiscard]] static Mask not_equal(Float a, Float b) noexcept { return _mm512_cmp_ps_mask(a, b, _CMP_NEQ_UQ); }
+    [[nodiscard]] static Mask mask_and(Mask a, Mask b) noexcept { return static_cast<Mask>(a & b); }
+    [[nodiscard]] static Mask mask_or(Mask a, Mask b) noexcept { return static_cast<Mask>(a | b); }
+    [[nodiscard]] static Mask mask_not(Mask a) noexcept { return static_cast<Mask>(~a); }
+    [[nodiscard]] static Float select(Mask m, Float a, Float b) noexcept { return _mm512_mask_blend_ps(m, b, a); }
+    [[nodiscard]] static std::uint32_t bits(Mask m) noexcept { return m; }
+    // clang-format on
+
+    // The hardware estimate has 14 bits of precision, one Newton-Raphson step
+    // brings it to about 23
+    [[nodiscard]] static Float rsqrt(Float a) noexcept
+    {
+        const auto y = _mm512_rsqrt14_ps(a);
+        const auto a_y_y = _mm512_mul_ps(_mm512_mul_ps(a, y), y);
+        return _mm512_mul_ps(_mm512_mul_ps(_mm512_set1_ps(0.5f), y),
+                             _mm512_sub_ps(_mm512_set1_ps(3.0f), a_y_y));
+    }
+};
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#endif
+
+// N floats, one per lane
+template <std::uint32_t N>
+struct floatx
+{
+    using Ops = Simd_ops<N>;
+    static constexpr std::uint32_t width {N};
+
+    typename Ops::Float v;
+
+    [[nodiscard]] static floatx broadcast(float f) noexcept
+    {
+        return {Ops::set1(f)};
+    }
+
+    [[nodiscard]] static floatx load(const float *p) noexcept
+    {
+        return {Ops::load(p)};
+    }
+
+    void store(float *p) const noexcept
+    {
+        Ops::store(p, v);
+    }
+};
+
+// Result of a lane by lane comparison
+template <std::uint32_t N>
+struct maskx
+{
+    using Ops = Simd_ops<N>;
+
+    typename Ops::Mask v;
+
+    // Bit i is set if lane i is
+    [[nodiscard]] std::uint32_t bits() const noexcept
+    {
+        return Ops::bits(v);
+    }
+
+    [[nodiscard]] bool any() const noexcept
+    {
+        return bits() != 0;
+    }
+
+    [[nodiscard]] bool all() const noexcept
+    {
+        return bits() == (N < 32 ? (1u << N) - 1 : ~0u);
+    }
+};
+
+#define FLOATX_BINARY_OPERATOR(op, name)                                       \
+    template <std::uint32_t N>                                                 \
+    [[nodiscard]] inline floatx<N> operator op(const floatx<N> &a,             \
+                                               const floatx<N> &b) noexcept    \
+    {                                                                          \
+        return {Simd_ops<N>::name(a.v, b.v)};                                  \
+    }                                                                          \
+    template <std::uint32_t N>                                                 \
+    [[nodiscard]] inline floatx<N> operator op(const floatx<N> &a,             \
+                                               float f) noexcept               \
+    {                                                                          \
+        return {Simd_ops<N>::name(a.v, Simd_ops<N>::set1(f))};                 \
+    }                                                                          \
+    template <std::uint32_t N>                                                 \
+    [[nodiscard]] inline floatx<N> operator op(float f,                        \
+                                               const floatx<N> &a) noexcept    \
+    {                                                                          \
+        return {Simd_ops<N>::name(Simd_ops<N>::set1(f), a.v)};                 \
+    }                                                                          \
+    template <std::uint32_t N>                                                 \
+    inline floatx<N> &operator op##=(floatx<N> &a,                             \
+                                     const floatx<N> &b) noexcept              \
+    {                                                                          \
+        a = a op b;                                                            \
+        return a;                                                              \
+    }                                                                          \
+    template <std::uint32_t N>                                                 \
+    inline floatx<N> &operator op##=(floatx<N> &a, float f) noexcept           \
+    {                                                                          \
+        a = a op f;                                                            \
+        return a;                                                              \
+    }
+
+FLOATX_BINARY_OPERATOR(+, add)
+FLOATX_BINARY_OPERATOR(-, sub)
+FLOATX_BINARY_OPERATOR(*, mul)
+FLOATX_BINARY_OPERATOR(/, div)
+
+#undef FLOATX_BINARY_OPERATOR
+
+#define FLOATX_COMPARISON(op, name, swap)                                      \
+    template <std::uint32_t N>                                                 \
+    [[nodiscard]] inline maskx<N> operator op(const floatx<N> &a,              \
+                                              const floatx<N> &b) noexcept     \
+    {                                                                          \
+        return swap ? maskx<N> {Simd_ops<N>::name(b.v, a.v)}                   \
+                    : maskx<N> {Simd_ops<N>::name(a.v, b.v)};                  \
+    }
+
+FLOATX_COMPARISON(<, less, false)
+FLOATX_COMPARISON(<=, less_equal, false)
+FLOATX_COMPARISON(>, less, true)
+FLOATX_COMPARISON(>=, less_equal, true)
+FLOATX_COMPARISON(==, equal, false)
+FLOATX_COMPARISON(!=, not_equal, false)
+
+#undef FLOATX_COMPARISON
+
+template <std::uint32_t N>
+[[nodiscard]] inline floatx<N> operator+(const floatx<N> &a) noexcept
+{
+    return a;
+}
+
+template <std::uint32_t N>
+[[nodiscard]] inline floatx<N> operator-(const floatx<N> &a) noexcept
+{
+    return 0.0f - a;
+}
+
+template <std::uint32_t N>
+[[nodiscard]] inline maskx<N> operator&(const maskx<N> &a,
+                                        const maskx<N> &b) noexcept
+{
+    return {Simd_ops<N>::mask_and(a.v, b.v)};
+}
+
+template <std::uint32_t N>
+[[nodiscard]] inline maskx<N> operator|(const maskx<N> &a,
+                                        const maskx<N> &b) noexcept
+{
+    return {Simd_ops<N>::mask_or(a.v, b.v)};
+}
+
+template <std::uint32_t N>
+[[nodiscard]] inline maskx<N> operator!(const maskx<N> &a) noexcept
+{
+    return {Simd_ops<N>::mask_not(a.v)};
+}
+
+template <std::uint32_t N>
+[[nodiscard]] inline floatx<N> min(const floatx<N> &a,
+                                   const floatx<N> &b) noexcept
+{
+    return {Simd_ops<N>::min(a.v, b.v)};
+}
+
+template <std::uint32_t N>
+[[nodiscard]] inline floatx<N> max(const floatx<N> &a,
+                                   const floatx<N> &b) noexcept
+{
+    return {Simd_ops<N>::max(a.v, b.v)};
+}
+
+template <std::uint32_t N>
+[[nodiscard]] inline floatx<N> sqrt(const floatx<N> &a) noexcept
+{
+    return {Simd_ops<N>::sqrt(a.v)};
+}
+
+// Approximation of 1 / sqrt(a), with a relative error of about 1e-7 where the
+// hardware provides an estimate, and exact otherwise
+template <std::uint32_t N>
+[[nodiscard]] inline floatx<N> rsqrt(const floatx<N> &a) noexcept
+{
+    return {Simd_ops<N>::rsqrt(a.v)};
+}
+
+// Lane i is a[i] if m[i] is set, b[i] otherwise
+template <std::uint32_t N>
+[[nodiscard]] inline floatx<N>
+select(const maskx<N> &m, const floatx<N> &a, const floatx<N> &b) noexcept
+{
+    return {Simd_ops<N>::select(m.v, a.v, b.v)};
+}
+
+template <std::uint32_t N>
+struct vec3x
+{
+    floatx<N> x;
+    floatx<N> y;
+    floatx<N> z;
+
+    // Every lane set to v
+    [[nodiscard]] static vec3x broadcast(const vec3 &v) noexcept
+    {
+        return {floatx<N>::broadcast(v.x),
+                floatx<N>::broadcast(v.y),
+                floatx<N>::broadcast(v.z)};
+    }
+
+    // From N consecutive values of each component
+    [[nodiscard]] static vec3x
+    load(const float *x, const float *y, const float *z) noexcept
+    {
+        return {floatx<N>::load(x), floatx<N>::load(y), floatx<N>::load(z)};
+    }
+
+    void store(float *x_values, float *y_values, float *z_values) const noexcept
+    {
+        x.store(x_values);
+        y.store(y_values);
+        z.store(z_values);
+    }
+
+    [[nodiscard]] vec3 get(std::uint32_t lane) const noexcept
+    {
+        float x_values[N];
+        float y_values[N];
+        float z_values[N];
+        store(x_values, y_values, z_values);
+        return {x_values[lane], y_values[lane], z_values[lane]};
+    }
+};
+
+using vec3x4 = vec3x<4>;
+using vec3x8 = vec3x<8>;
+using vec3x16 = vec3x<16>;
+
+template <std::uint32_t N>
+[[nodiscard]] inline vec3x<N> operator+(const vec3x<N> &v) noexcept
+{
+    return v;
+}
+
+template <std::uint32_t N>
+[[nodiscard]] inline vec3x<N> operator-(const vec3x<N> &v) noexcept
+{
+    return {-v.x, -v.y, -v.z};
+}
+
+// Same overloads as for vec3, plus the products with floatx<N>, which scale
+// each lane by its own factor
+#define VEC3X_BINARY_OPERATOR(op)                                              \
+    template <std::uint32_t N>                                                 \
+    [[nodiscard]] inline vec3x<N> operator op(const vec3x<N> &u,               \
+                                              const vec3x<N> &v) noexcept      \
+    {                                                                          \
+        return {u.x op v.x, u.y op v.y, u.z op v.z};                           \
+    }                                                                          \
+    template <std::uint32_t N>                                                 \
+    [[nodiscard]] inline vec3x<N> operator op(const vec3x<N> &v,               \
+                                              float f) noexcept                \
+    {                                                                          \
+        return v op floatx<N>::broadcast(f);                                   \
+    }                                                                          \
+    template <std::uint32_t N>                                                 \
+    [[nodiscard]] inline vec3x<N> operator op(float f,                         \
+                                              const vec3x<N> &v) noexcept      \
+    {                                                                          \
+        return floatx<N>::broadcast(f) op v;                                   \
+    }                                                                          \
+    template <std::uint32_t N>                                                 \
+    [[nodiscard]] inline vec3x<N> operator op(const vec3x<N> &v,               \
+                                              const floatx<N> &f) noexcept     \
+    {                                                                          \
+        return {v.x op f, v.y op f, v.z op f};                                 \
+    }                                                                          \
+    template <std::uint32_t N>                                                 \
+    [[nodiscard]] inline vec3x<N> operator op(const floatx<N> &f,              \
+                                              const vec3x<N> &v) noexcept      \
+    {                                                                          \
+        return {f op v.x, f op v.y, f op v.z};                                 \
+    }                                                                          \
+    template <std::uint32_t N>                                                 \
+    inline vec3x<N> &operator op##=(vec3x<N> &u, const vec3x<N> &v) noexcept   \
+    {                                                                          \
+        u = u op v;                                                            \
+        return u;                                                              \
+    }                                                                          \
+    template <std::uint32_t N>                                                 \
+    inline vec3x<N> &operator op##=(vec3x<N> &v, float f) noexcept             \
+    {                                                                          \
+        v = v op f;                                                            \
+        return v;                                                              \
+    }                                                                          \
+    template <std::uint32_t N>                                                 \
+    inline vec3x<N> &operator op##=(vec3x<N> &v, const floatx<N> &f) noexcept  \
+    {                                                                          \
+        v = v op f;                                                            \
+        return v;                                                              \
+    }
+
+VEC3X_BINARY_OPERATOR(+)
+VEC3X_BINARY_OPERATOR(-)
+VEC3X_BINARY_OPERATOR(*)
+VEC3X_BINARY_OPERATOR(/)
+
+#undef VEC3X_BINARY_OPERATOR
+
+template <std::uint32_t N>
+[[nodiscard]] inline floatx<N> dot(const vec3x<N> &u,
+                                   const vec3x<N> &v) noexcept
+{
+    return u.x * v.x + u.y * v.y + u.z * v.z;
+}
+
+template <std::uint32_t N>
+[[nodiscard]] inline vec3x<N> cross(const vec3x<N> &u,
+                                    const vec3x<N> &v) noexcept
+{
+    return {
+        u.y * v.z - u.z * v.y, u.z * v.x - u.x * v.z, u.x * v.y - u.y * v.x};
+}
+
+template <std::uint32_t N>
+[[nodiscard]] inline floatx<N> norm(const vec3x<N> &v) noexcept
+{
+    return sqrt(dot(v, v));
+}
+
+// Same result as normalize() on each lane
+template <std::uint32_t N>
+[[nodiscard]] inline vec3x<N> normalize(const vec3x<N> &v) noexcept
+{
+    return v * (1.0f / norm(v));
+}
+
+// Faster than normalize(), but only accurate to about 1e-7, see rsqrt()
+template <std::uint32_t N>
+[[nodiscard]] inline vec3x<N> normalize_fast(const vec3x<N> &v) noexcept
+{
+    return v * rsqrt(dot(v, v));
+}
+
+template <std::uint32_t N>
+[[nodiscard]] inline vec3x<N>
+select(const maskx<N> &m, const vec3x<N> &u, const vec3x<N> &v) noexcept
+{
+    return {select(m, u.x, v.x), select(m, u.y, v.y), select(m, u.z, v.z)};
+}
+
+} // namespace VEC3_SIMD_NAMESPACE
+
+#undef VEC3_SIMD_NAMESPACE
+
+#endif // VEC3_SIMD_HPP
@@ -0,0 +1,628 @@
+#include "wide_bvh.hpp"
+#include "wide_bvh_kernels.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define X86_64
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#endif
+
+namespace
+{
+
+template <std::uint32_t N>
+[[nodiscard]] Wide_bvh_node<N> make_empty_node() noexcept
+{
+    constexpr auto inf = std::numeric_limits<float>::infinity();
+
+    Wide_bvh_node<N> node {};
+    for (std::uint32_t i {0}; i < N; ++i)
+    {
+        node.min_x[i] = inf;
+        node.min_y[i] = inf;
+        node.min_z[i] = inf;
+        node.max_x[i] = -inf;
+        node.max_y[i] = -inf;
+        node.max_z[i] = -inf;
+    }
+    return node;
+}
+
+[[nodiscard]] float half_surface_area(const Aabb &aabb) noexcept
+{
+    const auto d = aabb.max - aabb.min;
+    return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+// Returns the index of the first block
+template <std::uint32_t M>
+[[nodiscard]] std::uint32_t
+append_triangle_blocks(std::pmr::vector<Triangle_block<M>> &triangle_blocks,
+                       const Bvh &bvh,
+                       const Bvh_node &leaf,
+                       const std::vector<vec3> &vertices,
+                       const std::vector<std::uint32_t> &indices)
+{
+    const auto first_block =
+        static_cast<std::uint32_t>(triangle_blocks.size());
+
+    for (std::uint32_t i {0}; i < leaf.primitive_count; ++i)
+    {
+        const auto lane = i % M;
+        if (lane == 0)
+        {
+            auto &block = triangle_blocks.emplace_back();
+            std::fill(std::begin(block.primitive_index),
+                      std::end(block.primitive_index),
+                      std::numeric_limits<std::uint32_t>::max());
+        }
+        auto &block = triangle_blocks.back();
+
+        const auto primitive = bvh.primitive_indices[leaf.index + i];
+        const auto &v0 = vertices[indices[primitive * 3 + 0]];
+        const auto edge_1 = vertices[indices[primitive * 3 + 1]] - v0;
+        const auto edge_2 = vertices[indices[primitive * 3 + 2]] - v0;
+        block.v0_x[lane] = v0.x;
+        block.v0_y[lane] = v0.y;
+        block.v0_z[lane] = v0.z;
+        block.edge_1_x[lane] = edge_1.x;
+        block.edge_1_y[lane] = edge_1.y;
+        block.edge_1_z[lane] = edge_1.z;
+        block.edge_2_x[lane] = edge_2.x;
+        block.edge_2_y[lane] = edge_2.y;
+        block.edge_2_z[lane] = edge_2.z;
+        block.primitive_index[lane] = primitive;
+    }
+
+    return first_block;
+}
+
+// Smallest and largest exponents of the quantization grid, such that its
+// scale is a normal float, and that all the planes are finite and exactly
+// representable as offset * scale
+constexpr int min_quantization_exponent {-126};
+constexpr int max_quantization_exponent {119};
+
+// Must match the traversal kernel bit for bit
+[[nodiscard]] float decode_plane(float origin, float scale, int offset) noexcept
+{
+    return origin + static_cast<float>(offset) * scale;
+}
+
+// Returns false if some child cannot be covered by the grid with this exponent
+[[nodiscard]] bool quantize_axis(const float *min,
+                                 const float *max,
+                                 std::uint32_t child_count,
+                                 float origin,
+                                 int exponent,
+                                 std::uint8_t *quantized_min,
+                                 std::uint8_t *quantized_max)
+{
+    const auto scale =
+        std::bit_cast<float>(static_cast<std::uint32_t>(exponent + 127) << 23);
+
+    for (std::uint32_t i {0}; i < child_count; ++i)
+    {
+        // The estimates can be off by one because of rounding, the planes
+        // are then moved to the tightest ones that still contain the bounds
+        auto q_min = static_cast<int>(
+            std::clamp(std::floor((min[i] - origin) / scale), 0.0f, 255.0f));
+        while (q_min > 0 && decode_plane(origin, scale, q_min) > min[i])
+        {
+            --q_min;
+        }
+        while (q_min < 255 && decode_plane(origin, scale, q_min + 1) <= min[i])
+        {
+            ++q_min;
+        }
+
+        auto q_max = static_cast<int>(
+            std::clamp(std::ceil((max[i] - origin) / scale), 0.0f, 255.0f));
+        while (q_max < 255 && decode_plane(origin, scale, q_max) < max[i])
+        {
+            ++q_max;
+        }
+        while (q_max > 0 && decode_plane(origin, scale, q_max - 1) >= max[i])
+        {
+            --q_max;
+        }
+
+        if (decode_plane(origin, scale, q_min) > min[i] ||
+            decode_plane(origin, scale, q_max) < max[i])
+        {
+            return false;
+        }
+        quantized_min[i] = static_cast<std::uint8_t>(q_min);
+        quantized_max[i] = static_cast<std::uint8_t>(q_max);
+    }
+
+    return true;
+}
+
+// Chooses the finest grid whose 255 cells span all the children
+[[nodiscard]] std::int8_t quantize_axis(const float *min,
+                                        const float *max,
+                                        std::uint32_t child_count,
+                                        float &origin,
+                                        std::uint8_t *quantized_min,
+                                        std::uint8_t *quantized_max)
+{
+    origin = min[0];
+    auto extent_max = max[0];
+    for (std::uint32_t i {1}; i < child_count; ++i)
+    {
+        origin = std::min(origin, min[i]);
+        extent_max = std::max(extent_max, max[i]);
+    }
+
+    auto exponent = min_quantization_exponent;
+    const auto extent = extent_max - origin;
+    if (extent > 0.0f)
+    {
+        exponent = std::max(
+            exponent, static_cast<int>(std::ceil(std::log2(extent / 255.0f))));
+    }
+    for (; exponent <= max_quantization_exponent; ++exponent)
+    {
+        if (quantize_axis(min,
+                          max,
+                          child_count,
+                          origin,
+                          exponent,
+                          quantized_min,
+                          quantized_max))
+        {
+            return static_cast<std::int8_t>(exponent);
+        }
+    }
+
+    throw std::runtime_error("BVH bounds are too large to be quantized");
+}
+
+template <std::uint32_t N>
+[[nodiscard]] bool is_child_used(const Wide_bvh_node<N> &node,
+                                 std::uint32_t i) noexcept
+{
+    return node.min_x[i] <= node.max_x[i];
+}
+
+[[nodiscard]] bool is_child_used(const Quantized_bvh_node &node,
+                                 std::uint32_t i) noexcept
+{
+    return ((node.child_mask >> i) & 1u) != 0;
+}
+
+template <std::uint32_t N>
+[[nodiscard]] float get_child_area(const Wide_bvh_node<N> &node,
+                                   std::uint32_t i) noexcept
+{
+    const Aabb bounds {.min = {node.min_x[i], node.min_y[i], node.min_z[i]},
+                       .max = {node.max_x[i], node.max_y[i], node.max_z[i]}};
+    return half_surface_area(bounds);
+}
+
+[[nodiscard]] float get_child_area(const Quantized_bvh_node &node,
+                                   std::uint32_t i) noexcept
+{
+    // Only the relative sizes matter, so offsets are enough
+    const auto extent = [i](int exponent,
+                            const std::uint8_t *quantized_min,
+                            const std::uint8_t *quantized_max)
+    {
+        return std::ldexp(static_cast<float>(quantized_max[i]) -
+                              static_cast<float>(quantized_min[i]),
+                          exponent);
+    };
+    const auto d_x = extent(node.exponent_x, node.min_x, node.max_x);
+    const auto d_y = extent(node.exponent_y, node.min_y, node.max_y);
+    const auto d_z = extent(node.exponent_z, node.min_z, node.max_z);
+    return d_x * d_y + d_y * d_z + d_z * d_x;
+}
+
+template <typename Bvh_type>
+[[nodiscard]] Bvh_type reorder_nodes(const Bvh_type &bvh,
+                                     std::pmr::memory_resource *resource)
+{
+    using Node = typename decltype(Bvh_type::nodes)::value_type;
+    using Block = typename decltype(Bvh_type::triangle_blocks)::value_type;
+    constexpr auto N =
+        static_cast<std::uint32_t>(std::extent_v<decltype(Node::index)>);
+    constexpr auto M = static_cast<std::uint32_t>(
+        std::extent_v<decltype(Block::primitive_index)>);
+
+    Bvh_type result {.nodes = std::pmr::vector<Node>(resource),
+                     .triangle_blocks = std::pmr::vector<Block>(resource)};
+    if (bvh.nodes.empty())
+    {
+        return result;
+    }
+
+    // Depth-first order, and the new index of each node
+    std::vector<std::uint32_t> order;
+    order.reserve(bvh.nodes.size());
+    std::vector<std::uint32_t> new_indices(bvh.nodes.size());
+    std::vector<std::uint32_t> stack {0};
+    while (!stack.empty())
+    {
+        const auto index = stack.back();
+        stack.pop_back();
+        new_indices[index] = static_cast<std::uint32_t>(order.size());
+        order.push_back(index);
+
+        const auto &node = bvh.nodes[index];
+        // Interior children sorted by increasing surface area, so that the
+        // largest one is pushed last and visited next
+        std::uint32_t children[N] {};
+        float areas[N] {};
+        std::uint32_t child_count {0};
+        for (std::uint32_t i {0}; i < N; ++i)
+        {
+            if (!is_child_used(node, i) || node.primitive_count[i] > 0)
+            {
+                continue;
+            }
+            const auto area = get_child_area(node, i);
+            auto j = child_count++;
+            while (j > 0 && areas[j - 1] > area)
+            {
+                children[j] = children[j - 1];
+                areas[j] = areas[j - 1];
+                --j;
+            }
+            children[j] = i;
+            areas[j] = area;
+        }
+        for (std::uint32_t i {0}; i < child_count; ++i)
+        {
+            stack.push_back(node.index[children[i]]);
+        }
+    }
+
+    result.nodes.reserve(bvh.nodes.size());
+    result.triangle_blocks.reserve(bvh.triangle_blocks.size());
+    for (const auto index : order)
+    {
+        auto node = bvh.nodes[index];
+        for (std::uint32_t i {0}; i < N; ++i)
+        {
+            if (!is_child_used(node, i))
+            {
+                continue;
+            }
+            if (node.primitive_count[i] == 0)
+            {
+                node.index[i] = new_indices[node.index[i]];
+                continue;
+            }
+            const auto first_block =
+                bvh.triangle_blocks.begin() + node.index[i];
+            const auto block_count = (node.primitive_count[i] + M - 1) / M;
+            node.index[i] =
+                static_cast<std::uint32_t>(result.triangle_blocks.size());
+            result.triangle_blocks.insert(result.triangle_blocks.end(),
+                                          first_block,
+                                          first_block + block_count);
+        }
+        result.nodes.push_back(node);
+    }
+
+    return result;
+}
+
+} // namespace
+
+template <std::uint32_t N>
+Wide_bvh<N> collapse_bvh(const Bvh &bvh,
+                         const std::vector<vec3> &vertices,
+                         const std::vector<std::uint32_t> &indices)
+{
+    static_assert(N >= 2);
+
+    Wide_bvh<N> result {};
+    if (bvh.nodes.empty())
+    {
+        return result;
+    }
+
+    struct Collapse_task
+    {
+        std::uint32_t binary_index;
+        std::uint32_t wide_index;
+    };
+
+    result.nodes.push_back(make_empty_node<N>());
+    std::vector<Collapse_task> tasks {{0, 0}};
+
+    while (!tasks.empty())
+    {
+        const auto task = tasks.back();
+        tasks.pop_back();
+
+        std::uint32_t children[N] {};
+        std::uint32_t child_count {0};
+        const auto &binary_node = bvh.nodes[task.binary_index];
+        if (binary_node.primitive_count > 0)
+        {
+            // Only possible if the root is a leaf
+            children[child_count++] = task.binary_index;
+        }
+        else
+        {
+            children[child_count++] = binary_node.index;
+            children[child_count++] = binary_node.index + 1;
+        }
+
+        while (child_count < N)
+        {
+            std::uint32_t largest_child {N};
+            float largest_area {-1.0f};
+            for (std::uint32_t i {0}; i < child_count; ++i)
+            {
+                const auto &child = bvh.nodes[children[i]];
+                const auto area = half_surface_area(child.bounds);
+                if (child.primitive_count == 0 && area > largest_area)
+                {
+                    largest_child = i;
+                    largest_area = area;
+                }
+            }
+            if (largest_child == N)
+            {
+                break;
+            }
+
+            const auto opened_index = bvh.nodes[children[largest_child]].index;
+            children[largest_child] = opened_index;
+            children[child_count++] = opened_index + 1;
+        }
+
+        for (std::uint32_t i {0}; i < child_count; ++i)
+        {
+            const auto &child = bvh.nodes[children[i]];
+
+            std::uint32_t index {};
+            if (child.primitive_count == 0)
+            {
+                index = static_cast<std::uint32_t>(result.nodes.size());
+                result.nodes.push_back(make_empty_node<N>());
+                tasks.push_back({children[i], index});
+            }
+            else
+            {
+                index = append_triangle_blocks(
+                    result.triangle_blocks, bvh, child, vertices, indices);
+            }
+
+            auto &node = result.nodes[task.wide_index];
+            node.min_x[i] = child.bounds.min.x;
+            node.min_y[i] = child.bounds.min.y;
+            node.min_z[i] = child.bounds.min.z;
+            node.max_x[i] = child.bounds.max.x;
+            node.max_y[i] = child.bounds.max.y;
+            node.max_z[i] = child.bounds.max.z;
+            node.index[i] = index;
+            node.primitive_count[i] = child.primitive_count;
+        }
+    }
+
+    return result;
+}
+
+template Wide_bvh<4> collapse_bvh(const Bvh &bvh,
+                                  const std::vector<vec3> &vertices,
+                                  const std::vector<std::uint32_t> &indices);
+template Wide_bvh<8> collapse_bvh(const Bvh &bvh,
+                                  const std::vector<vec3> &vertices,
+                                  const std::vector<std::uint32_t> &indices);
+template Wide_bvh<16> collapse_bvh(const Bvh &bvh,
+                                   const std::vector<vec3> &vertices,
+                                   const std::vector<std::uint32_t> &indices);
+
+Quantized_bvh quantize_bvh(Wide_bvh<4> bvh)
+{
+    Quantized_bvh result {};
+    result.nodes.reserve(bvh.nodes.size());
+    result.triangle_blocks = std::move(bvh.triangle_blocks);
+
+    for (const auto &node : bvh.nodes)
+    {
+        auto &quantized_node = result.nodes.emplace_back();
+
+        // Used children are always packed at the front
+        std::uint32_t child_count {0};
+        while (child_count < 4 &&
+               node.min_x[child_count] <= node.max_x[child_count])
+        {
+            quantized_node.index[child_count] = node.index[child_count];
+            quantized_node.primitive_count[child_count] =
+                static_cast<std::uint8_t>(node.primitive_count[child_count]);
+            ++child_count;
+        }
+        quantized_node.child_mask =
+            static_cast<std::uint8_t>((1u << child_count) - 1);
+        if (child_count == 0)
+        {
+            continue;
+        }
+
+        quantized_node.exponent_x = quantize_axis(node.min_x,
+                                                  node.max_x,
+                                                  child_count,
+                                                  quantized_node.origin_x,
+                                                  quantized_node.min_x,
+                                                  quantized_node.max_x);
+        quantized_node.exponent_y = quantize_axis(node.min_y,
+                                                  node.max_y,
+                                                  child_count,
+                                                  quantized_node.origin_y,
+                                                  quantized_node.min_y,
+                                                  quantized_node.max_y);
+        quantized_node.exponent_z = quantize_axis(node.min_z,
+                                                  node.max_z,
+                                                  child_count,
+                                                  quantized_node.origin_z,
+                                                  quantized_node.min_z,
+                                                  quantized_node.max_z);
+    }
+
+    return result;
+}
+
+Wide_bvh<4> reorder_bvh(const Wide_bvh<4> &bvh,
+                        std::pmr::memory_resource *resource)
+{
+    return reorder_nodes(bvh, resource);
+}
+
+Wide_bvh<8> reorder_bvh(const Wide_bvh<8> &bvh,
+                        std::pmr::memory_resource *resource)
+{
+    return reorder_nodes(bvh, resource);
+}
+
+Wide_bvh<16> reorder_bvh(const Wide_bvh<16> &bvh,
+                         std::pmr::memory_resource *resource)
+{
+    return reorder_nodes(bvh, resource);
+}
+
+Quantized_bvh reorder_bvh(const Quantized_bvh &bvh,
+                          std::pmr::memory_resource *resource)
+{
+    return reorder_nodes(bvh, resource);
+}
+
+std::uint32_t get_native_bvh_width()
+{
+#if defined(X86_64) && defined(_MSC_VER) && !defined(__clang__)
+    int info[4] {};
+    __cpuid(info, 1);
+    const bool fma {(info[2] & (1 << 12)) != 0};
+    const bool os_xsave {(info[2] & (1 << 27)) != 0};
+    if (!os_xsave)
+    {
+        return 4;
+    }
+    // The OS must save the YMM (and for AVX-512, the opmask and ZMM) state
+    const auto xcr0 = _xgetbv(0);
+    const bool os_avx {(xcr0 & 0x06) == 0x06};
+    const bool os_avx512 {(xcr0 & 0xe6) == 0xe6};
+    __cpuidex(info, 7, 0);
+    const bool avx2 {(info[1] & (1 << 5)) != 0};
+    const bool avx512f {(info[1] & (1 << 16)) != 0};
+    if (avx512f && os_avx512)
+    {
+        return 16;
+    }
+    if (avx2 && fma && os_avx)
+    {
+        return 8;
+    }
+    return 4;
+#elif defined(X86_64)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        return 16;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    {
+        return 8;
+    }
+    return 4;
+#else
+    return 4;
+#endif
+}
+
+bool is_bvh_width_supported(std::uint32_t width)
+{
+    if (width == 2)
+    {
+        return true;
+    }
+    if (width != 4 && width != 8 && width != 16)
+    {
+        return false;
+    }
+#if defined(X86_64)
+    return width <= get_native_bvh_width();
+#else
+    // The kernels fall back to portable code, which works with any width
+    return true;
+#endif
+}
+
+// The 8 and 16 wide kernels are compiled for AVX2 and AVX-512, so they are
+// given the arrays of the BVH from here, see wide_bvh_kernels.hpp
+
+bool intersect(const Wide_bvh<8> &bvh,
+               const Ray &ray,
+               float t_min,
+               Ray_hit &hit)
+{
+    return intersect(get_bvh_arrays(bvh), ray, t_min, hit);
+}
+
+bool intersect(const Wide_bvh<16> &bvh,
+               const Ray &ray,
+               float t_min,
+               Ray_hit &hit)
+{
+    return intersect(get_bvh_arrays(bvh), ray, t_min, hit);
+}
+
+std::uint32_t intersect(const Wide_bvh<8> &bvh,
+                        const Ray_packet<8> &packet,
+                        std::uint32_t active_mask,
+                        float t_min,
+                        Ray_packet_hit<8> &hit)
+{
+    return intersect(get_bvh_arrays(bvh), packet, active_mask, t_min, hit);
+}
+
+std::uint32_t intersect(const Wide_bvh<16> &bvh,
+                        const Ray_packet<16> &packet,
+                        std::uint32_t active_mask,
+                        float t_min,
+                        Ray_packet_hit<16> &hit)
+{
+    return intersect(get_bvh_arrays(bvh), packet, active_mask, t_min, hit);
+}
+
+bool occluded(const Wide_bvh<8> &bvh, const Ray &ray, float t_min, float t_max)
+{
+    return occluded(get_bvh_arrays(bvh), ray, t_min, t_max);
+}
+
+bool occluded(const Wide_bvh<16> &bvh, const Ray &ray, float t_min, float t_max)
+{
+    return occluded(get_bvh_arrays(bvh), ray, t_min, t_max);
+}
+
+std::uint32_t occluded(const Wide_bvh<8> &bvh,
+                       const Ray_packet<8> &packet,
+                       std::uint32_t active_mask,
+                       float t_min,
+                       const float *t_max)
+{
+    return occluded(get_bvh_arrays(bvh), packet, active_mask, t_min, t_max);
+}
+
+std::uint32_t occluded(const Wide_bvh<16> &bvh,
+                       const Ray_packet<16> &packet,
+                       std::uint32_t active_mask,
+                       float t_min,
+                       const float *t_max)
+{
+    return occluded(get_bvh_arrays(bvh), packet, active_mask, t_min, t_max);
+}
@@ -0,0 +1,269 @@
+#ifndef WIDE_BVH_HPP
+#define WIDE_BVH_HPP
+
+#include "bvh.hpp"
+
+#include <cstdint>
+#include <memory_resource>
+#include <vector>
+
+// Node with up to N children, stored as structure of arrays so that one ray
+// can be tested against all child bounds with a single SIMD slab test. If
+// primitive_count[i] is zero, child i is the interior node nodes[index[i]].
+// Otherwise, it is a leaf with primitive_count[i] triangles, stored in
+// consecutive triangle blocks starting at triangle_blocks[index[i]]. Unused
+// slots have min = +inf and max = -inf, which no ray can hit.
+template <std::uint32_t N>
+struct alignas(64) Wide_bvh_node
+{
+    float min_x[N];
+    float max_x[N];
+    float min_y[N];
+    float max_y[N];
+    float min_z[N];
+    float max_z[N];
+    std::uint32_t index[N];
+    std::uint32_t primitive_count[N];
+};
+static_assert(sizeof(Wide_bvh_node<4>) == 128);
+static_assert(sizeof(Wide_bvh_node<8>) == 256);
+static_assert(sizeof(Wide_bvh_node<16>) == 512);
+
+// 4 wide node compressed to a single cache line, half the size of
+// Wide_bvh_node<4>, in the style of Ylitie et al. 2017. The child bounds are
+// stored as 8-bit offsets on a grid local to the node: a plane q on the x axis
+// is at origin_x + q * 2^exponent_x, and similarly on y and z. The offsets are
+// rounded outwards, so that the decoded bounds always contain the exact ones.
+// Child i is unused if bit i of child_mask is not set. Leaves hold at most 8
+// triangles, so their count fits in a byte.
+struct alignas(64) Quantized_bvh_node
+{
+    float origin_x;
+    float origin_y;
+    float origin_z;
+    std::int8_t exponent_x;
+    std::int8_t exponent_y;
+    std::int8_t exponent_z;
+    std::uint8_t child_mask;
+    std::uint8_t min_x[4];
+    std::uint8_t max_x[4];
+    std::uint8_t min_y[4];
+    std::uint8_t max_y[4];
+    std::uint8_t min_z[4];
+    std::uint8_t max_z[4];
+    std::uint32_t index[4];
+    std::uint8_t primitive_count[4];
+};
+static_assert(sizeof(Quantized_bvh_node) == 64);
+
+// M triangles stored as structure of arrays, with the vertex and edges that
+// Möller-Trumbore needs precomputed, so that one ray can be tested against all
+// of them in a single SIMD pass. Unused slots have zero edges, which no ray
+// can hit, and an invalid primitive index.
+template <std::uint32_t M>
+struct alignas(32) Triangle_block
+{
+    float v0_x[M];
+    float v0_y[M];
+    float v0_z[M];
+    float edge_1_x[M]; // v1 - v0
+    float edge_1_y[M];
+    float edge_1_z[M];
+    float edge_2_x[M]; // v2 - v0
+    float edge_2_y[M];
+    float edge_2_z[M];
+    std::uint32_t primitive_index[M];
+};
+static_assert(sizeof(Triangle_block<4>) == 160);
+static_assert(sizeof(Triangle_block<8>) == 320);
+
+// Leaves hold at most 8 triangles, so 16 wide nodes also use blocks of 8
+template <std::uint32_t N>
+inline constexpr std::uint32_t triangle_block_width {N < 8 ? N : 8};
+
+// Rays stored as structure of arrays, so that a packet of P rays can be
+// tested against one box or one triangle with a single SIMD pass
+template <std::uint32_t P>
+struct alignas(64) Ray_packet
+{
+    float origin_x[P];
+    float origin_y[P];
+    float origin_z[P];
+    float direction_x[P];
+    float direction_y[P];
+    float direction_z[P];
+};
+
+template <std::uint32_t P>
+struct alignas(64) Ray_packet_hit
+{
+    float t[P];
+    float u[P];
+    float v[P];
+    std::uint32_t primitive_index[P];
+};
+
+// Packets match the vector width of the traversal kernels: 8 rays with SSE
+// and AVX2, 16 with AVX-512
+template <std::uint32_t N>
+inline constexpr std::uint32_t ray_packet_size {N < 16 ? 8 : 16};
+
+template <std::uint32_t N>
+struct Wide_bvh
+{
+    std::pmr::vector<Wide_bvh_node<N>> nodes;
+    std::pmr::vector<Triangle_block<triangle_block_width<N>>> triangle_blocks;
+};
+
+struct Quantized_bvh
+{
+    std::pmr::vector<Quantized_bvh_node> nodes;
+    std::pmr::vector<Triangle_block<4>> triangle_blocks;
+};
+
+// Collapses a binary BVH by repeatedly opening the interior child with the
+// largest surface area, until each node has N children, and packs the
+// triangles of each leaf into blocks. The root is always nodes[0].
+template <std::uint32_t N>
+[[nodiscard]] Wide_bvh<N> collapse_bvh(const Bvh &bvh,
+                                       const std::vector<vec3> &vertices,
+                                       const std::vector<std::uint32_t> &indices);
+
+extern template Wide_bvh<4>
+collapse_bvh(const Bvh &bvh,
+             const std::vector<vec3> &vertices,
+             const std::vector<std::uint32_t> &indices);
+extern template Wide_bvh<8>
+collapse_bvh(const Bvh &bvh,
+             const std::vector<vec3> &vertices,
+             const std::vector<std::uint32_t> &indices);
+extern template Wide_bvh<16>
+collapse_bvh(const Bvh &bvh,
+             const std::vector<vec3> &vertices,
+             const std::vector<std::uint32_t> &indices);
+
+// Compresses the nodes of a 4 wide BVH, with the same tree and the same
+// triangle blocks
+[[nodiscard]] Quantized_bvh quantize_bvh(Wide_bvh<4> bvh);
+
+// Copies the BVH into memory allocated from resource, with its nodes in
+// depth-first order, the interior child with the largest surface area (the
+// most likely to be visited) first. The nodes on the most likely traversal
+// paths are then in consecutive cache lines. The triangle blocks follow the
+// order of their leaves. The child slots are kept as they are, so the hits are
+// the same.
+[[nodiscard]] Wide_bvh<4> reorder_bvh(const Wide_bvh<4> &bvh,
+                                      std::pmr::memory_resource *resource);
+[[nodiscard]] Wide_bvh<8> reorder_bvh(const Wide_bvh<8> &bvh,
+                                      std::pmr::memory_resource *resource);
+[[nodiscard]] Wide_bvh<16> reorder_bvh(const Wide_bvh<16> &bvh,
+                                       std::pmr::memory_resource *resource);
+[[nodiscard]] Quantized_bvh reorder_bvh(const Quantized_bvh &bvh,
+                                        std::pmr::memory_resource *resource);
+
+// On x86-64, returns the widest node width whose traversal kernel can run on
+// this CPU: 16 with AVX-512, 8 with AVX2, 4 otherwise (SSE). Other
+// architectures use portable kernels, and 4 matches their vector registers.
+[[nodiscard]] std::uint32_t get_native_bvh_width();
+
+// Returns true for 2 (the binary BVH) and for the wide node widths that can
+// be traversed on this CPU
+[[nodiscard]] bool is_bvh_width_supported(std::uint32_t width);
+
+// Same contract as the binary BVH intersect(), and the same hits bit for bit.
+// The 8 and 16 wide versions must only be called if is_bvh_width_supported()
+// returns true for their width.
+[[nodiscard]] bool intersect(const Wide_bvh<4> &bvh,
+                             const Ray &ray,
+                             float t_min,
+                             Ray_hit &hit);
+[[nodiscard]] bool intersect(const Wide_bvh<8> &bvh,
+                             const Ray &ray,
+                             float t_min,
+                             Ray_hit &hit);
+[[nodiscard]] bool intersect(const Wide_bvh<16> &bvh,
+                             const Ray &ray,
+                             float t_min,
+                             Ray_hit &hit);
+// The decoded bounds of the children are slightly larger than the exact ones,
+// so more nodes are visited. Rays that graze the bounds of a leaf can then
+// find a hit that the rounding of the exact slab test misses, otherwise the
+// hits are the same.
+[[nodiscard]] bool intersect(const Quantized_bvh &bvh,
+                             const Ray &ray,
+                             float t_min,
+                             Ray_hit &hit);
+
+// Intersects the rays of the packet whose bit is set in active_mask, with the
+// same contract as the single ray intersect() for each of them. Returns the
+// mask of the rays whose hit was updated. The packet is culled as a whole
+// against the frustum bounding its rays, which is only possible if the
+// direction components of the active rays have the same sign on each axis, so
+// the packet should be coherent. Otherwise, it is still correct, but slower
+// than tracing the rays one by one.
+[[nodiscard]] std::uint32_t intersect(const Wide_bvh<4> &bvh,
+                                      const Ray_packet<8> &packet,
+                                      std::uint32_t active_mask,
+                                      float t_min,
+                                      Ray_packet_hit<8> &hit);
+[[nodiscard]] std::uint32_t intersect(const Wide_bvh<8> &bvh,
+                                      const Ray_packet<8> &packet,
+                                      std::uint32_t active_mask,
+                                      float t_min,
+                                      Ray_packet_hit<8> &hit);
+[[nodiscard]] std::uint32_t intersect(const Wide_bvh<16> &bvh,
+                                      const Ray_packet<16> &packet,
+                                      std::uint32_t active_mask,
+                                      float t_min,
+                                      Ray_packet_hit<16> &hit);
+[[nodiscard]] std::uint32_t intersect(const Quantized_bvh &bvh,
+                                      const Ray_packet<8> &packet,
+                                      std::uint32_t active_mask,
+                                      float t_min,
+                                      Ray_packet_hit<8> &hit);
+
+// Same contract as the binary BVH occluded(). The traversal stops at the
+// first hit found, and the children of each node are visited in no particular
+// order.
+[[nodiscard]] bool occluded(const Wide_bvh<4> &bvh,
+                            const Ray &ray,
+                            float t_min,
+                            float t_max);
+[[nodiscard]] bool occluded(const Wide_bvh<8> &bvh,
+                            const Ray &ray,
+                            float t_min,
+                            float t_max);
+[[nodiscard]] bool occluded(const Wide_bvh<16> &bvh,
+                            const Ray &ray,
+                            float t_min,
+                            float t_max);
+[[nodiscard]] bool occluded(const Quantized_bvh &bvh,
+                            const Ray &ray,
+                            float t_min,
+                            float t_max);
+
+// Packet version of occluded(), for the rays whose bit is set in active_mask,
+// with t_max[i] for ray i. Returns the mask of the occluded rays. The packet
+// is dropped as soon as all of its rays are found occluded.
+[[nodiscard]] std::uint32_t occluded(const Wide_bvh<4> &bvh,
+                                     const Ray_packet<8> &packet,
+                                     std::uint32_t active_mask,
+                                     float t_min,
+                                     const float *t_max);
+[[nodiscard]] std::uint32_t occluded(const Wide_bvh<8> &bvh,
+                                     const Ray_packet<8> &packet,
+                                     std::uint32_t active_mask,
+                                     float t_min,
+                                     const float *t_max);
+[[nodiscard]] std::uint32_t occluded(const Wide_bvh<16> &bvh,
+                                     const Ray_packet<16> &packet,
+                                     std::uint32_t active_mask,
+                                     float t_min,
+                                     const float *t_max);
+[[nodiscard]] std::uint32_t occluded(const Quantized_bvh &bvh,
+                                     const Ray_packet<8> &packet,
+                                     std::uint32_t active_mask,
+                                     float t_min,
+                                     const float *t_max);
+
+#endif // WIDE_BVH_HPP
@@ -0,0 +1,60 @@
+// 16 wide traversal, with AVX-512 on x86-64. This file is compiled with
+// AVX-512 enabled, so it only defines the kernels of wide_bvh_kernels.hpp, see
+// the note in wide_bvh_traversal.hpp. Leaves hold at most 8 triangles, so they
+// are tested with 8 wide AVX2 vectors.
+
+#include "wide_bvh_traversal.hpp"
+
+#include <cstring>
+
+namespace
+{
+#if defined(__AVX512F__)
+using Simd_16 = Avx512;
+using Simd_8 = Avx2;
+#else
+using Simd_16 = Portable_simd<16>;
+using Simd_8 = Portable_simd<8>;
+#endif
+} // namespace
+
+bool intersect(const Wide_bvh_arrays<16> &bvh,
+               const Ray &ray,
+               float t_min,
+               Ray_hit &hit)
+{
+    return intersect_wide_bvh<Query::closest_hit, Simd_16, Simd_8>(
+        bvh, ray, t_min, hit);
+}
+
+std::uint32_t intersect(const Wide_bvh_arrays<16> &bvh,
+                        const Ray_packet<16> &packet,
+                        std::uint32_t active_mask,
+                        float t_min,
+                        Ray_packet_hit<16> &hit)
+{
+    return intersect_wide_bvh_packet<Query::closest_hit, Simd_16, Simd_16>(
+        bvh, packet, active_mask, t_min, hit);
+}
+
+bool occluded(const Wide_bvh_arrays<16> &bvh,
+              const Ray &ray,
+              float t_min,
+              float t_max)
+{
+    Ray_hit hit {.t = t_max, .u = 0.0f, .v = 0.0f, .primitive_index = 0};
+    return intersect_wide_bvh<Query::any_hit, Simd_16, Simd_8>(
+        bvh, ray, t_min, hit);
+}
+
+std::uint32_t occluded(const Wide_bvh_arrays<16> &bvh,
+                       const Ray_packet<16> &packet,
+                       std::uint32_t active_mask,
+                       float t_min,
+                       const float *t_max)
+{
+    Ray_packet_hit<16> hit;
+    std::memcpy(hit.t, t_max, sizeof(hit.t));
+    return intersect_wide_bvh_packet<Query::any_hit, Simd_16, Simd_16>(
+        bvh, packet, active_mask, t_min, hit);
+}
@@ -0,0 +1,86 @@
+#ifndef WIDE_BVH_KERNELS_HPP
+#define WIDE_BVH_KERNELS_HPP
+
+// Entry points of the traversal kernels of wide_bvh_avx2.cpp and
+// wide_bvh_avx512.cpp, which the intersect() and occluded() overloads of
+// wide_bvh.hpp for 8 and 16 wide nodes forward to.
+//
+// NOTE: those two files are compiled for another instruction set, so they get
+// the arrays of the BVH as raw pointers. Even indexing a std::vector
+// instantiates member functions with external linkage, which are not inlined
+// in debug builds. The linker then keeps a single copy of each, and it could
+// be the one compiled for AVX-512.
+
+#include "wide_bvh.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+template <typename Node, typename Block>
+struct Bvh_arrays
+{
+    const Node *nodes;
+    const Block *triangle_blocks;
+    std::size_t node_count; // Zero for an empty BVH
+};
+
+template <std::uint32_t N>
+using Wide_bvh_arrays =
+    Bvh_arrays<Wide_bvh_node<N>, Triangle_block<triangle_block_width<N>>>;
+
+using Quantized_bvh_arrays = Bvh_arrays<Quantized_bvh_node, Triangle_block<4>>;
+
+// Must only be called from files compiled for the baseline instruction set,
+// see the note above
+template <typename Bvh_type>
+[[nodiscard]] auto get_bvh_arrays(const Bvh_type &bvh) noexcept
+{
+    using Node = typename decltype(bvh.nodes)::value_type;
+    using Block = typename decltype(bvh.triangle_blocks)::value_type;
+    return Bvh_arrays<Node, Block> {.nodes = bvh.nodes.data(),
+                                    .triangle_blocks =
+                                        bvh.triangle_blocks.data(),
+                                    .node_count = bvh.nodes.size()};
+}
+
+[[nodiscard]] bool intersect(const Wide_bvh_arrays<8> &bvh,
+                             const Ray &ray,
+                             float t_min,
+                             Ray_hit &hit);
+[[nodiscard]] bool intersect(const Wide_bvh_arrays<16> &bvh,
+                             const Ray &ray,
+                             float t_min,
+                             Ray_hit &hit);
+
+[[nodiscard]] std::uint32_t intersect(const Wide_bvh_arrays<8> &bvh,
+                                      const Ray_packet<8> &packet,
+                                      std::uint32_t active_mask,
+                                      float t_min,
+                                      Ray_packet_hit<8> &hit);
+[[nodiscard]] std::uint32_t intersect(const Wide_bvh_arrays<16> &bvh,
+                                      const Ray_packet<16> &packet,
+                                      std::uint32_t active_mask,
+                                      float t_min,
+                                      Ray_packet_hit<16> &hit);
+
+[[nodiscard]] bool occluded(const Wide_bvh_arrays<8> &bvh,
+                            const Ray &ray,
+                            float t_min,
+                            float t_max);
+[[nodiscard]] bool occluded(const Wide_bvh_arrays<16> &bvh,
+                            const Ray &ray,
+                            float t_min,
+                            float t_max);
+
+[[nodiscard]] std::uint32_t occluded(const Wide_bvh_arrays<8> &bvh,
+                                     const Ray_packet<8> &packet,
+                                     std::uint32_t active_mask,
+                                     float t_min,
+                                     const float *t_max);
+[[nodiscard]] std::uint32_t occluded(const Wide_bvh_arrays<16> &bvh,
+                                     const Ray_packet<16> &packet,
+                                     std::uint32_t active_mask,
+                                     float t_min,
+                                     const float *t_max);
+
+#endif // WIDE_BVH_KERNELS_HPP
@@ -0,0 +1,96 @@
+// 4 wide traversal, with SSE on x86-64, for both uncompressed and quantized
+// nodes. Packets have 8 rays, like with AVX2.
+
+#include "wide_bvh_traversal.hpp"
+
+#include <cstring>
+
+namespace
+{
+#if defined(__SSE2__) || defined(_M_X64)
+using Simd_4 = Sse;
+#else
+using Simd_4 = Portable_simd<4>;
+#endif
+// Packets of 8 rays are processed as pairs of SSE vectors by the compiler
+using Simd_8 = Portable_simd<8>;
+} // namespace
+
+bool intersect(const Wide_bvh<4> &bvh,
+               const Ray &ray,
+               float t_min,
+               Ray_hit &hit)
+{
+    return intersect_wide_bvh<Query::closest_hit, Simd_4, Simd_4>(
+        get_bvh_arrays(bvh), ray, t_min, hit);
+}
+
+std::uint32_t intersect(const Wide_bvh<4> &bvh,
+                        const Ray_packet<8> &packet,
+                        std::uint32_t active_mask,
+                        float t_min,
+                        Ray_packet_hit<8> &hit)
+{
+    return intersect_wide_bvh_packet<Query::closest_hit, Simd_4, Simd_8>(
+        get_bvh_arrays(bvh), packet, active_mask, t_min, hit);
+}
+
+bool intersect(const Quantized_bvh &bvh,
+               const Ray &ray,
+               float t_min,
+               Ray_hit &hit)
+{
+    return intersect_wide_bvh<Query::closest_hit, Simd_4, Simd_4>(
+        get_bvh_arrays(bvh), ray, t_min, hit);
+}
+
+std::uint32_t intersect(const Quantized_bvh &bvh,
+                        const Ray_packet<8> &packet,
+                        std::uint32_t active_mask,
+                        float t_min,
+                        Ray_packet_hit<8> &hit)
+{
+    return intersect_wide_bvh_packet<Query::closest_hit, Simd_4, Simd_8>(
+        get_bvh_arrays(bvh), packet, active_mask, t_min, hit);
+}
+
+bool occluded(const Wide_bvh<4> &bvh, const Ray &ray, float t_min, float t_max)
+{
+    Ray_hit hit {.t = t_max, .u = 0.0f, .v = 0.0f, .primitive_index = 0};
+    return intersect_wide_bvh<Query::any_hit, Simd_4, Simd_4>(
+        get_bvh_arrays(bvh), ray, t_min, hit);
+}
+
+std::uint32_t occluded(const Wide_bvh<4> &bvh,
+                       const Ray_packet<8> &packet,
+                       std::uint32_t active_mask,
+                       float t_min,
+                       const float *t_max)
+{
+    Ray_packet_hit<8> hit;
+    std::memcpy(hit.t, t_max, sizeof(hit.t));
+    return intersect_wide_bvh_packet<Query::any_hit, Simd_4, Simd_8>(
+        get_bvh_arrays(bvh), packet, active_mask, t_min, hit);
+}
+
+bool occluded(const Quantized_bvh &bvh,
+              const Ray &ray,
+              float t_min,
+              float t_max)
+{
+    Ray_hit hit {.t = t_max, .u = 0.0f, .v = 0.0f, .primitive_index = 0};
+    return intersect_wide_bvh<Query::any_hit, Simd_4, Simd_4>(
+        get_bvh_arrays(bvh), ray, t_min, hit);
+}
+
+std::uint32_t occluded(const Quantized_bvh &bvh,
+                       const Ray_packet<8> &packet,
+                       std::uint32_t active_mask,
+                       float t_min,
+                       const float *t_max)
+{
+    Ray_packet_hit<8> hit;
+    std::memcpy(hit.t, t_max, sizeof(hit.t));
+    return intersect_wide_bvh_packet<Query::any_hit, Simd_4, Simd_8>(
+        get_bvh_arrays(bvh), packet, active_mask, t_min, hit);
+}
@@ -0,0 +1,1156 @@
+#ifndef WIDE_BVH_TRAVERSAL_HPP
+#define WIDE_BVH_TRAVERSAL_HPP
+
+// Traversal kernel shared by the wide_bvh_*.cpp files, each of which is
+// compiled for a different instruction set and instantiates it with the SIMD
+// types that instruction set enables.
+//
+// NOTE: everything here has internal linkage, and only uses built-in
+// arithmetic and the SIMD types. Inline functions and templates with external
+// linkage must not be called, whether they do floating point math (e.g. the
+// vec3 operators) or not (e.g. std::vector::operator[] or
+// std::numeric_limits<float>::infinity() outside of a constant expression):
+// the linker keeps a single copy of each, and it could pick one compiled for
+// AVX-512 and use it everywhere. The BVH is therefore accessed through the
+// raw pointers of wide_bvh_kernels.hpp.
+//
+// The order of the floating point operations matches intersect_triangle() in
+// bvh.cpp, so that all BVHs return bit-identical hits.
+
+#include "wide_bvh_kernels.hpp"
+
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
+namespace
+{
+
+// Fallback for architectures without a dedicated implementation. This is
+// written so that the compiler can vectorize it.
+template <std::uint32_t N>
+struct Portable_simd
+{
+    static constexpr std::uint32_t width {N};
+
+    struct Float
+    {
+        float v[N];
+    };
+
+    [[nodiscard]] static Float load(const float *p) noexcept
+    {
+        Float result;
+        for (std::uint32_t i {0}; i < N; ++i)
+        {
+            result.v[i] = p[i];
+        }
+        return result;
+    }
+
+    [[nodiscard]] static Float set1(float f) noexcept
+    {
+        Float result;
+        for (std::uint32_t i {0}; i < N; ++i)
+        {
+            result.v[i] = f;
+        }
+        return result;
+    }
+
+    static void store(float *p, const Float &a) noexcept
+    {
+        for (std::uint32_t i {0}; i < N; ++i)
+        {
+            p[i] = a.v[i];
+        }
+    }
+
+    [[nodiscard]] static Float load_u8(const std::uint8_t *p) noexcept
+    {
+        Float result;
+        for (std::uint32_t i {0}; i < N; ++i)
+        {
+            result.v[i] = static_cast<float>(p[i]);
+        }
+        return result;
+    }
+
+#define PORTABLE_SIMD_BINARY_OP(name, expression)                              \
+    [[nodiscard]] static Float name(const Float &a, const Float &b) noexcept   \
+    {                                                                          \
+        Float result;                                                          \
+        for (std::uint32_t i {0}; i < N; ++i)                                  \
+        {                                                                      \
+            result.v[i] = expression;                                          \
+        }                                                                      \
+        return result;                                                         \
+    }
+
+    PORTABLE_SIMD_BINARY_OP(add, a.v[i] + b.v[i])
+    PORTABLE_SIMD_BINARY_OP(sub, a.v[i] - b.v[i])
+    PORTABLE_SIMD_BINARY_OP(mul, a.v[i] * b.v[i])
+    PORTABLE_SIMD_BINARY_OP(div, a.v[i] / b.v[i])
+    PORTABLE_SIMD_BINARY_OP(min, a.v[i] < b.v[i] ? a.v[i] : b.v[i])
+    PORTABLE_SIMD_BINARY_OP(max, a.v[i] > b.v[i] ? a.v[i] : b.v[i])
+
+#undef PORTABLE_SIMD_BINARY_OP
+
+#define PORTABLE_SIMD_COMPARISON(name, op)                                     \
+    [[nodiscard]] static std::uint32_t name(const Float &a,                    \
+                                            const Float &b) noexcept           \
+    {                                                                          \
+        std::uint32_t mask {0};                                                \
+        for (std::uint32_t i {0}; i < N; ++i)                                  \
+        {                                                                      \
+            mask |= static_cast<std::uint32_t>(a.v[i] op b.v[i]) << i;         \
+        }                                                                      \
+        return mask;                                                           \
+    }
+
+    PORTABLE_SIMD_COMPARISON(less_mask, <)
+    PORTABLE_SIMD_COMPARISON(less_equal_mask, <=)
+    PORTABLE_SIMD_COMPARISON(not_equal_mask, !=)
+
+#undef PORTABLE_SIMD_COMPARISON
+};
+
+#if defined(__SSE2__) || defined(_M_X64)
+
+struct Sse
+{
+    static constexpr std::uint32_t width {4};
+    using Float = __m128;
+
+    // clang-format off
+    [[nodiscard]] static Float load(const float *p) noexcept { return _mm_load_ps(p); }
+    [[nodiscard]] static Float set1(float f) noexcept { return _mm_set1_ps(f); }
+    static void store(float *p, Float a) noexcept { _mm_store_ps(p, a); }
+    [[nodiscard]] static Float add(Float a, Float b) noexcept { return _mm_add_ps(a, b); }
+    [[nodiscard]] static Float sub(Float a, Float b) noexcept { return _mm_sub_ps(a, b); }
+    [[nodiscard]] static Float mul(Float a, Float b) noexcept { return _mm_mul_ps(a, b); }
+    [[nodiscard]] static Float div(Float a, Float b) noexcept { return _mm_div_ps(a, b); }
+    [[nodiscard]] static Float min(Float a, Float b) noexcept { return _mm_min_ps(a, b); }
+    [[nodiscard]] static Float max(Float a, Float b) noexcept { return _mm_max_ps(a, b); }
+    // clang-format on
+
+    // Converts 4 bytes to floats
+    [[nodiscard]] static Float load_u8(const std::uint8_t *p) noexcept
+    {
+        int bytes {};
+        std::memcpy(&bytes, p, sizeof(bytes));
+        const auto zero = _mm_setzero_si128();
+        const auto words = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero);
+        return _mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero));
+    }
+
+    [[nodiscard]] static std::uint32_t less_mask(Float a, Float b) noexcept
+    {
+        return static_cast<std::uint32_t>(_mm_movemask_ps(_mm_cmplt_ps(a, b)));
+    }
+
+    [[nodiscard]] static std::uint32_t less_equal_mask(Float a,
+                                                       Float b) noexcept
+    {
+        return static_cast<std::uint32_t>(_mm_movemask_ps(_mm_cmple_ps(a, b)));
+    }
+
+    [[nodiscard]] static std::uint32_t not_equal_mask(Float a,
+                                                      Float b) noexcept
+    {
+        return static_cast<std::uint32_t>(
+            _mm_movemask_ps(_mm_cmpneq_ps(a, b)));
+    }
+};
+
+#endif
+
+#if defined(__AVX2__)
+
+struct Avx2
+{
+    static constexpr std::uint32_t width {8};
+    using Float = __m256;
+
+    // clang-format off
+    [[nodiscard]] static Float load(const float *p) noexcept { return _mm256_load_ps(p); }
+    [[nodiscard]] static Float set1(float f) noexcept { return _mm256_set1_ps(f); }
+    static void store(float *p, Float a) noexcept { _mm256_store_ps(p, a); }
+    [[nodiscard]] static Float add(Float a, Float b) noexcept { return _mm256_add_ps(a, b); }
+    [[nodiscard]] static Float sub(Float a, Float b) noexcept { return _mm256_sub_ps(a, b); }
+    [[nodiscard]] static Float mul(Float a, Float b) noexcept { return _mm256_mul_ps(a, b); }
+    [[nodiscard]] static Float div(Float a, Float b) noexcept { return _mm256_div_ps(a, b); }
+    [[nodiscard]] static Float min(Float a, Float b) noexcept { return _mm256_min_ps(a, b); }
+    [[nodiscard]] static Float max(Float a, Float b) noexcept { return _mm256_max_ps(a, b); }
+    // clang-format on
+
+    [[nodiscard]] static std::uint32_t less_mask(Float a, Float b) noexcept
+    {
+        return static_cast<std::uint32_t>(
+            _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LT_OQ)));
+    }
+
+    [[nodiscard]] static std::uint32_t less_equal_mask(Float a,
+                                                       Float b) noexcept
+    {
+        return static_cast<std::uint32_t>(
+            _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LE_OQ)));
+    }
+
+    [[nodiscard]] static std::uint32_t not_equal_mask(Float a,
+                                                      Float b) noexcept
+    {
+        return static_cast<std::uint32_t>(
+            _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_NEQ_UQ)));
+    }
+};
+
+#endif
+
+#if defined(__AVX512F__)
+
+// GCC warns that the undefined source operand that _mm512_min_ps() and
+// _mm512_max_ps() pass to their masked builtin is used uninitialized. The
+// operand is ignored under the full mask they use, so this is a false positive
+// from the compiler headers.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+struct Avx512
+{
+    static constexpr std::uint32_t width {16};
+    using Float = __m512;
+
+    // clang-format off
+    [[nodiscard]] static Float load(const float *p) noexcept { return _mm512_load_ps(p); }
+    [[nodiscard]] static Float set1(float f) noexcept { return _mm512_set1_ps(f); }
+    static void store(float *p, Float a) noexcept { _mm512_store_ps(p, a); }
+    [[nodiscard]] static Float add(Float a, Float b) noexcept { return _mm512_add_ps(a, b); }
+    [[nodiscard]] static Float sub(Float a, Float b) noexcept { return _mm512_sub_ps(a, b); }
+    [[nodiscard]] static Float mul(Float a, Float b) noexcept { return _mm512_mul_ps(a, b); }
+    [[nodiscard]] static Float div(Float a, Float b) noexcept { return _mm512_div_ps(a, b); }
+    [[nodiscard]] static Float min(Float a, Float b) noexcept { return _mm512_min_ps(a, b); }
+    [[nodiscard]] static Float max(Float a, Float b) noexcept { return _mm512_max_ps(a, b); }
+    // clang-format on
+
+    [[nodiscard]] static std::uint32_t less_mask(Float a, Float b) noexcept
+    {
+        return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ);
+    }
+
+    [[nodiscard]] static std::uint32_t less_equal_mask(Float a,
+                                                       Float b) noexcept
+    {
+        return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ);
+    }
+
+    [[nodiscard]] static std::uint32_t not_equal_mask(Float a,
+                                                      Float b) noexcept
+    {
+        return _mm512_cmp_ps_mask(a, b, _CMP_NEQ_UQ);
+    }
+};
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#endif
+
+// mask must not be zero
+[[nodiscard]] inline std::uint32_t
+count_trailing_zeros(std::uint32_t mask) noexcept
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long index {};
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return static_cast<std::uint32_t>(__builtin_ctz(mask));
+#endif
+}
+
+// Decodes the child bounds of a quantized node with the same operations as
+// quantize_bvh(), and gives its unused children empty bounds like in
+// Wide_bvh_node
+template <typename Simd>
+void decode_node(const Quantized_bvh_node &node,
+                 Wide_bvh_node<4> &decoded) noexcept
+{
+    static_assert(Simd::width == 4);
+
+    const auto decode_axis = [](float origin,
+                                std::int8_t exponent,
+                                const std::uint8_t *quantized_min,
+                                const std::uint8_t *quantized_max,
+                                float *min,
+                                float *max)
+    {
+        const auto scale = Simd::set1(std::bit_cast<float>(
+            static_cast<std::uint32_t>(exponent + 127) << 23));
+        const auto planes_origin = Simd::set1(origin);
+        Simd::store(min,
+                    Simd::add(planes_origin,
+                              Simd::mul(Simd::load_u8(quantized_min), scale)));
+        Simd::store(max,
+                    Simd::add(planes_origin,
+                              Simd::mul(Simd::load_u8(quantized_max), scale)));
+    };
+    decode_axis(node.origin_x,
+                node.exponent_x,
+                node.min_x,
+                node.max_x,
+                decoded.min_x,
+                decoded.max_x);
+    decode_axis(node.origin_y,
+                node.exponent_y,
+                node.min_y,
+                node.max_y,
+                decoded.min_y,
+                decoded.max_y);
+    decode_axis(node.origin_z,
+                node.exponent_z,
+                node.min_z,
+                node.max_z,
+                decoded.min_z,
+                decoded.max_z);
+
+    for (std::uint32_t i {0}; i < 4; ++i)
+    {
+        decoded.index[i] = node.index[i];
+        decoded.primitive_count[i] = node.primitive_count[i];
+    }
+
+    constexpr auto inf = std::numeric_limits<float>::infinity();
+    for (std::uint32_t mask {~node.child_mask & 0xfu}; mask != 0;
+         mask &= mask - 1)
+    {
+        const auto i = count_trailing_zeros(mask);
+        decoded.min_x[i] = inf;
+        decoded.min_y[i] = inf;
+        decoded.min_z[i] = inf;
+        decoded.max_x[i] = -inf;
+        decoded.max_y[i] = -inf;
+        decoded.max_z[i] = -inf;
+    }
+}
+
+// Returns the node with its bounds as floats, which for uncompressed nodes is
+// the node itself, and for quantized ones is decoded into storage
+template <typename Simd>
+[[nodiscard]] const Wide_bvh_node<Simd::width> &
+fetch_node(const Wide_bvh_node<Simd::width> &node,
+           [[maybe_unused]] Wide_bvh_node<Simd::width> &storage) noexcept
+{
+    return node;
+}
+
+template <typename Simd>
+[[nodiscard]] const Wide_bvh_node<4> &
+fetch_node(const Quantized_bvh_node &node,
+           Wide_bvh_node<4> &storage) noexcept
+{
+    decode_node<Simd>(node, storage);
+    return storage;
+}
+
+struct Stack_entry
+{
+    std::uint32_t index;
+    std::uint32_t primitive_count;
+    float t; // Entry distance into the bounds
+};
+
+// Kind of query answered by the traversal kernels. With any_hit, the single
+// ray kernel returns as soon as a hit closer than hit.t is found, without
+// updating hit. The packet kernel sets hit.t to -infinity for the rays it
+// finds a hit for, which excludes them from the rest of the traversal, and
+// returns as soon as all the active rays have one.
+enum struct Query
+{
+    closest_hit,
+    any_hit
+};
+
+// Möller-Trumbore, without backface culling, against all the triangles of
+// the block at once. Returns the mask of the triangles hit with
+// t_min <= t < t_max. If it is not zero, t, u and v are set for all of them.
+template <typename Simd>
+[[nodiscard]] std::uint32_t
+test_triangle_block(const Triangle_block<Simd::width> &block,
+                    const Ray &ray,
+                    float t_min,
+                    float t_max,
+                    typename Simd::Float &t_values,
+                    typename Simd::Float &u_values,
+                    typename Simd::Float &v_values) noexcept
+{
+    const auto zero = Simd::set1(0.0f);
+    const auto one = Simd::set1(1.0f);
+
+    const auto d_x = Simd::set1(ray.direction.x);
+    const auto d_y = Simd::set1(ray.direction.y);
+    const auto d_z = Simd::set1(ray.direction.z);
+    const auto e1_x = Simd::load(block.edge_1_x);
+    const auto e1_y = Simd::load(block.edge_1_y);
+    const auto e1_z = Simd::load(block.edge_1_z);
+    const auto e2_x = Simd::load(block.edge_2_x);
+    const auto e2_y = Simd::load(block.edge_2_y);
+    const auto e2_z = Simd::load(block.edge_2_z);
+
+    // p = cross(d, e2)
+    const auto p_x = Simd::sub(Simd::mul(d_y, e2_z), Simd::mul(d_z, e2_y));
+    const auto p_y = Simd::sub(Simd::mul(d_z, e2_x), Simd::mul(d_x, e2_z));
+    const auto p_z = Simd::sub(Simd::mul(d_x, e2_y), Simd::mul(d_y, e2_x));
+    const auto det = Simd::add(
+        Simd::add(Simd::mul(e1_x, p_x), Simd::mul(e1_y, p_y)),
+        Simd::mul(e1_z, p_z));
+    auto mask = Simd::not_equal_mask(det, zero);
+    if (mask == 0)
+    {
+        return 0;
+    }
+    const auto inv_det = Simd::div(one, det);
+
+    // s = o - v0
+    const auto s_x =
+        Simd::sub(Simd::set1(ray.origin.x), Simd::load(block.v0_x));
+    const auto s_y =
+        Simd::sub(Simd::set1(ray.origin.y), Simd::load(block.v0_y));
+    const auto s_z =
+        Simd::sub(Simd::set1(ray.origin.z), Simd::load(block.v0_z));
+    const auto u = Simd::mul(
+        Simd::add(Simd::add(Simd::mul(s_x, p_x), Simd::mul(s_y, p_y)),
+                  Simd::mul(s_z, p_z)),
+        inv_det);
+    mask &= Simd::less_equal_mask(zero, u) & Simd::less_equal_mask(u, one);
+    if (mask == 0)
+    {
+        return 0;
+    }
+
+    // q = cross(s, e1)
+    const auto q_x = Simd::sub(Simd::mul(s_y, e1_z), Simd::mul(s_z, e1_y));
+    const auto q_y = Simd::sub(Simd::mul(s_z, e1_x), Simd::mul(s_x, e1_z));
+    const auto q_z = Simd::sub(Simd::mul(s_x, e1_y), Simd::mul(s_y, e1_x));
+    const auto v = Simd::mul(
+        Simd::add(Simd::add(Simd::mul(d_x, q_x), Simd::mul(d_y, q_y)),
+                  Simd::mul(d_z, q_z)),
+        inv_det);
+    mask &= Simd::less_equal_mask(zero, v) &
+            Simd::less_equal_mask(Simd::add(u, v), one);
+    if (mask == 0)
+    {
+        return 0;
+    }
+
+    const auto t = Simd::mul(
+        Simd::add(Simd::add(Simd::mul(e2_x, q_x), Simd::mul(e2_y, q_y)),
+                  Simd::mul(e2_z, q_z)),
+        inv_det);
+    mask &= Simd::less_equal_mask(Simd::set1(t_min), t) &
+            Simd::less_mask(t, Simd::set1(t_max));
+    t_values = t;
+    u_values = u;
+    v_values = v;
+    return mask;
+}
+
+// Updates hit with the closest valid triangle of the block, the first one in
+// case of a tie, like testing them one after the other would
+template <typename Simd>
+[[nodiscard]] bool
+intersect_triangle_block(const Triangle_block<Simd::width> &block,
+                         const Ray &ray,
+                         float t_min,
+                         Ray_hit &hit) noexcept
+{
+    typename Simd::Float t;
+    typename Simd::Float u;
+    typename Simd::Float v;
+    auto mask = test_triangle_block<Simd>(block, ray, t_min, hit.t, t, u, v);
+    if (mask == 0)
+    {
+        return false;
+    }
+
+    alignas(64) float t_values[Simd::width];
+    alignas(64) float u_values[Simd::width];
+    alignas(64) float v_values[Simd::width];
+    Simd::store(t_values, t);
+    Simd::store(u_values, u);
+    Simd::store(v_values, v);
+
+    auto closest = count_trailing_zeros(mask);
+    for (mask &= mask - 1; mask != 0; mask &= mask - 1)
+    {
+        const auto i = count_trailing_zeros(mask);
+        if (t_values[i] < t_values[closest])
+        {
+            closest = i;
+        }
+    }
+
+    hit.t = t_values[closest];
+    hit.u = u_values[closest];
+    hit.v = v_values[closest];
+    hit.primitive_index = block.primitive_index[closest];
+    return true;
+}
+
+// Node_simd must have the width of the nodes, and Block_simd the width of the
+// triangle blocks. Bvh_type is the Bvh_arrays of a Wide_bvh or of a
+// Quantized_bvh.
+template <Query query,
+          typename Node_simd,
+          typename Block_simd,
+          typename Bvh_type>
+[[nodiscard]] bool intersect_wide_bvh(const Bvh_type &bvh,
+                                      const Ray &ray,
+                                      float t_min,
+                                      Ray_hit &hit) noexcept
+{
+    using Simd = Node_simd;
+    constexpr auto N = Simd::width;
+    constexpr auto M = Block_simd::width;
+    static_assert(M == triangle_block_width<N>);
+    // Enough for a depth of 64, each level pushing all but one child
+    constexpr std::uint32_t max_stack_size {64 * (N - 1) + 1};
+
+    if (bvh.node_count == 0)
+    {
+        return false;
+    }
+
+    const float inv_x {1.0f / ray.direction.x};
+    const float inv_y {1.0f / ray.direction.y};
+    const float inv_z {1.0f / ray.direction.z};
+    // The near plane of each slab only depends on the sign of the direction,
+    // so the min/max swap of the slab test can be done once per ray
+    const bool negative_x {inv_x < 0.0f};
+    const bool negative_y {inv_y < 0.0f};
+    const bool negative_z {inv_z < 0.0f};
+    const auto origin_x = Simd::set1(ray.origin.x);
+    const auto origin_y = Simd::set1(ray.origin.y);
+    const auto origin_z = Simd::set1(ray.origin.z);
+    const auto inv_direction_x = Simd::set1(inv_x);
+    const auto inv_direction_y = Simd::set1(inv_y);
+    const auto inv_direction_z = Simd::set1(inv_z);
+    const auto ray_t_min = Simd::set1(t_min);
+
+    bool found_hit {false};
+
+    Wide_bvh_node<N> decoded_node;
+    Stack_entry stack[max_stack_size];
+    std::uint32_t stack_size {0};
+    stack[stack_size++] = {0, 0, t_min};
+
+    while (stack_size > 0)
+    {
+        const auto entry = stack[--stack_size];
+        if (entry.t >= hit.t)
+        {
+            continue;
+        }
+
+        if (entry.primitive_count > 0)
+        {
+            const auto block_count = (entry.primitive_count + M - 1) / M;
+            for (std::uint32_t i {0}; i < block_count; ++i)
+            {
+                const auto &block = bvh.triangle_blocks[entry.index + i];
+                if constexpr (query == Query::any_hit)
+                {
+                    typename Block_simd::Float t;
+                    typename Block_simd::Float u;
+                    typename Block_simd::Float v;
+                    if (test_triangle_block<Block_simd>(
+                            block, ray, t_min, hit.t, t, u, v) != 0)
+                    {
+                        return true;
+                    }
+                }
+                else if (intersect_triangle_block<Block_simd>(
+                             block, ray, t_min, hit))
+                {
+                    found_hit = true;
+                }
+            }
+            continue;
+        }
+
+        const auto &node =
+            fetch_node<Simd>(bvh.nodes[entry.index], decoded_node);
+        const auto t_near_x =
+            Simd::mul(Simd::sub(Simd::load(negative_x ? node.max_x : node.min_x),
+                                origin_x),
+                      inv_direction_x);
+        const auto t_near_y =
+            Simd::mul(Simd::sub(Simd::load(negative_y ? node.max_y : node.min_y),
+                                origin_y),
+                      inv_direction_y);
+        const auto t_near_z =
+            Simd::mul(Simd::sub(Simd::load(negative_z ? node.max_z : node.min_z),
+                                origin_z),
+                      inv_direction_z);
+        const auto t_far_x =
+            Simd::mul(Simd::sub(Simd::load(negative_x ? node.min_x : node.max_x),
+                                origin_x),
+                      inv_direction_x);
+        const auto t_far_y =
+            Simd::mul(Simd::sub(Simd::load(negative_y ? node.min_y : node.max_y),
+                                origin_y),
+                      inv_direction_y);
+        const auto t_far_z =
+            Simd::mul(Simd::sub(Simd::load(negative_z ? node.min_z : node.max_z),
+                                origin_z),
+                      inv_direction_z);
+        const auto t_enter = Simd::max(Simd::max(t_near_x, t_near_y),
+                                       Simd::max(t_near_z, ray_t_min));
+        const auto t_exit =
+            Simd::min(Simd::min(t_far_x, t_far_y),
+                      Simd::min(t_far_z, Simd::set1(hit.t)));
+        auto mask = Simd::less_equal_mask(t_enter, t_exit);
+        if (mask == 0)
+        {
+            continue;
+        }
+
+        if constexpr (query == Query::any_hit)
+        {
+            // Any hit will do, so the order of the children does not matter
+            for (; mask != 0; mask &= mask - 1)
+            {
+                const auto i = count_trailing_zeros(mask);
+                stack[stack_size++] = {.index = node.index[i],
+                                       .primitive_count = node.primitive_count[i],
+                                       .t = t_min};
+            }
+            continue;
+        }
+
+        alignas(64) float t_enter_values[N];
+        Simd::store(t_enter_values, t_enter);
+
+        // Push the hit children sorted by decreasing entry distance, so that
+        // the nearest one is visited first
+        const auto first_pushed = stack_size;
+        for (; mask != 0; mask &= mask - 1)
+        {
+            const auto i = count_trailing_zeros(mask);
+            const Stack_entry child {.index = node.index[i],
+                                     .primitive_count = node.primitive_count[i],
+                                     .t = t_enter_values[i]};
+            auto j = stack_size++;
+            while (j > first_pushed && stack[j - 1].t < child.t)
+            {
+                stack[j] = stack[j - 1];
+                --j;
+            }
+            stack[j] = child;
+        }
+    }
+
+    return found_hit;
+}
+
+struct Packet_stack_entry
+{
+    std::uint32_t index;
+    std::uint32_t primitive_count;
+    std::uint32_t ray_mask; // Rays that hit the bounds
+    float t;                // Smallest entry distance of these rays
+};
+
+// Bounds of the origins and inverse directions of a packet along one axis
+struct Packet_interval
+{
+    float origin_min;
+    float origin_max;
+    float inv_direction_min;
+    float inv_direction_max;
+    bool negative;
+};
+
+// Returns false if the inverse directions of the rays in ray_mask do not all
+// have the same sign, or are not all finite, in which case the packet cannot
+// be bounded by a frustum
+[[nodiscard]] inline bool compute_packet_interval(const float *origin,
+                                                  const float *inv_direction,
+                                                  std::uint32_t ray_mask,
+                                                  Packet_interval &interval)
+{
+    const auto first = count_trailing_zeros(ray_mask);
+    interval = {.origin_min = origin[first],
+                .origin_max = origin[first],
+                .inv_direction_min = inv_direction[first],
+                .inv_direction_max = inv_direction[first],
+                .negative = inv_direction[first] < 0.0f};
+
+    for (; ray_mask != 0; ray_mask &= ray_mask - 1)
+    {
+        const auto i = count_trailing_zeros(ray_mask);
+        // Infinities and NaNs stay NaN when multiplied by zero
+        if (inv_direction[i] * 0.0f != 0.0f ||
+            (inv_direction[i] < 0.0f) != interval.negative)
+        {
+            return false;
+        }
+        interval.origin_min =
+            origin[i] < interval.origin_min ? origin[i] : interval.origin_min;
+        interval.origin_max =
+            origin[i] > interval.origin_max ? origin[i] : interval.origin_max;
+        interval.inv_direction_min =
+            inv_direction[i] < interval.inv_direction_min
+                ? inv_direction[i]
+                : interval.inv_direction_min;
+        interval.inv_direction_max =
+            inv_direction[i] > interval.inv_direction_max
+                ? inv_direction[i]
+                : interval.inv_direction_max;
+    }
+
+    return true;
+}
+
+// Lower bounds of the entry distances and upper bounds of the exit distances
+// of all the rays of a packet into the slabs of each child, along one axis
+template <typename Simd>
+void compute_frustum_slab(const float *min,
+                          const float *max,
+                          const Packet_interval &interval,
+                          typename Simd::Float &t_near,
+                          typename Simd::Float &t_far) noexcept
+{
+    const auto near_planes = Simd::load(interval.negative ? max : min);
+    const auto far_planes = Simd::load(interval.negative ? min : max);
+    // The smallest entry distance is along the ray whose origin is the
+    // farthest from the near plane, and vice versa for the exit distance
+    const auto near_distance = Simd::sub(
+        near_planes,
+        Simd::set1(interval.negative ? interval.origin_min
+                                     : interval.origin_max));
+    const auto far_distance = Simd::sub(
+        far_planes,
+        Simd::set1(interval.negative ? interval.origin_max
+                                     : interval.origin_min));
+    const auto inv_min = Simd::set1(interval.inv_direction_min);
+    const auto inv_max = Simd::set1(interval.inv_direction_max);
+    t_near = Simd::min(Simd::mul(near_distance, inv_min),
+                       Simd::mul(near_distance, inv_max));
+    t_far = Simd::max(Simd::mul(far_distance, inv_min),
+                      Simd::mul(far_distance, inv_max));
+}
+
+// Rays of a packet, prepared for slab tests
+template <typename Simd>
+struct Packet_slab_rays
+{
+    typename Simd::Float origin_x;
+    typename Simd::Float origin_y;
+    typename Simd::Float origin_z;
+    typename Simd::Float inv_direction_x;
+    typename Simd::Float inv_direction_y;
+    typename Simd::Float inv_direction_z;
+    typename Simd::Float t_min;
+};
+
+// Tests the rays of ray_mask against one box. Returns the mask of the rays
+// that hit it, and sets t to their smallest entry distance.
+template <typename Simd>
+[[nodiscard]] std::uint32_t
+intersect_box_packet(float min_x,
+                     float min_y,
+                     float min_z,
+                     float max_x,
+                     float max_y,
+                     float max_z,
+                     const Packet_slab_rays<Simd> &rays,
+                     std::uint32_t ray_mask,
+                     const Ray_packet_hit<Simd::width> &hit,
+                     float &t) noexcept
+{
+    // The near and far planes depend on the sign of each direction
+    const auto t_0_x = Simd::mul(Simd::sub(Simd::set1(min_x), rays.origin_x),
+                                 rays.inv_direction_x);
+    const auto t_1_x = Simd::mul(Simd::sub(Simd::set1(max_x), rays.origin_x),
+                                 rays.inv_direction_x);
+    const auto t_0_y = Simd::mul(Simd::sub(Simd::set1(min_y), rays.origin_y),
+                                 rays.inv_direction_y);
+    const auto t_1_y = Simd::mul(Simd::sub(Simd::set1(max_y), rays.origin_y),
+                                 rays.inv_direction_y);
+    const auto t_0_z = Simd::mul(Simd::sub(Simd::set1(min_z), rays.origin_z),
+                                 rays.inv_direction_z);
+    const auto t_1_z = Simd::mul(Simd::sub(Simd::set1(max_z), rays.origin_z),
+                                 rays.inv_direction_z);
+    const auto t_enter =
+        Simd::max(Simd::max(Simd::min(t_0_x, t_1_x), Simd::min(t_0_y, t_1_y)),
+                  Simd::max(Simd::min(t_0_z, t_1_z), rays.t_min));
+    const auto t_exit =
+        Simd::min(Simd::min(Simd::max(t_0_x, t_1_x), Simd::max(t_0_y, t_1_y)),
+                  Simd::min(Simd::max(t_0_z, t_1_z), Simd::load(hit.t)));
+    ray_mask &= Simd::less_equal_mask(t_enter, t_exit);
+    if (ray_mask == 0)
+    {
+        return 0;
+    }
+
+    alignas(64) float t_enter_values[Simd::width];
+    Simd::store(t_enter_values, t_enter);
+    t = t_enter_values[count_trailing_zeros(ray_mask)];
+    for (auto mask = ray_mask & (ray_mask - 1); mask != 0; mask &= mask - 1)
+    {
+        const auto i = count_trailing_zeros(mask);
+        t = t_enter_values[i] < t ? t_enter_values[i] : t;
+    }
+    return ray_mask;
+}
+
+// Tests the rays of ray_mask against triangle i of the block, with the same
+// order of operations as intersect_triangle() in bvh.cpp. Returns the mask of
+// the rays that hit it with t_min <= t < t_max[j] for ray j. If it is not
+// zero, t, u and v are set for all of them.
+template <typename Simd, typename Block>
+[[nodiscard]] std::uint32_t
+test_triangle_packet(const Block &block,
+                     std::uint32_t i,
+                     const Ray_packet<Simd::width> &packet,
+                     std::uint32_t ray_mask,
+                     float t_min,
+                     const float *t_max,
+                     typename Simd::Float &t_values,
+                     typename Simd::Float &u_values,
+                     typename Simd::Float &v_values) noexcept
+{
+    const auto zero = Simd::set1(0.0f);
+    const auto one = Simd::set1(1.0f);
+
+    const auto d_x = Simd::load(packet.direction_x);
+    const auto d_y = Simd::load(packet.direction_y);
+    const auto d_z = Simd::load(packet.direction_z);
+    const auto e1_x = Simd::set1(block.edge_1_x[i]);
+    const auto e1_y = Simd::set1(block.edge_1_y[i]);
+    const auto e1_z = Simd::set1(block.edge_1_z[i]);
+    const auto e2_x = Simd::set1(block.edge_2_x[i]);
+    const auto e2_y = Simd::set1(block.edge_2_y[i]);
+    const auto e2_z = Simd::set1(block.edge_2_z[i]);
+
+    const auto p_x = Simd::sub(Simd::mul(d_y, e2_z), Simd::mul(d_z, e2_y));
+    const auto p_y = Simd::sub(Simd::mul(d_z, e2_x), Simd::mul(d_x, e2_z));
+    const auto p_z = Simd::sub(Simd::mul(d_x, e2_y), Simd::mul(d_y, e2_x));
+    const auto det = Simd::add(
+        Simd::add(Simd::mul(e1_x, p_x), Simd::mul(e1_y, p_y)),
+        Simd::mul(e1_z, p_z));
+    auto mask = ray_mask & Simd::not_equal_mask(det, zero);
+    if (mask == 0)
+    {
+        return 0;
+    }
+    const auto inv_det = Simd::div(one, det);
+
+    const auto s_x =
+        Simd::sub(Simd::load(packet.origin_x), Simd::set1(block.v0_x[i]));
+    const auto s_y =
+        Simd::sub(Simd::load(packet.origin_y), Simd::set1(block.v0_y[i]));
+    const auto s_z =
+        Simd::sub(Simd::load(packet.origin_z), Simd::set1(block.v0_z[i]));
+    const auto u = Simd::mul(
+        Simd::add(Simd::add(Simd::mul(s_x, p_x), Simd::mul(s_y, p_y)),
+                  Simd::mul(s_z, p_z)),
+        inv_det);
+    mask &= Simd::less_equal_mask(zero, u) & Simd::less_equal_mask(u, one);
+    if (mask == 0)
+    {
+        return 0;
+    }
+
+    const auto q_x = Simd::sub(Simd::mul(s_y, e1_z), Simd::mul(s_z, e1_y));
+    const auto q_y = Simd::sub(Simd::mul(s_z, e1_x), Simd::mul(s_x, e1_z));
+    const auto q_z = Simd::sub(Simd::mul(s_x, e1_y), Simd::mul(s_y, e1_x));
+    const auto v = Simd::mul(
+        Simd::add(Simd::add(Simd::mul(d_x, q_x), Simd::mul(d_y, q_y)),
+                  Simd::mul(d_z, q_z)),
+        inv_det);
+    mask &= Simd::less_equal_mask(zero, v) &
+            Simd::less_equal_mask(Simd::add(u, v), one);
+    if (mask == 0)
+    {
+        return 0;
+    }
+
+    const auto t = Simd::mul(
+        Simd::add(Simd::add(Simd::mul(e2_x, q_x), Simd::mul(e2_y, q_y)),
+                  Simd::mul(e2_z, q_z)),
+        inv_det);
+    mask &= Simd::less_equal_mask(Simd::set1(t_min), t) &
+            Simd::less_mask(t, Simd::load(t_max));
+    t_values = t;
+    u_values = u;
+    v_values = v;
+    return mask;
+}
+
+// Same test, which updates the hits of the rays that hit the triangle closer
+// than their current one. Returns the mask of these rays.
+template <typename Simd, typename Block>
+[[nodiscard]] std::uint32_t
+intersect_triangle_packet(const Block &block,
+                          std::uint32_t i,
+                          const Ray_packet<Simd::width> &packet,
+                          std::uint32_t ray_mask,
+                          float t_min,
+                          Ray_packet_hit<Simd::width> &hit) noexcept
+{
+    typename Simd::Float t;
+    typename Simd::Float u;
+    typename Simd::Float v;
+    const auto mask = test_triangle_packet<Simd>(
+        block, i, packet, ray_mask, t_min, hit.t, t, u, v);
+    if (mask == 0)
+    {
+        return 0;
+    }
+
+    alignas(64) float t_values[Simd::width];
+    alignas(64) float u_values[Simd::width];
+    alignas(64) float v_values[Simd::width];
+    Simd::store(t_values, t);
+    Simd::store(u_values, u);
+    Simd::store(v_values, v);
+    for (auto updated = mask; updated != 0; updated &= updated - 1)
+    {
+        const auto j = count_trailing_zeros(updated);
+        hit.t[j] = t_values[j];
+        hit.u[j] = u_values[j];
+        hit.v[j] = v_values[j];
+        hit.primitive_index[j] = block.primitive_index[i];
+    }
+    return mask;
+}
+
+// Node_simd must have the width of the nodes, and Packet_simd the width of the
+// packets. Each node is first tested against the frustum bounding the packet,
+// which culls the children that no ray can hit with a single test, then the
+// remaining children are tested against each ray. Bvh_type is the Bvh_arrays
+// of a Wide_bvh or of a Quantized_bvh.
+template <Query query,
+          typename Node_simd,
+          typename Packet_simd,
+          typename Bvh_type>
+[[nodiscard]] std::uint32_t
+intersect_wide_bvh_packet(const Bvh_type &bvh,
+                          const Ray_packet<Packet_simd::width> &packet,
+                          std::uint32_t active_mask,
+                          float t_min,
+                          Ray_packet_hit<Packet_simd::width> &hit) noexcept
+{
+    constexpr auto N = Node_simd::width;
+    constexpr auto P = Packet_simd::width;
+    constexpr auto M = triangle_block_width<N>;
+    static_assert(P == ray_packet_size<N>);
+    constexpr std::uint32_t max_stack_size {64 * (N - 1) + 1};
+
+    if (bvh.node_count == 0 || active_mask == 0)
+    {
+        return 0;
+    }
+
+    const auto one = Packet_simd::set1(1.0f);
+    const Packet_slab_rays<Packet_simd> rays {
+        .origin_x = Packet_simd::load(packet.origin_x),
+        .origin_y = Packet_simd::load(packet.origin_y),
+        .origin_z = Packet_simd::load(packet.origin_z),
+        .inv_direction_x =
+            Packet_simd::div(one, Packet_simd::load(packet.direction_x)),
+        .inv_direction_y =
+            Packet_simd::div(one, Packet_simd::load(packet.direction_y)),
+        .inv_direction_z =
+            Packet_simd::div(one, Packet_simd::load(packet.direction_z)),
+        .t_min = Packet_simd::set1(t_min)};
+
+    alignas(64) float inv_x[P];
+    alignas(64) float inv_y[P];
+    alignas(64) float inv_z[P];
+    Packet_simd::store(inv_x, rays.inv_direction_x);
+    Packet_simd::store(inv_y, rays.inv_direction_y);
+    Packet_simd::store(inv_z, rays.inv_direction_z);
+    Packet_interval interval_x {};
+    Packet_interval interval_y {};
+    Packet_interval interval_z {};
+    const bool use_frustum {
+        compute_packet_interval(
+            packet.origin_x, inv_x, active_mask, interval_x) &&
+        compute_packet_interval(
+            packet.origin_y, inv_y, active_mask, interval_y) &&
+        compute_packet_interval(
+            packet.origin_z, inv_z, active_mask, interval_z)};
+
+    std::uint32_t updated_mask {0};
+
+    Wide_bvh_node<N> decoded_node;
+    Packet_stack_entry stack[max_stack_size];
+    std::uint32_t stack_size {0};
+    stack[stack_size++] = {0, 0, active_mask, t_min};
+
+    while (stack_size > 0)
+    {
+        const auto entry = stack[--stack_size];
+        float max_hit_t {t_min};
+        for (auto mask = entry.ray_mask; mask != 0; mask &= mask - 1)
+        {
+            const auto i = count_trailing_zeros(mask);
+            max_hit_t = hit.t[i] > max_hit_t ? hit.t[i] : max_hit_t;
+        }
+        if (entry.t >= max_hit_t)
+        {
+            continue;
+        }
+
+        if constexpr (query == Query::any_hit)
+        {
+            if (entry.primitive_count > 0)
+            {
+                auto ray_mask = entry.ray_mask & ~updated_mask;
+                for (std::uint32_t i {0};
+                     i < entry.primitive_count && ray_mask != 0;
+                     ++i)
+                {
+                    typename Packet_simd::Float t;
+                    typename Packet_simd::Float u;
+                    typename Packet_simd::Float v;
+                    const auto mask = test_triangle_packet<Packet_simd>(
+                        bvh.triangle_blocks[entry.index + i / M],
+                        i % M,
+                        packet,
+                        ray_mask,
+                        t_min,
+                        hit.t,
+                        t,
+                        u,
+                        v);
+                    constexpr auto inf = std::numeric_limits<float>::infinity();
+                    for (auto occluded = mask; occluded != 0;
+                         occluded &= occluded - 1)
+                    {
+                        hit.t[count_trailing_zeros(occluded)] = -inf;
+                    }
+                    ray_mask &= ~mask;
+                    updated_mask |= mask;
+                }
+                if (updated_mask == active_mask)
+                {
+                    return updated_mask;
+                }
+                continue;
+            }
+        }
+
+        if (entry.primitive_count > 0)
+        {
+            for (std::uint32_t i {0}; i < entry.primitive_count; ++i)
+            {
+                updated_mask |= intersect_triangle_packet<Packet_simd>(
+                    bvh.triangle_blocks[entry.index + i / M],
+                    i % M,
+                    packet,
+                    entry.ray_mask,
+                    t_min,
+                    hit);
+            }
+            continue;
+        }
+
+        const auto &node =
+            fetch_node<Node_simd>(bvh.nodes[entry.index], decoded_node);
+        auto child_mask = Node_simd::less_equal_mask(
+            Node_simd::load(node.min_x), Node_simd::load(node.max_x));
+        alignas(64) float frustum_t_enter[N];
+        if (use_frustum)
+        {
+            typename Node_simd::Float t_near_x;
+            typename Node_simd::Float t_near_y;
+            typename Node_simd::Float t_near_z;
+            typename Node_simd::Float t_far_x;
+            typename Node_simd::Float t_far_y;
+            typename Node_simd::Float t_far_z;
+            compute_frustum_slab<Node_simd>(
+                node.min_x, node.max_x, interval_x, t_near_x, t_far_x);
+            compute_frustum_slab<Node_simd>(
+                node.min_y, node.max_y, interval_y, t_near_y, t_far_y);
+            compute_frustum_slab<Node_simd>(
+                node.min_z, node.max_z, interval_z, t_near_z, t_far_z);
+            const auto t_enter =
+                Node_simd::max(Node_simd::max(t_near_x, t_near_y),
+                               Node_simd::max(t_near_z, Node_simd::set1(t_min)));
+            const auto t_exit =
+                Node_simd::min(Node_simd::min(t_far_x, t_far_y),
+                               Node_simd::min(t_far_z,
+                                              Node_simd::set1(max_hit_t)));
+            child_mask &= Node_simd::less_equal_mask(t_enter, t_exit);
+            Node_simd::store(frustum_t_enter, t_enter);
+        }
+
+        // Push the hit children sorted by decreasing entry distance, so that
+        // the nearest one is visited first
+        const auto first_pushed = stack_size;
+        for (; child_mask != 0; child_mask &= child_mask - 1)
+        {
+            const auto i = count_trailing_zeros(child_mask);
+
+            Packet_stack_entry child {.index = node.index[i],
+                                      .primitive_count = node.primitive_count[i],
+                                      .ray_mask = entry.ray_mask,
+                                      .t = 0.0f};
+            if (use_frustum && child.primitive_count == 0)
+            {
+                // Coherent rays mostly hit the same interior nodes, so they
+                // are only tested one by one against the leaves
+                child.t = frustum_t_enter[i];
+            }
+            else
+            {
+                child.ray_mask =
+                    intersect_box_packet<Packet_simd>(node.min_x[i],
+                                                      node.min_y[i],
+                                                      node.min_z[i],
+                                                      node.max_x[i],
+                                                      node.max_y[i],
+                                                      node.max_z[i],
+                                                      rays,
+                                                      entry.ray_mask,
+                                                      hit,
+                                                      child.t);
+                if (child.ray_mask == 0)
+                {
+                    continue;
+                }
+            }
+
+            auto j = stack_size++;
+            while (j > first_pushed && stack[j - 1].t < child.t)
+            {
+                stack[j] = stack[j - 1];
+                --j;
+            }
+            stack[j] = child;
+        }
+    }
+
+    return updated_mask;
+}
+
+} // namespace
+
+#endif // WIDE_BVH_TRAVERSAL_HPP
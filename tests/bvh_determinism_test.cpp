@@ -0,0 +1,145 @@
+// The BVH builders must give the same nodes and primitive order whatever the
+// number of threads, so that a scene always renders with the same layout. Each
+// builder runs on a single thread and then on several, over a triangle soup
+// large enough to be cut into many subtrees.
+
+#include "bvh.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <vector>
+
+namespace
+{
+
+constexpr std::uint32_t triangle_count {1u << 17};
+constexpr unsigned int thread_counts[] {2, 3, 8};
+
+struct Mesh
+{
+    std::vector<vec3> vertices;
+    std::vector<std::uint32_t> indices;
+};
+
+// Small triangles in clusters, and some long ones across the scene for the
+// SBVH to split
+[[nodiscard]] Mesh create_mesh()
+{
+    Mesh mesh {};
+    std::mt19937 generator {1};
+    std::uniform_real_distribution<float> position(-1.0f, 1.0f);
+    std::uniform_real_distribution<float> offset(-0.01f, 0.01f);
+    std::vector<vec3> clusters(64);
+    for (auto &cluster : clusters)
+    {
+        cluster = {position(generator),
+                   position(generator),
+                   position(generator)};
+    }
+    for (std::uint32_t i {0}; i < triangle_count; ++i)
+    {
+        if (i % 64 == 0)
+        {
+            for (int j {0}; j < 3; ++j)
+            {
+                mesh.vertices.push_back({position(generator),
+                                         position(generator),
+                                         position(generator)});
+            }
+        }
+        else
+        {
+            const auto &cluster = clusters[i % clusters.size()];
+            const vec3 center {cluster.x + 10.0f * offset(generator),
+                               cluster.y + 10.0f * offset(generator),
+                               cluster.z + 10.0f * offset(generator)};
+            for (int j {0}; j < 3; ++j)
+            {
+                mesh.vertices.push_back({center.x + offset(generator),
+                                         center.y + offset(generator),
+                                         center.z + offset(generator)});
+            }
+        }
+        mesh.indices.push_back(3 * i);
+        mesh.indices.push_back(3 * i + 1);
+        mesh.indices.push_back(3 * i + 2);
+    }
+    return mesh;
+}
+
+[[nodiscard]] std::vector<Aabb> compute_triangle_bounds(const Mesh &mesh)
+{
+    std::vector<Aabb> bounds(triangle_count);
+    for (std::uint32_t i {0}; i < triangle_count; ++i)
+    {
+        const auto &v0 = mesh.vertices[mesh.indices[3 * i]];
+        const auto &v1 = mesh.vertices[mesh.indices[3 * i + 1]];
+        const auto &v2 = mesh.vertices[mesh.indices[3 * i + 2]];
+        bounds[i] = {{std::min({v0.x, v1.x, v2.x}),
+                      std::min({v0.y, v1.y, v2.y}),
+                      std::min({v0.z, v1.z, v2.z})},
+                     {std::max({v0.x, v1.x, v2.x}),
+                      std::max({v0.y, v1.y, v2.y}),
+                      std::max({v0.z, v1.z, v2.z})}};
+    }
+    return bounds;
+}
+
+[[nodiscard]] bool is_same_layout(const Bvh &a, const Bvh &b)
+{
+    return a.nodes.size() == b.nodes.size() &&
+           std::memcmp(a.nodes.data(),
+                       b.nodes.data(),
+                       a.nodes.size() * sizeof(Bvh_node)) == 0 &&
+           a.primitive_indices == b.primitive_indices;
+}
+
+// Returns false if a build on several threads differs from the build on a
+// single thread
+template <typename F>
+[[nodiscard]] bool check_builder(const char *name, F &&build)
+{
+    const auto reference = build(1u);
+    bool ok {true};
+    for (const auto thread_count : thread_counts)
+    {
+        if (!is_same_layout(build(thread_count), reference))
+        {
+            std::cerr << name << ": the build on " << thread_count
+                      << " threads differs from the build on 1 thread\n";
+            ok = false;
+        }
+    }
+    std::cout << name << ": " << reference.nodes.size() << " nodes, "
+              << (ok ? "same layout on all thread counts" : "FAILED") << '\n';
+    return ok;
+}
+
+} // namespace
+
+int main()
+{
+    const auto mesh = create_mesh();
+
+    bool ok {check_builder(
+        "sah",
+        [&](unsigned int thread_count)
+        { return build_bvh(mesh.vertices, mesh.indices, thread_count); })};
+
+    const auto bounds = compute_triangle_bounds(mesh);
+    ok &= check_builder("sah over boxes",
+                        [&](unsigned int thread_count)
+                        { return build_bvh(bounds, thread_count); });
+    ok &= check_builder(
+        "sbvh",
+        [&](unsigned int thread_count)
+        {
+            return build_sbvh(mesh.vertices, mesh.indices, thread_count, 0.25f);
+        });
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}